@@ -86,6 +86,9 @@ static int radius_chap_auth_unknown(char *name, char *ourname, int code, int id,
 			struct chap_digest_type *digest,
 			unsigned char *challenge, unsigned char *pkt, int pkt_len,
 			unsigned char *message, int message_space);
+static void radius_request_input(int fd, void *arg);
+static void radius_request_timeout(void *arg);
+static void radius_link_down(void *arg, uintptr_t p);
 static int radius_ip_allowed_address(u_int32_t addr);
 static void radius_ip_choose(u_int32_t *addr);
 static void radius_ip_up(void *arg, uintptr_t p);
@@ -502,6 +505,9 @@ void radius_system_inited(void *param, uintptr_t code)
 	add_notifier(&ip_up_notify, radius_ip_up, 0);
 	add_notifier(&ip_down_notify, radius_ip_down, 0);
 
+	// a request still waiting for the server must not complete on a new link
+	add_notifier(&link_down_notifier, radius_link_down, 0);
+
 }
 
 /* -----------------------------------------------------------------------------
@@ -559,6 +565,7 @@ hex2ascii(u_char *hex, int len, u_char *text)
 }
 
 /* -----------------------------------------------------------------------------
+build the access request
 type :  
     0 = PAP, clear text
     5 = CHAP_DIGEST_MD5
@@ -566,17 +573,13 @@ type :
     0x81 = CHAP_MICROSOFT_V2
 ----------------------------------------------------------------------------- */
 static 
-int radius_authenticate_user(char *user, char *passwd, int type, 
+struct rad_handle *radius_create_request(char *user, char *passwd, int type, 
     char *challenge, int chal_len, int chal_id, 
-    void *remotemd, int remotemd_len, unsigned char *message, int message_space, int changepassword)
+    void *remotemd, int remotemd_len, int changepassword)
 {
 	struct rad_handle *h = 0;
-    int err, ret = 0, attr_type, i;
-	void *attr_value;
-	size_t attr_len, len;
-	u_int32_t attr_vendor;
+    int err, i;
     char buf[256]; //MS_CHAP_RESPONSE_LEN + 1];
-    char auth[MD4_SIGNATURE_SIZE + 1];
 	
     h = rad_auth_open();
     if (h == NULL) 
@@ -589,8 +592,10 @@ int radius_authenticate_user(char *user, char *passwd, int type,
 			err = rad_add_server(h, server->address, server->port, server->secret, server->timeout, server->retries);
 			if (err != 0) {
 				error("Radius : Can't use server '%s'\n", server->address);
-				if (i == 0)
-					goto done;
+				if (i == 0) {
+					rad_close(h);
+					return NULL;
+				}
 			}
 		}
 	}
@@ -684,9 +689,24 @@ int radius_authenticate_user(char *user, char *passwd, int type,
     if (remoteaddress)
 	rad_put_string(h, RAD_CALLING_STATION_ID, remoteaddress);
 #endif
-    
-    err = rad_send_request(h);
-    
+
+    return h;
+}
+
+/* -----------------------------------------------------------------------------
+interpret the server answer err to the request h
+return the value expected by the pap/chap hooks
+----------------------------------------------------------------------------- */
+static 
+int radius_process_response(struct rad_handle *h, int err, int type, 
+    char *challenge, unsigned char *message, int message_space)
+{
+    int ret = 0, attr_type;
+	void *attr_value;
+	size_t attr_len, len;
+	u_int32_t attr_vendor;
+    char auth[MD4_SIGNATURE_SIZE + 1];
+
     switch (err) {
         case RAD_ACCESS_ACCEPT: 
             /* TO DO: fetch interesting information from the response */
@@ -846,22 +866,218 @@ int radius_authenticate_user(char *user, char *passwd, int type,
 
     }
     
-done:
-    if (h)
-        rad_close(h);
-    
     return ret;
 }
 
+/* -----------------------------------------------------------------------------
+request in progress, the server answer is read from the main loop
+----------------------------------------------------------------------------- */
+static struct {
+	struct rad_handle	*h;
+	int					fd;
+	int					owned;		/* close the handle if the request is cancelled */
+	void				(*done)(struct rad_handle *h, int err);
+} pending;
+
+/* pap/chap request parameters, to interpret the answer */
+static struct {
+	int					type;
+	unsigned char		*message;
+	int					message_space;
+	char				challenge[MAX_CHALLENGE_LEN];
+} pending_auth;
+
+/* -----------------------------------------------------------------------------
+stop watching the server for the request in progress
+----------------------------------------------------------------------------- */
+static void
+radius_request_stop()
+{
+	untimeout(radius_request_timeout, NULL);
+	remove_fd(pending.fd);
+	pending.h = NULL;
+}
+
+/* -----------------------------------------------------------------------------
+abandon the request in progress, its completion will not be called
+----------------------------------------------------------------------------- */
+void
+radius_request_cancel()
+{
+	struct rad_handle *h = pending.h;
+
+	if (h == NULL)
+		return;
+	radius_request_stop();
+	if (pending.owned)
+		rad_close(h);
+}
+
+/* -----------------------------------------------------------------------------
+err is the value returned by rad_init_send_request or rad_continue_send_request
+either wait for more, or complete the request
+----------------------------------------------------------------------------- */
+static void
+radius_request_result(int err, int fd, struct timeval *tv)
+{
+	struct rad_handle *h = pending.h;
+
+	if (err == 0) {
+		/* nothing yet, wait for the answer or for the retransmission time */
+		if (fd != pending.fd) {
+			remove_fd(pending.fd);
+			pending.fd = fd;
+		}
+		add_fd_handler(fd, radius_request_input, NULL);
+		timeout(radius_request_timeout, NULL, tv->tv_sec, tv->tv_usec);
+		return;
+	}
+
+	radius_request_stop();
+	(*pending.done)(h, err);
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+radius_request_input(int fd, void *arg)
+{
+	struct timeval tv;
+	int err;
+
+	untimeout(radius_request_timeout, NULL);
+	err = rad_continue_send_request(pending.h, 1, &fd, &tv);
+	radius_request_result(err, fd, &tv);
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+radius_request_timeout(void *arg)
+{
+	struct timeval tv;
+	int err, fd = pending.fd;
+
+	err = rad_continue_send_request(pending.h, 0, &fd, &tv);
+	radius_request_result(err, fd, &tv);
+}
+
+/* -----------------------------------------------------------------------------
+send the request h without blocking pppd while the server answers
+owned is set if the handle must be closed when the request is cancelled
+return 0 if done will be called with the answer, 
+or the value of rad_init_send_request if the request completed right away
+----------------------------------------------------------------------------- */
+int
+radius_request_start(struct rad_handle *h, int owned, void (*done)(struct rad_handle *h, int err))
+{
+	struct timeval tv;
+	int err, fd = -1;
+
+	radius_request_cancel();
+
+	err = rad_init_send_request(h, &fd, &tv);
+	if (err != 0)
+		return err;
+
+	pending.h = h;
+	pending.fd = fd;
+	pending.owned = owned;
+	pending.done = done;
+	radius_request_result(0, fd, &tv);
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+the link went down, the protocols have forgotten the request in progress
+----------------------------------------------------------------------------- */
+static void
+radius_link_down(void *arg, uintptr_t p)
+{
+	radius_request_cancel();
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+radius_pap_done(struct rad_handle *h, int err)
+{
+	int ret;
+
+	ret = radius_process_response(h, err, 0, 0, 0, 0);
+	rad_close(h);
+	pap_verify_done(0, ret, NULL);
+}
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 static int
 radius_pap_auth(char *user, char *passwd, char **msgp,
 		struct wordlist **paddrs, struct wordlist **popts)
 {
-   
-    return radius_authenticate_user(user, passwd, 0, 0, 0, 0, 0, 0, 0, 0, 0);
-    
+	struct rad_handle *h;
+	int err;
+
+	h = radius_create_request(user, passwd, 0, 0, 0, 0, 0, 0, 0);
+	if (h == NULL)
+		return 0;
+
+	/* don't block pppd while the server answers, see radius_pap_done */
+	err = radius_request_start(h, 1, radius_pap_done);
+	if (err != 0) {
+		err = radius_process_response(h, err, 0, 0, 0, 0);
+		rad_close(h);
+		return err;
+	}
+
+	return PAP_VERIFY_PENDING;
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+radius_chap_done(struct rad_handle *h, int err)
+{
+	int ret;
+
+	ret = radius_process_response(h, err, pending_auth.type, pending_auth.challenge, 
+		pending_auth.message, pending_auth.message_space);
+	rad_close(h);
+	chap_verify_done(0, ret);
+}
+
+/* -----------------------------------------------------------------------------
+send a chap response, or a MSChapV2 change password packet, to the server
+return the value expected by the chap hooks
+----------------------------------------------------------------------------- */
+static int
+radius_chap_start(char *user, int type, 
+	unsigned char *challenge, int challenge_len, int id, 
+	unsigned char *response, int response_len, 
+	unsigned char *message, int message_space, int changepassword)
+{
+	struct rad_handle *h;
+	int err;
+
+	h = radius_create_request(user, 0, type,  
+		(char*)challenge, challenge_len, id, 
+		response, response_len, changepassword);
+	if (h == NULL)
+		return 0;
+
+	/* don't block pppd while the server answers, see radius_chap_done */
+	err = radius_request_start(h, 1, radius_chap_done);
+	if (err != 0) {
+		err = radius_process_response(h, err, type, (char*)challenge, message, message_space);
+		rad_close(h);
+		return err;
+	}
+
+	pending_auth.type = type;
+	pending_auth.message = message;
+	pending_auth.message_space = message_space;
+	memcpy(pending_auth.challenge, challenge, MIN(challenge_len, sizeof(pending_auth.challenge)));
+	return CHAP_VERIFY_PENDING;
 }
 
 /* -----------------------------------------------------------------------------
@@ -874,9 +1090,9 @@ static int radius_chap_auth(u_char *user, u_char *ourname, int id,
     int challenge_len = *challenge++;
     int response_len = *response++;
 
-    return radius_authenticate_user((char*)user, 0, digest->code,  
-        (char*)challenge, challenge_len, id, 
-        response, response_len, message, message_space, 0);
+	return radius_chap_start((char*)user, digest->code, 
+		challenge, challenge_len, id, 
+		response, response_len, message, message_space, 0);
 }
 
 /* -----------------------------------------------------------------------------
@@ -891,8 +1107,8 @@ static int radius_chap_auth_unknown(char *user, char *ourname, int code, int id,
 	/* only handle MSChapV2 ChangePassword messages */
 	if (digest->code == CHAP_MICROSOFT_V2 && code == 7) {
 		/* pkt_len should be 582 */
-		return radius_authenticate_user(user, 0, digest->code,  
-			(char*)challenge, challenge_len, id, 
+		return radius_chap_start(user, digest->code,  
+			challenge, challenge_len, id, 
 			pkt, pkt_len, message, message_space, 1);
 	}
 	
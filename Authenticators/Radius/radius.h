@@ -59,4 +59,9 @@ int radius_decryptmppekey(char *key, u_int8_t *attr_value, size_t attr_len, char
 
 int radius_eap_install();
 
+// requests sent without blocking pppd
+struct rad_handle;
+int radius_request_start(struct rad_handle *h, int owned, void (*done)(struct rad_handle *h, int err));
+void radius_request_cancel();
+
 #endif
\ No newline at end of file
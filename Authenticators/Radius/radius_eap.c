@@ -57,6 +57,8 @@ static int radius_eap_init __P((struct EAP_Input *eap_in, void **context));
 static int radius_eap_dispose __P((void *context));
 static int radius_eap_process __P((void *context, EAP_Input *eap_in, EAP_Output *eap_out));
 static int radius_eap_attribute __P((void *context, EAP_Attribute *eap_attr));
+static void radius_eap_response(int err, struct EAP_Output *eap_out);
+static void radius_eap_done(struct rad_handle *h, int err);
 
 static void makePacket(struct EAP_Output *eap_out, u_int8_t code, u_int8_t id, u_int8_t *data, u_int16_t datalen, u_int16_t action);
 
@@ -86,6 +88,8 @@ static eap_ext *eap_handle = NULL;		// EAP proxy handler
 static u_int8_t output_buffer[1500];
 static u_int16_t output_buffer_len = 0;
 
+static struct EAP_Output *pending_out = NULL;	// output to fill when the server answers
+
 /* -----------------------------------------------------------------------------
 install eap handler
 ----------------------------------------------------------------------------- */
@@ -176,6 +180,7 @@ radius_eap_dispose (void *context)
 {
 
 	if (rad_handle) {
+		radius_request_cancel();
 		rad_close(rad_handle);
 		rad_handle = 0;
 	}
@@ -189,12 +194,8 @@ static int
 radius_eap_process (void *context, struct EAP_Input *eap_in, struct EAP_Output *eap_out)
 {
     struct EAP_Packet *pkt_in;
-	int	err = 0, attr_type, len, n;
-	unsigned char *attr_value;
-	size_t attr_len;
+	int	err = 0, len, n;
 	unsigned char *p;
-	u_int32_t attr_vendor;
-    char auth[MD4_SIGNATURE_SIZE + 1];
 	
 	// by default, ignore the message
 	eap_out->action = EAP_ACTION_NONE;
@@ -261,116 +262,146 @@ radius_eap_process (void *context, struct EAP_Input *eap_in, struct EAP_Output *
 				}
 			}
 			
-			err = rad_send_request(rad_handle);
+			/* don't block pppd while the server answers, see radius_eap_done */
+			err = radius_request_start(rad_handle, 0, radius_eap_done);
+			if (err == 0) {
+				pending_out = eap_out;
+				eap_out->action = EAP_ACTION_VERIFY_PENDING;
+				break;
+			}
+			
+			radius_eap_response(err, eap_out);
+			break;
 			
-			switch (err) {
-				case RAD_ACCESS_ACCEPT: 
-					/* authentication succeeded, retrieve keys attributes if present */
-					eap_mppe_keys_set = 0;
-					while ((attr_type = rad_get_attr(rad_handle, (const void **)&attr_value, &attr_len)) > 0 ) {
+		case EAP_NOTIFICATION_TIMEOUT:
+			/* retransmit same EAP packet on timeout */
+			if (++retransmits >= MAX_RETRANSMITS) {
+				makePacket(eap_out, EAP_FAILURE, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
+				break;
+			}
+			
+			eap_out->action = EAP_ACTION_SEND_WITH_TIMEOUT;
+			eap_out->data = output_buffer;
+			eap_out->data_len = output_buffer_len;
+			break;
 
-						switch (attr_type) {
-						
-							case RAD_VENDOR_SPECIFIC: 
-							
-								attr_type = rad_get_vendor_attr(&attr_vendor, (const void **)&attr_value,  &attr_len);
-								switch (attr_type) {
-									case RAD_MICROSOFT_MS_MPPE_SEND_KEY:
-										len = rad_request_authenticator(rad_handle, auth, sizeof(auth));
-										
-										if(len != -1)
-										{
-											radius_decryptmppekey((char*)eap_mppe_send_key, attr_value, attr_len, (char*)rad_server_secret(rad_handle), auth, len);
-											eap_mppe_keys_set = 1;
-										}
-										else
-											(*log_error)("Radius: rad-eap-mppe-send-key:  could not get authenticator!\n");
-										break;
-										
-									case RAD_MICROSOFT_MS_MPPE_RECV_KEY:
-										len = rad_request_authenticator(rad_handle, auth, sizeof(auth));
-										
-										if(len != -1)
-										{										
-											radius_decryptmppekey((char*)eap_mppe_recv_key, attr_value, attr_len, (char*)rad_server_secret(rad_handle), auth, len);
-											eap_mppe_keys_set = 1;
-										}
-										else
-											(*log_error)("Radius: rad-eap-mppe-recv-key:  could not get authenticator!\n");											
-										break;
-								}
-								break;
-						}
-					}
-					
-					makePacket(eap_out, EAP_SUCCESS, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
-					break;
+	}
+	
+	return EAP_NO_ERROR;
+}
 
-				case RAD_ACCESS_REJECT: 
-					/* pretty clear, the server don't like us ... */
-					makePacket(eap_out, EAP_FAILURE, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
-					break;
-					
-				case RAD_ACCESS_CHALLENGE: 
-					/* concatenate all EAP message attributes, and build an EAP packet */
-					output_buffer_len = 0;
-					last_state_attr_len = 0;
-					while ((attr_type = rad_get_attr(rad_handle, (const void **)&attr_value, &attr_len)) > 0 ) {
+/* -----------------------------------------------------------------------------
+interpret the server answer err to the access request, and build the eap packet
+----------------------------------------------------------------------------- */
+static void
+radius_eap_response(int err, struct EAP_Output *eap_out)
+{
+	int	attr_type, len;
+	unsigned char *attr_value;
+	size_t attr_len;
+	u_int32_t attr_vendor;
+    char auth[MD4_SIGNATURE_SIZE + 1];
 
+	switch (err) {
+		case RAD_ACCESS_ACCEPT: 
+			/* authentication succeeded, retrieve keys attributes if present */
+			eap_mppe_keys_set = 0;
+			while ((attr_type = rad_get_attr(rad_handle, (const void **)&attr_value, &attr_len)) > 0 ) {
+
+				switch (attr_type) {
+				
+					case RAD_VENDOR_SPECIFIC: 
+					
+						attr_type = rad_get_vendor_attr(&attr_vendor, (const void **)&attr_value,  &attr_len);
 						switch (attr_type) {
-						
-							case RAD_EAP_MESSAGE: 
-								if (output_buffer_len == 0)
-									current_id = attr_value[1];
-								if ((output_buffer_len + attr_len) <= sizeof(output_buffer)) {
-									bcopy(attr_value, output_buffer + output_buffer_len, attr_len);
-									output_buffer_len += attr_len;
+							case RAD_MICROSOFT_MS_MPPE_SEND_KEY:
+								len = rad_request_authenticator(rad_handle, auth, sizeof(auth));
+								
+								if(len != -1)
+								{
+									radius_decryptmppekey((char*)eap_mppe_send_key, attr_value, attr_len, (char*)rad_server_secret(rad_handle), auth, len);
+									eap_mppe_keys_set = 1;
 								}
+								else
+									(*log_error)("Radius: rad-eap-mppe-send-key:  could not get authenticator!\n");
 								break;
 								
-							case RAD_STATE: 
-								/* memorize server state for next access request */
-								last_state_attr_len = attr_len;
-								bcopy(attr_value, last_state_attr, attr_len);
+							case RAD_MICROSOFT_MS_MPPE_RECV_KEY:
+								len = rad_request_authenticator(rad_handle, auth, sizeof(auth));
+								
+								if(len != -1)
+								{										
+									radius_decryptmppekey((char*)eap_mppe_recv_key, attr_value, attr_len, (char*)rad_server_secret(rad_handle), auth, len);
+									eap_mppe_keys_set = 1;
+								}
+								else
+									(*log_error)("Radius: rad-eap-mppe-recv-key:  could not get authenticator!\n");											
 								break;
 						}
-					}
-					
-					if (!output_buffer_len) {
-						(*log_error)("Radius : Incorrect Access Challenge received\n");
-						makePacket(eap_out, EAP_FAILURE, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
 						break;
-					}
-
-					retransmits = 0;
-					eap_out->action = EAP_ACTION_SEND_WITH_TIMEOUT;
-					eap_out->data = output_buffer;
-					eap_out->data_len = output_buffer_len;
-					break;
-					
-				default: 
-					(*log_error)("Radius : Authentication error %d. %s.\n", err, rad_strerror(rad_handle));
-					makePacket(eap_out, EAP_FAILURE, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
-					break;
+				}
 			}
+			
+			makePacket(eap_out, EAP_SUCCESS, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
+			break;
 
+		case RAD_ACCESS_REJECT: 
+			/* pretty clear, the server don't like us ... */
+			makePacket(eap_out, EAP_FAILURE, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
 			break;
 			
-		case EAP_NOTIFICATION_TIMEOUT:
-			/* retransmit same EAP packet on timeout */
-			if (++retransmits >= MAX_RETRANSMITS) {
+		case RAD_ACCESS_CHALLENGE: 
+			/* concatenate all EAP message attributes, and build an EAP packet */
+			output_buffer_len = 0;
+			last_state_attr_len = 0;
+			while ((attr_type = rad_get_attr(rad_handle, (const void **)&attr_value, &attr_len)) > 0 ) {
+
+				switch (attr_type) {
+				
+					case RAD_EAP_MESSAGE: 
+						if (output_buffer_len == 0)
+							current_id = attr_value[1];
+						if ((output_buffer_len + attr_len) <= sizeof(output_buffer)) {
+							bcopy(attr_value, output_buffer + output_buffer_len, attr_len);
+							output_buffer_len += attr_len;
+						}
+						break;
+						
+					case RAD_STATE: 
+						/* memorize server state for next access request */
+						last_state_attr_len = attr_len;
+						bcopy(attr_value, last_state_attr, attr_len);
+						break;
+				}
+			}
+			
+			if (!output_buffer_len) {
+				(*log_error)("Radius : Incorrect Access Challenge received\n");
 				makePacket(eap_out, EAP_FAILURE, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
 				break;
 			}
-			
+
+			retransmits = 0;
 			eap_out->action = EAP_ACTION_SEND_WITH_TIMEOUT;
 			eap_out->data = output_buffer;
 			eap_out->data_len = output_buffer_len;
 			break;
-
+			
+		default: 
+			(*log_error)("Radius : Authentication error %d. %s.\n", err, rad_strerror(rad_handle));
+			makePacket(eap_out, EAP_FAILURE, current_id++, 0, 0, EAP_ACTION_SEND_AND_DONE);
+			break;
 	}
-	
-	return EAP_NO_ERROR;
+}
+
+/* -----------------------------------------------------------------------------
+the server answered a request sent by radius_eap_process
+----------------------------------------------------------------------------- */
+static void
+radius_eap_done(struct rad_handle *h, int err)
+{
+	radius_eap_response(err, pending_out);
+	eap_verify_done(0);
 }
 
 /* -----------------------------------------------------------------------------
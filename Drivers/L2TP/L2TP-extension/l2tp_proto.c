@@ -88,37 +88,6 @@ extern lck_mtx_t	*ppp_domain_mutex;
 --------------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 
-/* -----------------------------------------------------------------------------
- L2TP Timer, at 500 ms. Replaces l2tp_slowtimo, which is deprecated.
- ----------------------------------------------------------------------------- */
-static uint8_t l2tp_timer_thread_is_dying = 0; /* > 0 if dying */
-static uint8_t l2tp_timer_thread_is_dead = 0; /* > 0 if dead */
-static void l2tp_timer()
-{
-    struct timespec ts = {0};
-    
-    /* timeout of 500 ms */
-    ts.tv_nsec = 500 * 1000 * 1000;
-    ts.tv_sec = 0;
-
-    lck_mtx_lock(ppp_domain_mutex);
-    while (TRUE) {
-        if (l2tp_timer_thread_is_dying > 0) {
-            break;
-        }
-
-        l2tp_rfc_slowtimer();
-        
-        msleep(&l2tp_timer_thread_is_dying, ppp_domain_mutex, PSOCK, "l2tp_timer_sleep", &ts);
-    }
-
-    l2tp_timer_thread_is_dead++;
-    wakeup(&l2tp_timer_thread_is_dead);
-    lck_mtx_unlock(ppp_domain_mutex);
-
-    thread_terminate(current_thread());
-}
-
 /* -----------------------------------------------------------------------------
 Called when we need to add the L2TP protocol to the domain
 Typically, ppp_add is called by ppp_domain when we add the domain,
@@ -127,7 +96,6 @@ but we can add the protocol anytime later, if the domain is present
 int l2tp_add(struct domain *domain)
 {
     int 	 err;
-    thread_t l2tp_timer_thread = NULL;
 
     bzero(&l2tp_usr, sizeof(struct pr_usrreqs));
     l2tp_usr.pru_abort 		= pru_abort_notsupp;
@@ -163,12 +131,6 @@ int l2tp_add(struct domain *domain)
 
     l2tp.pr_usrreqs 	= &l2tp_usr;
 
-    /* Start timer thread */
-    l2tp_timer_thread_is_dying = 0;
-    if (kernel_thread_start((thread_continue_t)l2tp_timer, NULL, &l2tp_timer_thread) == KERN_SUCCESS) {
-        thread_deallocate(l2tp_timer_thread);
-    }
-    
     err = net_add_proto(&l2tp, domain);
     if (err)
         return err;
@@ -185,13 +147,6 @@ int l2tp_remove(struct domain *domain)
 
     lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
     
-    /* Cleanup timer thread */
-    if (l2tp_timer_thread_is_dead == 0) {
-        l2tp_timer_thread_is_dying++;           /* Tell thread to die */
-        wakeup(&l2tp_timer_thread_is_dying);    /* Wake thread */
-        msleep(&l2tp_timer_thread_is_dead, ppp_domain_mutex, PSOCK, "l2tp_timer_sleep", 0);
-    }
-
     err = net_del_proto(l2tp.pr_type, l2tp.pr_protocol, domain);
     if (err)
         return err;
@@ -226,6 +181,7 @@ int l2tp_ctloutput(struct socket *so, struct sockopt *sopt)
     u_int32_t	lval, cmd = 0;
     u_int16_t	val;
     u_char 	*addr;
+    u_int8_t	cookie[1 + L2TP_V3_MAX_COOKIE];
 		
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
     
@@ -309,6 +265,29 @@ int l2tp_ctloutput(struct socket *so, struct sockopt *sopt)
                         l2tp_rfc_command(so->so_pcb, L2TP_CMD_SETDELEGATEDPID, &lval);
                     break;
                     
+                case L2TP_OPT_V3_SESSION_ID:
+                case L2TP_OPT_V3_PEER_SESSION_ID:
+                    if (sopt->sopt_valsize != 4)
+                        error = EMSGSIZE;
+                    else if ((error = sooptcopyin(sopt, &lval, 4, 4)) == 0)
+                        l2tp_rfc_command(so->so_pcb, 
+                            sopt->sopt_name == L2TP_OPT_V3_SESSION_ID ? L2TP_CMD_SETV3SESSIONID : L2TP_CMD_SETV3PEERSESSIONID,
+                            &lval);
+                    break;
+
+                case L2TP_OPT_COOKIE:
+                case L2TP_OPT_PEER_COOKIE:
+                    /* cookie is passed to l2tp_rfc with its length in the first byte */
+                    if (sopt->sopt_valsize > L2TP_V3_MAX_COOKIE)
+                        error = EMSGSIZE;
+                    else if ((error = sooptcopyin(sopt, &cookie[1], sopt->sopt_valsize, sopt->sopt_valsize)) == 0) {
+                        cookie[0] = sopt->sopt_valsize;
+                        error = l2tp_rfc_command(so->so_pcb, 
+                            sopt->sopt_name == L2TP_OPT_COOKIE ? L2TP_CMD_SETCOOKIE : L2TP_CMD_SETPEERCOOKIE,
+                            cookie);
+                    }
+                    break;
+                    
                 default:
                     error = ENOPROTOOPT;
             }
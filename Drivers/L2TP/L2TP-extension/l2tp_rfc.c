@@ -29,7 +29,11 @@
 #include <sys/malloc.h>
 #include <sys/syslog.h>
 #include <sys/domain.h>
+#include <sys/sysctl.h>
 #include <kern/locks.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
+#include <libkern/OSAtomic.h>
 
 #include "../../../Family/if_ppplink.h"
 #include "../../../Family/ppp_domain.h"
@@ -50,6 +54,19 @@ Definitions
 #define L2TP_STATE_NEW_SEQUENCE	0x00000002	/* we have a seq number to acknowledge */
 #define L2TP_STATE_FREEING	0x00000004	/* rfc has been freed. structure is kept for 31 seconds */
 #define L2TP_STATE_RELIABILITY_OFF	0x00000008	/* reliability layer is currently off */
+#define L2TP_STATE_SESSION_HASHED	0x00000010	/* data rfc is in the session hash table */
+#define L2TP_STATE_TIMER_ARMED	0x00000020	/* rfc is in the timer list */
+#define L2TP_STATE_DATA_SEQ_SYNC	0x00000040	/* peer data sequence number is known */
+#define L2TP_STATE_RTT_SAMPLED	0x00000080	/* srtt and rttvar hold a measure */
+#define L2TP_STATE_XMIT_FULL	0x00000100	/* output thread is congested - client is told to stop sending */
+#define L2TP_STATE_V3_HASHED	0x00000200	/* data rfc is in the L2TPv3 session hash table */
+#define L2TP_STATE_IP_ATTACHED	0x00000400	/* rfc holds a reference on the L2TPv3 raw IP socket */
+
+/* output flow of a data connection, sessions of a tunnel are spread over the output threads */
+#define L2TP_RFC_FLOW(rfc)	\
+	((rfc)->flags & L2TP_FLAG_V3_IP ? (int)((rfc)->our_v3_session_id & 0x7FFFFFFF) :	\
+	 (rfc)->thread < 0 ? -1 : \
+	 (int)(((rfc)->thread + ((rfc)->flags & L2TP_FLAG_V3 ? (rfc)->our_v3_session_id : (rfc)->our_session_id)) & 0x7FFFFFFF))
 
 
 /*
@@ -77,6 +94,10 @@ struct l2tp_rfc {
 
     // administrative info
     TAILQ_ENTRY(l2tp_rfc) 	next;
+    TAILQ_ENTRY(l2tp_rfc) 	session_next;		/* link in the data session hash table */
+    TAILQ_ENTRY(l2tp_rfc) 	timer_next;		/* link in the timer list */
+    TAILQ_ENTRY(l2tp_rfc) 	xmit_next;		/* link in the xmit full list */
+    u_int64_t		timer_deadline;			/* earliest armed timer - absolute time */
     void 			*host; 			/* pointer back to the hosting structure */
     l2tp_rfc_input_callback 	inputcb;		/* callback function when data are present */
     l2tp_rfc_event_callback 	eventcb;		/* callback function for events */
@@ -96,12 +117,22 @@ struct l2tp_rfc {
     u_int16_t		peer_session_id;		/* peer's session id */
     u_int16_t		our_window;			/* our recv window */
     u_int16_t		peer_window;			/* peer's recv window */
-    u_int16_t		free_time_remain;		/* time until rfc is freed - seconds/2 */
-    u_int16_t		initial_timeout;		/* initial timeout value - seconds/2 */
-    u_int16_t		timeout_cap;			/* maximum timeout cap - seconds/2 */
+    u_int32_t		initial_timeout;		/* initial timeout value - milliseconds */
+    u_int32_t		timeout_cap;			/* maximum timeout cap - milliseconds */
     u_int16_t		max_retries;			/* maximum retries allowed */
     u_int16_t		retry_count;			/* current retry count */
-    u_int16_t		retrans_time_remain;		/* time until next retransmission - seconds/2 */
+    u_int32_t		rto;				/* retransmission timeout - milliseconds */
+    int32_t			srtt;				/* smoothed round trip time - milliseconds << 3 */
+    int32_t			rttvar;				/* round trip time variation - milliseconds << 2 */
+    u_int16_t		rtt_seq;			/* seq number being timed */
+    u_int64_t		rtt_start;			/* time rtt_seq was sent - 0 if not timing */
+    u_int16_t		cwnd;				/* congestion window (RFC 2661 appendix A) */
+    u_int16_t		ssthresh;			/* slow start threshold */
+    u_int16_t		cwnd_acked;			/* packets acked since last cwnd increase */
+    u_int16_t		snd_max;			/* first seq number never sent */
+    u_int64_t		retrans_deadline;		/* retransmit first queued message - 0 if not armed */
+    u_int64_t		ack_deadline;			/* send a ZLB ack - 0 if not armed */
+    u_int64_t		free_deadline;			/* free the rfc - 0 if not armed */
     u_int16_t		our_ns;				/* last seq number we sent */
     u_int16_t		our_nr;				/* last seq number we acked */
     u_int16_t		peer_nr;			/* last seq number peer acked */
@@ -109,6 +140,17 @@ struct l2tp_rfc {
     u_int16_t		peer_last_data_seq;		/* last data seq number we received */
     TAILQ_HEAD(, l2tp_elem) send_queue;		/* control message send queue */
     TAILQ_HEAD(, l2tp_elem) recv_queue;		/* control or sequenced data message recv queue */
+    u_int16_t		reorder_count;			/* data packets waiting in the recv queue */
+    u_int64_t		reorder_deadline;		/* give up on missing data packets at this time - 0 if not armed */
+
+    // l2tpv3 data session info
+    u_int32_t		our_v3_session_id;		/* our L2TPv3 session id */
+    u_int32_t		peer_v3_session_id;		/* peer's L2TPv3 session id */
+    u_int32_t		our_v3_data_seq;		/* next L2TPv3 data seq number we send - 24 bits */
+    u_int8_t		cookie_len;				/* cookie expected in received packets */
+    u_int8_t		cookie[L2TP_V3_MAX_COOKIE];
+    u_int8_t		peer_cookie_len;		/* cookie put in sent packets */
+    u_int8_t		peer_cookie[L2TP_V3_MAX_COOKIE];
 
 };
 
@@ -128,6 +170,48 @@ extern lck_mtx_t	*ppp_domain_mutex;
 #define L2TP_RFC_MAX_HASH 256
 static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_hash[L2TP_RFC_MAX_HASH];
 
+/* data connections are also hashed on the (tunnel id, session id) pair,
+   so that data demultiplexing doesn't depend on the number of sessions per tunnel */
+#define L2TP_RFC_MAX_SESSION_HASH 1024	/* power of 2 */
+#define L2TP_RFC_SESSION_HASH(tunnel_id, session_id)	\
+	((((u_int32_t)(tunnel_id) * 0x9E3779B1U) ^ (u_int32_t)(session_id)) & (L2TP_RFC_MAX_SESSION_HASH - 1))
+static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_session_hash[L2TP_RFC_MAX_SESSION_HASH];
+
+/* L2TPv3 session ids are unique whatever the tunnel, data connections are hashed on the 32 bits session id only */
+#define L2TP_RFC_V3_SESSION_HASH(session_id)	\
+	((((u_int32_t)(session_id)) * 0x9E3779B1U) >> 22)		/* 10 bits, L2TP_RFC_MAX_SESSION_HASH */
+static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_v3_session_hash[L2TP_RFC_MAX_SESSION_HASH];
+static u_int32_t	l2tp_rfc_v3_cookie_drops = 0;
+
+/* high resolution timer, shared by all rfc with a pending deadline */
+static thread_call_t	l2tp_rfc_timer_call = 0;
+static u_int64_t		l2tp_rfc_timer_next = 0;		/* deadline the timer call is set for */
+static volatile SInt32	l2tp_rfc_timer_running = 0;
+static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_timer_list;
+
+/* data connections waiting for their output thread to drain */
+static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_xmit_full_list;
+
+/* reordering of sequenced data packets */
+static int			l2tp_rfc_reorder_depth = L2TP_DEFAULT_REORDER_DEPTH;
+static int			l2tp_rfc_reorder_timeout = L2TP_DEFAULT_REORDER_TIMEOUT;
+static u_int32_t	l2tp_rfc_reorder_queued = 0;
+static u_int32_t	l2tp_rfc_reorder_late_drops = 0;
+static u_int32_t	l2tp_rfc_reorder_timeouts = 0;
+
+SYSCTL_INT(_net_ppp_l2tp, OID_AUTO, reorder_depth, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &l2tp_rfc_reorder_depth, 0, "Max sequenced data packets held for reordering per session, 0 to disable");
+SYSCTL_INT(_net_ppp_l2tp, OID_AUTO, reorder_timeout, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &l2tp_rfc_reorder_timeout, 0, "Time to wait for a missing data packet (milliseconds)");
+SYSCTL_INT(_net_ppp_l2tp, OID_AUTO, reorder_queued, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &l2tp_rfc_reorder_queued, 0, "Data packets received out of order and queued");
+SYSCTL_INT(_net_ppp_l2tp, OID_AUTO, reorder_late_drops, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &l2tp_rfc_reorder_late_drops, 0, "Data packets dropped as duplicate or too late");
+SYSCTL_INT(_net_ppp_l2tp, OID_AUTO, reorder_timeouts, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &l2tp_rfc_reorder_timeouts, 0, "Missing data packets given up after the reorder timeout");
+SYSCTL_INT(_net_ppp_l2tp, OID_AUTO, v3_cookie_drops, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &l2tp_rfc_v3_cookie_drops, 0, "L2TPv3 data packets dropped because of a wrong cookie");
+
 
 /* -----------------------------------------------------------------------------
 Forward declarations
@@ -135,6 +219,8 @@ Forward declarations
 
 u_int16_t l2tp_rfc_output_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *to);
 u_int16_t l2tp_rfc_output_data(struct l2tp_rfc *rfc, mbuf_t m);
+static u_int16_t l2tp_rfc_output_v3(struct l2tp_rfc *rfc, mbuf_t m);
+static u_int16_t l2tp_rfc_output_done(struct l2tp_rfc *rfc, int error);
 int l2tp_rfc_output_queued(struct l2tp_rfc *rfc, struct l2tp_elem *elem);
 int l2tp_rfc_compare_address(struct sockaddr* addr1, struct sockaddr* addr2);
 void l2tp_rfc_handle_ack(struct l2tp_rfc *rfc, u_int16_t nr);
@@ -144,6 +230,19 @@ u_int16_t l2tp_handle_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *f
     u_int16_t flags, u_int16_t len, u_int16_t tunnel_id, u_int16_t session_id);
 void l2tp_rfc_free_now(struct l2tp_rfc *rfc);
 void l2tp_rfc_accept(struct l2tp_rfc* rfc);
+static void l2tp_rfc_session_unhash(struct l2tp_rfc *rfc);
+static void l2tp_rfc_session_rehash(struct l2tp_rfc *rfc);
+static void l2tp_rfc_timer(thread_call_param_t param0, thread_call_param_t param1);
+static void l2tp_rfc_timer_update(struct l2tp_rfc *rfc);
+static void l2tp_rfc_reorder_input(struct l2tp_rfc *rfc, mbuf_t m, u_int16_t ns);
+static void l2tp_rfc_reorder_release(struct l2tp_rfc *rfc, int skip);
+static void l2tp_rfc_delayed_ack(struct l2tp_rfc *rfc);
+static void l2tp_rfc_ack_later(struct l2tp_rfc *rfc);
+static void l2tp_rfc_retransmit(struct l2tp_rfc *rfc);
+static void l2tp_rfc_arm_retransmit(struct l2tp_rfc *rfc, u_int32_t timeout);
+static void l2tp_rfc_rtt_update(struct l2tp_rfc *rfc);
+static int l2tp_rfc_send_new(struct l2tp_rfc *rfc, struct l2tp_elem *elem);
+static int l2tp_rfc_v3_input(mbuf_t m, struct sockaddr *from, int offset, int ip);
 
 /* -----------------------------------------------------------------------------
 intialize L2TP protocol
@@ -152,9 +251,26 @@ u_int16_t l2tp_rfc_init()
 {
 	int i;
 	
+	l2tp_rfc_timer_call = thread_call_allocate(l2tp_rfc_timer, 0);
+	if (l2tp_rfc_timer_call == 0)
+		return 1;
+	TAILQ_INIT(&l2tp_rfc_timer_list);
+	TAILQ_INIT(&l2tp_rfc_xmit_full_list);
+
     l2tp_udp_init();
 	for (i = 0; i < L2TP_RFC_MAX_HASH; i++)
 		TAILQ_INIT(&l2tp_rfc_hash[i]);
+	for (i = 0; i < L2TP_RFC_MAX_SESSION_HASH; i++) {
+		TAILQ_INIT(&l2tp_rfc_session_hash[i]);
+		TAILQ_INIT(&l2tp_rfc_v3_session_hash[i]);
+	}
+
+    sysctl_register_oid(&sysctl__net_ppp_l2tp_reorder_depth);
+    sysctl_register_oid(&sysctl__net_ppp_l2tp_reorder_timeout);
+    sysctl_register_oid(&sysctl__net_ppp_l2tp_reorder_queued);
+    sysctl_register_oid(&sysctl__net_ppp_l2tp_reorder_late_drops);
+    sysctl_register_oid(&sysctl__net_ppp_l2tp_reorder_timeouts);
+    sysctl_register_oid(&sysctl__net_ppp_l2tp_v3_cookie_drops);
     return 0;
 }
 
@@ -172,8 +288,24 @@ u_int16_t l2tp_rfc_dispose()
 			return 1;
 	}
 
+	/* the timer may have fired and be waiting for the domain lock */
+	thread_call_cancel(l2tp_rfc_timer_call);
+	if (l2tp_rfc_timer_running)
+		return 1;
+
     if (l2tp_udp_dispose())
         return 1;
+
+    sysctl_unregister_oid(&sysctl__net_ppp_l2tp_reorder_depth);
+    sysctl_unregister_oid(&sysctl__net_ppp_l2tp_reorder_timeout);
+    sysctl_unregister_oid(&sysctl__net_ppp_l2tp_reorder_queued);
+    sysctl_unregister_oid(&sysctl__net_ppp_l2tp_reorder_late_drops);
+    sysctl_unregister_oid(&sysctl__net_ppp_l2tp_reorder_timeouts);
+    sysctl_unregister_oid(&sysctl__net_ppp_l2tp_v3_cookie_drops);
+
+	thread_call_free(l2tp_rfc_timer_call);
+	l2tp_rfc_timer_call = 0;
+	l2tp_rfc_timer_next = 0;
     return 0;
 }
 
@@ -202,14 +334,17 @@ u_int16_t l2tp_rfc_new_client(void *host, void **data,
     rfc->host = host;
     rfc->inputcb = input;
     rfc->eventcb = event;
-    rfc->timeout_cap = L2TP_DEFAULT_TIMEOUT_CAP * 2;		
-    rfc->initial_timeout = L2TP_DEFAULT_INITIAL_TIMEOUT * 2;	
+    rfc->timeout_cap = L2TP_DEFAULT_TIMEOUT_CAP * 1000;		
+    rfc->initial_timeout = L2TP_DEFAULT_INITIAL_TIMEOUT * 1000;	
+    rfc->rto = rfc->initial_timeout;
     rfc->max_retries = L2TP_DEFAULT_RETRY_COUNT;
     rfc->flags = L2TP_FLAG_ADAPT_TIMER;
     
     // let's use some default values
     rfc->peer_window = L2TP_DEFAULT_WINDOW_SIZE;
     rfc->our_window = L2TP_DEFAULT_WINDOW_SIZE;
+    rfc->cwnd = 1;
+    rfc->ssthresh = rfc->peer_window;
     
     TAILQ_INIT(&rfc->send_queue);
     TAILQ_INIT(&rfc->recv_queue);
@@ -242,12 +377,13 @@ void l2tp_rfc_free_client(void *data)
     if (rfc->flags & L2TP_FLAG_CONTROL 
         && rfc->our_tunnel_id && rfc->peer_tunnel_id) {
         /* keep control connections around for a full retransmission cycle */
-        rfc->free_time_remain = 62; // give 31 seconds
+        clock_interval_to_deadline(31, kSecondScale, &rfc->free_deadline); // give 31 seconds
     }
     else {
         /* immediatly dispose of data connections */
-        rfc->free_time_remain = 1; // free it a.s.a.p
+        clock_get_uptime(&rfc->free_deadline); // free it a.s.a.p
     }
+    l2tp_rfc_timer_update(rfc);
 }
 
 /* -----------------------------------------------------------------------------
@@ -264,14 +400,49 @@ void l2tp_rfc_free_now(struct l2tp_rfc *rfc)
     
     LOGIT(rfc, "L2TP free (%p)\n", rfc);
     
+    /* 
+     * unlink the rfc first, l2tp_udp_detach drops the domain lock 
+     * and nobody must find the rfc in the meantime
+     */
+    rfc->reorder_count = 0;
+    rfc->reorder_deadline = 0;
+    rfc->retrans_deadline = 0;
+    rfc->ack_deadline = 0;
+    rfc->free_deadline = 0;
+    l2tp_rfc_timer_update(rfc);
+    l2tp_rfc_session_unhash(rfc);
+    TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);
+    if (rfc->state & L2TP_STATE_XMIT_FULL) {
+        TAILQ_REMOVE(&l2tp_rfc_xmit_full_list, rfc, xmit_next);
+        rfc->state &= ~L2TP_STATE_XMIT_FULL;
+    }
+
+    if (rfc->peer_address)
+        _FREE(rfc->peer_address, M_SONAME);
+                            
+    while((send_elem = TAILQ_FIRST(&rfc->send_queue))) {
+        TAILQ_REMOVE(&rfc->send_queue, send_elem, next);
+        mbuf_freem(send_elem->packet);
+        _FREE(send_elem, M_TEMP);
+    }
+    while((recv_elem = TAILQ_FIRST(&rfc->recv_queue))) {
+        TAILQ_REMOVE(&rfc->recv_queue, recv_elem, next);
+        mbuf_freem(recv_elem->packet);
+        _FREE(recv_elem, M_TEMP);
+    }
+
+    if (rfc->state & L2TP_STATE_IP_ATTACHED) {
+        rfc->state &= ~L2TP_STATE_IP_ATTACHED;
+        l2tp_udp_ip_detach();
+    }
+
     if (rfc->socket) {
         /* the control connection own socket */
         if (rfc->flags & L2TP_FLAG_CONTROL){
             // find an rfc with same socket
 			for (i = 0; i < L2TP_RFC_MAX_HASH; i++) {
 				TAILQ_FOREACH(rfc1, &l2tp_rfc_hash[i], next)
-					if (rfc1 != rfc
-						&& (rfc1->flags & L2TP_FLAG_CONTROL)
+					if ((rfc1->flags & L2TP_FLAG_CONTROL)
 						&& (rfc1->socket == rfc->socket))
 						break;
 				// check if found
@@ -285,22 +456,135 @@ void l2tp_rfc_free_now(struct l2tp_rfc *rfc)
         rfc->socket = 0;
     }
 
-    if (rfc->peer_address)
-        _FREE(rfc->peer_address, M_SONAME);
-                            
-    while((send_elem = TAILQ_FIRST(&rfc->send_queue))) {
-        TAILQ_REMOVE(&rfc->send_queue, send_elem, next);
-        mbuf_freem(send_elem->packet);
-        _FREE(send_elem, M_TEMP);
+    _FREE(rfc, M_TEMP);
+}
+
+/* -----------------------------------------------------------------------------
+remove a data connection from the session hash table
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_session_unhash(struct l2tp_rfc *rfc)
+{
+    if (rfc->state & L2TP_STATE_SESSION_HASHED) {
+        TAILQ_REMOVE(&l2tp_rfc_session_hash[L2TP_RFC_SESSION_HASH(rfc->our_tunnel_id, rfc->our_session_id)], rfc, session_next);
+        rfc->state &= ~L2TP_STATE_SESSION_HASHED;
     }
-    while((recv_elem = TAILQ_FIRST(&rfc->recv_queue))) {
-        TAILQ_REMOVE(&rfc->recv_queue, recv_elem, next);
-        mbuf_freem(recv_elem->packet);
-        _FREE(recv_elem, M_TEMP);
+    else if (rfc->state & L2TP_STATE_V3_HASHED) {
+        TAILQ_REMOVE(&l2tp_rfc_v3_session_hash[L2TP_RFC_V3_SESSION_HASH(rfc->our_v3_session_id)], rfc, session_next);
+        rfc->state &= ~L2TP_STATE_V3_HASHED;
     }
+}
 
-    TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);
-    _FREE(rfc, M_TEMP);
+/* -----------------------------------------------------------------------------
+(re)insert a data connection in the session hash table
+must be called after any change of the flags, tunnel id or session id,
+only data connections with both ids set, or with a L2TPv3 session id, can receive data
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_session_rehash(struct l2tp_rfc *rfc)
+{
+    l2tp_rfc_session_unhash(rfc);
+    if (rfc->flags & L2TP_FLAG_CONTROL)
+        return;
+    if (rfc->flags & L2TP_FLAG_V3) {
+        if (rfc->our_v3_session_id) {
+            TAILQ_INSERT_TAIL(&l2tp_rfc_v3_session_hash[L2TP_RFC_V3_SESSION_HASH(rfc->our_v3_session_id)], rfc, session_next);
+            rfc->state |= L2TP_STATE_V3_HASHED;
+        }
+    }
+    else if (rfc->our_tunnel_id && rfc->our_session_id) {
+        TAILQ_INSERT_TAIL(&l2tp_rfc_session_hash[L2TP_RFC_SESSION_HASH(rfc->our_tunnel_id, rfc->our_session_id)], rfc, session_next);
+        rfc->state |= L2TP_STATE_SESSION_HASHED;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+recompute the rfc deadline from its individual timers, and update the timer list
+must be called after any change of an individual deadline
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_timer_update(struct l2tp_rfc *rfc)
+{
+    u_int64_t	deadline = 0;
+	
+#define L2TP_EARLIEST(d)	if ((d) && (deadline == 0 || (d) < deadline)) deadline = (d)
+    L2TP_EARLIEST(rfc->reorder_deadline);
+    L2TP_EARLIEST(rfc->retrans_deadline);
+    L2TP_EARLIEST(rfc->ack_deadline);
+    L2TP_EARLIEST(rfc->free_deadline);
+#undef L2TP_EARLIEST
+
+    if (rfc->state & L2TP_STATE_TIMER_ARMED) {
+        TAILQ_REMOVE(&l2tp_rfc_timer_list, rfc, timer_next);
+        rfc->state &= ~L2TP_STATE_TIMER_ARMED;
+    }
+
+    rfc->timer_deadline = deadline;
+    if (deadline == 0)
+        return;
+
+    TAILQ_INSERT_TAIL(&l2tp_rfc_timer_list, rfc, timer_next);
+    rfc->state |= L2TP_STATE_TIMER_ARMED;
+
+    /* the timer call is only moved forward here, l2tp_rfc_timer sets it to the next deadline */
+    if (l2tp_rfc_timer_next == 0 || deadline < l2tp_rfc_timer_next) {
+        l2tp_rfc_timer_next = deadline;
+        thread_call_enter_delayed(l2tp_rfc_timer_call, deadline);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+called by the high resolution timer, run the expired timers of each rfc
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_timer(thread_call_param_t param0, thread_call_param_t param1)
+{
+    struct l2tp_rfc  	*rfc, *rfc1;
+    u_int64_t			now, next = 0;
+
+	OSIncrementAtomic(&l2tp_rfc_timer_running);
+	lck_mtx_lock(ppp_domain_mutex);
+
+	l2tp_rfc_timer_next = 0;
+	clock_get_uptime(&now);
+
+	rfc = TAILQ_FIRST(&l2tp_rfc_timer_list);
+	while (rfc) {
+		rfc1 = TAILQ_NEXT(rfc, timer_next);
+		if (rfc->timer_deadline <= now) {
+			if (rfc->free_deadline && rfc->free_deadline <= now) {
+				l2tp_rfc_free_now(rfc);
+				/* the domain lock may have been dropped, rfc1 can be gone.
+				   the rfcs already processed are not expired anymore */
+				rfc = TAILQ_FIRST(&l2tp_rfc_timer_list);
+				continue;
+			}
+			if (rfc->retrans_deadline && rfc->retrans_deadline <= now)
+				l2tp_rfc_retransmit(rfc);
+			if (rfc->reorder_deadline && rfc->reorder_deadline <= now) {
+				/* waited long enough for the missing data packets */
+				rfc->reorder_deadline = 0;
+				if (!TAILQ_EMPTY(&rfc->recv_queue)) {
+					l2tp_rfc_reorder_timeouts++;
+					l2tp_rfc_reorder_release(rfc, 1);
+				}
+			}
+			// do the delayed ack last to take advantage of any data transmits in above code
+			if (rfc->ack_deadline && rfc->ack_deadline <= now) {
+				rfc->ack_deadline = 0;
+				l2tp_rfc_delayed_ack(rfc);
+			}
+			l2tp_rfc_timer_update(rfc);
+		}
+		rfc = rfc1;
+	}
+
+	TAILQ_FOREACH(rfc, &l2tp_rfc_timer_list, timer_next)
+		if (next == 0 || rfc->timer_deadline < next)
+			next = rfc->timer_deadline;
+	if (next && next != l2tp_rfc_timer_next) {
+		l2tp_rfc_timer_next = next;
+		thread_call_enter_delayed(l2tp_rfc_timer_call, next);
+	}
+
+	lck_mtx_unlock(ppp_domain_mutex);
+	OSDecrementAtomic(&l2tp_rfc_timer_running);
 }
 
 /* -----------------------------------------------------------------------------
@@ -320,6 +604,19 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
         case L2TP_CMD_SETFLAGS:
             LOGIT(rfc, "L2TP command (%p): set flags = 0x%x\n", rfc, *(u_int32_t *)cmddata);
             rfc->flags = *(u_int32_t *)cmddata;
+            l2tp_rfc_session_rehash(rfc);
+            /* L2TPv3 over IP shares a raw IP socket */
+            if ((rfc->flags & L2TP_FLAG_V3_IP) && !(rfc->flags & L2TP_FLAG_CONTROL)
+                && !(rfc->state & L2TP_STATE_IP_ATTACHED)) {
+                error = l2tp_udp_ip_attach();
+                if (error == 0)
+                    rfc->state |= L2TP_STATE_IP_ATTACHED;
+            }
+            else if (!(rfc->flags & L2TP_FLAG_V3_IP) 
+                && (rfc->state & L2TP_STATE_IP_ATTACHED)) {
+                rfc->state &= ~L2TP_STATE_IP_ATTACHED;
+                l2tp_udp_ip_detach();
+            }
            break;
 
         case L2TP_CMD_GETFLAGS:
@@ -335,6 +632,9 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
         case L2TP_CMD_SETPEERWINDOW:
             LOGIT(rfc, "L2TP command (%p): set peer window = %d\n", rfc, *(u_int16_t *)cmddata);
             rfc->peer_window = *(u_int16_t *)cmddata;
+            rfc->ssthresh = rfc->peer_window;
+            if (rfc->cwnd > rfc->peer_window)
+                rfc->cwnd = rfc->peer_window ? rfc->peer_window : 1;
             break;
 
         case L2TP_CMD_GETNEWTUNNELID:
@@ -348,16 +648,20 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
                         break;
             } while (rfc1);
             TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);	/* remove the rfc struct from the hash table */
+            l2tp_rfc_session_unhash(rfc);
             *(u_int16_t *)cmddata = rfc->our_tunnel_id = unique_tunnel_id;
 			TAILQ_INSERT_TAIL(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next); /* and reinsert it at the right place */
+            l2tp_rfc_session_rehash(rfc);
             LOGIT(rfc, "L2TP command (%p): get new tunnel id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
             break;
             
         case L2TP_CMD_SETTUNNELID:
             LOGIT(rfc, "L2TP command (%p): set tunnel id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
             TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);	/* remove the rfc struct from the hash table */
+            l2tp_rfc_session_unhash(rfc);
             rfc->our_tunnel_id = *(u_int16_t *)cmddata;
 			TAILQ_INSERT_TAIL(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next); /* and reinsert it at the right place */
+            l2tp_rfc_session_rehash(rfc);
 
             if (!(rfc->flags & L2TP_FLAG_CONTROL)) {
                 /* for data connection, join the existing socket of the associated control connection */
@@ -384,8 +688,11 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
 
         case L2TP_CMD_SETSESSIONID:
             LOGIT(rfc, "L2TP command (%p): set session id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
-            if (!(rfc->flags & L2TP_FLAG_CONTROL))
+            if (!(rfc->flags & L2TP_FLAG_CONTROL)) {
+                l2tp_rfc_session_unhash(rfc);
                 rfc->our_session_id = *(u_int16_t *)cmddata;
+                l2tp_rfc_session_rehash(rfc);
+            }
             break;
 
         case L2TP_CMD_GETSESSIONID:
@@ -412,12 +719,14 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
 
         case L2TP_CMD_SETTIMEOUT:
             LOGIT(rfc, "L2TP command (%p): set initial timeout = %d (seconds)\n", rfc, *(u_int16_t *)cmddata);
-            rfc->initial_timeout = *(u_int16_t *)cmddata * 2;	
+            rfc->initial_timeout = *(u_int16_t *)cmddata * 1000;	
+            if (!(rfc->state & L2TP_STATE_RTT_SAMPLED))
+                rfc->rto = rfc->initial_timeout;
             break;
 
         case L2TP_CMD_SETTIMEOUTCAP:
             LOGIT(rfc, "L2TP command (%p): set timeout cap = %d (seconds)\n", rfc, *(u_int16_t *)cmddata);
-            rfc->timeout_cap = *(u_int16_t *)cmddata * 2;	
+            rfc->timeout_cap = *(u_int16_t *)cmddata * 1000;	
             break;
 
         case L2TP_CMD_SETMAXRETRIES:
@@ -561,10 +870,14 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
             if (*(u_int16_t *)cmddata) {
 				rfc->state &= ~L2TP_STATE_RELIABILITY_OFF;
 				rfc->retry_count = 0;
-				rfc->retrans_time_remain = rfc->initial_timeout;
+				if (!TAILQ_EMPTY(&rfc->send_queue))
+					l2tp_rfc_arm_retransmit(rfc, rfc->rto);
 			}
-			else 
+			else {
 				rfc->state |= L2TP_STATE_RELIABILITY_OFF;
+				rfc->retrans_deadline = 0;
+				l2tp_rfc_timer_update(rfc);
+			}
             break;
             
         case L2TP_CMD_SETDELEGATEDPID:
@@ -573,6 +886,40 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
                 rfc->delegate_pid = *(int *)cmddata;
             break;
 
+        case L2TP_CMD_SETV3SESSIONID:
+            LOGIT(rfc, "L2TP command (%p): set L2TPv3 session id = 0x%x\n", rfc, *(u_int32_t *)cmddata);
+            if (!(rfc->flags & L2TP_FLAG_CONTROL)) {
+                l2tp_rfc_session_unhash(rfc);
+                rfc->our_v3_session_id = *(u_int32_t *)cmddata;
+                l2tp_rfc_session_rehash(rfc);
+            }
+            break;
+
+        case L2TP_CMD_SETV3PEERSESSIONID:
+            LOGIT(rfc, "L2TP command (%p): set L2TPv3 peer session id = 0x%x\n", rfc, *(u_int32_t *)cmddata);
+            if (!(rfc->flags & L2TP_FLAG_CONTROL))
+                rfc->peer_v3_session_id = *(u_int32_t *)cmddata;
+            break;
+
+        case L2TP_CMD_SETCOOKIE:
+        case L2TP_CMD_SETPEERCOOKIE:
+            /* cookie length is in the first byte, and can be 0, 4 or 8 bytes */
+            p = (u_char *)cmddata;
+            LOGIT(rfc, "L2TP command (%p): set L2TPv3 %scookie, len = %d\n", rfc, cmd == L2TP_CMD_SETCOOKIE ? "" : "peer ", p[0]);
+            if (p[0] != 0 && p[0] != 4 && p[0] != 8) {
+                error = EINVAL;
+                break;
+            }
+            if (cmd == L2TP_CMD_SETCOOKIE) {
+                rfc->cookie_len = p[0];
+                bcopy(&p[1], rfc->cookie, p[0]);
+            }
+            else {
+                rfc->peer_cookie_len = p[0];
+                bcopy(&p[1], rfc->peer_cookie, p[0]);
+            }
+            break;
+
         default:
             LOGIT(rfc, "L2TP command (%p): unknown command = %d\n", rfc, cmd);
     }
@@ -582,9 +929,9 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
 
 
 /* -----------------------------------------------------------------------------
- main body of function used to be l2tp_rfc_fasttimer... called by protocol family when fast timer expired:
- now it's called when slow timer expired because of <rdar://problem/7617885> 
- ----------------------------------------------------------------------------- */
+send a ZLB ack if we have a sequence number to acknowledge,
+called when the ack timer expires, if no control message carried the ack meanwhile
+----------------------------------------------------------------------------- */
 static void l2tp_rfc_delayed_ack(struct l2tp_rfc *rfc)
 {
     mbuf_t				m;
@@ -617,59 +964,101 @@ static void l2tp_rfc_delayed_ack(struct l2tp_rfc *rfc)
 }
 
 /* -----------------------------------------------------------------------------
-called by protocol family when slow timer expires
+we have a new sequence number to acknowledge, give a chance to a control message
+to carry the ack before sending a ZLB ack
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_ack_later(struct l2tp_rfc *rfc)
+{
+    rfc->state |= L2TP_STATE_NEW_SEQUENCE;
+    if (rfc->ack_deadline == 0) {
+        clock_interval_to_deadline(L2TP_DEFAULT_ACK_DELAY, kMillisecondScale, &rfc->ack_deadline);
+        l2tp_rfc_timer_update(rfc);
+    }
+}
 
-    Decrements retrans_time_remain and checks if time to re-send the message
-    at the beginning of the transmit queue.  If retry count is exhasted,
-    time to break the connection.
+/* -----------------------------------------------------------------------------
+arm the retransmission timer
 ----------------------------------------------------------------------------- */
-void l2tp_rfc_slowtimer()
+static void l2tp_rfc_arm_retransmit(struct l2tp_rfc *rfc, u_int32_t timeout)
 {
-    struct l2tp_rfc  	*rfc1, *rfc;
-	int					i;
-    
-	for (i = 0; i < L2TP_RFC_MAX_HASH; i++) {
+    clock_interval_to_deadline(timeout, kMillisecondScale, &rfc->retrans_deadline);
+    l2tp_rfc_timer_update(rfc);
+}
 
-		rfc = TAILQ_FIRST(&l2tp_rfc_hash[i]);
+/* -----------------------------------------------------------------------------
+called when the retransmission timer expires
 
-		while (rfc) {
+    Increments the retry count and re-sends the message at the beginning 
+    of the transmit queue.  If retry count is exhasted, time to break the 
+    connection. A timeout is a congestion signal, the congestion window 
+    goes back to slow start (RFC 2661 appendix A).
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_retransmit(struct l2tp_rfc *rfc)
+{
+    u_int32_t	timeout;
+
+    rfc->retrans_deadline = 0;
+    if ((rfc->state & L2TP_STATE_RELIABILITY_OFF) 
+        || TAILQ_EMPTY(&rfc->send_queue))
+        return;
+
+    rfc->retry_count++;
+    if (rfc->retry_count >= rfc->max_retries) {
+        /* send event to client */
+        if (!(rfc->state & L2TP_STATE_FREEING))
+            (*rfc->eventcb)(rfc->host, L2TP_EVT_RELIABLE_FAILED, 0);
+        return;
+    }
 
-			if (rfc->state & L2TP_STATE_FREEING 
-				&& --rfc->free_time_remain == 0) {
-				
-				rfc1 = TAILQ_NEXT(rfc, next);
-				l2tp_rfc_free_now(rfc);
-				rfc = rfc1;
-				continue;
-			}
+    rfc->ssthresh = rfc->cwnd / 2 ? rfc->cwnd / 2 : 1;
+    rfc->cwnd = 1;
+    rfc->cwnd_acked = 0;
+    rfc->rtt_start = 0;		/* don't time retransmitted messages */
 
-			if (!(rfc->state & L2TP_STATE_RELIABILITY_OFF) 
-				&& !TAILQ_EMPTY(&rfc->send_queue)) {
-				if (--rfc->retrans_time_remain == 0) {
-					rfc->retry_count++;
-					if (rfc->retry_count >= rfc->max_retries) {
-						/* send event to client */
-						if (!(rfc->state & L2TP_STATE_FREEING))
-							(*rfc->eventcb)(rfc->host, L2TP_EVT_RELIABLE_FAILED, 0);
-					}
-					else {						
-						l2tp_rfc_output_queued(rfc, TAILQ_FIRST(&rfc->send_queue)); 
-						if (rfc->flags & L2TP_FLAG_ADAPT_TIMER)
-							rfc->retrans_time_remain = rfc->initial_timeout << rfc->retry_count; 
-						else 
-							rfc->retrans_time_remain = rfc->initial_timeout;
-						if (rfc->retrans_time_remain > rfc->timeout_cap)
-							rfc->retrans_time_remain = rfc->timeout_cap;
-					}
-				}
-			}
+    l2tp_rfc_output_queued(rfc, TAILQ_FIRST(&rfc->send_queue)); 
 
-			// do the delayed ack last to take advantage of any data transmits in above code
-			l2tp_rfc_delayed_ack(rfc);
+    if (rfc->flags & L2TP_FLAG_ADAPT_TIMER)
+        timeout = (rfc->retry_count < 16) ? rfc->rto << rfc->retry_count : rfc->timeout_cap; 
+    else 
+        timeout = rfc->initial_timeout;
+    if (timeout > rfc->timeout_cap)
+        timeout = rfc->timeout_cap;
+    l2tp_rfc_arm_retransmit(rfc, timeout);
+}
 
-			rfc = TAILQ_NEXT(rfc, next);
-		}
-	}
+/* -----------------------------------------------------------------------------
+the message being timed has been acknowledged, update the retransmission timeout
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_rtt_update(struct l2tp_rfc *rfc)
+{
+    u_int64_t	now, nsec;
+    int32_t		rtt, delta;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - rfc->rtt_start, &nsec);
+    rfc->rtt_start = 0;
+    rtt = nsec / 1000000;
+
+    if (!(rfc->state & L2TP_STATE_RTT_SAMPLED)) {
+        rfc->srtt = rtt << 3;
+        rfc->rttvar = rtt << 1;
+        rfc->state |= L2TP_STATE_RTT_SAMPLED;
+    }
+    else {
+        delta = rtt - (rfc->srtt >> 3);
+        rfc->srtt += delta;
+        if (delta < 0)
+            delta = -delta;
+        rfc->rttvar += delta - (rfc->rttvar >> 2);
+    }
+
+    if (!(rfc->flags & L2TP_FLAG_ADAPT_TIMER))
+        return;
+    rfc->rto = (rfc->srtt >> 3) + rfc->rttvar;
+    if (rfc->rto < L2TP_MIN_RTO)
+        rfc->rto = L2TP_MIN_RTO;
+    if (rfc->rto > rfc->timeout_cap)
+        rfc->rto = rfc->timeout_cap;
 }
 
 /* -----------------------------------------------------------------------------
@@ -693,7 +1082,7 @@ void l2tp_rfc_accept(struct l2tp_rfc* rfc)
             TAILQ_REMOVE(&call_rfc->recv_queue, elem, next);	/* remove the packet from the call socket */
             
             rfc->our_nr = 1;							/* set nr to the correct value */
-            rfc->state |= L2TP_STATE_NEW_SEQUENCE;				/* setup to send ack */
+            l2tp_rfc_ack_later(rfc);						/* setup to send ack */
             if ((*rfc->inputcb)(rfc->host, elem->packet, (struct sockaddr *)elem->addr, 1)) {	/* up to the socket */
 				/* mbuf has been freed by upcall */ 
 			}
@@ -733,6 +1122,7 @@ u_int16_t l2tp_rfc_output_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockadd
     struct l2tp_header	*hdr, hdr_data;
     mbuf_t				m0;
     u_int16_t 			len;
+    int					error;
 
     len = 0;
     for (m0 = m; m0 != 0; m0 = mbuf_next(m0))
@@ -764,7 +1154,8 @@ u_int16_t l2tp_rfc_output_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockadd
 
 	if (rfc->state & L2TP_STATE_RELIABILITY_OFF) {
 		//IOLog("l2tp_rfc_output_control send once rfc = %p\n", rfc);   
-		return l2tp_udp_output(rfc->socket, rfc->thread , m, to->sa_family ? to : (struct sockaddr *)rfc->peer_address);
+		error = l2tp_udp_output(rfc->socket, rfc->thread , m, to->sa_family ? to : (struct sockaddr *)rfc->peer_address);
+		return (error == EWOULDBLOCK ? 0 : error);
 	} 
 
 	rfc->our_ns++;
@@ -784,13 +1175,11 @@ u_int16_t l2tp_rfc_output_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockadd
     	
     if (TAILQ_EMPTY(&rfc->send_queue)) {			/* first on queue ? */
         rfc->retry_count = 0;
-        rfc->retrans_time_remain = rfc->initial_timeout;
+        l2tp_rfc_arm_retransmit(rfc, rfc->rto);
     }
     TAILQ_INSERT_TAIL(&rfc->send_queue, elem, next);
-    if (SEQ_LT(elem->seqno, rfc->peer_nr + rfc->peer_window)) {	/* within window ?  - send it */
-        rfc->state &= ~L2TP_STATE_NEW_SEQUENCE;			/* disable sending of ack - piggybacked on this packet */
-        return l2tp_rfc_output_queued(rfc, elem);
-    } 
+    if (SEQ_LT(elem->seqno, rfc->peer_nr + MIN(rfc->cwnd, rfc->peer_window)))	/* within window ?  - send it */
+        return l2tp_rfc_send_new(rfc, elem);
     
     return 0;
 }
@@ -802,6 +1191,7 @@ u_int16_t l2tp_rfc_output_data(struct l2tp_rfc *rfc, mbuf_t m)
     struct l2tp_header	*hdr, hdr_data;
     mbuf_t				m0;
     u_int16_t 			len, hdr_length, flags, i;
+    int					error;
 
     len = 0;
 	i = 0;
@@ -820,6 +1210,9 @@ u_int16_t l2tp_rfc_output_data(struct l2tp_rfc *rfc, mbuf_t m)
 		};
 	}
 
+    if (rfc->flags & L2TP_FLAG_V3)
+        return l2tp_rfc_output_v3(rfc, m);
+
     hdr_length = L2TP_DATA_HDR_SIZE + (rfc->flags & L2TP_FLAG_PEER_SEQ_REQ ? 4 : 0);
                 
     if (mbuf_prepend(&m, hdr_length, MBUF_WAITOK) != 0)
@@ -842,7 +1235,109 @@ u_int16_t l2tp_rfc_output_data(struct l2tp_rfc *rfc, mbuf_t m)
     hdr->flags_vers = htons(flags);
 
     memcpy(mbuf_data(m), hdr, sizeof(hdr_data));
-    return l2tp_udp_output(rfc->socket, rfc->thread, m, (struct sockaddr *)rfc->peer_address);
+    error = l2tp_udp_output(rfc->socket, L2TP_RFC_FLOW(rfc), m, (struct sockaddr *)rfc->peer_address);
+    return l2tp_rfc_output_done(rfc, error);
+}
+
+/* -----------------------------------------------------------------------------
+L2TPv3 data packet, the header is:
+    flags and version, reserved (over UDP only)
+    session id (32 bits)
+    cookie (0, 4 or 8 bytes)
+    default L2-Specific Sublayer (optional)
+----------------------------------------------------------------------------- */
+static u_int16_t l2tp_rfc_output_v3(struct l2tp_rfc *rfc, mbuf_t m)
+{
+    u_int8_t			hdr[L2TP_V3_UDP_HDR_SIZE + 4 + L2TP_V3_MAX_COOKIE + L2TP_V3_SUBLAYER_SIZE];
+    u_int32_t			val;
+    u_int16_t 			hdr_length = 0;
+    int					error;
+
+    if (!(rfc->flags & L2TP_FLAG_V3_IP)) {
+        val = htonl(L2TP_V3_VERSION << 16);		/* flags and version, reserved */
+        bcopy(&val, &hdr[hdr_length], 4);
+        hdr_length += L2TP_V3_UDP_HDR_SIZE;
+    }
+    val = htonl(rfc->peer_v3_session_id);
+    bcopy(&val, &hdr[hdr_length], 4);
+    hdr_length += 4;
+    bcopy(rfc->peer_cookie, &hdr[hdr_length], rfc->peer_cookie_len);
+    hdr_length += rfc->peer_cookie_len;
+    if (rfc->flags & L2TP_FLAG_V3_SUBLAYER) {
+        val = 0;
+        if (rfc->flags & L2TP_FLAG_PEER_SEQ_REQ)
+            val = L2TP_V3_SUBLAYER_S | (rfc->our_v3_data_seq++ & L2TP_V3_SEQ_MASK);
+        val = htonl(val);
+        bcopy(&val, &hdr[hdr_length], 4);
+        hdr_length += L2TP_V3_SUBLAYER_SIZE;
+    }
+
+    if (mbuf_prepend(&m, hdr_length, MBUF_WAITOK) != 0)
+        return ENOBUFS;
+    memcpy(mbuf_data(m), hdr, hdr_length);
+
+    if (rfc->flags & L2TP_FLAG_V3_IP)
+        error = l2tp_udp_ip_output(L2TP_RFC_FLOW(rfc), m, (struct sockaddr *)rfc->peer_address);
+    else 
+        error = l2tp_udp_output(rfc->socket, L2TP_RFC_FLOW(rfc), m, (struct sockaddr *)rfc->peer_address);
+    return l2tp_rfc_output_done(rfc, error);
+}
+
+/* -----------------------------------------------------------------------------
+handle the result of a data packet output
+----------------------------------------------------------------------------- */
+static u_int16_t l2tp_rfc_output_done(struct l2tp_rfc *rfc, int error)
+{
+    /* 
+     * hold the ppp link until l2tp_rfc_xmit_ok only if an output thread is congested,
+     * it is the only one to call it. without thread, the socket error is returned as is
+     */
+    if (error == EWOULDBLOCK
+        || (error == ENOBUFS && l2tp_udp_xmit_full(L2TP_RFC_FLOW(rfc)))) {
+        if (!(rfc->state & L2TP_STATE_XMIT_FULL) && rfc->eventcb) {
+            rfc->state |= L2TP_STATE_XMIT_FULL;
+            TAILQ_INSERT_TAIL(&l2tp_rfc_xmit_full_list, rfc, xmit_next);
+            (*rfc->eventcb)(rfc->host, L2TP_EVT_XMIT_FULL, 0);
+        }
+        if (error == EWOULDBLOCK)
+            error = 0;		/* packet has been queued */
+    }
+    return error;
+}
+
+/* -----------------------------------------------------------------------------
+called from l2tp_udp when an output thread is no longer congested
+tell the clients waiting on an uncongested thread they can send again
+----------------------------------------------------------------------------- */
+void l2tp_rfc_xmit_ok()
+{
+    struct l2tp_rfc  	*rfc, *nextrfc;
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+	for (rfc = TAILQ_FIRST(&l2tp_rfc_xmit_full_list); rfc; rfc = nextrfc) {
+		nextrfc = TAILQ_NEXT(rfc, xmit_next);
+		if (!l2tp_udp_xmit_full(L2TP_RFC_FLOW(rfc))) {
+			TAILQ_REMOVE(&l2tp_rfc_xmit_full_list, rfc, xmit_next);
+			rfc->state &= ~L2TP_STATE_XMIT_FULL;
+			if (rfc->eventcb)
+				(*rfc->eventcb)(rfc->host, L2TP_EVT_XMIT_OK, 0);
+		}
+	}
+}
+
+/* -----------------------------------------------------------------------------
+    send a queued control message for the first time
+----------------------------------------------------------------------------- */
+static int l2tp_rfc_send_new(struct l2tp_rfc *rfc, struct l2tp_elem *elem)
+{
+    rfc->snd_max = elem->seqno + 1;
+    if (rfc->rtt_start == 0) {
+        /* time this one */
+        rfc->rtt_seq = elem->seqno;
+        clock_get_uptime(&rfc->rtt_start);
+    }
+    return l2tp_rfc_output_queued(rfc, elem);
 }
 
 /* -----------------------------------------------------------------------------
@@ -852,16 +1347,25 @@ int l2tp_rfc_output_queued(struct l2tp_rfc *rfc, struct l2tp_elem *elem)
 {
     mbuf_t				dup;
     struct l2tp_header	*hdr, hdr_data;
+    int					error;
 
     if (mbuf_copym(elem->packet, 0, MBUF_COPYALL, MBUF_DONTWAIT, &dup) != 0)
         return ENOBUFS;
    
+    /* disable sending of ack - piggybacked on this packet */
+    rfc->state &= ~L2TP_STATE_NEW_SEQUENCE;
+    if (rfc->ack_deadline) {
+        rfc->ack_deadline = 0;
+        l2tp_rfc_timer_update(rfc);
+    }
+
     hdr = &hdr_data;
     memcpy(hdr, mbuf_data(dup), sizeof(hdr_data));
     hdr->nr = htons(rfc->our_nr); 
     memcpy(mbuf_data(dup), hdr, sizeof(hdr_data));
     
-    return l2tp_udp_output(rfc->socket, rfc->thread, dup, (struct sockaddr *)elem->addr);
+    error = l2tp_udp_output(rfc->socket, rfc->thread, dup, (struct sockaddr *)elem->addr);
+    return (error == EWOULDBLOCK ? 0 : error);
 }
 
 /* -----------------------------------------------------------------------------
@@ -870,7 +1374,7 @@ u_int16_t l2tp_handle_data(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *from
     u_int16_t flags, u_int16_t len, u_int16_t tunnel_id, u_int16_t session_id)
 {
     struct l2tp_header 		*hdr, hdr_data;
-    u_int16_t 			*p, ns, hdr_length;
+    u_int16_t 			*p, ns = 0, hdr_length;
 
     hdr = &hdr_data;
     memcpy(hdr, mbuf_data(m), sizeof(hdr_data));
@@ -897,16 +1401,6 @@ u_int16_t l2tp_handle_data(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *from
             ns = ntohs(*p);
             p += 2;					/* skip sequence fields */
             hdr_length += 4;
-            if (SEQ_GT(ns, rfc->peer_last_data_seq)) {
-				rfc->peer_last_data_seq++;
-                if (rfc->peer_last_data_seq != ns) {
-                    if (rfc->eventcb)
-						(*rfc->eventcb)(rfc->host, L2TP_EVT_INPUTERROR, 0);
-					rfc->peer_last_data_seq = ns;
-				}
-            } 
-            else
-                goto dropit;
         }
 
         if (flags & L2TP_FLAGS_O) 			/* payload is at offset in the packet */
@@ -916,6 +1410,8 @@ u_int16_t l2tp_handle_data(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *from
         mbuf_adj(m, hdr_length);				/* remove the header and send it up to PPP */
 		if (rfc->state & L2TP_STATE_FREEING)
 			mbuf_freem(m);
+		else if (flags & L2TP_FLAGS_S)
+			l2tp_rfc_reorder_input(rfc, m, ns);
 		else 
 			(*rfc->inputcb)(rfc->host, m, 0, 0);
 
@@ -923,10 +1419,109 @@ u_int16_t l2tp_handle_data(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *from
     }
 
     return 0;
+}
 
-dropit:
-    mbuf_freem(m);
-    return 1;
+/* -----------------------------------------------------------------------------
+give up a sequenced data packet, header removed
+packets received out of order are held in the recv queue, sorted by sequence number,
+until the missing ones arrive, the queue overflows or the reorder timer expires
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_reorder_input(struct l2tp_rfc *rfc, mbuf_t m, u_int16_t ns)
+{
+    struct l2tp_elem 	*elem, *new_elem;
+
+    if (!(rfc->state & L2TP_STATE_DATA_SEQ_SYNC)) {
+        /* first sequenced packet, synchronize on it */
+        rfc->peer_last_data_seq = ns - 1;
+        rfc->state |= L2TP_STATE_DATA_SEQ_SYNC;
+    }
+
+    if (!SEQ_GT(ns, rfc->peer_last_data_seq)) {
+        /* duplicate, or too late, we already gave up on it */
+        l2tp_rfc_reorder_late_drops++;
+        mbuf_freem(m);
+        return;
+    }
+
+    if (ns == (u_int16_t)(rfc->peer_last_data_seq + 1)) {
+        /* in sequence, give it up with whatever follows in the queue */
+        rfc->peer_last_data_seq = ns;
+        (*rfc->inputcb)(rfc->host, m, 0, 0);
+        if (!TAILQ_EMPTY(&rfc->recv_queue))
+            l2tp_rfc_reorder_release(rfc, 0);
+        return;
+    }
+
+    /* out of order, insert it in the queue */
+    TAILQ_FOREACH(elem, &rfc->recv_queue, next) {
+        if (elem->seqno == ns) {
+            l2tp_rfc_reorder_late_drops++;
+            mbuf_freem(m);
+            return;
+        }
+        if (SEQ_GT(elem->seqno, ns))
+            break;
+    }
+    new_elem = (struct l2tp_elem *)_MALLOC(sizeof (struct l2tp_elem), M_TEMP, M_NOWAIT);
+    if (new_elem == 0) {
+        mbuf_freem(m);
+        return;
+    }
+    new_elem->packet = m;
+    new_elem->seqno = ns;
+    if (elem)
+        TAILQ_INSERT_BEFORE(elem, new_elem, next);
+    else
+        TAILQ_INSERT_TAIL(&rfc->recv_queue, new_elem, next);
+    rfc->reorder_count++;
+
+    if (rfc->reorder_count > l2tp_rfc_reorder_depth) {
+        /* no more room, consider the missing packets lost */
+        l2tp_rfc_reorder_release(rfc, 1);
+        return;
+    }
+
+    l2tp_rfc_reorder_queued++;
+    if (rfc->reorder_deadline == 0) {
+        clock_interval_to_deadline(l2tp_rfc_reorder_timeout, kMillisecondScale, &rfc->reorder_deadline);
+        l2tp_rfc_timer_update(rfc);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+give up the packets at the head of the recv queue that are in sequence
+if skip is set, the packets missing in front of the queue are considered lost
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_reorder_release(struct l2tp_rfc *rfc, int skip)
+{
+    struct l2tp_elem 	*elem;
+    int					released = 0;
+
+    while ((elem = TAILQ_FIRST(&rfc->recv_queue))) {
+        if (elem->seqno != (u_int16_t)(rfc->peer_last_data_seq + 1)) {
+            if (!skip)
+                break;
+            skip = 0;
+            if (rfc->eventcb)
+                (*rfc->eventcb)(rfc->host, L2TP_EVT_INPUTERROR, 0);
+        }
+        TAILQ_REMOVE(&rfc->recv_queue, elem, next);
+        rfc->reorder_count--;
+        rfc->peer_last_data_seq = elem->seqno;
+        if (rfc->state & L2TP_STATE_FREEING)
+            mbuf_freem(elem->packet);
+        else
+            (*rfc->inputcb)(rfc->host, elem->packet, 0, 0);
+        _FREE(elem, M_TEMP);
+        released++;
+    }
+
+    /* restart the timer for the new gap */
+    if (TAILQ_EMPTY(&rfc->recv_queue))
+        rfc->reorder_deadline = 0;
+    else if (released || rfc->reorder_deadline == 0)
+        clock_interval_to_deadline(l2tp_rfc_reorder_timeout, kMillisecondScale, &rfc->reorder_deadline);
+    l2tp_rfc_timer_update(rfc);
 }
 
 /* -----------------------------------------------------------------------------
@@ -1032,7 +1627,7 @@ u_int16_t l2tp_handle_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *f
                     TAILQ_INSERT_HEAD(&rfc->recv_queue, new_elem, next);   
             } else if (SEQ_LT(ntohs(hdr->ns), rfc->our_nr)) {
                 //IOLog("L2TP dropping message already received seq#=%d\n", ntohs(hdr->ns));
-                rfc->state |= L2TP_STATE_NEW_SEQUENCE;		/* its a dup thats already been ack'd - drop it and ack */
+                l2tp_rfc_ack_later(rfc);		/* its a dup thats already been ack'd - drop it and ack */
                 goto dropit;					
             } else {						/* packet we are waiting for */
                                                                         
@@ -1045,7 +1640,7 @@ u_int16_t l2tp_handle_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *f
 					return 1;
 				
                 rfc->our_nr++;
-                rfc->state |= L2TP_STATE_NEW_SEQUENCE;		/* sent up - ack it */
+                l2tp_rfc_ack_later(rfc);		/* sent up - ack it */
                 
                 /*
                     * now check for other packets on the queue that can be sent up.
@@ -1119,33 +1714,56 @@ int l2tp_rfc_compare_address(struct sockaddr* addr1, struct sockaddr* addr2)
 
 /* -----------------------------------------------------------------------------
     handle incomming ack - remove ack'd packets from the control message
-    send queue and send any packets that were outside the window.
+    send queue, open the congestion window and send any packets that now 
+    fit in the window.
 ----------------------------------------------------------------------------- */
 void l2tp_rfc_handle_ack(struct l2tp_rfc *rfc, u_int16_t nr)
 {
     struct l2tp_elem 	*elem;
-    u_int16_t			old_nr = rfc->peer_nr;
+    u_int16_t			window;
+    int					acked = 0;
     
     rfc->peer_nr = nr;
+
+    if (rfc->rtt_start && SEQ_GT(nr, rfc->rtt_seq))
+        l2tp_rfc_rtt_update(rfc);
+
     while((elem = TAILQ_FIRST(&rfc->send_queue)))
         if (SEQ_GT(nr, elem->seqno)) {
-            rfc->retrans_time_remain = rfc->initial_timeout;	/* setup timeout and count */
-            rfc->retry_count = 0;
             TAILQ_REMOVE(&rfc->send_queue, elem, next);
             mbuf_freem(elem->packet);
             _FREE(elem, M_TEMP);
+            acked++;
+            /* slow start, then congestion avoidance */
+            if (rfc->cwnd < rfc->ssthresh)
+                rfc->cwnd++;
+            else if (++rfc->cwnd_acked >= rfc->cwnd) {
+                rfc->cwnd_acked = 0;
+                rfc->cwnd++;
+            }
         } else
             break;
             
+    if (rfc->cwnd > rfc->peer_window)
+        rfc->cwnd = rfc->peer_window ? rfc->peer_window : 1;
+
+    if (acked) {
+        /* setup timeout and count */
+        rfc->retry_count = 0;
+        rfc->retrans_deadline = 0;
+        if (!TAILQ_EMPTY(&rfc->send_queue) && !(rfc->state & L2TP_STATE_RELIABILITY_OFF))
+            l2tp_rfc_arm_retransmit(rfc, rfc->rto);
+        else
+            l2tp_rfc_timer_update(rfc);
+    }
     
-    if (!TAILQ_EMPTY(&rfc->send_queue)) {      
-         /* check for packets that were outside the window that should now be sent */
-        TAILQ_FOREACH(elem, &rfc->send_queue, next) {
-            if (SEQ_GT(elem->seqno, nr + rfc->peer_window - 1))	/* outside current window ? */
-                break;
-            if (SEQ_GT(elem->seqno, old_nr + rfc->peer_window - 1))	/* outside previous window ? */
-                l2tp_rfc_output_queued(rfc, elem);
-        }
+    /* check for packets that were outside the window that should now be sent */
+    window = MIN(rfc->cwnd, rfc->peer_window);
+    TAILQ_FOREACH(elem, &rfc->send_queue, next) {
+        if (!SEQ_LT(elem->seqno, nr + window))		/* outside current window ? */
+            break;
+        if (SEQ_GEQ(elem->seqno, rfc->snd_max))		/* not sent yet ? */
+            l2tp_rfc_send_new(rfc, elem);
     }
 }
 
@@ -1170,6 +1788,10 @@ int l2tp_rfc_lower_input(socket_t so, mbuf_t m, struct sockaddr *from)
 
     flags = ntohs(hdr->flags_vers);
 
+    /* L2TPv3 data messages, control connections are L2TPv2 only */
+    if ((flags & L2TP_VERSION_MASK) == L2TP_V3_VERSION && !(flags & L2TP_FLAGS_T))
+        return l2tp_rfc_v3_input(m, from, L2TP_V3_UDP_HDR_SIZE, 0);
+
     if ((flags & L2TP_VERSION_MASK) != L2TP_VERSION)
         goto dropit;
 	
@@ -1206,9 +1828,10 @@ int l2tp_rfc_lower_input(socket_t so, mbuf_t m, struct sockaddr *from)
 					return 1;
     }
     else {
-        /* data packet */
-		TAILQ_FOREACH(rfc, &l2tp_rfc_hash[tunnel_id % L2TP_RFC_MAX_HASH], next)
-			if ((rfc->flags & L2TP_FLAG_CONTROL) == 0
+        /* data packet, exact match on tunnel and session ids, l2tp_handle_data checks the address */
+		TAILQ_FOREACH(rfc, &l2tp_rfc_session_hash[L2TP_RFC_SESSION_HASH(tunnel_id, session_id)], session_next)
+			if (rfc->our_tunnel_id == tunnel_id
+				&& rfc->our_session_id == session_id
 				&& l2tp_handle_data(rfc, m, from, flags, len, tunnel_id, session_id))
 					return 1;
     }
@@ -1220,3 +1843,91 @@ dropit:
     mbuf_freem(m);
     return 0;
 }
+
+/* -----------------------------------------------------------------------------
+called from l2tp_udp when a L2TPv3 packet is received over IP, IP header removed
+----------------------------------------------------------------------------- */
+int l2tp_rfc_lower_input_ip(mbuf_t m, struct sockaddr *from)
+{
+    lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    return l2tp_rfc_v3_input(m, from, 0, 1);
+}
+
+/* -----------------------------------------------------------------------------
+L2TPv3 data packet, offset is the size of the UDP specific part of the header
+the session is found directly from its 32 bits session id, then the cookie is checked
+session id 0 is a control message over IP, not supported
+----------------------------------------------------------------------------- */
+static int l2tp_rfc_v3_input(mbuf_t m, struct sockaddr *from, int offset, int ip)
+{
+    struct l2tp_rfc  	*rfc;
+    struct sockaddr_in	*peer;
+    u_int32_t			session_id, sublayer = 0;
+    u_int16_t			hdr_length;
+    u_int8_t			*p;
+	
+    hdr_length = offset + 4;
+	if (mbuf_pkthdr_len(m) < hdr_length
+        || (mbuf_len(m) < hdr_length && mbuf_pullup(&m, hdr_length))) 
+        goto dropit;
+    
+    memcpy(&session_id, (u_int8_t *)mbuf_data(m) + offset, 4);
+    session_id = ntohl(session_id);
+    if (session_id == 0)
+        goto dropit;
+		
+    TAILQ_FOREACH(rfc, &l2tp_rfc_v3_session_hash[L2TP_RFC_V3_SESSION_HASH(session_id)], session_next) {
+        if (rfc->our_v3_session_id != session_id || rfc->peer_address == 0)
+            continue;
+        if (!ip) {
+            if (!(rfc->flags & L2TP_FLAG_V3_IP)
+                && !l2tp_rfc_compare_address((struct sockaddr *)rfc->peer_address, from))
+                break;
+        }
+        else {
+            /* no port over IP */
+            peer = (struct sockaddr_in *)(void *)rfc->peer_address;
+            if ((rfc->flags & L2TP_FLAG_V3_IP)
+                && from->sa_family == AF_INET && peer->sin_family == AF_INET
+                && !bcmp(&peer->sin_addr, &((struct sockaddr_in *)(void *)from)->sin_addr, sizeof(struct in_addr)))
+                break;
+        }
+    }
+    if (rfc == 0)
+        goto dropit;
+
+    hdr_length += rfc->cookie_len + (rfc->flags & L2TP_FLAG_V3_SUBLAYER ? L2TP_V3_SUBLAYER_SIZE : 0);
+	if (mbuf_pkthdr_len(m) < hdr_length
+        || (mbuf_len(m) < hdr_length && mbuf_pullup(&m, hdr_length))) 
+        goto dropit;
+
+    p = (u_int8_t *)mbuf_data(m) + offset + 4;
+    if (rfc->cookie_len) {
+        if (bcmp(p, rfc->cookie, rfc->cookie_len)) {
+            l2tp_rfc_v3_cookie_drops++;
+            goto dropit;
+        }
+        p += rfc->cookie_len;
+    }
+    if (rfc->flags & L2TP_FLAG_V3_SUBLAYER) {
+        memcpy(&sublayer, p, 4);
+        sublayer = ntohl(sublayer);
+    }
+	
+    /* data packet are given up without header */
+    mbuf_adj(m, hdr_length);
+    if (rfc->state & L2TP_STATE_FREEING)
+        mbuf_freem(m);
+    else if (sublayer & L2TP_V3_SUBLAYER_S)
+        /* 24 bits sequence numbers, reordering works on the low 16 bits */
+        l2tp_rfc_reorder_input(rfc, m, (u_int16_t)(sublayer & L2TP_V3_SEQ_MASK));
+    else 
+        (*rfc->inputcb)(rfc->host, m, 0, 0);
+    return 1;
+
+dropit:
+    if (m)
+        mbuf_freem(m);
+    return 0;
+}
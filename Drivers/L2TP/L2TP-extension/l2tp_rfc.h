@@ -59,7 +59,11 @@ enum {
     L2TP_CMD_SETBAUDRATE,	// set tunnel baud rate
     L2TP_CMD_GETBAUDRATE,	// get tunnel baud rate
     L2TP_CMD_SETRELIABILITY, // turn on/off the reliability layer
-    L2TP_CMD_SETDELEGATEDPID // set the delegated process ID
+    L2TP_CMD_SETDELEGATEDPID, // set the delegated process ID
+    L2TP_CMD_SETV3SESSIONID,	// set L2TPv3 session id
+    L2TP_CMD_SETV3PEERSESSIONID,	// set L2TPv3 peer session id
+    L2TP_CMD_SETCOOKIE,		// set the L2TPv3 cookie the peer sends
+    L2TP_CMD_SETPEERCOOKIE	// set the L2TPv3 cookie we send
 };
 
 typedef int (*l2tp_rfc_input_callback)(void *data, mbuf_t m, struct sockaddr *from, int more);
@@ -72,11 +76,13 @@ u_int16_t l2tp_rfc_new_client(void *host, void **data,
                          l2tp_rfc_event_callback event);
 
 void l2tp_rfc_free_client(void *data);
-void l2tp_rfc_slowtimer();
 u_int16_t l2tp_rfc_command(void *userdata, u_int32_t cmd, void *cmddata);
 u_int16_t l2tp_rfc_output(void *data, mbuf_t m, struct sockaddr *to);
 
 // callback from dlil layer
 int l2tp_rfc_lower_input(socket_t so, mbuf_t m, struct sockaddr *from);
+int l2tp_rfc_lower_input_ip(mbuf_t m, struct sockaddr *from);
+// callback from l2tp_udp when output can resume
+void l2tp_rfc_xmit_ok();
 
 #endif
\ No newline at end of file
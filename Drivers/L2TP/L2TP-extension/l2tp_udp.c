@@ -35,44 +35,74 @@
 #include <netinet/in_pcb.h>
 #include <netinet/in_systm.h>
 #include <netinet/in_var.h>
+#include <netinet/ip.h>
 #include <netinet/udp.h>
 
 #include <kern/thread.h>
 #include <kern/task.h>
 #include <kern/kern_types.h>
 #include <kern/sched_prim.h>
+#include <kern/thread_call.h>
+#include <libkern/OSAtomic.h>
 #include <sys/sysctl.h>
 
 #include "l2tpk.h"
 #include "l2tp_rfc.h"
 #include "l2tp_udp.h"
 #include "../../../Family/ppp_domain.h"
+#include "../../../Family/if_ppplink.h"
 
 
 /* -----------------------------------------------------------------------------
 Definitions
 ----------------------------------------------------------------------------- */
 
+/* a packet waiting in an output queue, with the socket to send it to */
+struct l2tp_udp_pkt {
+	mbuf_t		m;
+	socket_t	so;			/* retained until the packet is sent */
+	struct sockaddr	addr;	/* destination for an unconnected socket */
+};
+
 struct l2tp_udp_thread {
 	thread_t	thread;
 	int			wakeup;
 	int			terminate;
-  struct pppqueue	outq;
+	int			sleeping;	/* thread is waiting for packets */
+	int			full;		/* queue went over the high mark, senders are blocked */
+	struct l2tp_udp_pkt	*outq;	/* ring of packets to send */
+	u_int32_t	outq_size;
+	u_int32_t	outq_head;
+	u_int32_t	outq_len;
 	int			nbclient;
+	struct l2tp_udp_thread_stats stats;
 	
 	lck_mtx_t       *mtx;
 } ; 
 
 #define L2TP_UDP_MAX_THREADS 16
 #define L2TP_UDP_DEF_OUTQ_SIZE 1024
+#define L2TP_UDP_MIN_OUTQ_SIZE 16
+#define L2TP_UDP_BATCH_SIZE 32			/* max packets sent per lock of the queue */
+
+/* backpressure marks: senders are blocked above the high mark, released below the low mark */
+#define L2TP_UDP_OUTQ_HIWAT(t)	((t)->outq_size - (t)->outq_size / 4)
+#define L2TP_UDP_OUTQ_LOWAT(t)	((t)->outq_size / 4)
 
 void	l2tp_ip_input(mbuf_t , int len);
 void l2tp_udp_thread_func(struct l2tp_udp_thread *thread_socket);
 kern_return_t thread_terminate(register thread_act_t act);
-int l2tp_udp_init_threads(int nb_threads);
+int l2tp_udp_init_threads(int nb_threads, int force);
 void l2tp_udp_dispose_threads();
+static void l2tp_udp_xmit_ok(thread_call_param_t param0, thread_call_param_t param1);
+static int l2tp_udp_send(socket_t so, int flow, mbuf_t m, struct sockaddr *to);
+static errno_t l2tp_udp_sendmbuf(socket_t so, mbuf_t m, struct sockaddr *to);
+static void l2tp_udp_ip_input(socket_t so, void *arg, int waitflag);
+static void l2tp_udp_ip_close(thread_call_param_t param0, thread_call_param_t param1);
 #if !TARGET_OS_EMBEDDED
 static int sysctl_nb_threads SYSCTL_HANDLER_ARGS;
+static int sysctl_thread_outq_size SYSCTL_HANDLER_ARGS;
+static int sysctl_thread_stats SYSCTL_HANDLER_ARGS;
 #endif
 
 /* -----------------------------------------------------------------------------
@@ -83,6 +113,12 @@ static struct l2tp_udp_thread *l2tp_udp_threads = 0;
 static int l2tp_udp_thread_outq_size = L2TP_UDP_DEF_OUTQ_SIZE;
 static int l2tp_udp_nb_threads = 0;
 static int l2tp_udp_inited = 0;
+static thread_call_t	l2tp_udp_xmit_ok_call = 0;
+static socket_t		l2tp_udp_ip_socket = 0;		/* raw IP socket shared by the L2TPv3 sessions over IP */
+static int			l2tp_udp_ip_refcount = 0;
+static thread_call_t	l2tp_udp_ip_close_call = 0;	/* closes the raw IP socket without the domain lock */
+static volatile SInt32	l2tp_udp_ip_close_running = 0;
+static volatile SInt32	l2tp_udp_xmit_ok_running = 0;
 
 static lck_rw_t			*l2tp_udp_mtx;
 static lck_attr_t		*l2tp_udp_mtx_attr;
@@ -92,8 +128,10 @@ static lck_grp_attr_t	*l2tp_udp_mtx_grp_attr;
 #if !TARGET_OS_EMBEDDED
 SYSCTL_PROC(_net_ppp_l2tp, OID_AUTO, nb_threads, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
     &l2tp_udp_nb_threads, 0, sysctl_nb_threads, "I", "Number of l2tp output threads 0 - 16");
-SYSCTL_INT(_net_ppp_l2tp, OID_AUTO, thread_outq_size, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
-    &l2tp_udp_thread_outq_size, 0, "Queue size for each l2tp output thread");
+SYSCTL_PROC(_net_ppp_l2tp, OID_AUTO, thread_outq_size, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &l2tp_udp_thread_outq_size, 0, sysctl_thread_outq_size, "I", "Queue size for each l2tp output thread");
+SYSCTL_PROC(_net_ppp_l2tp, OID_AUTO, thread_stats, CTLTYPE_STRUCT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    0, 0, sysctl_thread_stats, "S,l2tp_udp_thread_stats", "Queue depth and drops of each l2tp output thread");
 #endif 
 
 /* -----------------------------------------------------------------------------
@@ -123,20 +161,35 @@ int l2tp_udp_init()
 	l2tp_udp_mtx = lck_rw_alloc_init(l2tp_udp_mtx_grp, l2tp_udp_mtx_attr);
 	LOGNULLFAIL(l2tp_udp_mtx, "l2tp_udp_init: can't alloc mutex\n")
 
+	l2tp_udp_xmit_ok_call = thread_call_allocate(l2tp_udp_xmit_ok, 0);
+	LOGNULLFAIL(l2tp_udp_xmit_ok_call, "l2tp_udp_init: can't alloc thread call\n");
+
+	l2tp_udp_ip_close_call = thread_call_allocate(l2tp_udp_ip_close, 0);
+	LOGNULLFAIL(l2tp_udp_ip_close_call, "l2tp_udp_init: can't alloc thread call\n");
+
 	// init threads
-	err = l2tp_udp_init_threads(0);
+	err = l2tp_udp_init_threads(0, 0);
 	if (err)
 		goto fail;
 		
 #if !TARGET_OS_EMBEDDED
     sysctl_register_oid(&sysctl__net_ppp_l2tp_nb_threads);
     sysctl_register_oid(&sysctl__net_ppp_l2tp_thread_outq_size);
+    sysctl_register_oid(&sysctl__net_ppp_l2tp_thread_stats);
 #endif
 	l2tp_udp_inited = 1;
 
 	return 0;
 
 fail:
+	if (l2tp_udp_ip_close_call) {
+		thread_call_free(l2tp_udp_ip_close_call);
+		l2tp_udp_ip_close_call = 0;
+	}
+	if (l2tp_udp_xmit_ok_call) {
+		thread_call_free(l2tp_udp_xmit_ok_call);
+		l2tp_udp_xmit_ok_call = 0;
+	}
 	if (l2tp_udp_mtx) {
 		lck_rw_free(l2tp_udp_mtx, l2tp_udp_mtx_grp);
 		l2tp_udp_mtx = 0;
@@ -164,12 +217,35 @@ int l2tp_udp_dispose()
 	if (!l2tp_udp_inited)
 		return 0;
 		
+	l2tp_udp_dispose_threads();
+
+	/* the xmit ok call may have fired and be waiting for the domain lock */
+	thread_call_cancel(l2tp_udp_xmit_ok_call);
+	if (l2tp_udp_xmit_ok_running)
+		return EBUSY;
+
+	/* the raw IP socket may still be waiting to be closed */
+	thread_call_cancel(l2tp_udp_ip_close_call);
+	if (l2tp_udp_ip_close_running)
+		return EBUSY;
+	if (l2tp_udp_ip_socket && l2tp_udp_ip_refcount == 0) {
+		socket_t so = l2tp_udp_ip_socket;
+		l2tp_udp_ip_socket = 0;
+		lck_mtx_unlock(ppp_domain_mutex);
+		sock_close(so);
+		lck_mtx_lock(ppp_domain_mutex);
+	}
+
 #if !TARGET_OS_EMBEDDED
     sysctl_unregister_oid(&sysctl__net_ppp_l2tp_nb_threads);
     sysctl_unregister_oid(&sysctl__net_ppp_l2tp_thread_outq_size);
+    sysctl_unregister_oid(&sysctl__net_ppp_l2tp_thread_stats);
 #endif
 
-	l2tp_udp_dispose_threads();
+	thread_call_free(l2tp_udp_xmit_ok_call);
+	l2tp_udp_xmit_ok_call = 0;
+	thread_call_free(l2tp_udp_ip_close_call);
+	l2tp_udp_ip_close_call = 0;
 	
 	lck_rw_free(l2tp_udp_mtx, l2tp_udp_mtx_grp);
 	l2tp_udp_mtx = 0;
@@ -199,17 +275,78 @@ static int sysctl_nb_threads SYSCTL_HANDLER_ARGS
 		return error;
 
 	lck_mtx_lock(ppp_domain_mutex);
-    error = l2tp_udp_init_threads(s);
+    error = l2tp_udp_init_threads(s, 0);
 	lck_mtx_unlock(ppp_domain_mutex);
 	
 	return error;
 }
+
+/* -----------------------------------------------------------------------------
+sysctl to change the queue size, the threads are restarted with the new size
+----------------------------------------------------------------------------- */
+static int sysctl_thread_outq_size SYSCTL_HANDLER_ARGS
+{
+	int error, s;
+
+	s = *(int *)oidp->oid_arg1;
+
+	error = sysctl_handle_int(oidp, &s, 0, req);
+	if (error || !req->newptr)
+		return error;
+
+	if (s < L2TP_UDP_MIN_OUTQ_SIZE)
+		s = L2TP_UDP_MIN_OUTQ_SIZE;
+	
+	lck_mtx_lock(ppp_domain_mutex);
+	if (s != l2tp_udp_thread_outq_size) {
+		l2tp_udp_thread_outq_size = s;
+		error = l2tp_udp_init_threads(l2tp_udp_nb_threads, 1);
+	}
+	lck_mtx_unlock(ppp_domain_mutex);
+	
+	return error;
+}
+
+/* -----------------------------------------------------------------------------
+sysctl to read the statistics of the threads, one l2tp_udp_thread_stats per thread
+----------------------------------------------------------------------------- */
+static int sysctl_thread_stats SYSCTL_HANDLER_ARGS
+{
+	struct l2tp_udp_thread_stats	*stats;
+	int			i, nb, error;
+	
+	if (req->newptr)
+		return EPERM;
+
+	lck_rw_lock_shared(l2tp_udp_mtx);
+	nb = l2tp_udp_nb_threads;
+	if (nb == 0) {
+		lck_rw_unlock_shared(l2tp_udp_mtx);
+		return 0;
+	}
+	stats = (struct l2tp_udp_thread_stats *)_MALLOC(sizeof(struct l2tp_udp_thread_stats) * nb, M_TEMP, M_WAITOK);
+	if (stats == 0) {
+		lck_rw_unlock_shared(l2tp_udp_mtx);
+		return ENOMEM;
+	}
+	for (i = 0; i < nb; i++) {
+		lck_mtx_lock(l2tp_udp_threads[i].mtx);
+		l2tp_udp_threads[i].stats.depth = l2tp_udp_threads[i].outq_len;
+		stats[i] = l2tp_udp_threads[i].stats;
+		lck_mtx_unlock(l2tp_udp_threads[i].mtx);
+	}
+	lck_rw_unlock_shared(l2tp_udp_mtx);
+
+	error = SYSCTL_OUT(req, stats, sizeof(struct l2tp_udp_thread_stats) * nb);
+	_FREE(stats, M_TEMP);
+	return error;
+}
 #endif
 
 /* -----------------------------------------------------------------------------
 initialize the worker threads
 ----------------------------------------------------------------------------- */
-int l2tp_udp_init_threads(int nb_threads)
+int l2tp_udp_init_threads(int nb_threads, int force)
 {
     int				i;
 	errno_t			err;
@@ -220,7 +357,7 @@ int l2tp_udp_init_threads(int nb_threads)
 		if (nb_threads > L2TP_UDP_MAX_THREADS) 
 			nb_threads = L2TP_UDP_MAX_THREADS;
 
-	if (l2tp_udp_nb_threads == nb_threads)
+	if (l2tp_udp_nb_threads == nb_threads && !force)
 		return 0;
 	
 	IOLog("l2tp_udp_init_threads: changing # of threads from %d to %d\n", l2tp_udp_nb_threads, nb_threads);
@@ -243,6 +380,10 @@ int l2tp_udp_init_threads(int nb_threads)
 		l2tp_udp_threads[i].mtx = lck_mtx_alloc_init(l2tp_udp_mtx_grp, l2tp_udp_mtx_attr);
 		LOGNULLFAIL(l2tp_udp_threads[i].mtx, "l2tp_udp_init_threads: can't alloc mutex\n");
 
+		l2tp_udp_threads[i].outq_size = l2tp_udp_thread_outq_size;
+		l2tp_udp_threads[i].outq = (struct l2tp_udp_pkt *)_MALLOC(sizeof(struct l2tp_udp_pkt) * l2tp_udp_thread_outq_size, M_TEMP, M_WAITOK);
+		LOGNULLFAIL(l2tp_udp_threads[i].outq, "l2tp_udp_init_threads: can't alloc queue\n");
+
 		// Start up working thread
 		err = kernel_thread_start((thread_continue_t)l2tp_udp_thread_func, &l2tp_udp_threads[i], &l2tp_udp_threads[i].thread);
 		LOGGOTOFAIL(err, "l2tp_udp_init_threads: kernel_thread_start failed, error %d\n");
@@ -254,6 +395,10 @@ int l2tp_udp_init_threads(int nb_threads)
 	
 fail:
 	
+	if (l2tp_udp_threads[i].outq) {
+		_FREE(l2tp_udp_threads[i].outq, M_TEMP);
+		l2tp_udp_threads[i].outq = 0;
+	}
 	if (l2tp_udp_threads[i].mtx) {
 		lck_mtx_free(l2tp_udp_threads[i].mtx, l2tp_udp_mtx_grp);
 		l2tp_udp_threads[i].mtx = 0;
@@ -289,14 +434,47 @@ void l2tp_udp_dispose_threads()
 			thread_deallocate(l2tp_udp_threads[i].thread);
 
 			lck_mtx_free(l2tp_udp_threads[i].mtx, l2tp_udp_mtx_grp);
+			_FREE(l2tp_udp_threads[i].outq, M_TEMP);
 		}
 	}
 	
 	_FREE(l2tp_udp_threads, M_TEMP);
+	l2tp_udp_threads = 0;
 	l2tp_udp_nb_threads = 0;
 	
 	lck_rw_unlock_exclusive(l2tp_udp_mtx);
 
+	/* senders blocked on the old queues can send again */
+	thread_call_enter(l2tp_udp_xmit_ok_call);
+}
+
+/* -----------------------------------------------------------------------------
+an output queue went back under its low mark, wake up the blocked senders
+----------------------------------------------------------------------------- */
+static void l2tp_udp_xmit_ok(thread_call_param_t param0, thread_call_param_t param1)
+{
+	OSIncrementAtomic(&l2tp_udp_xmit_ok_running);
+	lck_mtx_lock(ppp_domain_mutex);
+	l2tp_rfc_xmit_ok();
+	lck_mtx_unlock(ppp_domain_mutex);
+	OSDecrementAtomic(&l2tp_udp_xmit_ok_running);
+}
+
+/* -----------------------------------------------------------------------------
+return 1 if senders using this flow must wait before sending more data
+----------------------------------------------------------------------------- */
+int l2tp_udp_xmit_full(int flow)
+{
+	int full = 0;
+	
+	if (flow < 0)
+		return 0;
+	
+	lck_rw_lock_shared(l2tp_udp_mtx);
+	if (l2tp_udp_nb_threads)
+		full = l2tp_udp_threads[flow % l2tp_udp_nb_threads].full;
+	lck_rw_unlock_shared(l2tp_udp_mtx);
+	return full;
 }
 
 /* -----------------------------------------------------------------------------
@@ -332,17 +510,33 @@ void l2tp_udp_input(socket_t so, void *arg, int waitflag)
 
 /* -----------------------------------------------------------------------------
 called from ppp_proto when data need to be sent
+flow selects the output thread, packets of the same flow are sent in order.
+return EWOULDBLOCK if the packet has been queued but the caller should stop
+sending until l2tp_rfc_xmit_ok is called, and ENOBUFS if the packet has been 
+dropped because the queue is full, or the socket couldn't send it.
 ----------------------------------------------------------------------------- */
-int l2tp_udp_output(socket_t so, int thread, mbuf_t m, struct sockaddr* to)
+int l2tp_udp_output(socket_t so, int flow, mbuf_t m, struct sockaddr* to)
 {
-	int err = 0;
-	
     if (so == 0 || to == 0) {
         mbuf_freem(m);	
         return EINVAL;
     }
 
-	if (thread < 0)
+	/* the udp socket is connected to the peer */
+	return l2tp_udp_send(so, flow, m, 0);
+}
+
+/* -----------------------------------------------------------------------------
+queue a packet to the output thread of the flow, or send it directly if there is no thread
+to is the destination for unconnected sockets, 0 otherwise
+----------------------------------------------------------------------------- */
+static int l2tp_udp_send(socket_t so, int flow, mbuf_t m, struct sockaddr *to)
+{
+	struct l2tp_udp_thread	*thread;
+	struct l2tp_udp_pkt		*pkt;
+	int err = 0;
+	
+	if (flow < 0)
 		goto no_thread;
 
 	lck_rw_lock_shared(l2tp_udp_mtx);
@@ -351,37 +545,215 @@ int l2tp_udp_output(socket_t so, int thread, mbuf_t m, struct sockaddr* to)
 		goto no_thread;
 	}
 
-	if (thread >= l2tp_udp_nb_threads)
-		thread %= l2tp_udp_nb_threads;
+	thread = &l2tp_udp_threads[flow % l2tp_udp_nb_threads];
 	
-	if (l2tp_udp_threads[thread].outq.len >= l2tp_udp_thread_outq_size) {
+	lck_mtx_lock(thread->mtx);
+	if (thread->outq_len >= thread->outq_size) {
+		thread->stats.drops++;
+		thread->full = 1;
+		lck_mtx_unlock(thread->mtx);
 		lck_rw_unlock_shared(l2tp_udp_mtx);
-		mbuf_free(m);
-        return EBUSY;
+		mbuf_freem(m);
+        return ENOBUFS;
 	}	
 
-	if ((err = mbuf_prepend(&m, sizeof(socket_t), M_NOWAIT))) {
-		lck_rw_unlock_shared(l2tp_udp_mtx);
-        return err;
-	}
-	
-	memcpy(mbuf_data(m), &so, sizeof(so));
+	/* keep the socket in the queue, the packet is sent untouched */
 	sock_retain(so);
+	pkt = &thread->outq[(thread->outq_head + thread->outq_len) % thread->outq_size];
+	pkt->m = m;
+	pkt->so = so;
+	if (to)
+		bcopy(to, &pkt->addr, MIN(to->sa_len, sizeof(pkt->addr)));
+	else 
+		pkt->addr.sa_len = 0;
+	thread->outq_len++;
+	if (thread->outq_len > thread->stats.max_depth)
+		thread->stats.max_depth = thread->outq_len;
+
+	if (thread->outq_len >= L2TP_UDP_OUTQ_HIWAT(thread)) {
+		if (!thread->full)
+			thread->stats.blocked++;
+		thread->full = 1;
+	}
+	if (thread->full)
+		err = EWOULDBLOCK;
 
-	lck_mtx_lock(l2tp_udp_threads[thread].mtx);
-	ppp_enqueue(&l2tp_udp_threads[thread].outq, m);
-	wakeup(&l2tp_udp_threads[thread].wakeup);
-	lck_mtx_unlock(l2tp_udp_threads[thread].mtx);
+	/* the thread drains the whole queue before sleeping, wake it up only once */
+	if (thread->sleeping) {
+		thread->sleeping = 0;
+		wakeup(&thread->wakeup);
+	}
+	lck_mtx_unlock(thread->mtx);
 	
 	lck_rw_unlock_shared(l2tp_udp_mtx);
 
-	return 0;
+	return err;
 	
 no_thread:	
 	lck_mtx_unlock(ppp_domain_mutex);
-	err = sock_sendmbuf(so, 0, m, MSG_DONTWAIT, 0);
+	err = l2tp_udp_sendmbuf(so, m, to);
 	lck_mtx_lock(ppp_domain_mutex);
-	return err;
+	/* the packet is dropped, EWOULDBLOCK means queued to a thread */
+	return (err == EWOULDBLOCK ? ENOBUFS : err);
+}
+
+/* -----------------------------------------------------------------------------
+send a packet, to the given destination if the socket is not connected
+the inner DSCP, if any, is passed to ip as the outer type of service
+----------------------------------------------------------------------------- */
+static errno_t l2tp_udp_sendmbuf(socket_t so, mbuf_t m, struct sockaddr *to)
+{
+	struct msghdr	msg;
+	u_int8_t		tos;
+	union {
+		struct cmsghdr	hdr;
+		u_int8_t		buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	
+	bzero(&msg, sizeof(msg));
+	if (to) {
+		msg.msg_name = to;
+		msg.msg_namelen = to->sa_len;
+	}
+
+	if (ppp_link_gettos(m, &tos) == 0) {
+		bzero(&cmsg, sizeof(cmsg));
+		cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+		cmsg.hdr.cmsg_level = IPPROTO_IP;
+		cmsg.hdr.cmsg_type = IP_TOS;
+		*(int *)(void *)CMSG_DATA(&cmsg.hdr) = tos;
+		msg.msg_control = &cmsg;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int));
+	}
+	else if (to == 0)
+		return sock_sendmbuf(so, 0, m, MSG_DONTWAIT, 0);
+	
+	return sock_sendmbuf(so, &msg, m, MSG_DONTWAIT, 0);
+}
+
+/* -----------------------------------------------------------------------------
+open the raw IP socket used by L2TPv3 sessions over IP, or take a reference on it
+a socket waiting to be closed by l2tp_udp_ip_close is reused
+----------------------------------------------------------------------------- */
+int l2tp_udp_ip_attach()
+{
+	socket_t	so = 0;
+	errno_t		err;
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+	if (l2tp_udp_ip_socket) {
+		l2tp_udp_ip_refcount++;
+		return 0;
+	}
+
+	lck_mtx_unlock(ppp_domain_mutex);
+	err = sock_socket(AF_INET, SOCK_RAW, L2TP_IPPROTO, l2tp_udp_ip_input, 0, &so);
+	lck_mtx_lock(ppp_domain_mutex);
+	if (err)
+		return err;
+	
+	if (l2tp_udp_ip_socket) {
+		/* opened by someone else in the meantime */
+		lck_mtx_unlock(ppp_domain_mutex);
+		sock_close(so);
+		lck_mtx_lock(ppp_domain_mutex);
+	}
+	else 
+		l2tp_udp_ip_socket = so;
+	
+	l2tp_udp_ip_refcount++;
+	return 0;
+}
+
+/* -----------------------------------------------------------------------------
+release a reference on the raw IP socket, close it with the last one
+the domain lock is never dropped here, callers may be walking the rfc lists,
+the socket is closed later by l2tp_udp_ip_close
+----------------------------------------------------------------------------- */
+void l2tp_udp_ip_detach()
+{
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+	if (l2tp_udp_ip_refcount == 0 || --l2tp_udp_ip_refcount)
+		return;
+		
+	thread_call_enter(l2tp_udp_ip_close_call);
+}
+
+/* -----------------------------------------------------------------------------
+thread call, close the raw IP socket if no session attached it again
+----------------------------------------------------------------------------- */
+static void l2tp_udp_ip_close(thread_call_param_t param0, thread_call_param_t param1)
+{
+	socket_t	so = 0;
+	
+	OSIncrementAtomic(&l2tp_udp_ip_close_running);
+	lck_mtx_lock(ppp_domain_mutex);
+	if (l2tp_udp_ip_refcount == 0) {
+		so = l2tp_udp_ip_socket;
+		l2tp_udp_ip_socket = 0;
+	}
+	lck_mtx_unlock(ppp_domain_mutex);
+
+	if (so)
+		sock_close(so);
+	OSDecrementAtomic(&l2tp_udp_ip_close_running);
+}
+
+/* -----------------------------------------------------------------------------
+send a L2TPv3 packet directly over IP
+----------------------------------------------------------------------------- */
+int l2tp_udp_ip_output(int flow, mbuf_t m, struct sockaddr *to)
+{
+    if (l2tp_udp_ip_socket == 0 || to == 0) {
+        mbuf_freem(m);	
+        return EINVAL;
+    }
+
+	return l2tp_udp_send(l2tp_udp_ip_socket, flow, m, to);
+}
+
+/* -----------------------------------------------------------------------------
+callback from the raw IP socket, packets are received with their IP header
+----------------------------------------------------------------------------- */
+static void l2tp_udp_ip_input(socket_t so, void *arg, int waitflag)
+{
+    mbuf_t mp = 0;
+	size_t recvlen = 1000000000;
+    struct sockaddr from;
+    struct msghdr msg;
+	struct ip *ip;
+	int hlen;
+		
+    do {
+    
+		bzero(&from, sizeof(from));
+		bzero(&msg, sizeof(msg));
+		msg.msg_namelen = sizeof(from);
+		msg.msg_name = &from;
+	
+		if (sock_receivembuf(so, &msg, &mp, MSG_DONTWAIT, &recvlen) != 0)
+			break;
+
+        if (mp == 0) 
+            break;
+
+		if (mbuf_len(mp) < sizeof(struct ip) 
+			&& mbuf_pullup(&mp, sizeof(struct ip))) {
+			if (mp)
+				mbuf_freem(mp);
+			continue;
+		}
+		ip = mbuf_data(mp);
+		hlen = ip->ip_hl << 2;
+		mbuf_adj(mp, hlen);
+
+		lck_mtx_lock(ppp_domain_mutex);
+		l2tp_rfc_lower_input_ip(mp, &from);
+		lck_mtx_unlock(ppp_domain_mutex);
+		
+    } while (1);
 }
 
 /* -----------------------------------------------------------------------------
@@ -404,34 +776,50 @@ int l2tp_udp_setpeer(socket_t so, struct sockaddr *addr)
 ----------------------------------------------------------------------------- */
 void l2tp_udp_thread_func(struct l2tp_udp_thread *thread_socket)
 {
-	mbuf_t m;
-	socket_t so;
+	struct l2tp_udp_pkt	batch[L2TP_UDP_BATCH_SIZE];
+	int		i, nb, xmit_ok;
 	
+	lck_mtx_lock(thread_socket->mtx);
 	for (;;) {
 	
-		lck_mtx_lock(thread_socket->mtx);
-dequeue:
-		m = ppp_dequeue(&thread_socket->outq);
-		if (m == NULL) {
+		if (thread_socket->outq_len == 0) {
 			if (thread_socket->terminate) {
 				wakeup(&thread_socket->terminate);
 				// just sleep again. caller will terminate the thread.
 				msleep(&thread_socket->thread, thread_socket->mtx, PZERO + 1, "l2tp_udp_thread_func terminate", 0);
 				/* NOT REACHED */
 			}
+			thread_socket->sleeping = 1;
 			msleep(&thread_socket->wakeup, thread_socket->mtx, PZERO + 1, "l2tp_udp_thread_func", 0);
-			goto dequeue;
+			thread_socket->sleeping = 0;
+			continue;
 		}
+
+		/* take a batch of packets with a single lock of the queue */
+		nb = MIN(thread_socket->outq_len, L2TP_UDP_BATCH_SIZE);
+		for (i = 0; i < nb; i++) {
+			batch[i] = thread_socket->outq[thread_socket->outq_head];
+			thread_socket->outq_head = (thread_socket->outq_head + 1) % thread_socket->outq_size;
+		}
+		thread_socket->outq_len -= nb;
+		
+		xmit_ok = thread_socket->full && thread_socket->outq_len <= L2TP_UDP_OUTQ_LOWAT(thread_socket);
+		if (xmit_ok)
+			thread_socket->full = 0;
 		lck_mtx_unlock(thread_socket->mtx);
 		
-		memcpy((void *)&so, mbuf_data(m), sizeof(so));
-		mbuf_adj(m, sizeof(socket_t));
-
-		// should have a kpi to sendmbuf and release at the same time
-		// to avoid too extra lock/unlock
-		sock_sendmbuf(so, 0, m, MSG_DONTWAIT, 0);
-		sock_release(so);
+		if (xmit_ok)
+			thread_call_enter(l2tp_udp_xmit_ok_call);
+
+		for (i = 0; i < nb; i++) {
+			// should have a kpi to sendmbuf and release at the same time
+			// to avoid too extra lock/unlock
+			l2tp_udp_sendmbuf(batch[i].so, batch[i].m, batch[i].addr.sa_len ? &batch[i].addr : 0);
+			sock_release(batch[i].so);
+		}
 
+		lck_mtx_lock(thread_socket->mtx);
+		thread_socket->stats.sent += nb;
 	}
 
     /* NOTREACHED */
@@ -26,12 +26,25 @@
 #define __L2TP_UDP_H__
 
 
+/* statistics of an output thread, returned by the net.ppp.l2tp.thread_stats sysctl */
+struct l2tp_udp_thread_stats {
+	u_int32_t	depth;			/* packets currently queued */
+	u_int32_t	max_depth;		/* highest number of packets queued */
+	u_int32_t	sent;			/* packets sent */
+	u_int32_t	drops;			/* packets dropped because the queue was full */
+	u_int32_t	blocked;		/* times the senders have been blocked */
+};
+
 int l2tp_udp_init();
 int l2tp_udp_dispose();
 int l2tp_udp_attach(socket_t *so, struct sockaddr *addr, int *thread, int nocksum, int delegated_process);
 int l2tp_udp_detach(socket_t so, int thread);
 int l2tp_udp_setpeer(socket_t so, struct sockaddr *addr);
-int l2tp_udp_output(socket_t so, int thread, mbuf_t m, struct sockaddr* to);
+int l2tp_udp_output(socket_t so, int flow, mbuf_t m, struct sockaddr* to);
+int l2tp_udp_xmit_full(int flow);
+int l2tp_udp_ip_attach();
+void l2tp_udp_ip_detach();
+int l2tp_udp_ip_output(int flow, mbuf_t m, struct sockaddr *to);
 void l2tp_udp_input(socket_t so, void *arg, int waitflag);
 void l2tp_udp_clear_INP_INADDR_ANY(socket_t so);
 
@@ -40,6 +40,10 @@ SYSCTL_DECL(_net_ppp_l2tp);
 #define L2TP_DEFAULT_RETRY_COUNT	9	
 #define L2TP_DEFAULT_CONNECT_TIMEOUT		1	/* 1 seconds */
 #define L2TP_DEFAULT_CONNECT_RETRY_COUNT	60	/* 60 tries */
+#define L2TP_DEFAULT_REORDER_DEPTH	16	/* max sequenced data packets held per session */
+#define L2TP_DEFAULT_REORDER_TIMEOUT	20	/* 20 milliseconds */
+#define L2TP_DEFAULT_ACK_DELAY		100	/* 100 milliseconds before sending a ZLB ack */
+#define L2TP_MIN_RTO			200	/* 200 milliseconds, lower bound of the estimated retransmission timeout */
 
 #define L2TP_OPT_FLAGS			1	/* see flags definition below */
 #define L2TP_OPT_PEERADDRESS		2	/* peer IP address */
@@ -58,6 +62,10 @@ SYSCTL_DECL(_net_ppp_l2tp);
 #define L2TP_OPT_BAUDRATE		15	/* tunnel baudrate */
 #define L2TP_OPT_RELIABILITY		16	/* turn on/off reliability layer */
 #define L2TP_OPT_SETDELEGATEDPID    17  /* set the delegated process for traffic statistics */
+#define L2TP_OPT_V3_SESSION_ID		18	/* L2TPv3 session id for the connection - 32 bits */
+#define L2TP_OPT_V3_PEER_SESSION_ID	19	/* L2TPv3 peer session id for the connection - 32 bits */
+#define L2TP_OPT_COOKIE			20	/* L2TPv3 cookie expected from the peer - 0, 4 or 8 bytes */
+#define L2TP_OPT_PEER_COOKIE		21	/* L2TPv3 cookie sent to the peer - 0, 4 or 8 bytes */
 
 /* flags definition */
 #define L2TP_FLAG_DEBUG		0x00000002	/* debug mode, send verbose logs to syslog */
@@ -66,6 +74,9 @@ SYSCTL_DECL(_net_ppp_l2tp);
 #define L2TP_FLAG_PEER_SEQ_REQ	0x00000010	/* peer sequencing required (ignored for control connection) */
 #define L2TP_FLAG_ADAPT_TIMER	0x00000020	/* use adaptative timer for reliable layer */
 #define L2TP_FLAG_IPSEC		0x00000040	/* is IPSec used for this connection */
+#define L2TP_FLAG_V3		0x00000080	/* L2TPv3 data session (ignored for control connection) */
+#define L2TP_FLAG_V3_IP		0x00000100	/* L2TPv3 session over IP instead of UDP */
+#define L2TP_FLAG_V3_SUBLAYER	0x00000200	/* L2TPv3 default L2-Specific Sublayer is present */
 
 /* control and data flags */
 #define L2TP_FLAGS_T		0x8000
@@ -76,6 +87,7 @@ SYSCTL_DECL(_net_ppp_l2tp);
 
 #define L2TP_VERSION_MASK	0x000F
 #define L2TP_VERSION		2
+#define L2TP_V3_VERSION		3
 
 
 /* define well known values */
@@ -83,6 +95,14 @@ SYSCTL_DECL(_net_ppp_l2tp);
 #define L2TP_CNTL_HDR_SIZE	12	/* control headers are always this size */
 #define L2TP_DATA_HDR_SIZE	8	/* hdr size for data we send - without sequencing */
 
+/* L2TPv3 (RFC 3931) data messages */
+#define L2TP_IPPROTO		115	/* IP protocol number for L2TPv3 over IP */
+#define L2TP_V3_UDP_HDR_SIZE	4	/* flags, version and reserved field present over UDP only */
+#define L2TP_V3_MAX_COOKIE	8
+#define L2TP_V3_SUBLAYER_SIZE	4
+#define L2TP_V3_SUBLAYER_S	0x40000000	/* sequence number is valid */
+#define L2TP_V3_SEQ_MASK	0x00FFFFFF
+
 struct l2tp_header {
     /* header for control messages */
     u_int16_t	flags_vers;
@@ -34,6 +34,7 @@
 
 /* include ppp domain as we use the ppp domain family */
 #include "../../../Family/ppp_domain.h"
+#include "../../../Family/if_ppplink.h"
 
 #include "PPPoE.h"
 #include "pppoe_rfc.h"
@@ -64,6 +65,7 @@ static void pppoe_dlil_event(ifnet_t ifp, protocol_family_t protocol,
 static errno_t pppoe_dlil_ioctl(ifnet_t ifp, protocol_family_t protocol,
 									 u_long command, void* argument);
 static void pppoe_dlil_detaching(u_int16_t unit);
+static mbuf_traffic_class_t pppoe_dlil_tos_to_tc(u_int8_t tos);
 
 
 /* -----------------------------------------------------------------------------
@@ -305,6 +307,25 @@ errno_t pppoe_dlil_input(ifnet_t ifp, protocol_family_t protocol,
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+map the inner DSCP to a traffic class, the ethernet driver turns it 
+into its link priority (802.1p user priority, wifi access category)
+----------------------------------------------------------------------------- */
+static mbuf_traffic_class_t pppoe_dlil_tos_to_tc(u_int8_t tos)
+{
+    switch (tos >> 5) {		// class selector
+        case 1:
+            return MBUF_TC_BK;
+        case 4:
+            return MBUF_TC_VI;
+        case 5:
+        case 6:
+        case 7:
+            return MBUF_TC_VO;
+    }
+    return MBUF_TC_BE;
+}
+
 /* -----------------------------------------------------------------------------
 called from pppenet_proto when data need to be sent
 ----------------------------------------------------------------------------- */
@@ -312,6 +333,10 @@ int pppoe_dlil_output(ifnet_t ifp, mbuf_t m, u_int8_t *to, u_int16_t typ)
 {
     struct ether_header 	*eh;
     struct sockaddr 		sa;
+    u_int8_t				tos;
+
+    if (ppp_link_gettos(m, &tos) == 0)
+        mbuf_set_traffic_class(m, pppoe_dlil_tos_to_tc(tos));
 
     eh = (struct ether_header *)sa.sa_data;
     (void)bcopy(to, eh->ether_dhost, sizeof(eh->ether_dhost));
@@ -54,6 +54,8 @@ Definitions
 ----------------------------------------------------------------------------- */
 
 
+SYSCTL_NODE(_net_ppp, OID_AUTO, pppoe, CTLFLAG_RW, 0, "");
+
 /* -----------------------------------------------------------------------------
 Forward declarations
 ----------------------------------------------------------------------------- */
@@ -133,6 +135,7 @@ int pppoe_domain_init(int init_arg)
     }
 
     pppoe_wan_init();
+    sysctl_register_oid(&sysctl__net_ppp_pppoe);
 
     pppoe_domain_inited = 1;
 
@@ -174,6 +177,8 @@ int pppoe_domain_terminate(int term_arg)
         IOLog("PPPoE domain terminate : pppoe_wan_dispose, err : %d\n", ret);
         goto end;
     }
+
+    sysctl_unregister_oid(&sysctl__net_ppp_pppoe);
     
     ret = pppoe_remove(pppdomain);
     if (ret) {
@@ -288,6 +288,12 @@ int pppoe_ctloutput(struct socket *so, struct sockopt *sopt)
                     else if ((error = sooptcopyin(sopt, &str, 2, 2)) == 0)
                         pppoe_rfc_command(so->so_pcb, PPPOE_CMD_SETPEERADDR , &str);
                     break;
+                case PPPOE_OPT_MAX_PAYLOAD:
+                    if (sopt->sopt_valsize != 2)
+                        error = EMSGSIZE;
+                    else if ((error = sooptcopyin(sopt, &val, 2, 2)) == 0)
+                        pppoe_rfc_command(so->so_pcb, PPPOE_CMD_SETMAXPAYLOAD , &val);
+                    break;
                 default:
                     error = ENOPROTOOPT;
             }
@@ -345,6 +351,14 @@ int pppoe_ctloutput(struct socket *so, struct sockopt *sopt)
                         error = sooptcopyout(sopt, &str, 6);
                     }
                     break;
+                case PPPOE_OPT_MAX_PAYLOAD:
+                    if (sopt->sopt_valsize != 2)
+                        error = EMSGSIZE;
+                    else {
+                        pppoe_rfc_command(so->so_pcb, PPPOE_CMD_GETMAXPAYLOAD, &val);
+                        error = sooptcopyout(sopt, &val, 2);
+                    }
+                    break;
                 default:
                     error = ENOPROTOOPT;
             }
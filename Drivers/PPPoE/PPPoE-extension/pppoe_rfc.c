@@ -28,8 +28,12 @@
 #include <sys/malloc.h>
 #include <sys/syslog.h>
 #include <sys/domain.h>
+#include <sys/sysctl.h>
+#include <sys/random.h>
+#include <sys/time.h>
 #include <kern/locks.h>
 #include <net/if.h>
+#include "crypto/sha1.h"
 
 #include "../../../Family/if_ppplink.h"
 #include "../../../Family/ppp_domain.h"
@@ -60,6 +64,7 @@ Definitions
 #define PPPOE_TAG_AC_COOKIE		0x0104
 #define PPPOE_TAG_VENDOR_SPECIFIC	0x0105
 #define PPPOE_TAG_RELAY_SESSION_ID	0x0110
+#define PPPOE_TAG_PPP_MAX_PAYLOAD	0x0120		/* RFC 4638 */
 #define PPPOE_TAG_SERVICE_NAME_ERROR	0x0201
 #define PPPOE_TAG_AC_SYSTEM_ERROR	0x0202
 #define PPPOE_TAG_GENERIC_ERROR		0x0203
@@ -75,8 +80,6 @@ Definitions
 #define	PPPOE_RELAY_ID_LEN		64	// 64 bytes (Fix Me: dynamically allocate tag)
 #define	PPPOE_AC_COOKIE_LEN		64	// 64 bytes (Fix Me: dynamically allocate tag)
 
-#define PPPOE_TMPBUF_SIZE		1500
-
 struct pppoe {
     u_int8_t ver:4;
     u_int8_t typ:4;
@@ -85,6 +88,23 @@ struct pppoe {
     u_int16_t len;
 };
 
+// location of the discovery tags we use, built by a single pass over the packet.
+// values stay in the mbuf and are only copied out by get_tag when needed.
+enum {
+    PPPOE_TAG_INDEX_SERVICE_NAME = 0,
+    PPPOE_TAG_INDEX_AC_NAME,
+    PPPOE_TAG_INDEX_HOST_UNIQ,
+    PPPOE_TAG_INDEX_AC_COOKIE,
+    PPPOE_TAG_INDEX_RELAY_SESSION_ID,
+    PPPOE_TAG_INDEX_PPP_MAX_PAYLOAD,
+    PPPOE_TAG_INDEX_MAX
+};
+
+struct pppoe_tag_index {
+    u_int16_t	offset[PPPOE_TAG_INDEX_MAX];	/* offset of the value in the packet, 0 if tag is absent */
+    u_int16_t	len[PPPOE_TAG_INDEX_MAX];	/* length of the value */
+};
+
 // a pppoe_tag is basically a buffer with information how much data it contains
 // right now, and how much space it provides in total.
 struct pppoe_tag {
@@ -130,6 +150,7 @@ struct pppoe_rfc {
 
     // administrative info
     TAILQ_ENTRY(pppoe_rfc) 	next;
+    TAILQ_ENTRY(pppoe_rfc) 	hash_next;		/* link in the session hash or in the discovery list */
     void 			*host; 			/* pointer back to the hosting structure */
     ifnet_t						ifp;			/* associated datalink attachment */
     pppoe_rfc_input_callback 	inputcb;		/* callback function when data are present */
@@ -161,6 +182,9 @@ struct pppoe_rfc {
     PPPOE_TAG(relay_id, PPPOE_RELAY_ID_LEN);		/* intermediate relay cookie */
     u_int16_t	session_id;				/* session id between client and server */
     u_int8_t	peer_address[ETHER_ADDR_LEN];		/* ethernet address we are connected to */
+    u_int16_t	max_payload;				/* PPP-Max-Payload we would like, 0 to not negotiate it */
+    u_int16_t	peer_max_payload;			/* PPP-Max-Payload offered by the peer, 0 if none */
+    u_int16_t	payload;				/* max PPP payload of the session */
 
 };
 
@@ -168,36 +192,100 @@ struct pppoe_rfc {
 /* -----------------------------------------------------------------------------
 Globals
 ----------------------------------------------------------------------------- */
-// change the algo to remove that var
-u_int8_t 	pppenet_tmpbuf[PPPOE_TMPBUF_SIZE];
-
 u_int16_t 	pppoe_unique_session_id = 1;
 u_int32_t 	pppoe_unique_address = 1;
 
 TAILQ_HEAD(, pppoe_rfc) 	pppoe_rfc_head;
 
+/* connected sessions are hashed on the (ifp, session id, peer address) triple,
+   so that data demultiplexing doesn't depend on the number of sessions.
+   rfcs in discovery are kept on a separate list, for the control packets */
+#define PPPOE_RFC_MAX_HASH 1024	/* power of 2 */
+#define PPPOE_RFC_HASH(ifp, sessid, addr)	\
+	(((((u_int32_t)(uintptr_t)(ifp) ^ ((addr)[4] << 8) ^ (addr)[5]) * 0x9E3779B1U) ^ (u_int32_t)(sessid)) \
+	& (PPPOE_RFC_MAX_HASH - 1))
+#define PPPOE_RFC_DISCOVERY(state)	\
+	((state) == PPPOE_STATE_LOOKING || (state) == PPPOE_STATE_CONNECTING || (state) == PPPOE_STATE_LISTENING)
+static TAILQ_HEAD(, pppoe_rfc) pppoe_rfc_hash[PPPOE_RFC_MAX_HASH];
+static TAILQ_HEAD(, pppoe_rfc) pppoe_rfc_discovery_head;
+
+/* in listen mode, PADO carry an AC-Cookie made of a timestamp and a truncated
+   HMAC-SHA1 of the timestamp and the client address. a PADR is only considered
+   if it echoes a valid cookie, so no state is kept for a client before that */
+#define PPPOE_COOKIE_KEY_LEN		64	/* SHA1 block size */
+#define PPPOE_COOKIE_HMAC_LEN		16
+#define PPPOE_COOKIE_LEN		(4 + PPPOE_COOKIE_HMAC_LEN)
+#define PPPOE_COOKIE_LIFETIME		60	/* seconds */
+static u_int8_t		pppoe_rfc_cookie_key[PPPOE_COOKIE_KEY_LEN];
+static int			pppoe_rfc_ac_cookie = 1;
+static u_int32_t	pppoe_rfc_cookie_drops = 0;
+
+/* PADI are rate limited per client address and globally, using token buckets.
+   client buckets are direct mapped, so memory stays bounded during a storm */
+#define PPPOE_PADI_MAX_BUCKETS		256	/* power of 2 */
+#define PPPOE_PADI_BUCKET(addr)	\
+	((((((u_int32_t)(addr)[2]) << 24) | ((addr)[3] << 16) | ((addr)[4] << 8) | (addr)[5]) * 0x9E3779B1U) >> 24)	/* 8 bits */
+struct pppoe_bucket {
+    u_int8_t	address[ETHER_ADDR_LEN];	/* client owning the bucket */
+    u_int32_t	tokens;				/* in thousandths of packet */
+    u_int32_t	last;				/* time of last refill, in milliseconds */
+};
+static struct pppoe_bucket	pppoe_rfc_padi_buckets[PPPOE_PADI_MAX_BUCKETS];
+static struct pppoe_bucket	pppoe_rfc_padi_bucket;
+static int			pppoe_rfc_padi_rate = 1000;
+static int			pppoe_rfc_padi_client_rate = 2;
+static u_int32_t	pppoe_rfc_padi_drops = 0;
+
+SYSCTL_DECL(_net_ppp_pppoe);
+SYSCTL_INT(_net_ppp_pppoe, OID_AUTO, ac_cookie, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &pppoe_rfc_ac_cookie, 0, "Issue AC-Cookie in PADO and require it in PADR when listening");
+SYSCTL_INT(_net_ppp_pppoe, OID_AUTO, cookie_drops, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &pppoe_rfc_cookie_drops, 0, "PADR dropped because of a missing or invalid AC-Cookie");
+SYSCTL_INT(_net_ppp_pppoe, OID_AUTO, padi_rate, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &pppoe_rfc_padi_rate, 0, "Max PADI per second from all clients, 0 to disable");
+SYSCTL_INT(_net_ppp_pppoe, OID_AUTO, padi_client_rate, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &pppoe_rfc_padi_client_rate, 0, "Max PADI per second from a single client, 0 to disable");
+SYSCTL_INT(_net_ppp_pppoe, OID_AUTO, padi_drops, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &pppoe_rfc_padi_drops, 0, "PADI dropped by the rate limiter");
+
 extern lck_mtx_t	*ppp_domain_mutex;
 
 /* -----------------------------------------------------------------------------
 Forward declarations
 ----------------------------------------------------------------------------- */
-static u_int16_t handle_PADI(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from);
-static u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from);
-static u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from);
-static u_int16_t handle_PADS(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from);
+static u_int16_t handle_PADI(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags);
+static u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags);
+static u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags);
+static u_int16_t handle_PADS(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags);
 static u_int16_t handle_PADT(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from);
 static u_int16_t handle_data(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from);
-static u_int16_t handle_ctrl(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from);
+static u_int16_t handle_ctrl(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags);
+
+static void pppoe_rfc_link(struct pppoe_rfc *rfc);
+static void pppoe_rfc_unlink(struct pppoe_rfc *rfc);
+static void pppoe_rfc_set_state(struct pppoe_rfc *rfc, u_int16_t state);
+
+static u_int32_t pppoe_rfc_now(void);
+static void pppoe_rfc_cookie_hmac(u_int32_t timestamp, u_int8_t *address, u_int8_t *digest);
+static void pppoe_rfc_cookie_make(u_int8_t *address, struct pppoe_tag *cookie);
+static int pppoe_rfc_cookie_check(mbuf_t m, struct pppoe_tag_index *tags, u_int8_t *address);
+static int pppoe_rfc_bucket_take(struct pppoe_bucket *bucket, int rate, u_int32_t now);
+static int pppoe_rfc_padi_allowed(u_int8_t *address);
 
 static void send_event(struct pppoe_rfc *rfc, u_int32_t event, u_int32_t msg);
 static void send_PAD(struct pppoe_rfc *rfc, u_int8_t *address, u_int16_t code, u_int16_t sessid,
                      struct pppoe_tag *ac_name, struct pppoe_tag *service,
-                     struct pppoe_tag *host_uniq, struct pppoe_tag *ac_cookie, struct pppoe_tag *relay_id);
+                     struct pppoe_tag *host_uniq, struct pppoe_tag *ac_cookie, struct pppoe_tag *relay_id,
+                     u_int16_t max_payload);
+static u_int16_t get_max_payload(mbuf_t m, struct pppoe_tag_index *tags);
+static u_int16_t pppoe_rfc_payload_limit(struct pppoe_rfc *rfc);
 
 static u_int16_t add_tag(u_int8_t *data, u_int16_t tag, struct pppoe_tag *val);
-static u_int16_t get_tag(mbuf_t m, u_int16_t tag, struct pppoe_tag *val);
+static int tag_index(u_int16_t tag);
+static void parse_tags(mbuf_t m, struct pppoe_tag_index *tags);
+static u_int16_t get_tag(mbuf_t m, struct pppoe_tag_index *tags, u_int16_t tag, struct pppoe_tag *val);
 
-u_int16_t pppoe_rfc_input(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, u_int16_t typ);
+u_int16_t pppoe_rfc_input(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, u_int16_t typ, struct pppoe_tag_index *tags);
 void pppoe_rfc_lower_output(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *to, u_int16_t typ);
 
 
@@ -207,9 +295,19 @@ need to change it to handle multiple ethernet interfaces
 ----------------------------------------------------------------------------- */
 u_int16_t pppoe_rfc_init()
 {
+    int i;
 
     pppoe_dlil_init();
     TAILQ_INIT(&pppoe_rfc_head);
+    TAILQ_INIT(&pppoe_rfc_discovery_head);
+    for (i = 0; i < PPPOE_RFC_MAX_HASH; i++)
+        TAILQ_INIT(&pppoe_rfc_hash[i]);
+    read_random(pppoe_rfc_cookie_key, sizeof(pppoe_rfc_cookie_key));
+    sysctl_register_oid(&sysctl__net_ppp_pppoe_ac_cookie);
+    sysctl_register_oid(&sysctl__net_ppp_pppoe_cookie_drops);
+    sysctl_register_oid(&sysctl__net_ppp_pppoe_padi_rate);
+    sysctl_register_oid(&sysctl__net_ppp_pppoe_padi_client_rate);
+    sysctl_register_oid(&sysctl__net_ppp_pppoe_padi_drops);
     return 0;
 }
 
@@ -222,6 +320,11 @@ u_int16_t pppoe_rfc_dispose()
     if (pppoe_dlil_dispose())
         return 1;
         
+    sysctl_unregister_oid(&sysctl__net_ppp_pppoe_ac_cookie);
+    sysctl_unregister_oid(&sysctl__net_ppp_pppoe_cookie_drops);
+    sysctl_unregister_oid(&sysctl__net_ppp_pppoe_padi_rate);
+    sysctl_unregister_oid(&sysctl__net_ppp_pppoe_padi_client_rate);
+    sysctl_unregister_oid(&sysctl__net_ppp_pppoe_padi_drops);
     return 0;
 }
 
@@ -253,6 +356,7 @@ u_int16_t pppoe_rfc_new_client(void *host, void **data,
     rfc->timer_connect_setup = PPPOE_TIMER_CONNECT;
     rfc->timer_ring_setup = PPPOE_TIMER_RING;
     rfc->timer_retry_setup = PPPOE_TIMER_RETRY;
+    rfc->payload = PPPOE_MTU;
 
     rfc->state = PPPOE_STATE_DISCONNECTED;
     PPPOE_TAG_SETUP(rfc->ac_name);
@@ -286,6 +390,7 @@ void pppoe_rfc_free_client(void *data)
 
     if (rfc) {
     
+        pppoe_rfc_unlink(rfc);
         if (rfc->ifp)
             pppoe_dlil_detach(rfc->ifp);
         
@@ -294,6 +399,40 @@ void pppoe_rfc_free_client(void *data)
     }
 }
 
+/* -----------------------------------------------------------------------------
+insert the rfc in the session hash if it is connected,
+or in the discovery list if it waits for control packets
+----------------------------------------------------------------------------- */
+static void pppoe_rfc_link(struct pppoe_rfc *rfc)
+{
+    if (rfc->state == PPPOE_STATE_CONNECTED)
+        TAILQ_INSERT_TAIL(&pppoe_rfc_hash[PPPOE_RFC_HASH(rfc->ifp, rfc->session_id, rfc->peer_address)], rfc, hash_next);
+    else if (PPPOE_RFC_DISCOVERY(rfc->state))
+        TAILQ_INSERT_TAIL(&pppoe_rfc_discovery_head, rfc, hash_next);
+}
+
+/* -----------------------------------------------------------------------------
+remove the rfc from the session hash or from the discovery list
+must be called before any of ifp, session_id or peer_address changes
+----------------------------------------------------------------------------- */
+static void pppoe_rfc_unlink(struct pppoe_rfc *rfc)
+{
+    if (rfc->state == PPPOE_STATE_CONNECTED)
+        TAILQ_REMOVE(&pppoe_rfc_hash[PPPOE_RFC_HASH(rfc->ifp, rfc->session_id, rfc->peer_address)], rfc, hash_next);
+    else if (PPPOE_RFC_DISCOVERY(rfc->state))
+        TAILQ_REMOVE(&pppoe_rfc_discovery_head, rfc, hash_next);
+}
+
+/* -----------------------------------------------------------------------------
+change the state of the rfc, and move it to the matching lookup structure
+----------------------------------------------------------------------------- */
+static void pppoe_rfc_set_state(struct pppoe_rfc *rfc, u_int16_t state)
+{
+    pppoe_rfc_unlink(rfc);
+    rfc->state = state;
+    pppoe_rfc_link(rfc);
+}
+
 /* -----------------------------------------------------------------------------
 connect the protocol to the service 'num'
 ----------------------------------------------------------------------------- */
@@ -327,8 +466,10 @@ u_int16_t pppoe_rfc_connect(void *data, u_int8_t *ac_name, u_int8_t *service)
     rfc->host_uniq.len = sizeof(uintptr_t);
     rfc->ac_cookie.len = 0;
     rfc->relay_id.len = 0;
+    rfc->peer_max_payload = 0;
+    rfc->payload = PPPOE_MTU;
     
-    rfc->state = PPPOE_STATE_LOOKING;
+    pppoe_rfc_set_state(rfc, PPPOE_STATE_LOOKING);
     rfc->timer_connect = rfc->timer_connect_setup;
     // resend PADI/PADR every PPPOE_TIMEOUT_RETRY seconds
     rfc->timer_connect_resend = rfc->timer_connect - rfc->timer_retry_setup;
@@ -338,7 +479,8 @@ u_int16_t pppoe_rfc_connect(void *data, u_int8_t *ac_name, u_int8_t *service)
 
     // if ac-name specified, try to reach it, otherwise, don't use name
     // may be shoult use a '*' semantic in the address ?
-    send_PAD(rfc, rfc->peer_address, PPPOE_PADI, 0, &rfc->ac_name, &rfc->service, &rfc->host_uniq, 0, 0);
+    send_PAD(rfc, rfc->peer_address, PPPOE_PADI, 0, &rfc->ac_name, &rfc->service, &rfc->host_uniq, 0, 0,
+             pppoe_rfc_payload_limit(rfc));
     return 0;
 }
 
@@ -381,10 +523,12 @@ u_int16_t pppoe_rfc_accept(void *data)
     rfc->session_id = pppoe_unique_session_id++; // generate a session id
 
     // host_uniq and rfc->relay_session_id have been got from the previous PADR
+    // as well as the PPP-Max-Payload, if the client asked for one
     send_PAD(rfc, rfc->peer_address, PPPOE_PADS, rfc->session_id, &rfc->ac_name, &rfc->service,
-             rfc->host_uniq.len ? &rfc->host_uniq : 0, 0, rfc->relay_id.len ? &rfc->relay_id : 0);
+             rfc->host_uniq.len ? &rfc->host_uniq : 0, 0, rfc->relay_id.len ? &rfc->relay_id : 0,
+             rfc->peer_max_payload ? rfc->payload : 0);
              
-    rfc->state = PPPOE_STATE_CONNECTED;
+    pppoe_rfc_set_state(rfc, PPPOE_STATE_CONNECTED);
     send_event(rfc, PPPOE_EVT_CONNECTED, 0);
 
     return 0;
@@ -413,7 +557,9 @@ u_int16_t pppoe_rfc_listen(void *data)
         rfc->unit = 0;
     }
 
-    rfc->state = PPPOE_STATE_LISTENING;
+    rfc->peer_max_payload = 0;
+    rfc->payload = PPPOE_MTU;
+    pppoe_rfc_set_state(rfc, PPPOE_STATE_LISTENING);
     
     return 0;
 }
@@ -435,7 +581,7 @@ u_int16_t pppoe_rfc_abort(void *data, int evt_enable)
         case PPPOE_STATE_CONNECTING:
         case PPPOE_STATE_LISTENING:
         case PPPOE_STATE_RINGING:
-            rfc->state = PPPOE_STATE_DISCONNECTED;
+            pppoe_rfc_set_state(rfc, PPPOE_STATE_DISCONNECTED);
             bzero(rfc->peer_address, sizeof(rfc->peer_address));
             if (evt_enable)
 				send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
@@ -467,9 +613,9 @@ u_int16_t pppoe_rfc_disconnect(void *data)
     if (rfc->flags & PPPOE_FLAG_DEBUG)
         IOLog("PPPoE disconnect (%p)\n", rfc);
 
-    send_PAD(rfc, rfc->peer_address, PPPOE_PADT, rfc->session_id, 0, 0, 0, 0, 0);
+    send_PAD(rfc, rfc->peer_address, PPPOE_PADT, rfc->session_id, 0, 0, 0, 0, 0, 0);
 
-    rfc->state = PPPOE_STATE_DISCONNECTED;
+    pppoe_rfc_set_state(rfc, PPPOE_STATE_DISCONNECTED);
     bzero(rfc->peer_address, sizeof(rfc->peer_address));
     send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
 
@@ -488,12 +634,15 @@ void pppoe_rfc_clone(void *data1, void *data2)
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
     host2 = rfc2->host;
+    pppoe_rfc_unlink(rfc2);
     if (rfc2->ifp)
         pppoe_dlil_detach(rfc2->ifp);
     TAILQ_REMOVE(&pppoe_rfc_head, rfc2, next);
     bcopy(data1, data2, sizeof(struct pppoe_rfc));
     rfc2->host = host2;
     TAILQ_INSERT_TAIL(&pppoe_rfc_head, rfc2, next);
+    // the hash linkage copied from rfc1 is meaningless for rfc2
+    pppoe_rfc_link(rfc2);
     // cannot fail, there is no attachment done, and it's is just refcnt bumping
     if (rfc2->ifp)
         pppoe_dlil_attach(rfc2->unit, &rfc2->ifp);
@@ -528,7 +677,7 @@ void pppoe_rfc_timer()
                 if (rfc->timer_connect == 0) {
                     if (rfc->flags & PPPOE_FLAG_DEBUG)
                         IOLog("PPPoE timer (%p): CONNECT_TIMER expires\n", rfc);
-                    rfc->state = PPPOE_STATE_DISCONNECTED;
+                    pppoe_rfc_set_state(rfc, PPPOE_STATE_DISCONNECTED);
                     bzero(rfc->peer_address, sizeof(rfc->peer_address));
                     // double-check for the error number ?
                     send_event(rfc, PPPOE_EVT_DISCONNECTED, 
@@ -542,7 +691,9 @@ void pppoe_rfc_timer()
                         rfc->ac_name.len ? &rfc->ac_name : 0, &rfc->service,
                         &rfc->host_uniq, 
                         rfc->ac_cookie.len ? &rfc->ac_cookie : 0, 
-                        rfc->relay_id.len ? &rfc->relay_id : 0);
+                        rfc->relay_id.len ? &rfc->relay_id : 0,
+                        rfc->state == PPPOE_STATE_LOOKING ? pppoe_rfc_payload_limit(rfc) : 
+                            (rfc->peer_max_payload ? rfc->payload : 0));
                 }
                 rfc->timer_connect--;
                 break;
@@ -550,7 +701,7 @@ void pppoe_rfc_timer()
                 if (rfc->timer_ring == 0) {
                     if (rfc->flags & PPPOE_FLAG_DEBUG)
                         IOLog("PPPoE timer (%p): RING_TIMER expires\n", rfc);
-                    rfc->state = PPPOE_STATE_DISCONNECTED;
+                    pppoe_rfc_set_state(rfc, PPPOE_STATE_DISCONNECTED);
                     bzero(rfc->peer_address, sizeof(rfc->peer_address));
                     send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
                     break;
@@ -642,16 +793,20 @@ u_int16_t pppoe_rfc_command(void *data, u_int32_t cmd, void *cmddata)
             if (rfc->flags & PPPOE_FLAG_DEBUG)
                 IOLog("PPPoE command (%p): set interface unit = %d\n", rfc, unit);
             if (rfc->unit != unit) {
+               pppoe_rfc_unlink(rfc);
                if (rfc->ifp) {
                     pppoe_dlil_detach(rfc->ifp);
                     rfc->ifp = 0;
                     rfc->unit = 0xFFFF;
                 }
                 if (unit != 0xFFFF) {
-                    if (pppoe_dlil_attach(unit, &rfc->ifp))
+                    if (pppoe_dlil_attach(unit, &rfc->ifp)) {
+                        pppoe_rfc_link(rfc);
                         return 1;
+                    }
                     rfc->unit = unit;
                 }
+               pppoe_rfc_link(rfc);
              }
             break;
 
@@ -711,6 +866,20 @@ u_int16_t pppoe_rfc_command(void *data, u_int32_t cmd, void *cmddata)
             bcopy(cmddata, rfc->peer_address, ETHER_ADDR_LEN);
             break;
 
+        // PPP-Max-Payload to negotiate, RFC 4638. must be set before connect or listen
+        case PPPOE_CMD_SETMAXPAYLOAD:
+            if (rfc->flags & PPPOE_FLAG_DEBUG)
+                IOLog("PPPoE command (%p): set max payload = %d\n", rfc, *(u_int16_t *)cmddata);
+            rfc->max_payload = *(u_int16_t *)cmddata;
+            break;
+
+        // max PPP payload of the session, once connected
+        case PPPOE_CMD_GETMAXPAYLOAD:
+            if (rfc->flags & PPPOE_FLAG_DEBUG)
+                IOLog("PPPoE command (%p): get max payload = %d\n", rfc, rfc->payload);
+            *(u_int16_t *)cmddata = rfc->payload;
+            break;
+
         // return the ethernet address we are connected to
         // broadcast and zero-address are treated the same way.
         case PPPOE_CMD_GETPEERADDR:
@@ -732,7 +901,7 @@ u_int16_t pppoe_rfc_command(void *data, u_int32_t cmd, void *cmddata)
 
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
-u_int16_t pppoe_rfc_input(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, u_int16_t typ)
+u_int16_t pppoe_rfc_input(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, u_int16_t typ, struct pppoe_tag_index *tags)
 {
 
     //IOLog("PPPoE input, rfc = %p\n", rfc);
@@ -744,7 +913,7 @@ u_int16_t pppoe_rfc_input(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, u_int
 
    switch (typ) {
         case PPPOE_ETHERTYPE_CTRL:
-            return handle_ctrl(rfc, m, from);
+            return handle_ctrl(rfc, m, from, tags);
 
         case PPPOE_ETHERTYPE_DATA:
             return handle_data(rfc, m, from);
@@ -781,71 +950,112 @@ void send_event(struct pppoe_rfc *rfc, u_int32_t event, u_int32_t msg)
 }
 
 /* -----------------------------------------------------------------------------
-get the value for the tag
-maxlen contains the max size of name (including null terminator)
-return 1 if the tag was found and it could fit with maxlen, 0 otherwise
+return the slot of the tag in a pppoe_tag_index, -1 if the tag is not indexed
 ----------------------------------------------------------------------------- */
-u_int16_t get_tag(mbuf_t m, u_int16_t tag, struct pppoe_tag *val)
+int tag_index(u_int16_t tag)
 {
-    u_int8_t 		*data, *tmpbuf;
-    struct pppoe	p_data;
-    u_int16_t 		totallen, copylen, len;
-
-    data = mbuf_data(m);
-    memcpy(&p_data, data, sizeof(p_data));
-    totallen =  ntohs(p_data.len);
+    switch (tag) {
+        case PPPOE_TAG_SERVICE_NAME: return PPPOE_TAG_INDEX_SERVICE_NAME;
+        case PPPOE_TAG_AC_NAME: return PPPOE_TAG_INDEX_AC_NAME;
+        case PPPOE_TAG_HOST_UNIQ: return PPPOE_TAG_INDEX_HOST_UNIQ;
+        case PPPOE_TAG_AC_COOKIE: return PPPOE_TAG_INDEX_AC_COOKIE;
+        case PPPOE_TAG_RELAY_SESSION_ID: return PPPOE_TAG_INDEX_RELAY_SESSION_ID;
+        case PPPOE_TAG_PPP_MAX_PAYLOAD: return PPPOE_TAG_INDEX_PPP_MAX_PAYLOAD;
+    }
+    return -1;
+}
 
-    // Prevent buffer overflow - the PPPoE RFC gurantees us a maximum packet size, however, an attacker
-    // might very well produce huge packets.
-    if (totallen > PPPOE_TMPBUF_SIZE)
-        totallen = PPPOE_TMPBUF_SIZE;
+/* -----------------------------------------------------------------------------
+walk the tag list once, and record where the tags we are interested in are
+the tag values are left in place in the mbuf chain
+----------------------------------------------------------------------------- */
+void parse_tags(mbuf_t m, struct pppoe_tag_index *tags)
+{
+    struct pppoe	p_data;
+    u_int16_t 		hdr[2];
+    u_int32_t 		offset, end, len;
+    int				index;
 
-    copylen = MIN(totallen, mbuf_len(m) - sizeof(struct pppoe));
+    bzero(tags, sizeof(*tags));
 
-    tmpbuf = &pppenet_tmpbuf[0];
-    bcopy(data + sizeof(struct pppoe), tmpbuf, copylen);
+    memcpy(&p_data, mbuf_data(m), sizeof(p_data));
+    end = sizeof(struct pppoe) + ntohs(p_data.len);
+    // an attacker might very well announce more than the packet contains
+    if (end > mbuf_pkthdr_len(m))
+        end = mbuf_pkthdr_len(m);
 
-    for (m = mbuf_next(m); m && (copylen < totallen); m = mbuf_next(m)) {
-        if (mbuf_len(m) == 0)
-            continue;
+    for (offset = sizeof(struct pppoe); offset + 4 <= end; offset += 4 + len) {
+    
+        if (mbuf_copydata(m, offset, sizeof(hdr), hdr))
+            break;
+        len = ntohs(hdr[1]);
+        if ((offset + 4 + len) > end)
+            break;	// bogus packet
 
-        len = MIN(totallen - copylen, mbuf_len(m));
-        data = mbuf_data(m);
-        bcopy(data, tmpbuf + copylen, len);
-        copylen += len;
+        // only the first occurence of a tag is considered
+        index = tag_index(ntohs(hdr[0]));
+        if (index >= 0 && tags->offset[index] == 0) {
+            tags->offset[index] = offset + 4;
+            tags->len[index] = len;
+        }
     }
+}
 
-    totallen = copylen;
-    data = tmpbuf;
+/* -----------------------------------------------------------------------------
+get the value for the tag, from the index built by parse_tags
+return 1 if the tag was found and it could fit in val, 0 otherwise
+----------------------------------------------------------------------------- */
+u_int16_t get_tag(mbuf_t m, struct pppoe_tag_index *tags, u_int16_t tag, struct pppoe_tag *val)
+{
+    int		index;
 
     val->len = 0;
 
-    while (totallen > 0) {
-    
-        len = ntohs(*(u_int16_t *)(data + 2));
-        if ((len + 4) > totallen)
-            break;	// bogus packet
-            
-        //IOLog("tag 0x%x 0x%x 0x%x 0x%x \n", data[0], data[1], data[2], data[3]);
-        if (ntohs(*(u_int16_t *)data) == tag) {
-            data += 2;
-            if (len <= val->max_len) {
-                bcopy(data + 2, val->data, len);
-                val->len = len;
-                if (val->len < val->max_len)
-                    val->data[val->len] = 0;
-                return 1;
-            }
-            //IOLog("got PADO : %s\n", name);
-            break;
-        }
-        else {
-            totallen -= 4 + len;
-            data += 4 + len;
-        }
-    }
+    index = tag_index(tag);
+    if (index < 0 || tags->offset[index] == 0 || tags->len[index] > val->max_len)
+        return 0;
 
-    return 0;
+    if (mbuf_copydata(m, tags->offset[index], tags->len[index], val->data))
+        return 0;
+    val->len = tags->len[index];
+    if (val->len < val->max_len)
+        val->data[val->len] = 0;
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+get the value of the PPP-Max-Payload tag
+return 0 if the tag is absent, or doesn't allow more than the standard payload
+----------------------------------------------------------------------------- */
+u_int16_t get_max_payload(mbuf_t m, struct pppoe_tag_index *tags)
+{
+    PPPOE_TAG(payload, 2);
+    u_int16_t	val;
+
+    PPPOE_TAG_SETUP(payload);
+    if (!get_tag(m, tags, PPPOE_TAG_PPP_MAX_PAYLOAD, &payload) || payload.len != 2)
+        return 0;
+
+    bcopy(payload.data, &val, 2);
+    val = ntohs(val);
+    return (val > PPPOE_MTU ? val : 0);
+}
+
+/* -----------------------------------------------------------------------------
+return the largest payload we can negotiate on the rfc interface
+0 if PPP-Max-Payload is not configured, or the interface doesn't support baby-jumbo frames
+----------------------------------------------------------------------------- */
+u_int16_t pppoe_rfc_payload_limit(struct pppoe_rfc *rfc)
+{
+    int		limit;
+
+    if (!rfc->max_payload || !rfc->ifp)
+        return 0;
+
+    /* the PPP payload leaves room for the pppoe header and the 2 bytes ppp protocol */
+    limit = (int)ifnet_mtu(rfc->ifp) - (int)(sizeof(struct pppoe) + 2);
+    limit = MIN(limit, rfc->max_payload);
+    return (limit > PPPOE_MTU ? limit : 0);
 }
 
 /* -----------------------------------------------------------------------------
@@ -869,12 +1079,13 @@ address MUST be a valid ethernet address (6 bytes length)
 void send_PAD(struct pppoe_rfc *rfc, u_int8_t *address, u_int16_t code, u_int16_t sessid,
                      struct pppoe_tag *ac_name, struct pppoe_tag *service,
                      struct pppoe_tag *host_uniq, struct pppoe_tag *ac_cookie,
-                     struct pppoe_tag *relay_id)
+                     struct pppoe_tag *relay_id, u_int16_t max_payload)
 {
     mbuf_t			m = 0;
     u_int8_t 		*data;
     u_int16_t 		len;
     struct pppoe	*p, p_data;
+    PPPOE_TAG(payload, 2);
 
     if (mbuf_gethdr(MBUF_WAITOK, MBUF_TYPE_DATA, &m) != 0)
         return;
@@ -927,6 +1138,16 @@ void send_PAD(struct pppoe_rfc *rfc, u_int8_t *address, u_int16_t code, u_int16_
         data += len;
     }
 
+    if (max_payload) {
+        PPPOE_TAG_SETUP(payload);
+        max_payload = htons(max_payload);
+        bcopy(&max_payload, payload.data, 2);
+        payload.len = 2;
+        len = add_tag(data, PPPOE_TAG_PPP_MAX_PAYLOAD, &payload);
+        p->len += len;
+        data += len;
+    }
+
     mbuf_setlen(m, sizeof(struct pppoe) + p->len);
     mbuf_pkthdr_setlen(m, sizeof(struct pppoe) + p->len);
     p->len = htons(p->len);
@@ -939,12 +1160,14 @@ void send_PAD(struct pppoe_rfc *rfc, u_int8_t *address, u_int16_t code, u_int16_
 m contains ethernet header and the actual ethernet data
 from MUST be a valid ethernet address (6 bytes length)
 ----------------------------------------------------------------------------- */
-u_int16_t handle_PADI(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
+u_int16_t handle_PADI(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags)
 {
     PPPOE_TAG(name, PPPOE_AC_NAME_LEN);
     PPPOE_TAG(service, PPPOE_SERVICE_LEN);
     PPPOE_TAG(hostuniq, PPPOE_HOST_UNIQ_LEN);
     PPPOE_TAG(relay, PPPOE_RELAY_ID_LEN);
+    PPPOE_TAG(cookie, PPPOE_AC_COOKIE_LEN);
+    u_int16_t	max_payload;
 
     if (rfc->state != PPPOE_STATE_LISTENING)
         return 0;
@@ -953,9 +1176,10 @@ u_int16_t handle_PADI(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
     PPPOE_TAG_SETUP(service);
     PPPOE_TAG_SETUP(hostuniq);
     PPPOE_TAG_SETUP(relay);
+    PPPOE_TAG_SETUP(cookie);
 
-    get_tag(m, PPPOE_TAG_AC_NAME, &name);
-    get_tag(m, PPPOE_TAG_SERVICE_NAME, &service);
+    get_tag(m, tags, PPPOE_TAG_AC_NAME, &name);
+    get_tag(m, tags, PPPOE_TAG_SERVICE_NAME, &service);
 
     if (rfc->flags & PPPOE_FLAG_DEBUG)
         IOLog("PPPoE receive PADI (%p): requested service\\name = '%.64s\\%.64s', our service\\name = '%.64s\\%.64s'\n",
@@ -967,12 +1191,16 @@ u_int16_t handle_PADI(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
     if ((!name.len || !PPPOE_TAG_CMP(name, rfc->serv_ac_name))
         && (!service.len || !PPPOE_TAG_CMP(service, rfc->serv_service))) {
         
-        get_tag(m, PPPOE_TAG_HOST_UNIQ, &hostuniq);
-        get_tag(m, PPPOE_TAG_RELAY_SESSION_ID, &relay);
-
-        // could generate and use ac-cookie, but in that case we would need to change state
-        // do it later...
-        send_PAD(rfc, from, PPPOE_PADO, 0, &rfc->serv_ac_name, service.len ? &service : 0, hostuniq.len ? &hostuniq : 0, 0, relay.len ? &relay : 0);
+        get_tag(m, tags, PPPOE_TAG_HOST_UNIQ, &hostuniq);
+        get_tag(m, tags, PPPOE_TAG_RELAY_SESSION_ID, &relay);
+
+        // the ac-cookie is derived from the client address, so we don't need to change state
+        if (pppoe_rfc_ac_cookie)
+            pppoe_rfc_cookie_make(from, &cookie);
+        // offer a larger payload only if the client asks for it, and our interface can carry it
+        max_payload = MIN(get_max_payload(m, tags), pppoe_rfc_payload_limit(rfc));
+        send_PAD(rfc, from, PPPOE_PADO, 0, &rfc->serv_ac_name, service.len ? &service : 0, hostuniq.len ? &hostuniq : 0,
+            cookie.len ? &cookie : 0, relay.len ? &relay : 0, max_payload);
         return 1;
     }
 
@@ -983,7 +1211,7 @@ u_int16_t handle_PADI(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 m contains ethernet header and the actual ethernet data
 from MUST be a valid ethernet address (6 bytes length)
 ----------------------------------------------------------------------------- */
-u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
+u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags)
 {
     PPPOE_TAG(name, PPPOE_AC_NAME_LEN);
     PPPOE_TAG(service, PPPOE_SERVICE_LEN);
@@ -996,15 +1224,15 @@ u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
     PPPOE_TAG_SETUP(service);
     PPPOE_TAG_SETUP(hostuniq);
 
-    get_tag(m, PPPOE_TAG_AC_NAME, &name);
-    get_tag(m, PPPOE_TAG_SERVICE_NAME, &service);
+    get_tag(m, tags, PPPOE_TAG_AC_NAME, &name);
+    get_tag(m, tags, PPPOE_TAG_SERVICE_NAME, &service);
 
     if (rfc->flags & PPPOE_FLAG_DEBUG)
         IOLog("PPPoE receive PADO (%p): offered service\\name = '%.64s\\%.64s', expected service\\name = '%.64s\\%.64s'\n",
         rfc, service.data, name.data, rfc->service.data, rfc->ac_name.data);
 
     // since we sent PPPOE_TAG_HOST_UNIQ in our PADI, the tag MUST be present in this PADO
-    get_tag(m, PPPOE_TAG_HOST_UNIQ, &hostuniq);
+    get_tag(m, tags, PPPOE_TAG_HOST_UNIQ, &hostuniq);
 
     // the connecting rfc is identified by our host_uniq value
     // check if the ac-name and ac-service match our expectations
@@ -1013,11 +1241,17 @@ u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
         && (!rfc->ac_name.len || !PPPOE_TAG_CMP(name, rfc->ac_name))
         && (!rfc->service.len || !PPPOE_TAG_CMP(service, rfc->service)) ) {
 #endif
-        get_tag(m, PPPOE_TAG_AC_COOKIE, &rfc->ac_cookie);
-        get_tag(m, PPPOE_TAG_RELAY_SESSION_ID, &rfc->relay_id);
+        get_tag(m, tags, PPPOE_TAG_AC_COOKIE, &rfc->ac_cookie);
+        get_tag(m, tags, PPPOE_TAG_RELAY_SESSION_ID, &rfc->relay_id);
         
         bcopy(from, rfc->peer_address, ETHER_ADDR_LEN);
 
+        // the access concentrator echoes PPP-Max-Payload if it supports it
+        rfc->payload = MIN(get_max_payload(m, tags), pppoe_rfc_payload_limit(rfc));
+        rfc->peer_max_payload = rfc->payload;
+        if (!rfc->payload)
+            rfc->payload = PPPOE_MTU;
+
 		if (rfc->flags & PPPOE_FLAG_PROBE) {
 			// this is not a real connection, 
 			// we just performed a probe to detect the presence of a PPPoE servers
@@ -1032,8 +1266,9 @@ u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
                 rfc->ac_name.len ? &rfc->ac_name : 0, &rfc->service,
                 &rfc->host_uniq, 
                 rfc->ac_cookie.len ? &rfc->ac_cookie : 0, 
-                rfc->relay_id.len ? &rfc->relay_id : 0);
-        rfc->state = PPPOE_STATE_CONNECTING;
+                rfc->relay_id.len ? &rfc->relay_id : 0,
+                rfc->peer_max_payload ? rfc->payload : 0);
+        pppoe_rfc_set_state(rfc, PPPOE_STATE_CONNECTING);
         return 1;
 #ifndef PPPENET_COMPAT
     }
@@ -1045,7 +1280,7 @@ u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 m contains ethernet header and the actual ethernet data
 from MUST be a valid ethernet address (6 bytes length)
 ----------------------------------------------------------------------------- */
-u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
+u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags)
 {
     PPPOE_TAG(name, PPPOE_AC_NAME_LEN);
     PPPOE_TAG(service, PPPOE_SERVICE_LEN);
@@ -1056,8 +1291,8 @@ u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
     PPPOE_TAG_SETUP(name);
     PPPOE_TAG_SETUP(service);
 
-    get_tag(m, PPPOE_TAG_AC_NAME, &name);
-    get_tag(m, PPPOE_TAG_SERVICE_NAME, &service);
+    get_tag(m, tags, PPPOE_TAG_AC_NAME, &name);
+    get_tag(m, tags, PPPOE_TAG_SERVICE_NAME, &service);
     
     if (rfc->flags & PPPOE_FLAG_DEBUG)
         IOLog("PPPoE receive PADR (%p): requested service\\name = '%.64s\\%.64s', our service\\name = '%.64s\\%.64s'\n", rfc, service.data, name.data, rfc->serv_service.data, rfc->serv_ac_name.data);
@@ -1069,12 +1304,18 @@ u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
         
         bcopy(from, rfc->peer_address, ETHER_ADDR_LEN);
         
-        get_tag(m, PPPOE_TAG_HOST_UNIQ, &rfc->host_uniq);
-        get_tag(m, PPPOE_TAG_RELAY_SESSION_ID, &rfc->relay_id);
+        get_tag(m, tags, PPPOE_TAG_HOST_UNIQ, &rfc->host_uniq);
+        get_tag(m, tags, PPPOE_TAG_RELAY_SESSION_ID, &rfc->relay_id);
+
+        // the PPP-Max-Payload the client asked for, if our interface can carry it
+        rfc->payload = MIN(get_max_payload(m, tags), pppoe_rfc_payload_limit(rfc));
+        rfc->peer_max_payload = rfc->payload;
+        if (!rfc->payload)
+            rfc->payload = PPPOE_MTU;
 
         // change the state, so there is no other client trying to call...
         rfc->timer_ring = rfc->timer_ring_setup;
-        rfc->state = PPPOE_STATE_RINGING;
+        pppoe_rfc_set_state(rfc, PPPOE_STATE_RINGING);
         send_event(rfc, PPPOE_EVT_RINGING, 0);
 
         // only ring to the first client that matches...
@@ -1088,7 +1329,7 @@ u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 m contains ethernet header and the actual ethernet data
 from MUST be a valid ethernet address (6 bytes length)
 ----------------------------------------------------------------------------- */
-u_int16_t handle_PADS(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
+u_int16_t handle_PADS(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags)
 {
     PPPOE_TAG(hostuniq, PPPOE_HOST_UNIQ_LEN);
     struct pppoe 	p_data;
@@ -1106,7 +1347,7 @@ u_int16_t handle_PADS(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
         IOLog("PPPoE receive PADS (%p): session id = 0x%x\n", rfc, sessid);
 
     // since we sent PPPOE_TAG_HOST_UNIQ in our PADR, the tag MUST be present in this PADS
-    get_tag(m, PPPOE_TAG_HOST_UNIQ, &hostuniq);
+    get_tag(m, tags, PPPOE_TAG_HOST_UNIQ, &hostuniq);
 
     // the connecting rfc is identified by our host_uniq value
 #ifndef PPPENET_COMPAT
@@ -1116,8 +1357,11 @@ u_int16_t handle_PADS(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
         ) {
 #endif
 //        bcopy(from, rfc->peer_address, ETHER_ADDR_LEN);
-        rfc->state = PPPOE_STATE_CONNECTED;
         rfc->session_id = sessid;
+        // the larger payload is only used if the access concentrator confirms it
+        if (rfc->peer_max_payload)
+            rfc->payload = MAX(MIN(get_max_payload(m, tags), rfc->payload), PPPOE_MTU);
+        pppoe_rfc_set_state(rfc, PPPOE_STATE_CONNECTED);
         send_event(rfc, PPPOE_EVT_CONNECTED, 0);
 
         return 1;
@@ -1147,7 +1391,7 @@ u_int16_t handle_PADT(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 
     if ((sessid == rfc->session_id) && !bcmp(rfc->peer_address, from, ETHER_ADDR_LEN)) {
 
-        rfc->state = PPPOE_STATE_DISCONNECTED;
+        pppoe_rfc_set_state(rfc, PPPOE_STATE_DISCONNECTED);
         bzero(rfc->peer_address, sizeof(rfc->peer_address));
         send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
 
@@ -1159,7 +1403,7 @@ u_int16_t handle_PADT(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
-u_int16_t handle_ctrl(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
+u_int16_t handle_ctrl(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, struct pppoe_tag_index *tags)
 {
     struct pppoe 	*p = mbuf_data(m);
     u_int16_t 		done = 0;
@@ -1168,16 +1412,16 @@ u_int16_t handle_ctrl(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 
     switch (p->code) { 		// no alignment issue as p->code is u_int8_t.
        case PPPOE_PADI:
-            done = handle_PADI(rfc, m, from);
+            done = handle_PADI(rfc, m, from, tags);
             break;
         case PPPOE_PADO:
-            done = handle_PADO(rfc, m, from);
+            done = handle_PADO(rfc, m, from, tags);
             break;
         case PPPOE_PADR:
-            done = handle_PADR(rfc, m, from);
+            done = handle_PADR(rfc, m, from, tags);
             break;
         case PPPOE_PADS:
-            done = handle_PADS(rfc, m, from);
+            done = handle_PADS(rfc, m, from, tags);
             break;
        case PPPOE_PADT:
             done = handle_PADT(rfc, m, from);
@@ -1242,6 +1486,131 @@ u_int16_t handle_data(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+return the uptime in milliseconds
+----------------------------------------------------------------------------- */
+u_int32_t pppoe_rfc_now(void)
+{
+    struct timeval	tv;
+
+    microuptime(&tv);
+    return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+/* -----------------------------------------------------------------------------
+compute the HMAC-SHA1 of the cookie timestamp and the client address
+----------------------------------------------------------------------------- */
+void pppoe_rfc_cookie_hmac(u_int32_t timestamp, u_int8_t *address, u_int8_t *digest)
+{
+    struct sha1_ctxt 	context;
+    u_int8_t			pad[PPPOE_COOKIE_KEY_LEN];
+    int					i;
+
+    for (i = 0; i < PPPOE_COOKIE_KEY_LEN; i++)
+        pad[i] = pppoe_rfc_cookie_key[i] ^ 0x36;
+    sha1_init(&context);
+    sha1_loop(&context, pad, sizeof(pad));
+    sha1_loop(&context, (u_int8_t *)&timestamp, sizeof(timestamp));
+    sha1_loop(&context, address, ETHER_ADDR_LEN);
+    sha1_result(&context, digest);
+
+    for (i = 0; i < PPPOE_COOKIE_KEY_LEN; i++)
+        pad[i] = pppoe_rfc_cookie_key[i] ^ 0x5c;
+    sha1_init(&context);
+    sha1_loop(&context, pad, sizeof(pad));
+    sha1_loop(&context, digest, SHA1_RESULTLEN);
+    sha1_result(&context, digest);
+}
+
+/* -----------------------------------------------------------------------------
+build the ac-cookie to offer to a client
+----------------------------------------------------------------------------- */
+void pppoe_rfc_cookie_make(u_int8_t *address, struct pppoe_tag *cookie)
+{
+    u_int8_t	digest[SHA1_RESULTLEN];
+    u_int32_t	timestamp;
+
+    timestamp = htonl(pppoe_rfc_now() / 1000);
+    pppoe_rfc_cookie_hmac(timestamp, address, digest);
+
+    bcopy(&timestamp, cookie->data, sizeof(timestamp));
+    bcopy(digest, cookie->data + sizeof(timestamp), PPPOE_COOKIE_HMAC_LEN);
+    cookie->len = PPPOE_COOKIE_LEN;
+}
+
+/* -----------------------------------------------------------------------------
+check the ac-cookie echoed by a client in its PADR
+return 1 if it is one of ours, for this client, and not expired
+----------------------------------------------------------------------------- */
+int pppoe_rfc_cookie_check(mbuf_t m, struct pppoe_tag_index *tags, u_int8_t *address)
+{
+    PPPOE_TAG(cookie, PPPOE_AC_COOKIE_LEN);
+    u_int8_t	digest[SHA1_RESULTLEN];
+    u_int32_t	timestamp, now;
+
+    PPPOE_TAG_SETUP(cookie);
+
+    if (!get_tag(m, tags, PPPOE_TAG_AC_COOKIE, &cookie) || cookie.len != PPPOE_COOKIE_LEN)
+        return 0;
+
+    bcopy(cookie.data, &timestamp, sizeof(timestamp));
+    now = pppoe_rfc_now() / 1000;
+    if (ntohl(timestamp) > now || now - ntohl(timestamp) > PPPOE_COOKIE_LIFETIME)
+        return 0;
+
+    pppoe_rfc_cookie_hmac(timestamp, address, digest);
+    return !bcmp(digest, cookie.data + sizeof(timestamp), PPPOE_COOKIE_HMAC_LEN);
+}
+
+/* -----------------------------------------------------------------------------
+refill the bucket for the time elapsed, and take a token for one packet
+rate is in packets per second, and the bucket holds at most one second worth
+return 1 if the packet can be accepted
+----------------------------------------------------------------------------- */
+int pppoe_rfc_bucket_take(struct pppoe_bucket *bucket, int rate, u_int32_t now)
+{
+    u_int32_t	elapsed;
+
+    if (rate <= 0)
+        return 1;
+
+    elapsed = now - bucket->last;
+    bucket->last = now;
+    if (elapsed > 1000)
+        elapsed = 1000;
+    bucket->tokens += elapsed * rate;
+    if (bucket->tokens > rate * 1000)
+        bucket->tokens = rate * 1000;
+
+    if (bucket->tokens < 1000)
+        return 0;
+    bucket->tokens -= 1000;
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+apply the per client, then the global PADI rate limit
+the client bucket is checked first, so a single flooding client
+doesn't consume the tokens of the others
+----------------------------------------------------------------------------- */
+int pppoe_rfc_padi_allowed(u_int8_t *address)
+{
+    struct pppoe_bucket	*bucket = &pppoe_rfc_padi_buckets[PPPOE_PADI_BUCKET(address)];
+    u_int32_t			now = pppoe_rfc_now();
+
+    if (bcmp(bucket->address, address, ETHER_ADDR_LEN)) {
+        // new client, or collision with another one. start with a full bucket
+        bcopy(address, bucket->address, ETHER_ADDR_LEN);
+        bucket->tokens = pppoe_rfc_padi_client_rate * 1000;
+        bucket->last = now;
+    }
+
+    if (!pppoe_rfc_bucket_take(bucket, pppoe_rfc_padi_client_rate, now))
+        return 0;
+
+    return pppoe_rfc_bucket_take(&pppoe_rfc_padi_bucket, pppoe_rfc_padi_rate, now);
+}
+
 /* -----------------------------------------------------------------------------
 called from pppoe_rfc when data need to be sent
 ----------------------------------------------------------------------------- */
@@ -1280,39 +1649,73 @@ called from pppoe_dlil when pppoe data are present
 ----------------------------------------------------------------------------- */
 void pppoe_rfc_lower_input(ifnet_t ifp, mbuf_t m, u_int8_t *from, u_int16_t typ)
 {
-    struct pppoe_rfc  	*rfc, *lastrfc = 0;
+    struct pppoe_rfc  	*rfc;
+    struct pppoe		p_data;
+    struct pppoe_tag_index	tags;
+    u_int16_t			sessid;
     
     //IOLog("PPPoE inputdata, tag = %d\n", dl_tag);
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
-    TAILQ_FOREACH(rfc, &pppoe_rfc_head, next) {
-        // we use dl_tag because we only respond to the peer on the same interface
-        if (rfc->ifp == ifp) {
+    if (mbuf_len(m) < sizeof(struct pppoe)) {
+        mbuf_freem(m);
+        return;
+    }
 
-            if (pppoe_rfc_input(rfc, m, from, typ))
+    memcpy(&p_data, mbuf_data(m), sizeof(p_data));
+    sessid = ntohs(p_data.sessid);
+
+    if (typ == PPPOE_ETHERTYPE_DATA || p_data.code == PPPOE_PADT) {
+        // data and PADT belong to an established session, look it up in the hash
+        // we use ifp because we only respond to the peer on the same interface
+        TAILQ_FOREACH(rfc, &pppoe_rfc_hash[PPPOE_RFC_HASH(ifp, sessid, from)], hash_next) {
+            if (rfc->ifp == ifp
+                && rfc->session_id == sessid
+                && !bcmp(rfc->peer_address, from, ETHER_ADDR_LEN)) {
+                if (pppoe_rfc_input(rfc, m, from, typ, 0))
+                    return;
+                break;
+            }
+        }
+    }
+    else {
+        // other control packets are only relevant to rfcs in discovery
+        // parse the tags once, rather than once per rfc and per tag
+        parse_tags(m, &tags);
+
+        // filter the discovery storms before any rfc looks at the packet
+        if (p_data.code == PPPOE_PADI && !pppoe_rfc_padi_allowed(from)) {
+            pppoe_rfc_padi_drops++;
+            mbuf_freem(m);
+            return;
+        }
+        if (p_data.code == PPPOE_PADR && pppoe_rfc_ac_cookie && !pppoe_rfc_cookie_check(m, &tags, from)) {
+            pppoe_rfc_cookie_drops++;
+            mbuf_freem(m);
+            return;
+        }
+
+        TAILQ_FOREACH(rfc, &pppoe_rfc_discovery_head, hash_next) {
+            if (rfc->ifp == ifp && pppoe_rfc_input(rfc, m, from, typ, &tags))
                 return;
-                
-            lastrfc = rfc;
         }
     }
 
-    // the last matching rfc itself is irrelevant, just need unit number and tag information
+    // any rfc on the interface will do, just need unit number and tag information
+    TAILQ_FOREACH(rfc, &pppoe_rfc_head, next) {
+        if (rfc->ifp == ifp)
+            break;
+    }
     
     IOLog("PPPoE inputdata: unexpected %s packet on unit = %d\n", 
-        (typ == PPPOE_ETHERTYPE_CTRL ? "control" : "data"), lastrfc ? lastrfc->unit : -1);
+        (typ == PPPOE_ETHERTYPE_CTRL ? "control" : "data"), rfc ? rfc->unit : -1);
         
     if (typ == PPPOE_ETHERTYPE_DATA) {
         // in case of PPPOE_ETHERTYPE_DATA, send a PADT to the peer
         // trying to talk to us with an incorrect session id
-        struct pppoe	p_data;
-        u_int16_t	sessid;
-
-	memcpy(&p_data, mbuf_data(m), sizeof(p_data));
-	sessid = ntohs(p_data.sessid);
-
-        if (lastrfc)
-            send_PAD(lastrfc, from, PPPOE_PADT, sessid, 0, 0, 0, 0, 0);
+        if (rfc)
+            send_PAD(rfc, from, PPPOE_PADT, sessid, 0, 0, 0, 0, 0, 0);
     }
     
     // nobody was intersted in the packet, just ignore it
@@ -1325,6 +1728,7 @@ calls when the lower layer is detaching
 void pppoe_rfc_lower_detaching(ifnet_t ifp)
 {
     struct pppoe_rfc  	*rfc;
+    u_int16_t			state;
 	    
     TAILQ_FOREACH(rfc, &pppoe_rfc_head, next) {
 
@@ -1333,13 +1737,16 @@ void pppoe_rfc_lower_detaching(ifnet_t ifp)
             if (rfc->flags & PPPOE_FLAG_DEBUG)
                 IOLog("PPPoE lower layer detaching (%p): ethernet unit = %d\n", rfc, rfc->unit);
         
+            // leave the session hash while ifp is still valid
+            state = rfc->state;
+            pppoe_rfc_set_state(rfc, PPPOE_STATE_DISCONNECTED);
+
             pppoe_dlil_detach(rfc->ifp);
             rfc->ifp = 0;
             rfc->unit = 0xFFFF;
         
-            if (rfc->state != PPPOE_STATE_DISCONNECTED) {
+            if (state != PPPOE_STATE_DISCONNECTED) {
         
-                rfc->state = PPPOE_STATE_DISCONNECTED;
                 bzero(rfc->peer_address, sizeof(rfc->peer_address));
                 send_event(rfc, PPPOE_EVT_DISCONNECTED, ENXIO);
             }
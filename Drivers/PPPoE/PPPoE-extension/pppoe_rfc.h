@@ -58,7 +58,9 @@ enum {
     PPPOE_CMD_SETPEERADDR,	// set peer ethernet address
     PPPOE_CMD_GETPEERADDR,	// get peer ethernet address
     PPPOE_CMD_SETRETRYTIMER, 	// set ring timer
-    PPPOE_CMD_GETRETRYTIMER 	// get ring timer
+    PPPOE_CMD_GETRETRYTIMER, 	// get ring timer
+    PPPOE_CMD_SETMAXPAYLOAD,	// set PPP-Max-Payload to negotiate
+    PPPOE_CMD_GETMAXPAYLOAD	// get max PPP payload of the session
 };
 
 typedef void (*pppoe_rfc_event_callback)(void *data, u_int32_t event, u_int32_t msg);
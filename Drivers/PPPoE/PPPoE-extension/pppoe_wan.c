@@ -139,6 +139,7 @@ int pppoe_wan_attach(void *rfc, struct ppp_link **link)
     struct pppoe_wan  	*wan;
     struct ppp_link  	*lk;
     u_short 		unit;
+    u_int16_t		payload;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
@@ -161,8 +162,10 @@ int pppoe_wan_attach(void *rfc, struct ppp_link **link)
     
     // it's time now to register our brand new link
     lk->lk_name 	= (u_char*)PPPOE_NAME;
-    lk->lk_mtu 		= PPPOE_MTU;
-    lk->lk_mru 		= PPPOE_MTU;;
+    // PPPOE_MTU, unless a larger PPP-Max-Payload was negotiated (RFC 4638)
+    pppoe_rfc_command(rfc, PPPOE_CMD_GETMAXPAYLOAD, &payload);
+    lk->lk_mtu 		= payload;
+    lk->lk_mru 		= payload;
     lk->lk_type 	= PPP_TYPE_PPPoE;
     lk->lk_hdrlen 	= 14; // ethernet header len
     //ld->lk_if.link_lk_baudrate = tp->t_ospeed;
@@ -86,6 +86,8 @@
 #define PPPOE_NKE	"PPPoE.kext"
 #define PPPOE_NKE_ID	"com.apple.nke.pppoe"
 
+#define PPPOE_MTU	1492			/* standard PPPoE payload */
+
 /* -----------------------------------------------------------------------------
  Forward declarations
 ----------------------------------------------------------------------------- */
@@ -102,6 +104,7 @@ void pppoe_link_down(void *arg, uintptr_t p);
 
 static int pppoe_dial();
 static int pppoe_listen();
+static void pppoe_set_payload();
 static void closeall();
 static u_long load_kext(char *kext, int byBundleID);
 
@@ -122,6 +125,7 @@ static char	*access_concentrator = NULL; 	/* access concentrator to connect to *
 static int	retrytimer = 0; 		/* retry timer (default is 3 seconds) */
 static int	connecttimer = 65; 		/* bump the connection timer from 20 to 65 seconds */
 static bool	linkdown = 0; 			/* flag set when we receive link down event */
+static int	maxpayload = 0; 		/* PPP-Max-Payload to negotiate (RFC 4638), 0 for none */
 
 extern int kill_link;
 
@@ -141,6 +145,8 @@ option_t pppoe_options[] = {
       "Connect timer for outgoing call (default 65 seconds)" },
     { "pppoeretrytimer", o_int, &retrytimer,
       "Retry timer for outgoing call (default 3 seconds)" },
+    { "pppoemaxpayload", o_int, &maxpayload,
+      "Negotiate a PPP payload larger than 1492 bytes, if the interface supports it (RFC 4638)" },
     { NULL }
 };
 
@@ -337,6 +343,14 @@ int pppoe_connect(int *errorcode)
         return errno;
     }
 
+    if (maxpayload) {
+        u_int16_t 	payload = maxpayload;
+        if (setsockopt(sockfd, PPPPROTO_PPPOE, PPPOE_OPT_MAX_PAYLOAD, &payload, 2)) {
+            error("PPPoE can't set PPP-Max-Payload...\n");
+            return errno;
+        }
+    }
+
     if (!strcmp(mode, MODE_ANSWER)) {
         // nothing to do
     }
@@ -358,9 +372,36 @@ int pppoe_connect(int *errorcode)
         return -1;
     }
     
+    pppoe_set_payload();
     return sockfd;
 }
 
+/* ----------------------------------------------------------------------------- 
+if a PPP-Max-Payload larger than the standard one was negotiated, 
+let LCP negotiate the corresponding MRU and MTU
+----------------------------------------------------------------------------- */
+void pppoe_set_payload()
+{
+    u_int16_t 	payload;
+    socklen_t	len = sizeof(payload);
+    
+    if (!maxpayload)
+        return;
+
+    if (getsockopt(sockfd, PPPPROTO_PPPOE, PPPOE_OPT_MAX_PAYLOAD, &payload, &len) == -1) {
+        warning("PPPoE cannot retrieve PPP-Max-Payload, %m");
+        return;
+    }
+    
+    if (payload <= PPPOE_MTU)
+        return;
+        
+    notice("PPPoE using PPP-Max-Payload %d\n", payload);
+    lcp_wantoptions[0].mru = payload;
+    lcp_wantoptions[0].neg_mru = 1;
+    lcp_allowoptions[0].mru = payload;
+}
+
 /* ----------------------------------------------------------------------------- 
 run the disconnector connector
 ----------------------------------------------------------------------------- */
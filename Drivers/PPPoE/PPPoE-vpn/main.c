@@ -88,6 +88,7 @@ static int 		listen_sockfd = -1;
 static char		device[17];
 static CFStringRef	service = NULL;
 static CFStringRef	access_concentrator = NULL;
+static u_int32_t	max_payload = 0;		/* PPP-Max-Payload to echo (RFC 4638), 0 for none */
 
 #define PPPOE_NKE	"PPPoE.kext"
 #define PPPOE_NKE_ID	"com.apple.nke.pppoe"
@@ -192,6 +193,10 @@ int pppoevpn_get_pppd_args(struct vpn_params *params, int reload)
 
         if ((access_concentrator = get_cfstr_option(params->serverRef, kRASEntPPPoE, kRASPropPPPoEAccessConcentratorName)))
             CFRetain(access_concentrator);
+
+        get_int_option(params->serverRef, kRASEntPPPoE, kRASPropPPPoEMaxPayload, &max_payload, 0);
+        if (max_payload)
+            addintparam(params->exec_args, &params->next_arg_index, "pppoemaxpayload", max_payload);
     }
 
     return 0;
@@ -310,6 +315,15 @@ int pppoevpn_listen(void)
         goto fail;
     }
 
+    // the PPP-Max-Payload is echoed to the clients asking for it, and inherited by the accepted sockets
+    if (max_payload) {
+        u_int16_t 	payload = max_payload;
+        if (setsockopt(listen_sockfd, PPPPROTO_PPPOE, PPPOE_OPT_MAX_PAYLOAD, &payload, 2)) {
+            vpnlog(LOG_ERR, "PPPoE plugin: Could not set PPP-Max-Payload %d - err = %s\n", max_payload, strerror(errno));
+            goto fail;
+        }
+    }
+
     if (access_concentrator || service) {
         bzero(&addr, sizeof(addr));
         addr.ppp.ppp_len = sizeof(struct sockaddr_pppoe);
@@ -92,6 +92,33 @@ struct ppp_mppe_state {
     int			debug;
     int			mru;
     struct compstat 	stats;
+    unsigned char	tmp[2048];	/* linear packet buffer, per state as
+					   compression can run on several threads */
+    /* MPPC (RFC 2118) */
+    int			mppc;		/* MPPC compression negotiated */
+    unsigned char	*hist;		/* history buffer, MPPC_HIST_LEN bytes */
+    u_int16_t		*hash;		/* compressor match table, MPPC_HASH_SIZE entries */
+    int			histptr;	/* current position in the history */
+};
+
+/*
+ * MPPC history and match table sizes
+ */
+#define MPPC_HIST_LEN		8192
+#define MPPC_HASH_SIZE		4096
+#define MPPC_HASH(p)		((((((u_int32_t)(p)[0]) << 16) | ((p)[1] << 8) | (p)[2]) * 2654435761U) >> 20)
+#define MPPC_MAX_MATCH		8191
+
+/*
+ * MPPC bit stream, most significant bit first
+ */
+struct mppc_bits {
+    unsigned char	*buf;
+    int			size;		/* buffer size in bytes */
+    int			pos;		/* bytes written, or bits read */
+    u_int32_t		acc;		/* pending bits (writer) */
+    int			nbits;		/* number of pending bits (writer) */
+    int			overflow;	/* writer went past the buffer */
 };
 
 #define MPPE_CCOUNT_FROM_PACKET(ibuf)	((((ibuf)[0] & 0x0f) << 8) + (ibuf)[1])
@@ -110,8 +137,12 @@ static int	mppe_decompress __P((void *, mbuf_t *));
 static void	mppe_comp_reset __P((void *));
 static void	mppe_comp_stats __P((void *, struct compstat *));
 
+static int	mppc_compress __P((struct ppp_mppe_state *, unsigned char *,
+					unsigned char *, int, int));
+static int	mppc_decompress __P((struct ppp_mppe_state *, unsigned char *,
+					int, int));
+
 static ppp_comp_ref 	ppp_mppe_ref;
-static u_char 		ppp_mppe_tmp[2048];
 
 /* -----------------------------------------------------------------------------
 register the compressor to ppp 
@@ -190,6 +221,12 @@ static void
 mppe_synchronize_key(struct ppp_mppe_state *state)
 {
 
+    if (state->keylen == 0) {
+	/* MPPC without encryption */
+	state->bits = MPPE_BIT_FLUSHED;
+	return;
+    }
+
     /* get new keys and flag our state as such */
     rc4_init(&(state->rc4_state), state->session_key, state->keylen);
 
@@ -202,6 +239,11 @@ static void
 mppe_initialize_key(struct ppp_mppe_state *state)
 {
 
+    if (state->keylen == 0) {
+	mppe_synchronize_key(state);
+	return;
+    }
+
     /* generate new session keys */
     GetNewKeyFromSHA(state->master_key, state->master_key, state->keylen, state->session_key);
 
@@ -319,6 +361,10 @@ mppe_comp_free(void *arg)
     struct ppp_mppe_state *state = (struct ppp_mppe_state *) arg;
 
     if (state) {
+	    if (state->hist)
+		FREE(state->hist, M_TEMP);
+	    if (state->hash)
+		FREE(state->hash, M_TEMP);
 	    FREE(state, M_TEMP);
     }
 }
@@ -373,14 +419,32 @@ mppe_comp_init(void *arg, unsigned char *options, int opt_len, int unit,
 	state->keylen = 8;
     else if (mppe_opts & MPPE_OPT_128)
 	state->keylen = 16;
+    else if (mppe_opts & MPPE_OPT_MPPC)
+	state->keylen = 0;
     else {
 	IOLog("mppe compress rejected, unknown key length\n");
 	return 0;
     }
 
+    state->mppc = (mppe_opts & MPPE_OPT_MPPC) ? 1 : 0;
+    if (state->mppc) {
+	if (state->hist == NULL)
+	    MALLOC(state->hist, unsigned char *, MPPC_HIST_LEN, M_TEMP, M_WAITOK);
+	if (state->hash == NULL)
+	    MALLOC(state->hash, u_int16_t *, MPPC_HASH_SIZE * sizeof(u_int16_t), M_TEMP, M_WAITOK);
+	if (state->hist == NULL || state->hash == NULL) {
+	    IOLog("mppc compress rejected, no memory for history\n");
+	    return 0;
+	}
+	bzero(state->hist, MPPC_HIST_LEN);
+	bzero(state->hash, MPPC_HASH_SIZE * sizeof(u_int16_t));
+	state->histptr = 0;
+    }
+
     state->ccount = 0;
     state->unit  = unit;
     state->debug = debug;
+    state->mru = mtu ? mtu : PPP_MRU;
     state->stateless = mppe_opts & MPPE_OPT_STATEFUL ? 0 : 1;
 
     mppe_initialize_key(state);
@@ -400,6 +464,8 @@ mppe_comp_reset(void *arg)
     (state->stats).ratio = 0;
 
     mppe_synchronize_key(state);
+    state->histptr = 0;
+    state->decomp_error = 0;
 }
 
 /* -----------------------------------------------------------------------------
@@ -416,7 +482,8 @@ mppe_update_count(struct ppp_mppe_state *state)
 	    } else {
 		(state->ccount)++;
 	    }
-	    mppe_change_key(state);
+	    if (state->keylen)
+		mppe_change_key(state);
         } else {
             state->ccount++;
         }
@@ -426,7 +493,10 @@ mppe_update_count(struct ppp_mppe_state *state)
         } else {
 	    (state->ccount)++;
 	}
-       	mppe_change_key(state);
+	if (state->keylen)
+	    mppe_change_key(state);
+	else
+	    state->bits |= MPPE_BIT_FLUSHED;
     }
 }
 
@@ -437,7 +507,7 @@ mppe_compress(void *arg, mbuf_t *m)
 {
     struct ppp_mppe_state 	*state = (struct ppp_mppe_state *) arg;
     mbuf_t			m1;
-    int 			isize, proto = ntohs(*(u_int16_t *)mbuf_data(*m));
+    int 			isize, osize = 0, proto = ntohs(*(u_int16_t *)mbuf_data(*m));
     u_char 			*p;
 
     /* Check that the protocol is in the range we handle. */
@@ -447,43 +517,58 @@ mppe_compress(void *arg, mbuf_t *m)
     for (m1 = *m, isize = 0; m1 ; m1 = mbuf_next(m1))
         isize += mbuf_len(m1);
 
-    if (mbuf_getpacket(MBUF_WAITOK, &m1) != 0) {
-	IOLog("mppe_compress: no mbuf available\n");
-        return COMP_NOTDONE;
-    }
-
     /* fist transform mbuf into linear data buffer */
-	if (isize > sizeof(ppp_mppe_tmp)) {
+	if (isize > sizeof(state->tmp)) {
 		IOLog("%s: packet too big\n",__FUNCTION__);
         return COMP_NOTDONE;
 	}
 
-    mbuf_copydata(*m, 0, isize, ppp_mppe_tmp);
+    if (mbuf_getpacket(MBUF_WAITOK, &m1) != 0) {
+	IOLog("mppe_compress: no mbuf available\n");
+        return COMP_NOTDONE;
+    }
+
+    mbuf_copydata(*m, 0, isize, state->tmp);
 
 #ifdef DEBUG
-    ppp_print_buffer("mppe_encrypt", ppp_mppe_tmp, isize);
+    ppp_print_buffer("mppe_encrypt", state->tmp, isize);
 #endif
     
     p = mbuf_data(m1);
+
+    /* compress first, MPPC decides on the flushed bit of this packet */
+    if (state->mppc)
+	osize = mppc_compress(state, state->tmp, p + 2, isize, mbuf_maxlen(m1) - 2);
+    if (osize == 0) {
+	bcopy(state->tmp, p + 2, isize);
+	osize = isize;
+    }
+
     p[0] = MPPE_CTRLHI(state);
     p[1] = MPPE_CTRLLO(state);
 
-    state->bits=MPPE_BIT_ENCRYPTED;
+    /* the peer reinitializes its RC4 tables on a flushed packet, do the same */
+    if (state->keylen && !state->stateless && (state->bits & MPPE_BIT_FLUSHED))
+	rc4_init(&(state->rc4_state), state->session_key, state->keylen);
+
+    state->bits = state->keylen ? MPPE_BIT_ENCRYPTED : 0;
     mppe_update_count(state);
 
-    /* read from rptr, write to wptr */
-    rc4_crypt(&(state->rc4_state), ppp_mppe_tmp, p + 2, isize);
+    /* encrypt in place */
+    if (state->keylen)
+	rc4_crypt(&(state->rc4_state), p + 2, p + 2, osize);
 
     mbuf_freem(*m);
-    mbuf_setlen(m1, isize + 2);
-    mbuf_pkthdr_setlen(m1, isize + 2);
+    mbuf_setlen(m1, osize + 2);
+    mbuf_pkthdr_setlen(m1, osize + 2);
     *m = m1;
     
-    (state->stats).comp_bytes += isize;
+    (state->stats).unc_bytes += isize;
+    (state->stats).comp_bytes += osize;
     (state->stats).comp_packets++;
 
 #ifdef DEBUG
-    ppp_print_buffer("mppe_encrypt out", p, isize + 2);
+    ppp_print_buffer("mppe_encrypt out", p, osize + 2);
 #endif
 
     return COMP_OK;
@@ -516,7 +601,8 @@ mppe_decompress(void *arg, mbuf_t *m)
 {
     struct ppp_mppe_state 	*state = (struct ppp_mppe_state *) arg;
     mbuf_t			m1;
-    int 			seq, isize;
+    int 			seq, isize, osize, bits;
+    u_char			*out;
 
     for (m1 = *m, isize = 0; m1 ; m1 = mbuf_next(m1))
         isize += mbuf_len(m1);
@@ -528,24 +614,25 @@ mppe_decompress(void *arg, mbuf_t *m)
 	}
 	return DECOMP_ERROR;
     }
-	if (isize > sizeof(ppp_mppe_tmp)) {
+	if (isize > sizeof(state->tmp)) {
 		IOLog("%s: packet too big\n",__FUNCTION__);
         return COMP_NOTDONE;
 	}
 		
     /* fist transform mbuf into linear data buffer */
-    mbuf_copydata(*m, 0, isize, ppp_mppe_tmp);
+    mbuf_copydata(*m, 0, isize, state->tmp);
 
     /* Check the sequence number. */
-    seq = MPPE_CCOUNT_FROM_PACKET(ppp_mppe_tmp);
+    seq = MPPE_CCOUNT_FROM_PACKET(state->tmp);
+    bits = MPPE_BITS(state->tmp);
 
-    if(!state->stateless && (MPPE_BITS(ppp_mppe_tmp) & MPPE_BIT_FLUSHED)) {
+    if(!state->stateless && (bits & MPPE_BIT_FLUSHED)) {
         state->decomp_error = 0;
         state->ccount = seq;
     }
 
     if(state->decomp_error) {
-        return DECOMP_ERROR;
+        return DECOMP_RESYNC;
     }
 
     if (seq != state->ccount) {
@@ -557,6 +644,12 @@ mppe_decompress(void *arg, mbuf_t *m)
         while(state->ccount != seq) {
             mppe_update_count(state);
 	}
+
+	/* MPPC history is lost, wait for the peer to flush it */
+	if (state->mppc && !state->stateless) {
+	    state->decomp_error = 1;
+	    return DECOMP_RESYNC;
+	}
     }
 
     /*
@@ -564,33 +657,58 @@ mppe_decompress(void *arg, mbuf_t *m)
      * However, the inner protocol field comes from the decompressed data.
      */
 
-    if(!(MPPE_BITS(ppp_mppe_tmp) & MPPE_BIT_ENCRYPTED)) {
-        IOLog("ERROR: not an encrypted packet");
+    if ((state->keylen != 0) != ((bits & MPPE_BIT_ENCRYPTED) != 0)) {
+        IOLog("ERROR: unexpected encryption bit");
         mppe_synchronize_key(state);
 	return DECOMP_ERROR;
-    } else {
-	if(!state->stateless && (MPPE_BITS(ppp_mppe_tmp) & MPPE_BIT_FLUSHED))
-	    mppe_synchronize_key(state);
-	mppe_update_count(state);
-
-        if (mbuf_getpacket(MBUF_WAITOK, &m1) != 0) {
-            IOLog("mppe_decompress: no mbuf available\n");
-            return DECOMP_ERROR;
-        }
-        
-	/* decrypt - adjust for MPPE_OVHD - mru should be OK */
-	rc4_crypt(&(state->rc4_state), ppp_mppe_tmp + 2, mbuf_data(m1), isize - 2);
+    } 
 
-        mbuf_freem(*m);
-        mbuf_setlen(m1, isize - 2);
-        mbuf_pkthdr_setlen(m1, isize - 2);
-        *m = m1;
+    if(state->keylen && !state->stateless && (bits & MPPE_BIT_FLUSHED))
+	mppe_synchronize_key(state);
+    mppe_update_count(state);
 
-	(state->stats).unc_bytes += (isize - 2);
-	(state->stats).unc_packets ++;
+    /* decrypt in place - adjust for MPPE_OVHD */
+    if (state->keylen)
+	rc4_crypt(&(state->rc4_state), state->tmp + 2, state->tmp + 2, isize - 2);
+
+    out = state->tmp + 2;
+    osize = isize - 2;
+    if (state->mppc) {
+	if (bits & (MPPC_BIT_RESET | MPPC_BIT_FLUSH))
+	    state->histptr = 0;
+	if (bits & MPPC_BIT_COMP) {
+	    osize = mppc_decompress(state, state->tmp + 2, isize - 2, state->mru);
+	    if (osize < 0) {
+		if (state->debug)
+		    IOLog("mppe_decompress%d: mppc decompression failed\n", state->unit);
+		state->decomp_error = !state->stateless;
+		return DECOMP_RESYNC;
+	    }
+	    out = state->hist + state->histptr - osize;
+	}
+    }
 
-	return DECOMP_OK;
+    if (mbuf_getpacket(MBUF_WAITOK, &m1) != 0) {
+	IOLog("mppe_decompress: no mbuf available\n");
+	return DECOMP_ERROR;
     }
+    if (osize > mbuf_maxlen(m1)) {
+	IOLog("mppe_decompress: packet too big (len=%d)\n", osize);
+	mbuf_freem(m1);
+	return DECOMP_ERROR;
+    }
+    bcopy(out, mbuf_data(m1), osize);
+
+    mbuf_freem(*m);
+    mbuf_setlen(m1, osize);
+    mbuf_pkthdr_setlen(m1, osize);
+    *m = m1;
+
+    (state->stats).comp_bytes += (isize - 2);
+    (state->stats).unc_bytes += osize;
+    (state->stats).unc_packets ++;
+
+    return DECOMP_OK;
 }
 
 /* -----------------------------------------------------------------------------
@@ -604,3 +722,239 @@ mppe_incomp(void *arg, mbuf_t m)
     (state->stats).inc_bytes += mbuf_pkthdr_len(m);
     (state->stats).inc_packets++;
 }
+
+/* -----------------------------------------------------------------------------
+MPPC bit stream writer
+----------------------------------------------------------------------------- */
+static __inline__ void
+mppc_putbits(struct mppc_bits *b, u_int32_t val, int n)
+{
+    b->acc = (b->acc << n) | val;
+    b->nbits += n;
+    while (b->nbits >= 8) {
+	b->nbits -= 8;
+	if (b->pos >= b->size) {
+	    b->overflow = 1;
+	    continue;
+	}
+	b->buf[b->pos++] = b->acc >> b->nbits;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+MPPC bit stream reader, n <= 24
+----------------------------------------------------------------------------- */
+static __inline__ u_int32_t
+mppc_peekbits(struct mppc_bits *b, int n)
+{
+    int		i, byte = b->pos >> 3;
+    u_int32_t	w = 0;
+
+    for (i = 0; i < 4; i++)
+	w = (w << 8) | (byte + i < b->size ? b->buf[byte + i] : 0);
+    return (w << (b->pos & 7)) >> (32 - n);
+}
+
+/* -----------------------------------------------------------------------------
+compress isize bytes from ibuf into obuf (RFC 2118)
+the data is appended to the history, and matches are searched in the 
+history through a hash of the next 3 bytes.
+return the compressed size and update the MPPC bits of the state, 
+or 0 if the packet must be sent uncompressed (history is then flushed)
+----------------------------------------------------------------------------- */
+static int
+mppc_compress(struct ppp_mppe_state *state, unsigned char *ibuf, 
+	unsigned char *obuf, int isize, int osize)
+{
+    unsigned char	*hist = state->hist;
+    struct mppc_bits	b;
+    int			start, end, cur, cand, off, len, k, h;
+
+    /* the peer resets its history on a flushed packet */
+    if (state->bits & MPPC_BIT_RESET)
+	state->histptr = 0;
+
+    /* no room left in the history, restart from the front */
+    if (state->histptr + isize > MPPC_HIST_LEN) {
+	state->histptr = 0;
+	state->bits |= MPPC_BIT_FLUSH;
+    }
+
+    start = cur = state->histptr;
+    end = start + isize;
+    bcopy(ibuf, hist + start, isize);
+
+    bzero(&b, sizeof(b));
+    b.buf = obuf;
+    b.size = MIN(osize, isize);
+
+    while (cur < end && !b.overflow) {
+
+	len = 0;
+	if (end - cur >= 3) {
+	    h = MPPC_HASH(hist + cur);
+	    cand = state->hash[h];
+	    state->hash[h] = cur;
+	    /* entries from a previous history generation fail the compare */
+	    if (cand < cur && hist[cand] == hist[cur]
+		&& hist[cand + 1] == hist[cur + 1] && hist[cand + 2] == hist[cur + 2]) {
+		len = 3;
+		while (cur + len < end && len < MPPC_MAX_MATCH && hist[cand + len] == hist[cur + len])
+		    len++;
+	    }
+	}
+
+	if (len == 0) {
+	    /* literal */
+	    if (hist[cur] < 0x80)
+		mppc_putbits(&b, hist[cur], 8);
+	    else
+		mppc_putbits(&b, 0x100 | (hist[cur] & 0x7F), 9);
+	    cur++;
+	    continue;
+	}
+
+	/* copy tuple, offset then length */
+	off = cur - cand;
+	if (off < 64)
+	    mppc_putbits(&b, 0x3C0 | off, 10);
+	else if (off < 320)
+	    mppc_putbits(&b, 0xE00 | (off - 64), 12);
+	else
+	    mppc_putbits(&b, 0xC000 | (off - 320), 16);
+
+	if (len == 3)
+	    mppc_putbits(&b, 0, 1);
+	else {
+	    for (k = 2; (len >> (k + 1)) != 0; k++)
+		;
+	    mppc_putbits(&b, ((((1 << k) - 2)) << k) | (len & ((1 << k) - 1)), 2 * k);
+	}
+
+	/* keep the match table up to date for the bytes we skip */
+	for (k = cur + 1; k < cur + len && end - k >= 3; k++)
+	    state->hash[MPPC_HASH(hist + k)] = k;
+	cur += len;
+    }
+
+    /* pad the last byte with zeros */
+    if (b.nbits)
+	mppc_putbits(&b, 0, 8 - b.nbits);
+
+    if (b.overflow || b.pos >= isize) {
+	/* packet expands, send it uncompressed and flush the history */
+	state->histptr = 0;
+	state->bits |= MPPC_BIT_RESET;
+	state->bits &= ~(MPPC_BIT_FLUSH | MPPC_BIT_COMP);
+	(state->stats).inc_bytes += isize;
+	(state->stats).inc_packets++;
+	return 0;
+    }
+
+    state->histptr = end;
+    state->bits |= MPPC_BIT_COMP;
+    return b.pos;
+}
+
+/* -----------------------------------------------------------------------------
+decompress isize bytes from ibuf into the history (RFC 2118)
+return the decompressed size, the data ends at the history pointer,
+or -1 if the packet is invalid
+----------------------------------------------------------------------------- */
+static int
+mppc_decompress(struct ppp_mppe_state *state, unsigned char *ibuf, int isize, int mru)
+{
+    unsigned char	*hist = state->hist;
+    struct mppc_bits	b;
+    int			start, cur, left, off, len, k;
+    u_int32_t		code;
+
+    bzero(&b, sizeof(b));
+    b.buf = ibuf;
+    b.size = isize;
+
+    start = cur = state->histptr;
+
+    /* the last byte may be padded with up to 7 zero bits */
+    while ((left = b.size * 8 - b.pos) >= 8) {
+
+	code = mppc_peekbits(&b, 2);
+	if (code < 2) {
+	    /* 0xxxxxxx : literal < 0x80 */
+	    len = 1;
+	    off = 0;
+	    code = mppc_peekbits(&b, 8);
+	    b.pos += 8;
+	}
+	else if (code == 2) {
+	    /* 10xxxxxxx : literal >= 0x80 */
+	    if (left < 9)
+		goto bad;
+	    len = 1;
+	    off = 0;
+	    code = 0x80 | (mppc_peekbits(&b, 9) & 0x7F);
+	    b.pos += 9;
+	}
+	else {
+	    /* copy tuple, offset first */
+	    code = mppc_peekbits(&b, 4);
+	    if (code == 0xF) {
+		if (left < 10)
+		    goto bad;
+		off = mppc_peekbits(&b, 10) & 0x3F;
+		b.pos += 10;
+	    }
+	    else if (code == 0xE) {
+		if (left < 12)
+		    goto bad;
+		off = (mppc_peekbits(&b, 12) & 0xFF) + 64;
+		b.pos += 12;
+	    }
+	    else {
+		if (left < 16)
+		    goto bad;
+		off = (mppc_peekbits(&b, 16) & 0x1FFF) + 320;
+		b.pos += 16;
+	    }
+
+	    /* then length, k ones and a zero followed by k+1 bits */
+	    for (k = 0; k < 12; k++) {
+		if (b.pos + k >= b.size * 8)
+		    goto bad;
+		if (mppc_peekbits(&b, 1 + k) != (1U << (k + 1)) - 1)
+		    break;
+	    }
+	    if (k == 12)
+		goto bad;
+	    b.pos += k + 1;
+	    if (k == 0)
+		len = 3;
+	    else {
+		if (b.size * 8 - b.pos < k + 1)
+		    goto bad;
+		len = (1 << (k + 1)) + mppc_peekbits(&b, k + 1);
+		b.pos += k + 1;
+	    }
+	    if (off == 0 || off > cur)
+		goto bad;
+	}
+
+	if (cur + len > MPPC_HIST_LEN || cur + len - start > mru + PPP_HDRLEN)
+	    goto bad;
+
+	if (off == 0)
+	    hist[cur++] = code;
+	else {
+	    /* byte per byte, source and destination may overlap */
+	    for (k = 0; k < len; k++, cur++)
+		hist[cur] = hist[cur - off];
+	}
+    }
+
+    state->histptr = cur;
+    return cur - start;
+
+bad:
+    state->histptr = cur;
+    return -1;
+}
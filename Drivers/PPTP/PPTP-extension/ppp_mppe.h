@@ -52,7 +52,7 @@ extern struct protent mppe_protent;
 
 #define MPPC_BIT_RESET	MPPE_BIT_A
 #define MPPC_BIT_FLUSH	MPPE_BIT_B
-#define MPPC_BIT_COMP	MPPC_BIT_C
+#define MPPC_BIT_COMP	MPPE_BIT_C
 
 #define MPPE_40_SALT0	0xD1
 #define MPPE_40_SALT1	0x26
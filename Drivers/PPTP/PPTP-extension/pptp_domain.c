@@ -54,6 +54,7 @@
 Definitions
 ----------------------------------------------------------------------------- */
 
+SYSCTL_NODE(_net_ppp, OID_AUTO, pptp, CTLFLAG_RW, 0, "");
 
 /* -----------------------------------------------------------------------------
 Forward declarations
@@ -135,6 +136,7 @@ int pptp_domain_init(int init_arg)
     
     pptp_wan_init();
     ppp_mppe_init();
+    sysctl_register_oid(&sysctl__net_ppp_pptp);
 
     pptp_domain_inited = 1;
 
@@ -176,6 +178,8 @@ int pptp_domain_terminate(int term_arg)
         goto end;
     }
 
+    sysctl_unregister_oid(&sysctl__net_ppp_pptp);
+
     pppdomain = pffinddomain(PF_PPP);
     if (!pppdomain) {
         // humm.. should not happen
@@ -38,6 +38,7 @@
 
 
 #include "../../../Family/ppp_domain.h"
+#include "../../../Family/if_ppplink.h"
 #include "pptp_rfc.h"
 #include "pptp_ip.h"
 
@@ -119,6 +120,7 @@ called from pppenet_proto when data need to be sent
 int pptp_ip_output(mbuf_t m, u_int32_t from, u_int32_t to)
 {
     struct ip 	*ip, ip_data;
+    u_int8_t	tos = 0;
 
 #if 0
     u_int8_t 	*d, i;
@@ -136,7 +138,8 @@ int pptp_ip_output(mbuf_t m, u_int32_t from, u_int32_t to)
         
     ip = &ip_data; 
     memcpy(ip, mbuf_data(m), sizeof(ip_data));
-    ip->ip_tos = 0;
+    ppp_link_gettos(m, &tos);	// inner DSCP, if propagation is enabled
+    ip->ip_tos = tos;
     ip->ip_off = 0;
     ip->ip_p = IPPROTO_GRE;
     ip->ip_len = mbuf_pkthdr_len(m);
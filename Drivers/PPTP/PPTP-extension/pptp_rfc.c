@@ -29,7 +29,11 @@
 #include <sys/malloc.h>
 #include <sys/syslog.h>
 #include <sys/domain.h>
+#include <sys/sysctl.h>
 #include <kern/locks.h>
+#include <kern/clock.h>
+#include <kern/thread_call.h>
+#include <libkern/OSAtomic.h>
 
 #include "../../../Family/if_ppplink.h"
 #include "../../../Family/ppp_domain.h"
@@ -51,6 +55,7 @@ Definitions
 #define PPTP_STATE_NEW_SEQUENCE	0x00000002	/* we have a seq number to acknowledge */
 #define PPTP_STATE_PEERSTARTED	0x00000004	/* peer has sent its first packet, initial peer_sequence is known */
 #define PPTP_STATE_FREEING		0x00000008	/* structure is scheduled to be freed a.s.a.p */
+#define PPTP_STATE_TIMER_ARMED	0x00000010	/* rfc is in the timer list */
 
 struct pptp_gre {
     u_int8_t 	flags;
@@ -83,6 +88,9 @@ struct pptp_rfc {
 
     // administrative info
     TAILQ_ENTRY(pptp_rfc) 	next;
+    TAILQ_ENTRY(pptp_rfc) 	hash_next;		/* link in the call hash table */
+    TAILQ_ENTRY(pptp_rfc) 	timer_next;		/* link in the timer list */
+    u_int64_t		timer_deadline;			/* earliest armed timer - absolute time */
     void 			*host; 			/* pointer back to the hosting structure */
     pptp_rfc_input_callback 	inputcb;		/* callback function when data are present */
     pptp_rfc_event_callback 	eventcb;		/* callback function for events */
@@ -97,8 +105,12 @@ struct pptp_rfc {
     u_int16_t		our_window;			/* our recv window */
     u_int16_t		peer_window;			/* peer's recv window */
     u_int16_t		send_window;			/* current send window */
-    u_int16_t		send_timeout;			/* send timeout */
-    u_int16_t		recv_timeout;			/* recv timeout */
+    u_int16_t		ssthresh;			/* send window growth switches from per ack to per round-trip */
+    u_int16_t		peer_unacked;			/* packets received since we last sent an ack */
+    u_int64_t		send_deadline;			/* sampled packet considered lost - 0 if not armed */
+    u_int64_t		recv_deadline;			/* give up on missing packets - 0 if not armed */
+    u_int64_t		ack_deadline;			/* send a delayed ack - 0 if not armed */
+    u_int64_t		free_deadline;			/* free the rfc - 0 if not armed */
     u_int32_t		our_last_seq;			/* last seq number we sent */
     u_int32_t		our_last_seq_acked;		/* last seq number acked */
     u_int32_t		peer_last_seq;			/* highest last seq number we received */
@@ -108,7 +120,7 @@ struct pptp_rfc {
 
     // Adaptative time-out calculation, see PPTP rfc for details
     u_int32_t		sample_seq;			/* sequence number being currently sampled */
-    u_int16_t		sample;				/* sample round trip time measured for the current packet */
+    u_int64_t		sample_start;			/* time the sampled packet was sent - 0 if no sample */
     u_int32_t		rtt;				/* calculated round-trip time (scaled) */
     int32_t		dev;				/* deviation time (scaled) */
     u_int32_t		ato;				/* adaptative timeout (scaled) */
@@ -117,21 +129,22 @@ struct pptp_rfc {
 
 };
 
-// Adaptative time-out constants
+// Adaptative time-out constants, times are in milliseconds
 #define SCALE_FACTOR 	8 			//  shift everything by 8 bits to keep precision
 #define ALPHA 		8 			//  1/8
 #define BETA 		4 			//  1/4
 #define CHI 		4			//
 #define DELTA 		2 			//  
-#define MIN_TIMEOUT	(2 << SCALE_FACTOR)	//  min timeout will be 1 second
-#define MAX_TIMEOUT	(128 << SCALE_FACTOR)	//  max timeout will be 64 seconds
+#define MIN_TIMEOUT	(100 << SCALE_FACTOR)	//  min timeout will be 100 milliseconds
+#define MAX_TIMEOUT	(64000 << SCALE_FACTOR)	//  max timeout will be 64 seconds
 
 
 #define ROUND32DIFF(a, b)  	((a >= b) ? (a - b) : (0xFFFFFFFF - b + a + 1))
 #define ABS(a) 			(a >= 0 ? a : -a)
 
-#define RECV_TIMEOUT_DEF	2	// 1 second
+#define RECV_TIMEOUT_DEF	100	// 100 milliseconds
 #define RECV_MAXLEN_DEF		3	// 3 packets max pending
+#define ACK_DELAY_DEF		20	// 20 milliseconds max before acking received packets
 
 /* -----------------------------------------------------------------------------
 Globals
@@ -140,19 +153,49 @@ Globals
 TAILQ_HEAD(, pptp_rfc) 	pptp_rfc_head;
 extern lck_mtx_t	*ppp_domain_mutex;
 
+/* calls are also hashed on the (peer address, call id) pair,
+   so that GRE demultiplexing doesn't depend on the number of calls */
+#define PPTP_RFC_MAX_HASH 1024	/* power of 2 */
+#define PPTP_RFC_HASH(address, call_id)	\
+	((((u_int32_t)(address) * 0x9E3779B1U) ^ (u_int32_t)(call_id)) & (PPTP_RFC_MAX_HASH - 1))
+static TAILQ_HEAD(, pptp_rfc) pptp_rfc_hash[PPTP_RFC_MAX_HASH];
+static u_int32_t	pptp_rfc_unmatched = 0;
+
+/* high resolution timer, shared by all rfc with a pending deadline */
+static thread_call_t	pptp_rfc_timer_call = 0;
+static u_int64_t		pptp_rfc_timer_next = 0;		/* deadline the timer call is set for */
+static volatile SInt32	pptp_rfc_timer_running = 0;
+static TAILQ_HEAD(, pptp_rfc) pptp_rfc_timer_list;
+
+SYSCTL_DECL(_net_ppp_pptp);
+SYSCTL_INT(_net_ppp_pptp, OID_AUTO, unmatched_packets, CTLTYPE_INT|CTLFLAG_RD|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &pptp_rfc_unmatched, 0, "GRE packets not matching any PPTP call");
+
 /* -----------------------------------------------------------------------------
 Forward declarations
 ----------------------------------------------------------------------------- */
-
+static void pptp_rfc_rehash(struct pptp_rfc *rfc, u_int32_t peer_address, u_int16_t call_id);
+static void pptp_rfc_timer(thread_call_param_t param0, thread_call_param_t param1);
+static void pptp_rfc_timer_update(struct pptp_rfc *rfc);
+static void pptp_rfc_delayed_ack(struct pptp_rfc *rfc);
 
 /* -----------------------------------------------------------------------------
 intialize pptp protocol
 ----------------------------------------------------------------------------- */
 u_int16_t pptp_rfc_init()
 {
+    int i;
+
+    pptp_rfc_timer_call = thread_call_allocate(pptp_rfc_timer, 0);
+    if (pptp_rfc_timer_call == 0)
+        return 1;
+    TAILQ_INIT(&pptp_rfc_timer_list);
 
     pptp_ip_init();
     TAILQ_INIT(&pptp_rfc_head);
+    for (i = 0; i < PPTP_RFC_MAX_HASH; i++)
+        TAILQ_INIT(&pptp_rfc_hash[i]);
+    sysctl_register_oid(&sysctl__net_ppp_pptp_unmatched_packets);
     return 0;
 }
 
@@ -164,8 +207,19 @@ u_int16_t pptp_rfc_dispose()
 
     if (TAILQ_FIRST(&pptp_rfc_head))
         return 1;
+
+    /* the timer may have fired and be waiting for the domain lock */
+    thread_call_cancel(pptp_rfc_timer_call);
+    if (pptp_rfc_timer_running)
+        return 1;
+
     if (pptp_ip_dispose())
         return 1;
+    sysctl_unregister_oid(&sysctl__net_ppp_pptp_unmatched_packets);
+
+    thread_call_free(pptp_rfc_timer_call);
+    pptp_rfc_timer_call = 0;
+    pptp_rfc_timer_next = 0;
     return 0;
 }
 
@@ -198,9 +252,10 @@ u_int16_t pptp_rfc_new_client(void *host, void **data,
     // let's use some default values
     rfc->peer_window = 64;
     rfc->send_window = 32;
+    rfc->ssthresh = rfc->peer_window;
     rfc->peer_ppd = 0;
     rfc->maxtimeout = MAX_TIMEOUT; 
-    rfc->sample = 0;
+    rfc->sample_start = 0;
     rfc->dev = 0;
     rfc->rtt = rfc->peer_ppd;
     rfc->ato = MIN_TIMEOUT;
@@ -210,10 +265,22 @@ u_int16_t pptp_rfc_new_client(void *host, void **data,
     *data = rfc;
 
     TAILQ_INSERT_TAIL(&pptp_rfc_head, rfc, next);
+    TAILQ_INSERT_TAIL(&pptp_rfc_hash[PPTP_RFC_HASH(rfc->peer_address, rfc->call_id)], rfc, hash_next);
 
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+move a call to the hash bucket of its new (peer address, call id) pair
+----------------------------------------------------------------------------- */
+static void pptp_rfc_rehash(struct pptp_rfc *rfc, u_int32_t peer_address, u_int16_t call_id)
+{
+    TAILQ_REMOVE(&pptp_rfc_hash[PPTP_RFC_HASH(rfc->peer_address, rfc->call_id)], rfc, hash_next);
+    rfc->peer_address = peer_address;
+    rfc->call_id = call_id;
+    TAILQ_INSERT_TAIL(&pptp_rfc_hash[PPTP_RFC_HASH(rfc->peer_address, rfc->call_id)], rfc, hash_next);
+}
+
 /* -----------------------------------------------------------------------------
 dispose of a pptp structure
 ----------------------------------------------------------------------------- */
@@ -236,12 +303,151 @@ void pptp_rfc_free_client(void *data)
 			mbuf_freem(recv_elem->packet);
 			_FREE(recv_elem, M_TEMP);
 		}
+		clock_get_uptime(&rfc->free_deadline); // free it a.s.a.p
+		pptp_rfc_timer_update(rfc);
 	}
 }
 
 /* -----------------------------------------------------------------------------
-main body of function used to be pptp_rfc_fasttimer... called by protocol family when fast timer expired:
-now it's called when slow timer expired because of <rdar://problem/7617885> 
+free the structure now, called by the timer once the rfc is scheduled to be freed
+----------------------------------------------------------------------------- */
+static void pptp_rfc_free_now(struct pptp_rfc *rfc)
+{
+    rfc->send_deadline = 0;
+    rfc->recv_deadline = 0;
+    rfc->ack_deadline = 0;
+    rfc->free_deadline = 0;
+    pptp_rfc_timer_update(rfc);
+
+    TAILQ_REMOVE(&pptp_rfc_head, rfc, next);
+    TAILQ_REMOVE(&pptp_rfc_hash[PPTP_RFC_HASH(rfc->peer_address, rfc->call_id)], rfc, hash_next);
+    _FREE(rfc, M_TEMP);
+}
+
+/* -----------------------------------------------------------------------------
+recompute the rfc deadline from its individual timers, and update the timer list
+must be called after any change of an individual deadline
+----------------------------------------------------------------------------- */
+static void pptp_rfc_timer_update(struct pptp_rfc *rfc)
+{
+    u_int64_t	deadline = 0;
+	
+#define PPTP_EARLIEST(d)	if ((d) && (deadline == 0 || (d) < deadline)) deadline = (d)
+    PPTP_EARLIEST(rfc->send_deadline);
+    PPTP_EARLIEST(rfc->recv_deadline);
+    PPTP_EARLIEST(rfc->ack_deadline);
+    PPTP_EARLIEST(rfc->free_deadline);
+#undef PPTP_EARLIEST
+
+    if (rfc->state & PPTP_STATE_TIMER_ARMED) {
+        TAILQ_REMOVE(&pptp_rfc_timer_list, rfc, timer_next);
+        rfc->state &= ~PPTP_STATE_TIMER_ARMED;
+    }
+
+    rfc->timer_deadline = deadline;
+    if (deadline == 0)
+        return;
+
+    TAILQ_INSERT_TAIL(&pptp_rfc_timer_list, rfc, timer_next);
+    rfc->state |= PPTP_STATE_TIMER_ARMED;
+
+    /* the timer call is only moved forward here, pptp_rfc_timer sets it to the next deadline */
+    if (pptp_rfc_timer_next == 0 || deadline < pptp_rfc_timer_next) {
+        pptp_rfc_timer_next = deadline;
+        thread_call_enter_delayed(pptp_rfc_timer_call, deadline);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+arm the reordering timer, missing packets are given up on when it expires
+----------------------------------------------------------------------------- */
+static void pptp_rfc_arm_recv(struct pptp_rfc *rfc)
+{
+    clock_interval_to_deadline(RECV_TIMEOUT_DEF, kMillisecondScale, &rfc->recv_deadline);
+    pptp_rfc_timer_update(rfc);
+}
+
+/* -----------------------------------------------------------------------------
+we have a new sequence number to acknowledge
+ack right away once half of our receive window is waiting for an ack, 
+so that the peer never stalls on its send window, otherwise ack a bit later
+to give a chance to piggy-back the ack on outgoing data
+----------------------------------------------------------------------------- */
+static void pptp_rfc_ack_later(struct pptp_rfc *rfc)
+{
+    rfc->state |= PPTP_STATE_NEW_SEQUENCE;
+    if (++rfc->peer_unacked >= MAX(rfc->our_window / 2, 1)) {
+        pptp_rfc_delayed_ack(rfc);
+        return;
+    }
+    if (rfc->ack_deadline == 0) {
+        clock_interval_to_deadline(ACK_DELAY_DEF, kMillisecondScale, &rfc->ack_deadline);
+        pptp_rfc_timer_update(rfc);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+the peer's last sequence number has been acknowledged, by an ack packet or by data
+----------------------------------------------------------------------------- */
+static void pptp_rfc_ack_sent(struct pptp_rfc *rfc)
+{
+    rfc->state &= ~PPTP_STATE_NEW_SEQUENCE;
+    rfc->peer_unacked = 0;
+    if (rfc->ack_deadline) {
+        rfc->ack_deadline = 0;
+        pptp_rfc_timer_update(rfc);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+the sampled packet has been acknowledged, update the adaptative timeout
+----------------------------------------------------------------------------- */
+static void pptp_rfc_rtt_update(struct pptp_rfc *rfc)
+{
+    u_int64_t	now, nsec;
+    u_int32_t	elapsed;
+    int32_t 	diff;
+
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - rfc->sample_start, &nsec);
+    elapsed = MIN(nsec / 1000000, rfc->maxtimeout >> SCALE_FACTOR);
+
+    diff = (elapsed << SCALE_FACTOR) - rfc->rtt;
+    rfc->dev += (ABS(diff) - rfc->dev) / BETA;
+    rfc->rtt += diff / ALPHA;
+    rfc->ato = MAX(MIN_TIMEOUT, MIN(rfc->rtt + (CHI * rfc->dev), rfc->maxtimeout));
+    rfc->sample_start = 0;
+    rfc->send_deadline = 0;
+    pptp_rfc_timer_update(rfc);
+}
+
+/* -----------------------------------------------------------------------------
+the sampled packet was not acknowledged within the adaptative timeout
+consider it lost, back off and let the upper layer send again
+----------------------------------------------------------------------------- */
+static void pptp_rfc_send_timeout(struct pptp_rfc *rfc)
+{
+    //IOLog("pptp_rfc_send_timeout, send timer expires for packet = %d\n", rfc->sample_seq);
+    rfc->rtt = MIN(DELTA * rfc->rtt, rfc->maxtimeout);
+    rfc->ato = MAX(MIN_TIMEOUT, MIN(rfc->rtt + (CHI * rfc->dev), rfc->maxtimeout));
+
+    rfc->send_window = (rfc->send_window / 2) + (rfc->send_window % 2);
+    rfc->ssthresh = rfc->send_window;
+    rfc->sample_start = 0;
+    rfc->our_last_seq_acked = rfc->sample_seq;
+    //IOLog("pptp_rfc_send_timeout, new ato = %d, new send window = %d\n", rfc->ato, rfc->send_window);
+    
+    if (rfc->state & PPTP_STATE_XMIT_FULL) {
+        //IOLog("pptp_rfc_send_timeout PPTP_EVT_XMIT_OK\n");
+        rfc->state &= ~PPTP_STATE_XMIT_FULL;
+        if (rfc->eventcb) 
+            (*rfc->eventcb)(rfc->host, PPTP_EVT_XMIT_OK, 0);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+send an ack packet without data, called when the delayed ack timer expires
+or when enough received packets are waiting for an ack
 ----------------------------------------------------------------------------- */
 static void pptp_rfc_delayed_ack(struct pptp_rfc *rfc)
 {
@@ -270,7 +476,7 @@ static void pptp_rfc_delayed_ack(struct pptp_rfc *rfc)
         p->call_id = htons(rfc->peer_call_id);
         /* XXX use seq_num in the structure to put the ack */
         p->seq_num = htonl(rfc->peer_last_seq);
-        rfc->state &= ~PPTP_STATE_NEW_SEQUENCE;
+        pptp_rfc_ack_sent(rfc);
 	memcpy(mbuf_data(m), p, sizeof(p_data));
 
         //IOLog("pptp_rfc_delayed_ack, output delayed ACK = %d\n", rfc->peer_last_seq);
@@ -294,7 +500,6 @@ void pptp_rfc_input_recv_queue(struct pptp_rfc *rfc)
 		(*rfc->eventcb)(rfc->host, PPTP_EVT_INPUTERROR, 0);
 
 	rfc->peer_last_seq = elem->seqno - 1;
-	rfc->state |= PPTP_STATE_NEW_SEQUENCE; /* to send ack later */
 
 	do {
 
@@ -307,61 +512,64 @@ void pptp_rfc_input_recv_queue(struct pptp_rfc *rfc)
 
 		} 
 		else {
-			rfc->recv_timeout = RECV_TIMEOUT_DEF;
+			pptp_rfc_arm_recv(rfc);
 			break;
 		}
 	} while ((elem = TAILQ_FIRST(&rfc->recv_queue)));
+
+	pptp_rfc_ack_later(rfc);
 }
 
 /* -----------------------------------------------------------------------------
-called by protocol family when fast timer expires
+called by the high resolution timer, run the expired timers of each rfc
 ----------------------------------------------------------------------------- */
-void pptp_rfc_slowtimer()
+static void pptp_rfc_timer(thread_call_param_t param0, thread_call_param_t param1)
 {
-    struct pptp_rfc  	*rfc;
+    struct pptp_rfc  	*rfc, *rfc1;
+    u_int64_t			now, next = 0;
 
-	rfc = TAILQ_FIRST(&pptp_rfc_head);
-	while (rfc) {
-
-		if (rfc->state & PPTP_STATE_FREEING) {
-			struct pptp_rfc  	*next_rfc = TAILQ_NEXT(rfc, next);
-			TAILQ_REMOVE(&pptp_rfc_head, rfc, next);
-			_FREE(rfc, M_TEMP);
-			rfc = next_rfc;
-			continue;
-		}
+	OSIncrementAtomic(&pptp_rfc_timer_running);
+	lck_mtx_lock(ppp_domain_mutex);
 
-		pptp_rfc_delayed_ack(rfc);
-
-        if (rfc->send_timeout && (--rfc->send_timeout == 0)) {
-                
-            //IOLog("pptp_rfc_slowtimer, send timer expires for packet = %d\n", rfc->sample_seq);
-            rfc->rtt = DELTA * rfc->rtt;
-            rfc->ato = MAX(MIN_TIMEOUT, MIN(rfc->rtt + (CHI * rfc->dev), rfc->maxtimeout));
+	pptp_rfc_timer_next = 0;
+	clock_get_uptime(&now);
 
-            rfc->send_window = (rfc->send_window / 2) + (rfc->send_window % 2);
-            rfc->sample = 0;
-            rfc->our_last_seq_acked = rfc->sample_seq;
-            //IOLog("pptp_rfc_slowtimer, new ato = %d, new send window = %d\n", rfc->ato, rfc->send_window);
-            
-            if (rfc->state & PPTP_STATE_XMIT_FULL) {
-                //IOLog("pptp_rfc_slowtimer PPTP_EVT_XMIT_OK\n");
-                rfc->state &= ~PPTP_STATE_XMIT_FULL;
-                if (rfc->eventcb) 
-                    (*rfc->eventcb)(rfc->host, PPTP_EVT_XMIT_OK, 0);
-            }
-        }
-        
-        if (rfc->recv_timeout && (--rfc->recv_timeout == 0)) {
-		
-			pptp_rfc_input_recv_queue(rfc);
+	rfc = TAILQ_FIRST(&pptp_rfc_timer_list);
+	while (rfc) {
+		rfc1 = TAILQ_NEXT(rfc, timer_next);
+		if (rfc->timer_deadline <= now) {
+			if (rfc->free_deadline && rfc->free_deadline <= now) {
+				pptp_rfc_free_now(rfc);
+				rfc = rfc1;
+				continue;
+			}
+			if (rfc->send_deadline && rfc->send_deadline <= now) {
+				rfc->send_deadline = 0;
+				pptp_rfc_send_timeout(rfc);
+			}
+			if (rfc->recv_deadline && rfc->recv_deadline <= now) {
+				rfc->recv_deadline = 0;
+				pptp_rfc_input_recv_queue(rfc);
+			}
+			if (rfc->ack_deadline && rfc->ack_deadline <= now) {
+				rfc->ack_deadline = 0;
+				pptp_rfc_delayed_ack(rfc);
+			}
+			pptp_rfc_timer_update(rfc);
 		}
-		
-        if (rfc->sample)
-            rfc->sample++;
+		rfc = rfc1;
+	}
 
-		rfc = TAILQ_NEXT(rfc, next);
-    }
+	TAILQ_FOREACH(rfc, &pptp_rfc_timer_list, timer_next)
+		if (next == 0 || rfc->timer_deadline < next)
+			next = rfc->timer_deadline;
+	if (next && next != pptp_rfc_timer_next) {
+		pptp_rfc_timer_next = next;
+		thread_call_enter_delayed(pptp_rfc_timer_call, next);
+	}
+
+	lck_mtx_unlock(ppp_domain_mutex);
+	OSDecrementAtomic(&pptp_rfc_timer_running);
 }
 
 /* -----------------------------------------------------------------------------
@@ -421,7 +629,7 @@ u_int16_t pptp_rfc_output(void *data, mbuf_t m)
     p.seq_num = htonl(rfc->our_last_seq);
     p.flags_vers |= PPTP_GRE_FLAGS_A; // always include ack
     p.ack_num = htonl(rfc->peer_last_seq);
-    rfc->state &= ~PPTP_STATE_NEW_SEQUENCE;
+    pptp_rfc_ack_sent(rfc);
     memcpy(d, &p, sizeof(struct pptp_gre));     // Wcast-align fix - memcpy for unaligned access
 
     if (ROUND32DIFF(rfc->our_last_seq, rfc->our_last_seq_acked) >= rfc->send_window) {
@@ -431,10 +639,11 @@ u_int16_t pptp_rfc_output(void *data, mbuf_t m)
             (*rfc->eventcb)(rfc->host, PPTP_EVT_XMIT_FULL, 0);
     }    
     
-    if (rfc->sample == 0) {
-        rfc->sample = 1;
+    if (rfc->sample_start == 0) {
+        clock_get_uptime(&rfc->sample_start);
         rfc->sample_seq = rfc->our_last_seq;
-        rfc->send_timeout = rfc->ato >> SCALE_FACTOR;
+        clock_interval_to_deadline(rfc->ato >> SCALE_FACTOR, kMillisecondScale, &rfc->send_deadline);
+        pptp_rfc_timer_update(rfc);
         //IOLog("pptp_rfc_output, will sample packet = %d, timeout = %d\n", rfc->our_last_seq, rfc->ato);
     }
     //IOLog("pptp_rfc_output, SEND packet = %d\n", rfc->our_last_seq);
@@ -483,12 +692,13 @@ u_int16_t pptp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
                 IOLog("PPTP command (%p): set peer window = 0x%x\n", rfc, *(u_int16_t *)cmddata);
             rfc->peer_window = *(u_int16_t *)cmddata;
             rfc->send_window = (rfc->peer_window / 2) + (rfc->peer_window % 2);
+            rfc->ssthresh = rfc->peer_window;
             break;
 
         case PPTP_CMD_SETCALLID:
             if (rfc->flags & PPTP_FLAG_DEBUG)
                 IOLog("PPTP command (%p): set call id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
-            rfc->call_id = *(u_int16_t *)cmddata;
+            pptp_rfc_rehash(rfc, rfc->peer_address, *(u_int16_t *)cmddata);
             break;
 
         case PPTP_CMD_SETPEERCALLID:
@@ -504,7 +714,7 @@ u_int16_t pptp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
                 u_char *p = cmddata;
                 IOLog("PPTP command (%p): set peer IP address = %d.%d.%d.%d\n", rfc, p[0], p[1], p[2], p[3]);
             }
-            rfc->peer_address = *(u_int32_t *)cmddata;
+            pptp_rfc_rehash(rfc, *(u_int32_t *)cmddata, rfc->call_id);
             break;
 
         case PPTP_CMD_SETOURADDR:	
@@ -519,7 +729,7 @@ u_int16_t pptp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
             if (rfc->flags & PPTP_FLAG_DEBUG)
                 IOLog("PPTP command (%p): set peer PPD = 0x%x\n", rfc, *(u_int16_t *)cmddata);
             rfc->peer_ppd = *(u_int16_t *)cmddata;
-            rfc->rtt = rfc->peer_ppd;
+            rfc->rtt = MIN(rfc->peer_ppd * 100, MAX_TIMEOUT >> SCALE_FACTOR);	// ppd is in 1/10 seconds
             rfc->rtt <<= SCALE_FACTOR;
             rfc->ato = MAX(MIN_TIMEOUT, MIN(rfc->rtt + (CHI * rfc->dev), rfc->maxtimeout));
             break;
@@ -527,7 +737,7 @@ u_int16_t pptp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
         case PPTP_CMD_SETMAXTIMEOUT:
             if (rfc->flags & PPTP_FLAG_DEBUG)
                 IOLog("PPTP command (%p): set max timeout = %d seconds\n", rfc, *(u_int16_t *)cmddata);
-            rfc->maxtimeout = *(u_int16_t *)cmddata * 2;	// convert the timer in slow timeout ticks
+            rfc->maxtimeout = MIN(*(u_int16_t *)cmddata * 1000, MAX_TIMEOUT >> SCALE_FACTOR);	// convert the timer in milliseconds
             rfc->maxtimeout <<= SCALE_FACTOR;
             rfc->ato = MIN(rfc->ato, rfc->maxtimeout);
             break;
@@ -546,8 +756,7 @@ u_int16_t handle_data(struct pptp_rfc *rfc, mbuf_t m, u_int32_t from)
 {
     struct pptp_gre 	*p, p_data;
     u_int16_t 		size;
-    u_int32_t		ack;
-    int32_t 		diff;
+    u_int32_t		ack, window;
 	int				qlen;
 	struct pptp_elem 	*elem, *new_elem;
 
@@ -556,15 +765,6 @@ u_int16_t handle_data(struct pptp_rfc *rfc, mbuf_t m, u_int32_t from)
 
     //IOLog("handle_data, rfc = %p, from 0x%x, known peer address = 0x%x, our callid = 0x%x, target callid = 0x%x\n", rfc, from, rfc->peer_address, rfc->call_id, ntohs(p->call_id));    
     
-    // check identify the session, we must check the session id AND the address of the peer
-    // we could be connected to 2 different AC with the same session id
-    // or to 1 AC with 2 session id
-    if (!((rfc->call_id == ntohs(p->call_id))
-        && (rfc->peer_address == from))) {
-		// the packet was not for us
-		return 0;
-	}
-
 	size = 8;
 	if (p->flags_vers & PPTP_GRE_FLAGS_A) {	// handle window
 
@@ -575,16 +775,17 @@ u_int16_t handle_data(struct pptp_rfc *rfc, mbuf_t m, u_int32_t from)
 		if (SEQ_GT(ack, rfc->our_last_seq_acked)
 			&& SEQ_LEQ(ack, rfc->our_last_seq)) {
 
-			if (rfc->sample && SEQ_GEQ(ack, rfc->sample_seq)) {
-							
-				diff = (rfc->sample << SCALE_FACTOR) - rfc->rtt;
-				rfc->dev += (ABS(diff) - rfc->dev) / BETA;
-				rfc->rtt += diff / ALPHA;
-				rfc->ato = MAX(MIN_TIMEOUT, MIN(rfc->rtt + (CHI * rfc->dev), rfc->maxtimeout));
-				rfc->send_window = MIN(rfc->send_window + 1, rfc->peer_window);
-				rfc->sample = 0;
-				rfc->send_timeout = 0;
+			// open the send window by the number of packets acked until ssthresh,
+			// then by one packet per measured round-trip
+			window = rfc->send_window;
+			if (window < rfc->ssthresh)
+				window += ack - rfc->our_last_seq_acked;
+			if (rfc->sample_start && SEQ_GEQ(ack, rfc->sample_seq)) {
+				pptp_rfc_rtt_update(rfc);
+				if (window >= rfc->ssthresh)
+					window++;
 			}
+			rfc->send_window = MIN(window, rfc->peer_window);
 
 			rfc->our_last_seq_acked = ack;
 			if (rfc->state & PPTP_STATE_XMIT_FULL) {
@@ -640,18 +841,17 @@ u_int16_t handle_data(struct pptp_rfc *rfc, mbuf_t m, u_int32_t from)
 			otherwise, arm the timer if not already armed */
 		if (qlen >= RECV_MAXLEN_DEF) 
 			pptp_rfc_input_recv_queue(rfc);
-		else if (rfc->recv_timeout == 0)
-			rfc->recv_timeout = RECV_TIMEOUT_DEF;
+		else if (rfc->recv_deadline == 0)
+			pptp_rfc_arm_recv(rfc);
 
 
 	} else if (SEQ_LT(ntohl(p->seq_num), rfc->peer_last_seq + 1)) {
-		rfc->state |= PPTP_STATE_NEW_SEQUENCE;		/* its a dup thats already been ack'd - drop it and ack */
+		pptp_rfc_ack_later(rfc);		/* its a dup thats already been ack'd - drop it and ack */
 		goto dropit;					
 		
 	} else {
 		/* packet we are waiting for */
 		rfc->peer_last_seq = ntohl(p->seq_num);
-		rfc->state |= PPTP_STATE_NEW_SEQUENCE;
 		mbuf_adj(m, size);
 		
 		(*rfc->inputcb)(rfc->host, m); // packet is passed up to the host	
@@ -667,10 +867,12 @@ u_int16_t handle_data(struct pptp_rfc *rfc, mbuf_t m, u_int32_t from)
 				_FREE(elem, M_TEMP);
 
 			} else {
-				rfc->recv_timeout = RECV_TIMEOUT_DEF;
+				pptp_rfc_arm_recv(rfc);
 				break;
 			}
 		}
+		
+		pptp_rfc_ack_later(rfc);
 	}
 		
 	// let's say the packet have been treated
@@ -687,15 +889,28 @@ called from pptp_ip when pptp data are present
 int pptp_rfc_lower_input(mbuf_t m, u_int32_t from)
 {
     struct pptp_rfc  	*rfc;
+    struct pptp_gre 	p;
+    u_int16_t			call_id;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
     
     //IOLog("PPTP inputdata\n");
-    
-    TAILQ_FOREACH(rfc, &pptp_rfc_head, next)
-        if (handle_data(rfc, m, from))
-            return 1;
+
+    if (mbuf_len(m) < 8) {
+        pptp_rfc_unmatched++;
+        return 0;
+    }
+    memcpy(&p, mbuf_data(m), 8);
+    call_id = ntohs(p.call_id);
+
+    // identify the session, we must check the call id AND the address of the peer
+    // we could be connected to 2 different AC with the same call id
+    // or to 1 AC with 2 call id
+    TAILQ_FOREACH(rfc, &pptp_rfc_hash[PPTP_RFC_HASH(from, call_id)], hash_next)
+        if (rfc->call_id == call_id && rfc->peer_address == from)
+            return handle_data(rfc, m, from);
             
     // nobody was interested in the packet, just ignore it
+    pptp_rfc_unmatched++;
     return 0;
 }
@@ -79,6 +79,7 @@
 #define SC_COMP_RUN	0x00001000	/* compressor has been inited */
 #define SC_DECOMP_RUN	0x00002000	/* decompressor has been inited */
 #define SC_MP_XSHORTSEQ	0x00004000	/* transmit short MP seq numbers */
+#define SC_QOS_PROPAGATE	0x00008000	/* copy inner IP DSCP to the link/tunnel header */
 #define SC_DEBUG	0x00010000	/* enable debug messages */
 #define SC_LOOP_LOCAL	0x01000000      /* loopback packet to local address */
 #define	SC_SYNC		0x00200000	/* synchronous serial mode */
@@ -91,7 +92,7 @@
 #define SC_LOG_OUTPKT	0x00040000	/* log contents of pkts sent */
 #endif
 
-#define	SC_MASK		0x0f200fff	/* bits that user can change */
+#define	SC_MASK		0x0f208fff	/* bits that user can change */
 
 /* state bits */
 #define SC_XMIT_BUSY	0x10000000	/* link is busy transmitting, don't attempt to send */
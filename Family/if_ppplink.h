@@ -111,6 +111,10 @@ int ppp_link_event(struct ppp_link *link, u_int32_t event, void *data);
 
 void ppp_link_logmbuf(struct ppp_link *link, char *msg, mbuf_t m);
 
+/* DSCP of the inner IP packet, present when SC_QOS_PROPAGATE is set on the interface,
+   links copy or map it to their own header. returns ENOENT if the packet is not marked */
+int ppp_link_gettos(mbuf_t m, u_int8_t *tos);
+
 #endif /* KERNEL */
 
 #endif /* _IF_PPP_LINK_H_ */
@@ -103,8 +103,10 @@ int ppp_module_start(struct kmod_info *ki, void *data)
 	
     /* now init the if and link structures */
     ppp_if_init();
-    ppp_link_init();
-    ppp_comp_init();
+    ret = ppp_link_init();
+    LOGRETURN(ret, KERN_FAILURE, "ppp_module_start: ppp_link_init error = 0x%x\n");
+    ret = ppp_comp_init();
+    LOGRETURN(ret, KERN_FAILURE, "ppp_module_start: ppp_comp_init error = 0x%x\n");
 
     /* init ip protocol */
     ppp_ip_init(0);
@@ -82,7 +82,10 @@
 #include <net/netisr.h>
 #endif
 #include <sys/syslog.h>
+#include <sys/sysctl.h>
 #include <netinet/in.h>
+#include <kern/locks.h>
+#include <kern/thread.h>
 
 
 #include "ppp_defs.h"		// public ppp values
@@ -92,6 +95,7 @@
 #include "ppp_if.h"
 #include "ppp_domain.h"
 #include "ppp_comp.h"
+#include "ppp_link.h"
 
 /* -----------------------------------------------------------------------------
 Definitions
@@ -143,23 +147,103 @@ struct ppp_comp {
 };
 
 
+/*
+ * Compression worker threads.
+ * (De)compressor state is per direction and per interface, and must be run
+ * strictly in sequence for a given interface. Interfaces are hashed by unit
+ * on a worker, so that independent sessions are (de)compressed in parallel
+ * while the packet order within a session is preserved.
+ * The compressor state is protected by the interface mutex, the queues by 
+ * the worker mutex. Completion is done under the ppp domain mutex.
+ */
+struct ppp_comp_thread {
+	thread_t		thread;
+	int				wakeup;
+	int				terminate;			/* 1 = requested, 2 = acknowledged */
+	TAILQ_HEAD(, ppp_if) runq;			/* interfaces with packets to process */
+	struct ppp_if	*busy;				/* interface being processed, NULL if cancelled */
+	int				running;			/* worker is using the (de)compressor state */
+	lck_mtx_t		*mtx;
+};
+
+#define PPP_COMP_MAX_THREADS	16
+#define PPP_COMP_DEF_QUEUE_SIZE	256
+
 /* -----------------------------------------------------------------------------
 Forward declarations
 ----------------------------------------------------------------------------- */
 
 struct ppp_comp *ppp_comp_find(u_int32_t proto);
+static int ppp_comp_run(struct ppp_if *wan, mbuf_t *m, int transmit);
+static void ppp_comp_decomp_error(struct ppp_if *wan, int err);
+static int ppp_comp_init_threads(int nb_threads);
+static void ppp_comp_dispose_threads();
+static void ppp_comp_thread_func(struct ppp_comp_thread *thread);
+static void ppp_comp_flush(struct ppp_comp_thread *thread, struct ppp_if *wan);
+static void ppp_comp_ccp_packet(struct ppp_if *wan, u_char *p, int len, int rcvd);
+static u_int16_t ppp_comp_getproto(mbuf_t m, int transmit);
+static int sysctl_comp_nb_threads SYSCTL_HANDLER_ARGS;
+kern_return_t thread_terminate(register thread_act_t act);
 
 /* -----------------------------------------------------------------------------
 Globals
 ----------------------------------------------------------------------------- */
 static TAILQ_HEAD(, ppp_comp) 	ppp_comp_head;
 
+extern lck_mtx_t				*ppp_domain_mutex;
+
+static struct ppp_comp_thread	*ppp_comp_threads = 0;
+static int						ppp_comp_nb_threads = 0;
+static int						ppp_comp_queue_size = PPP_COMP_DEF_QUEUE_SIZE;
+static int						ppp_comp_threads_changing = 0;
+
+static lck_grp_attr_t			*ppp_comp_lck_grp_attr = 0;
+static lck_attr_t				*ppp_comp_lck_attr = 0;
+static lck_grp_t				*ppp_comp_lck_grp = 0;
+
+SYSCTL_PROC(_net_ppp, OID_AUTO, comp_nb_threads, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &ppp_comp_nb_threads, 0, sysctl_comp_nb_threads, "I", "Number of ppp compression threads 0 - 16");
+SYSCTL_INT(_net_ppp, OID_AUTO, comp_queue_size, CTLTYPE_INT|CTLFLAG_RW|CTLFLAG_NOAUTO|CTLFLAG_KERN,
+    &ppp_comp_queue_size, 0, "Compression queue size for each ppp interface and direction");
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 int ppp_comp_init()
 {
     TAILQ_INIT(&ppp_comp_head);
+
+	ppp_comp_lck_grp_attr = lck_grp_attr_alloc_init();
+	LOGNULLFAIL(ppp_comp_lck_grp_attr, "ppp_comp_init: lck_grp_attr_alloc_init failed\n");
+
+	lck_grp_attr_setdefault(ppp_comp_lck_grp_attr);
+
+	ppp_comp_lck_grp = lck_grp_alloc_init("PPP comp", ppp_comp_lck_grp_attr);
+	LOGNULLFAIL(ppp_comp_lck_grp, "ppp_comp_init: lck_grp_alloc_init failed\n");
+
+	ppp_comp_lck_attr = lck_attr_alloc_init();
+	LOGNULLFAIL(ppp_comp_lck_attr, "ppp_comp_init: lck_attr_alloc_init failed\n");
+
+	lck_attr_setdefault(ppp_comp_lck_attr);
+
+    sysctl_register_oid(&sysctl__net_ppp_comp_nb_threads);
+    sysctl_register_oid(&sysctl__net_ppp_comp_queue_size);
+
     return 0;
+
+fail:
+	if (ppp_comp_lck_grp) {
+		lck_grp_free(ppp_comp_lck_grp);
+		ppp_comp_lck_grp = 0;
+	}
+	if (ppp_comp_lck_grp_attr) {
+		lck_grp_attr_free(ppp_comp_lck_grp_attr);
+		ppp_comp_lck_grp_attr = 0;
+	}
+	if (ppp_comp_lck_attr) {
+		lck_attr_free(ppp_comp_lck_attr);
+		ppp_comp_lck_attr = 0;
+	}
+	return KERN_FAILURE;
 }
 
 /* -----------------------------------------------------------------------------
@@ -168,6 +252,25 @@ int ppp_comp_dispose()
 {
     struct ppp_comp  	*comp;
 
+    sysctl_unregister_oid(&sysctl__net_ppp_comp_nb_threads);
+    sysctl_unregister_oid(&sysctl__net_ppp_comp_queue_size);
+
+	// no more interfaces at this point, the workers are idle
+	ppp_comp_dispose_threads();
+
+	if (ppp_comp_lck_grp) {
+		lck_grp_free(ppp_comp_lck_grp);
+		ppp_comp_lck_grp = 0;
+	}
+	if (ppp_comp_lck_grp_attr) {
+		lck_grp_attr_free(ppp_comp_lck_grp_attr);
+		ppp_comp_lck_grp_attr = 0;
+	}
+	if (ppp_comp_lck_attr) {
+		lck_attr_free(ppp_comp_lck_attr);
+		ppp_comp_lck_attr = 0;
+	}
+
     while ((comp = TAILQ_FIRST(&ppp_comp_head))) {
         TAILQ_REMOVE(&ppp_comp_head, comp, next);
     	FREE(comp, M_TEMP);
@@ -301,6 +404,7 @@ int ppp_comp_setcompressor(struct ppp_if *wan, struct ppp_option_data *odp)
         return EINVAL;	/* no handler found */
     }
 
+    lck_mtx_lock(wan->mtx);
     if (transmit) {
         if (wan->xc_state)
             (*wan->xcomp->comp_free)(wan->xc_state);
@@ -323,6 +427,7 @@ int ppp_comp_setcompressor(struct ppp_if *wan, struct ppp_option_data *odp)
         }
         wan->sc_flags &= ~SC_DECOMP_RUN;
     }
+    lck_mtx_unlock(wan->mtx);
     
     return error;
 }
@@ -334,10 +439,12 @@ void ppp_comp_getstats(struct ppp_if *wan, struct ppp_comp_stats *stats)
 {
 
     bzero(stats, sizeof(struct ppp_comp_stats));
+    lck_mtx_lock(wan->mtx);
     if (wan->xc_state)
         (*wan->xcomp->comp_stat)(wan->xc_state, &stats->c);
     if (wan->rc_state)
         (*wan->rcomp->decomp_stat)(wan->rc_state, &stats->d);
+    lck_mtx_unlock(wan->mtx);
 }
 
 /* -----------------------------------------------------------------------------
@@ -347,16 +454,25 @@ mbuf points to the ccp payload (doesn't include FF03 and 80FD)
 ----------------------------------------------------------------------------- */
 void ppp_comp_ccp(struct ppp_if *wan, mbuf_t m, int rcvd)
 {
-    u_char 	*p = mbuf_data(m);	// no alignment issue as p is *u_char.
+    // no alignment issue as p is *u_char.
+    ppp_comp_ccp_packet(wan, mbuf_data(m), mbuf_pkthdr_len(m), rcvd);
+}
+
+/* -----------------------------------------------------------------------------
+p points to the ccp payload, len is the length available
+----------------------------------------------------------------------------- */
+static void ppp_comp_ccp_packet(struct ppp_if *wan, u_char *p, int len, int rcvd)
+{
     int 	slen;
     
     slen = CCP_LENGTH(p);
-    if (slen > mbuf_pkthdr_len(m)) {
+    if (slen > len) {
         LOGDBG(wan->net, ("ppp_comp_ccp: not enough data in mbuf (expected = %d, got = %d)\n",
-		   slen, mbuf_pkthdr_len(m)));
+		   slen, len));
 	return;
     }
     
+    lck_mtx_lock(wan->mtx);
     switch (CCP_CODE(p)) {
     case CCP_CONFREQ:
     case CCP_TERMREQ:
@@ -404,6 +520,7 @@ void ppp_comp_ccp(struct ppp_if *wan, mbuf_t m, int rcvd)
 	}
 	break;
     }
+    lck_mtx_unlock(wan->mtx);
 }
 
 /* -----------------------------------------------------------------------------
@@ -412,7 +529,15 @@ CCP is down; free (de)compressor state if necessary.
 void ppp_comp_close(struct ppp_if *wan)
 {
 
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
     wan->sc_flags &= ~(SC_CCP_OPEN | SC_CCP_UP | SC_COMP_RUN | SC_DECOMP_RUN);
+
+    // drop the packets still waiting for a worker thread
+    if (ppp_comp_nb_threads)
+        ppp_comp_flush(&ppp_comp_threads[wan->unit % ppp_comp_nb_threads], wan);
+
+    lck_mtx_lock(wan->mtx);
     if (wan->xc_state) {
 	(*wan->xcomp->comp_free)(wan->xc_state);
 	wan->xc_state = NULL;
@@ -421,6 +546,7 @@ void ppp_comp_close(struct ppp_if *wan)
 	(*wan->rcomp->decomp_free)(wan->rc_state);
 	wan->rc_state = NULL;
     }
+    lck_mtx_unlock(wan->mtx);
 }
 
 /* -----------------------------------------------------------------------------
@@ -476,10 +602,10 @@ return codes :
 ----------------------------------------------------------------------------- */
 int ppp_comp_compress(struct ppp_if *wan, mbuf_t *m)
 {    
-    if (wan->xc_state == 0 || (wan->sc_flags & SC_CCP_UP) == 0)
+    if ((wan->sc_flags & SC_CCP_UP) == 0)
         return COMP_NOTDONE;
     
-    return wan->xcomp->compress(wan->xc_state, m);
+    return ppp_comp_run(wan, m, 1);
 }
 
 /* -----------------------------------------------------------------------------
@@ -487,11 +613,14 @@ int ppp_comp_compress(struct ppp_if *wan, mbuf_t *m)
 int ppp_comp_incompress(struct ppp_if *wan, mbuf_t m)
 {
     
-    if ((wan->rc_state == 0) || (wan->sc_flags & (SC_DC_ERROR | SC_DC_FERROR)))
+    if (wan->sc_flags & (SC_DC_ERROR | SC_DC_FERROR))
         return 0;
         
     /* Uncompressed frame - pass to decompressor so it can update its dictionary if necessary. */
-    wan->rcomp->incomp(wan->rc_state, m);
+    lck_mtx_lock(wan->mtx);
+    if (wan->rc_state)
+        wan->rcomp->incomp(wan->rc_state, m);
+    lck_mtx_unlock(wan->mtx);
 
     return 0;
 }
@@ -502,16 +631,408 @@ int ppp_comp_decompress(struct ppp_if *wan, mbuf_t *m)
 {
     int err;
     
-    if ((wan->rc_state == 0) || (wan->sc_flags & (SC_DC_ERROR | SC_DC_FERROR)))
+    if (wan->sc_flags & (SC_DC_ERROR | SC_DC_FERROR))
         return DECOMP_ERROR;
             
-    err = wan->rcomp->decompress(wan->rc_state, m);
-    if (err != DECOMP_OK) {
-        if (err == DECOMP_FATALERROR)
-            wan->sc_flags |= SC_DC_FERROR;
+    err = ppp_comp_run(wan, m, 0);
+    if (err != DECOMP_OK)
+        ppp_comp_decomp_error(wan, err);
+
+    return err;	
+}
+
+/* -----------------------------------------------------------------------------
+run the (de)compressor on a packet, called inline or from a worker thread
+the ppp domain mutex may or may not be held
+----------------------------------------------------------------------------- */
+static int ppp_comp_run(struct ppp_if *wan, mbuf_t *m, int transmit)
+{
+    int 		err, marked;
+    u_int8_t	tos;
+
+    lck_mtx_lock(wan->mtx);
+    if (transmit) {
+        /* the compressor builds a new packet, carry the inner type of service over */
+        marked = (ppp_link_gettos(*m, &tos) == 0);
+        err = wan->xc_state ? wan->xcomp->compress(wan->xc_state, m) : COMP_NOTDONE;
+        if (err == COMP_OK && marked)
+            ppp_link_settos(*m, tos);
+    }
+    else
+        err = wan->rc_state ? wan->rcomp->decompress(wan->rc_state, m) : DECOMP_ERROR;
+    lck_mtx_unlock(wan->mtx);
+
+    return err;
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void ppp_comp_decomp_error(struct ppp_if *wan, int err)
+{
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (err == DECOMP_FATALERROR)
+        wan->sc_flags |= SC_DC_FERROR;
+    /*
+     * a decompressor returning DECOMP_RESYNC (MPPC) keeps running and 
+     * resynchronizes by itself on the next flushed packet.
+     */
+    if (err != DECOMP_RESYNC)
         wan->sc_flags |= SC_DC_ERROR;
-        ppp_if_error(wan->net);
+    ppp_if_error(wan->net);
+}
+
+/* -----------------------------------------------------------------------------
+return the protocol of a queued packet
+a packet to transmit starts with the protocol, a received packet has it in 
+its header, possibly compressed to a single byte
+----------------------------------------------------------------------------- */
+static u_int16_t ppp_comp_getproto(mbuf_t m, int transmit)
+{
+    u_char	*p = transmit ? mbuf_data(m) : mbuf_pkthdr_header(m);
+
+    if (!transmit && (p[0] & 0x1))  // lowest bit set for lowest byte of protocol
+        return p[0];
+    return (p[0] << 8) + p[1];
+}
+
+/* -----------------------------------------------------------------------------
+queue a packet for a worker thread
+return 0 if the packet has been consumed, 
+EOPNOTSUPP if there is no worker thread and the packet must be processed inline
+----------------------------------------------------------------------------- */
+int ppp_comp_dispatch(struct ppp_if *wan, mbuf_t m, int transmit)
+{
+    struct ppp_comp_thread	*thread;
+    struct pppqueue			*q = transmit ? &wan->compq : &wan->decompq;
+	struct ifnet_stat_increment_param statsinc;
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    // nothing must be queued once ppp_if_detach has flushed the interface
+    if (!ppp_comp_nb_threads || (wan->state & PPP_IF_STATE_CLOSING))
+        return EOPNOTSUPP;
+
+    thread = &ppp_comp_threads[wan->unit % ppp_comp_nb_threads];
+
+    lck_mtx_lock(thread->mtx);
+    if (q->len >= ppp_comp_queue_size) {
+        ppp_drop(q);
+        lck_mtx_unlock(thread->mtx);
+        mbuf_freem(m);
+        bzero(&statsinc, sizeof(statsinc));
+        if (transmit)
+            statsinc.errors_out = 1;
+        else
+            statsinc.errors_in = 1;
+        ifnet_stat_increment(wan->net, &statsinc);
+        return 0;
     }
+    ppp_enqueue(q, m);
+    if (!wan->comp_queued) {
+        TAILQ_INSERT_TAIL(&thread->runq, wan, comp_next);
+        wan->comp_queued = 1;
+        wakeup(&thread->wakeup);
+    }
+    lck_mtx_unlock(thread->mtx);
 
-    return err;	
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+return 1 if received packets are waiting for a worker thread, or being processed
+----------------------------------------------------------------------------- */
+int ppp_comp_pending(struct ppp_if *wan)
+{
+    struct ppp_comp_thread	*thread;
+    int						pending;
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (!ppp_comp_nb_threads)
+        return 0;
+
+    thread = &ppp_comp_threads[wan->unit % ppp_comp_nb_threads];
+
+    lck_mtx_lock(thread->mtx);
+    pending = (wan->decompq.len || thread->busy == wan);
+    lck_mtx_unlock(thread->mtx);
+
+    return pending;
+}
+
+/* -----------------------------------------------------------------------------
+remove an interface from a worker thread 
+drop the pending packets and wait until the worker stops using the interface
+called with the ppp domain mutex held
+----------------------------------------------------------------------------- */
+static void ppp_comp_flush(struct ppp_comp_thread *thread, struct ppp_if *wan)
+{
+    mbuf_t	m;
+
+    lck_mtx_lock(thread->mtx);
+    if (wan->comp_queued) {
+        TAILQ_REMOVE(&thread->runq, wan, comp_next);
+        wan->comp_queued = 0;
+    }
+    while ((m = ppp_dequeue(&wan->compq)))
+        mbuf_freem(m);
+    while ((m = ppp_dequeue(&wan->decompq)))
+        mbuf_freem(m);
+    if (thread->busy == wan) {
+        // the worker will drop its packet instead of completing it
+        thread->busy = NULL;
+        while (thread->running)
+            msleep(&thread->running, thread->mtx, PZERO + 1, "ppp_comp_flush", 0);
+    }
+    lck_mtx_unlock(thread->mtx);
+}
+
+/* -----------------------------------------------------------------------------
+worker thread
+take packets from the interfaces in the run queue, round robin,
+(de)compress them without the ppp domain mutex, and complete the send or
+input processing with the ppp domain mutex
+----------------------------------------------------------------------------- */
+static void ppp_comp_thread_func(struct ppp_comp_thread *thread)
+{
+    struct ppp_if	*wan;
+    mbuf_t			m;
+    int				transmit, err;
+    u_int16_t		proto;
+
+    for (;;) {
+
+        lck_mtx_lock(thread->mtx);
+dequeue:
+        wan = TAILQ_FIRST(&thread->runq);
+        if (wan == NULL) {
+            if (thread->terminate) {
+                thread->terminate = 2;
+                wakeup(&thread->terminate);
+                // just sleep again. caller will terminate the thread.
+                msleep(&thread->thread, thread->mtx, PZERO + 1, "ppp_comp_thread_func terminate", 0);
+                /* NOT REACHED */
+            }
+            msleep(&thread->wakeup, thread->mtx, PZERO + 1, "ppp_comp_thread_func", 0);
+            goto dequeue;
+        }
+
+        transmit = 1;
+        m = ppp_dequeue(&wan->compq);
+        if (m == NULL) {
+            transmit = 0;
+            m = ppp_dequeue(&wan->decompq);
+        }
+        TAILQ_REMOVE(&thread->runq, wan, comp_next);
+        if (wan->compq.len || wan->decompq.len)
+            TAILQ_INSERT_TAIL(&thread->runq, wan, comp_next);
+        else
+            wan->comp_queued = 0;
+        if (m == NULL)
+            goto dequeue;
+
+        thread->busy = wan;
+        thread->running = 1;
+        lck_mtx_unlock(thread->mtx);
+
+        // ccp packets and received uncompressed frames are handled at completion, 
+        // before the next packet is run
+        proto = ppp_comp_getproto(m, transmit);
+        if (proto == PPP_CCP)
+            err = transmit ? COMP_NOTDONE : DECOMP_OK;
+        else if (!transmit && proto != PPP_COMP)
+            err = DECOMP_OK;
+        else
+            err = ppp_comp_run(wan, &m, transmit);
+
+        lck_mtx_lock(thread->mtx);
+        thread->running = 0;
+        wakeup(&thread->running);
+        lck_mtx_unlock(thread->mtx);
+
+        lck_mtx_lock(ppp_domain_mutex);
+        lck_mtx_lock(thread->mtx);
+        wan = thread->busy;
+        thread->busy = NULL;
+        lck_mtx_unlock(thread->mtx);
+
+        if (wan == NULL) {
+            // interface went away while we were working on it
+            mbuf_freem(m);
+        }
+        else if (wan->state & PPP_IF_STATE_CLOSING) {
+            // interface is being detached, drop everything still queued for it
+            mbuf_freem(m);
+            ppp_comp_flush(thread, wan);
+        }
+        else if (proto == PPP_CCP) {
+            if (transmit) {
+                ppp_comp_ccp_packet(wan, (u_char *)mbuf_data(m) + 2, mbuf_pkthdr_len(m) - 2, 0);
+                ppp_if_send_compressed(wan->net, m, COMP_NOTDONE);
+            }
+            else
+                ppp_if_input_incomp(wan->net, m, PPP_CCP);
+        }
+        else if (!transmit && proto != PPP_COMP)
+            ppp_if_input_incomp(wan->net, m, proto);
+        else if (!(wan->sc_flags & (transmit ? SC_COMP_RUN : SC_DECOMP_RUN))) {
+            // ccp went down while the packet was (de)compressed, the state it was run with is gone
+            mbuf_freem(m);
+        }
+        else if (transmit)
+            ppp_if_send_compressed(wan->net, m, err);
+        else {
+            if (err != DECOMP_OK)
+                ppp_comp_decomp_error(wan, err);
+            ppp_if_input_decompressed(wan->net, m, err);
+        }
+        lck_mtx_unlock(ppp_domain_mutex);
+    }
+
+    /* NOTREACHED */
+}
+
+/* -----------------------------------------------------------------------------
+sysctl to change the number of threads
+----------------------------------------------------------------------------- */
+static int sysctl_comp_nb_threads SYSCTL_HANDLER_ARGS
+{
+	int error, s;
+
+	s = *(int *)oidp->oid_arg1;
+
+	error = sysctl_handle_int(oidp, &s, 0, req);
+	if (error || !req->newptr)
+		return error;
+
+	lck_mtx_lock(ppp_domain_mutex);
+	if (ppp_comp_threads_changing) {
+		lck_mtx_unlock(ppp_domain_mutex);
+		return EBUSY;
+	}
+	ppp_comp_threads_changing = 1;
+	error = ppp_comp_init_threads(s);
+	ppp_comp_threads_changing = 0;
+	lck_mtx_unlock(ppp_domain_mutex);
+	
+	return error;
+}
+
+/* -----------------------------------------------------------------------------
+initialize the worker threads
+called with the ppp domain mutex held
+----------------------------------------------------------------------------- */
+static int ppp_comp_init_threads(int nb_threads)
+{
+    struct ppp_comp_thread	*threads;
+    int						i;
+	errno_t					err = ENOMEM;
+
+	if (nb_threads < 0) 
+		nb_threads = 0;
+	else 
+		if (nb_threads > PPP_COMP_MAX_THREADS) 
+			nb_threads = PPP_COMP_MAX_THREADS;
+
+	if (ppp_comp_nb_threads == nb_threads)
+		return 0;
+	
+	IOLog("ppp_comp_init_threads: changing # of threads from %d to %d\n", ppp_comp_nb_threads, nb_threads);
+
+	ppp_comp_dispose_threads();
+
+	if (nb_threads == 0)
+		return 0;
+
+	threads = (struct ppp_comp_thread *)_MALLOC(sizeof(struct ppp_comp_thread) * nb_threads, M_TEMP, M_WAITOK);
+	if (!threads) 
+		return ENOMEM;
+	
+	bzero(threads, sizeof(struct ppp_comp_thread) * nb_threads);
+	ppp_comp_threads = threads;
+		
+	for (i = 0; i < nb_threads; i++) {
+
+		TAILQ_INIT(&threads[i].runq);
+
+		threads[i].mtx = lck_mtx_alloc_init(ppp_comp_lck_grp, ppp_comp_lck_attr);
+		LOGNULLFAIL(threads[i].mtx, "ppp_comp_init_threads: can't alloc mutex\n");
+
+		// Start up working thread
+		err = kernel_thread_start((thread_continue_t)ppp_comp_thread_func, &threads[i], &threads[i].thread);
+		LOGGOTOFAIL(err, "ppp_comp_init_threads: kernel_thread_start failed, error %d\n");
+		
+		ppp_comp_nb_threads++;
+	}
+	
+    return 0;
+	
+fail:
+	
+	if (threads[i].mtx) {
+		lck_mtx_free(threads[i].mtx, ppp_comp_lck_grp);
+		threads[i].mtx = 0;
+	}
+	
+	ppp_comp_dispose_threads();
+	return err;
+}
+
+/* -----------------------------------------------------------------------------
+dispose threads
+called with the ppp domain mutex held
+----------------------------------------------------------------------------- */
+static void ppp_comp_dispose_threads()
+{
+    struct ppp_comp_thread	*threads = ppp_comp_threads;
+    struct ppp_if			*wan;
+    int						i, nb_threads = ppp_comp_nb_threads;
+
+	if (!threads)
+		return;
+
+	// from now on, packets are (de)compressed inline
+	ppp_comp_nb_threads = 0;
+	ppp_comp_threads = 0;
+
+	for (i = 0; i < nb_threads; i++) {
+		lck_mtx_lock(threads[i].mtx);
+		while ((wan = TAILQ_FIRST(&threads[i].runq))) {
+			lck_mtx_unlock(threads[i].mtx);
+			ppp_comp_flush(&threads[i], wan);
+			lck_mtx_lock(threads[i].mtx);
+		}
+		if (threads[i].busy) {
+			lck_mtx_unlock(threads[i].mtx);
+			ppp_comp_flush(&threads[i], threads[i].busy);
+			lck_mtx_lock(threads[i].mtx);
+		}
+		threads[i].terminate = 1;
+		wakeup(&threads[i].wakeup);
+		lck_mtx_unlock(threads[i].mtx);
+	}
+
+	// a worker may be waiting for the domain mutex to drop its last packet
+	lck_mtx_unlock(ppp_domain_mutex);
+
+	for (i = 0; i < nb_threads; i++) {
+
+		if (threads[i].thread) {
+			
+			lck_mtx_lock(threads[i].mtx);
+			while (threads[i].terminate != 2)
+				msleep(&threads[i].terminate, threads[i].mtx, PZERO + 1, "ppp_comp_dispose_threads", 0);
+			lck_mtx_unlock(threads[i].mtx);
+			
+			thread_terminate(threads[i].thread);
+			thread_deallocate(threads[i].thread);
+
+			lck_mtx_free(threads[i].mtx, ppp_comp_lck_grp);
+		}
+	}
+	
+	_FREE(threads, M_TEMP);
+
+	lck_mtx_lock(ppp_domain_mutex);
 }
@@ -117,6 +117,7 @@ struct ppp_comp_reg {
 #define DECOMP_OK		0	/* everything went OK */
 #define DECOMP_ERROR		1	/* error detected before decomp. */
 #define DECOMP_FATALERROR	2	/* error detected after decomp. */
+#define DECOMP_RESYNC		3	/* error, decompressor waits for a flushed packet */
 
 #define COMP_OK			0	/* everything went OK, packet is compressed */
 #define COMP_NOTDONE		1	/* packet has not been compressed */
@@ -195,11 +196,11 @@ struct ppp_comp_reg {
 #define MPPE_OPT_40             0x01    /* 40 bit */
 #define MPPE_OPT_128            0x02    /* 128 bit */
 #define MPPE_OPT_STATEFUL       0x04    /* stateful mode */
+#define MPPE_OPT_MPPC           0x10    /* MPPC compression (RFC 2118) */
 /* unsupported opts */
 #define MPPE_OPT_56             0x08    /* 56 bit */
-#define MPPE_OPT_MPPC           0x10    /* MPPC compression */
 #define MPPE_OPT_D              0x20    /* Unknown */
-#define MPPE_OPT_UNSUPPORTED (MPPE_OPT_56|MPPE_OPT_MPPC|MPPE_OPT_D)
+#define MPPE_OPT_UNSUPPORTED (MPPE_OPT_56|MPPE_OPT_D)
 #define MPPE_OPT_UNKNOWN        0x40    /* Bits !defined in RFC 3078 were set */
 
 /*
@@ -232,13 +233,15 @@ struct ppp_comp_reg {
         *ptr++ = 0;                             \
         *ptr++ = 0;                             \
                                                 \
-        /* S,L bits */                          \
+        /* S,L,C bits */                        \
         *ptr = 0;                               \
         if (opts & MPPE_OPT_128)                \
             *ptr |= MPPE_S_BIT;                 \
         if (opts & MPPE_OPT_40)                 \
             *ptr |= MPPE_L_BIT;                 \
-        /* M,D,C bits not supported */          \
+        if (opts & MPPE_OPT_MPPC)               \
+            *ptr |= MPPE_C_BIT;                 \
+        /* M,D bits not supported */            \
     } while (/* CONSTCOND */ 0)
 
 /* The reverse of the above */
@@ -37,6 +37,8 @@ void ppp_comp_close(struct ppp_if *wan);
 int ppp_comp_compress(struct ppp_if *wan, mbuf_t *m);
 int ppp_comp_incompress(struct ppp_if *wan, mbuf_t m);
 int ppp_comp_decompress(struct ppp_if *wan, mbuf_t *m);
+int ppp_comp_dispatch(struct ppp_if *wan, mbuf_t m, int transmit);
+int ppp_comp_pending(struct ppp_if *wan);
 
 
 #endif
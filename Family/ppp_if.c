@@ -58,6 +58,7 @@ Includes
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <netinet/in_systm.h>
+#include <netinet/ip.h>
 #include <net/bpf.h>
 #include <net/kpi_interface.h>
 #include <net/if.h>
@@ -102,8 +103,10 @@ static errno_t  ppp_if_frameout(ifnet_t ifp, mbuf_t *m0,
 #endif /* !KPI_INTERFACE_EMBEDDED */
 
 static int 	ppp_if_detach(ifnet_t ifp);
+static int	ppp_if_input_proto(ifnet_t ifp, mbuf_t m, u_int16_t proto);
 static struct ppp_if *ppp_if_findunit(u_short unit);
 static int ppp_if_set_bpf_tap(ifnet_t ifp, bpf_tap_mode mode, bpf_packet_func func);
+static void ppp_if_qos_mark(mbuf_t m, u_int16_t proto);
 
 /* -----------------------------------------------------------------------------
 Globals
@@ -314,6 +317,8 @@ int ppp_if_detach(ifnet_t ifp)
         link->lk_ifnet = 0;
     }
 
+    // the interface is going away, stop queueing packets for the compression threads
+    wan->state |= PPP_IF_STATE_CLOSING;
     ppp_comp_close(wan);
 
     // detach protocols when detaching interface, just in case pppd forgot... 
@@ -332,7 +337,7 @@ int ppp_if_detach(ifnet_t ifp)
 	lck_mtx_unlock(ppp_domain_mutex);
     ret = ifnet_detach(ifp);
 	if (ret) {
-		wan->state &= ~PPP_IF_STATE_DETACHING;
+		wan->state &= ~(PPP_IF_STATE_DETACHING | PPP_IF_STATE_CLOSING);
 		lck_mtx_lock(ppp_domain_mutex);
 		return KERN_FAILURE;
 	}
@@ -520,43 +525,113 @@ called when data are present
 int ppp_if_input(ifnet_t ifp, mbuf_t m, u_int16_t proto, u_int16_t hdrlen)
 {    
     struct ppp_if 	*wan = ifnet_softc(ifp);
-    int 		inlen, vjlen;
-    u_char		*iphdr, *p = mbuf_data(m);	// no alignment issue as p is *u_char.
-    u_int 		hlen;
-    int 		error = ENOMEM;
-	struct timespec tv;
-	struct		ifnet_stat_increment_param statsinc;
-    u_int16_t   aligned_short;
+    u_char		*p = mbuf_data(m);	// no alignment issue as p is *u_char.
+    int			err;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
     mbuf_pkthdr_setheader(m, p);		// header point to the protocol header (0x21 or 0x0021)
     mbuf_adj(m, hdrlen);			// the packet points to the real data (0x45)
-    p = mbuf_data(m);
 
-    if (wan->sc_flags & SC_DECOMP_RUN) {
-        switch (proto) {
-            case PPP_COMP:
-                if (ppp_comp_decompress(wan, &m) != DECOMP_OK) {
-                    LOGDBG(ifp, ("ppp%d: decompression error\n", ifnet_unit(ifp)));
-                    goto free;
-                }
-                p = mbuf_data(m);
-                proto = p[0];
-                hdrlen = 1;
-                if (!(proto & 0x1)) {  // lowest bit set for lowest byte of protocol
-                    proto = (proto << 8) + p[1];
-                    hdrlen = 2;
-                } 
-                mbuf_pkthdr_setheader(m, p);// header point to the protocol header (0x21 or 0x0021)
-                mbuf_adj(m, hdrlen);	// the packet points to the real data (0x45)
-                p = mbuf_data(m);
-                break;
-            default:
-                ppp_comp_incompress(wan, m);
+    switch (proto) {
+        case PPP_COMP:
+            if (wan->sc_flags & SC_DECOMP_RUN) {
+                // worker thread will call ppp_if_input_decompressed when done
+                if (ppp_comp_dispatch(wan, m, 0) == 0)
+                    return 0;
+                // m is replaced by the decompressor, don't read it in the same expression
+                err = ppp_comp_decompress(wan, &m);
+                return ppp_if_input_decompressed(ifp, m, err);
+            }
+            break;
+        case PPP_CCP:
+            // ccp changes the decompressor state, keep it in sequence with
+            // the packets waiting for a worker thread, which will call ppp_if_input_incomp
+            if (ppp_comp_dispatch(wan, m, 0) == 0)
+                return 0;
+            break;
+        default:
+            // an uncompressed frame updates the decompressor dictionary, 
+            // don't let it overtake the compressed packets waiting for a worker thread
+            if (ppp_comp_pending(wan) && ppp_comp_dispatch(wan, m, 0) == 0)
+                return 0;
+            break;
+    }
+
+    return ppp_if_input_incomp(ifp, m, proto);
+}
+
+/* -----------------------------------------------------------------------------
+called for a received packet that doesn't need decompression, in sequence 
+with the compressed packets, either inline from ppp_if_input or from a 
+compression worker thread
+----------------------------------------------------------------------------- */
+int ppp_if_input_incomp(ifnet_t ifp, mbuf_t m, u_int16_t proto)
+{
+    struct ppp_if 	*wan = ifnet_softc(ifp);
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if ((wan->sc_flags & SC_DECOMP_RUN) && proto != PPP_COMP)
+        ppp_comp_incompress(wan, m);
+
+    return ppp_if_input_proto(ifp, m, proto);
+}
+
+/* -----------------------------------------------------------------------------
+called when a PPP_COMP packet went through the decompressor, 
+either inline from ppp_if_input or from a compression worker thread
+----------------------------------------------------------------------------- */
+int ppp_if_input_decompressed(ifnet_t ifp, mbuf_t m, int decomp)
+{
+    u_char		*p;
+    u_int16_t		proto, hdrlen;
+	struct		ifnet_stat_increment_param statsinc;
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (decomp != DECOMP_OK) {
+        LOGDBG(ifp, ("ppp%d: decompression error\n", ifnet_unit(ifp)));
+		bzero(&statsinc, sizeof(statsinc));
+		statsinc.errors_in = 1;
+		ifnet_stat_increment(ifp, &statsinc);		
+        if (decomp == DECOMP_RESYNC) {
+            // give the compressed header to pppd, it will send a ccp reset request
+            if (mbuf_pkthdr_len(m) > 2)
+                mbuf_adj(m, 2 - mbuf_pkthdr_len(m));
+            return ppp_if_input_proto(ifp, m, PPP_COMP);
         }
+        mbuf_freem(m);
+        return ENOMEM;
     }
 
+    p = mbuf_data(m);
+    proto = p[0];
+    hdrlen = 1;
+    if (!(proto & 0x1)) {  // lowest bit set for lowest byte of protocol
+        proto = (proto << 8) + p[1];
+        hdrlen = 2;
+    } 
+    mbuf_pkthdr_setheader(m, p);// header point to the protocol header (0x21 or 0x0021)
+    mbuf_adj(m, hdrlen);	// the packet points to the real data (0x45)
+
+    return ppp_if_input_proto(ifp, m, proto);
+}
+
+/* -----------------------------------------------------------------------------
+deliver an uncompressed packet to the network stack or to pppd
+----------------------------------------------------------------------------- */
+static int ppp_if_input_proto(ifnet_t ifp, mbuf_t m, u_int16_t proto)
+{    
+    struct ppp_if 	*wan = ifnet_softc(ifp);
+    int 		inlen, vjlen;
+    u_char		*iphdr, *p = mbuf_data(m);	// no alignment issue as p is *u_char.
+    u_int 		hlen;
+    int 		error = ENOMEM;
+	struct timespec tv;
+	struct		ifnet_stat_increment_param statsinc;
+    u_int16_t   aligned_short;
+
     switch (proto) {
         case PPP_VJC_COMP:
         case PPP_VJC_UNCOMP:
@@ -1064,6 +1139,9 @@ errno_t ppp_if_output(ifnet_t ifp, mbuf_t m)
         }
     }
 
+    if (wan->sc_flags & SC_QOS_PROPAGATE)
+        ppp_if_qos_mark(m, proto);
+
     // See if bpf wants to look at the packet.
 	lck_mtx_unlock(ppp_domain_mutex);
     if (wan->bpf_output) {
@@ -1108,6 +1186,29 @@ bad:
     return error;
 }
 
+/* -----------------------------------------------------------------------------
+record the DSCP of an outgoing IPv4 or IPv6 packet before compression hides it,
+so the link can copy it to the tunnel header. best effort packets are not marked
+----------------------------------------------------------------------------- */
+static void ppp_if_qos_mark(mbuf_t m, u_int16_t proto)
+{
+    u_int8_t	hdr[2], tos;
+
+    // the ppp protocol field is still in front of the ip header
+    if (mbuf_copydata(m, 2, sizeof(hdr), hdr))
+        return;
+
+    if (proto == PPP_IP)
+        tos = hdr[1];
+    else 
+        tos = (hdr[0] << 4) | (hdr[1] >> 4);	// ipv6 traffic class
+
+    // ecn is end to end, only the dscp is propagated
+    tos &= ~IPTOS_ECN_MASK;
+    if (tos)
+        ppp_link_settos(m, tos);
+}
+
 /* -----------------------------------------------------------------------------
 add protocol function
 called from dlil when a network protocol is attached for an
@@ -1269,8 +1370,8 @@ int ppp_if_send(ifnet_t ifp, mbuf_t m)
 {
     struct ppp_if 	*wan = ifnet_softc(ifp);
     u_int16_t		proto;
+    int				err;
 	struct			ifnet_stat_increment_param statsinc;
-	int				error = 0;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
         
@@ -1326,6 +1427,10 @@ int ppp_if_send(ifnet_t ifp, mbuf_t m)
             }
             break;
         case PPP_CCP:
+            // ccp changes the compressor state, keep it in sequence with
+            // the packets waiting for a worker thread
+            if (ppp_comp_dispatch(wan, m, 1) == 0)
+                return 0;
             mbuf_adj(m, 2);
             ppp_comp_ccp(wan, m, 0);
             if (mbuf_prepend(&m, 2, MBUF_DONTWAIT) != 0) {
@@ -1338,17 +1443,39 @@ int ppp_if_send(ifnet_t ifp, mbuf_t m)
     }
 
     if (wan->sc_flags & SC_COMP_RUN) {
+        // worker thread will call ppp_if_send_compressed when done
+        if (ppp_comp_dispatch(wan, m, 1) == 0)
+            return 0;
+        // m is replaced by the compressor, don't read it in the same expression
+        err = ppp_comp_compress(wan, &m);
+        return ppp_if_send_compressed(ifp, m, err);
+    } 
 
-        if (ppp_comp_compress(wan, &m) == COMP_OK) {
-            if (mbuf_prepend(&m, 2, MBUF_DONTWAIT) != 0) {
-				bzero(&statsinc, sizeof(statsinc));
-				statsinc.errors_out = 1;
-				ifnet_stat_increment(ifp, &statsinc);		
-                return ENOBUFS;
-            }
-            proto = htons(PPP_COMP); // update protocol
-	    memcpy(mbuf_data(m), &proto, sizeof(u_int16_t));
-        } 
+    return ppp_if_send_compressed(ifp, m, COMP_NOTDONE);
+}
+
+/* -----------------------------------------------------------------------------
+called when a packet went through the compressor, 
+either inline from ppp_if_send or from a compression worker thread
+----------------------------------------------------------------------------- */
+int ppp_if_send_compressed(ifnet_t ifp, mbuf_t m, int comp)
+{
+    struct ppp_if 	*wan = ifnet_softc(ifp);
+    u_int16_t		proto;
+	struct			ifnet_stat_increment_param statsinc;
+	int				error = 0;
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (comp == COMP_OK) {
+        if (mbuf_prepend(&m, 2, MBUF_DONTWAIT) != 0) {
+            bzero(&statsinc, sizeof(statsinc));
+            statsinc.errors_out = 1;
+            ifnet_stat_increment(ifp, &statsinc);		
+            return ENOBUFS;
+        }
+        proto = htons(PPP_COMP); // update protocol
+        memcpy(mbuf_data(m), &proto, sizeof(u_int16_t));
     } 
 
     if (wan->sndq.len) {
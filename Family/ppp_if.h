@@ -37,6 +37,7 @@
  * State of the interface.
  */
 #define PPP_IF_STATE_DETACHING	1
+#define PPP_IF_STATE_CLOSING	2	/* detach in progress, no more compression work */
 
 struct ppp_if {
     /* first, the ifnet structure... */
@@ -71,6 +72,12 @@ struct ppp_if {
     void				*rc_state;	/* send compressor state */
     struct ppp_comp		*rcomp;		/* send compressor structure */
 
+    /* parallel data compression (see ppp_comp.c) */
+    TAILQ_ENTRY(ppp_if)	comp_next;	/* link in the worker run queue */
+    u_int8_t			comp_queued;	/* interface is on a worker run queue */
+    struct pppqueue		compq;		/* packets waiting to be compressed */
+    struct pppqueue		decompq;	/* packets waiting to be decompressed */
+
 	/* network protocols data */
     int					ip_attached;
     struct in_addr		ip_src;
@@ -102,6 +109,9 @@ int ppp_if_detachlink(struct ppp_link *link);
 int ppp_if_send(ifnet_t ifp, mbuf_t m);
 void ppp_if_error(ifnet_t ifp);
 int ppp_if_xmit(ifnet_t ifp, mbuf_t m);
+int ppp_if_send_compressed(ifnet_t ifp, mbuf_t m, int comp);
+int ppp_if_input_decompressed(ifnet_t ifp, mbuf_t m, int decomp);
+int ppp_if_input_incomp(ifnet_t ifp, mbuf_t m, u_int16_t proto);
 
 
 
@@ -102,12 +102,18 @@ Globals
 static TAILQ_HEAD(, ppp_link) 	ppp_link_head;
 extern lck_mtx_t   *ppp_domain_mutex;
 
+#define PPP_LINK_TAG_TOS	1				/* mbuf tag type for the inner type of service */
+static mbuf_tag_id_t	ppp_link_tag_id = 0;
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 int ppp_link_init()
 {
     TAILQ_INIT(&ppp_link_head);
     
+    if (mbuf_tag_id_find("com.apple.nke.ppp", &ppp_link_tag_id))
+        return ENOMEM;
+
     return 0;
 }
 
@@ -435,6 +441,38 @@ int ppp_link_send(struct ppp_link *link, mbuf_t m)
     return (*link->lk_output)(link, m);
 }
 
+/* -----------------------------------------------------------------------------
+mark a packet with the type of service of its inner IP header
+the tag follows the packet header through prepends, down to the link driver
+----------------------------------------------------------------------------- */
+int ppp_link_settos(mbuf_t m, u_int8_t tos)
+{
+    u_int8_t	*data;
+    size_t		len;
+
+    if (mbuf_tag_find(m, ppp_link_tag_id, PPP_LINK_TAG_TOS, &len, (void **)&data)
+        && mbuf_tag_allocate(m, ppp_link_tag_id, PPP_LINK_TAG_TOS, sizeof(u_int8_t), MBUF_DONTWAIT, (void **)&data))
+        return ENOMEM;
+
+    *data = tos;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+get the type of service of the inner IP header, if the packet has been marked
+----------------------------------------------------------------------------- */
+int ppp_link_gettos(mbuf_t m, u_int8_t *tos)
+{
+    u_int8_t	*data;
+    size_t		len;
+
+    if (mbuf_tag_find(m, ppp_link_tag_id, PPP_LINK_TAG_TOS, &len, (void **)&data))
+        return ENOENT;
+
+    *tos = *data;
+    return 0;
+}
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 void ppp_link_logmbuf(struct ppp_link *link, char *msg, mbuf_t m) 
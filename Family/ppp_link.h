@@ -32,6 +32,7 @@ int ppp_link_control(struct ppp_link *link, u_long cmd, void *data);
 int ppp_link_attachclient(u_short index, void *host, struct ppp_link **link);
 int ppp_link_detachclient(struct ppp_link *link, void *host);
 int ppp_link_send(struct ppp_link *link, mbuf_t m);
+int ppp_link_settos(mbuf_t m, u_int8_t tos);
 
 
 #endif /* _PPP_LINK_H_ */
@@ -166,7 +166,8 @@ static option_t acscp_option_list[] = {
       "Disable ACSP and ACSCP" },
 
     { "acscp-restart", o_int, &acscp_fsm[0].timeouttime,
-      "Set timeout for acscp", OPT_PRIO },
+      "Set timeout for acscp", OPT_PRIO,
+      &acscp_fsm[0].timeout_set },
     { "acscp-max-terminate", o_int, &acscp_fsm[0].maxtermtransmits,
       "Set max #xmits for term-reqs", OPT_PRIO },
     { "acscp-max-configure", o_int, &acscp_fsm[0].maxconfreqtransmits,
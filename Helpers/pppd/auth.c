@@ -977,6 +977,7 @@ void
 auth_peer_fail(unit, protocol)
     int unit, protocol;
 {
+    trace_event(TRACE_HOOK, "auth-peer", protocol, -1);
     /*
      * Authentication failure: take the link down
      */
@@ -995,6 +996,8 @@ auth_peer_success(unit, protocol, prot_flavor, name, namelen)
 {
     int bit;
 
+    trace_event(TRACE_HOOK, "auth-peer", protocol, 0);
+
 #ifdef __APPLE__
     struct auth_peer_success_info note;
 
@@ -1069,6 +1072,7 @@ auth_withpeer_fail(unit, protocol)
     int unit, protocol;
 {
 
+    trace_event(TRACE_HOOK, "auth-withpeer", protocol, -1);
 #ifdef __APPLE__
     notify(auth_withpeer_fail_notify, protocol);
 #endif
@@ -1111,6 +1115,7 @@ auth_withpeer_success(unit, protocol, prot_flavor)
 {
     int bit;
 
+    trace_event(TRACE_HOOK, "auth-withpeer", protocol, 0);
 #ifdef __APPLE__
     notify(auth_withpeer_success_notify, protocol);
 #endif
@@ -1537,6 +1542,7 @@ auth_reset(unit)
  *	UPAP_AUTHNAK: Authentication failed.
  *	UPAP_AUTHACK: Authentication succeeded.
  * In either case, msg points to an appropriate message.
+ *	PAP_VERIFY_PENDING: pap_auth_hook will call pap_verify_done.
  */
 int
 check_passwd(unit, auser, userlen, apasswd, passwdlen, msg)
@@ -1569,6 +1575,10 @@ check_passwd(unit, auser, userlen, apasswd, passwdlen, msg)
      */
     if (pap_auth_hook) {
 	ret = (*pap_auth_hook)(user, passwd, msg, &addrs, &opts);
+	if (ret == PAP_VERIFY_PENDING) {
+	    BZERO(passwd, sizeof(passwd));
+	    return ret;
+	}
 	if (ret >= 0) {
 	    if (ret)
 		set_allowed_addrs(unit, addrs, opts);
@@ -1652,6 +1662,20 @@ check_passwd(unit, auser, userlen, apasswd, passwdlen, msg)
     return ret;
 }
 
+/*
+ * check_passwd_done - complete check_passwd for a pap_auth_hook
+ * that returned PAP_VERIFY_PENDING.
+ */
+int
+check_passwd_done(unit, ok)
+    int unit;
+    int ok;
+{
+    if (ok)
+	set_allowed_addrs(unit, NULL, NULL);
+    return ok? UPAP_AUTHACK: UPAP_AUTHNAK;
+}
+
 /*
  * This function is needed for PAM.
  */
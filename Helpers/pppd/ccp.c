@@ -97,6 +97,7 @@ static char deflate_value[8];
  */
 #ifdef MPPE
 bool refuse_mppe_stateful = 1;		/* Allow stateful mode? */
+bool refuse_mppc = 1;			/* Allow MPPC compression? */
 #endif
 
 static option_t ccp_option_list[] = {
@@ -187,6 +188,12 @@ static option_t ccp_option_list[] = {
     { "nomppe-stateful", o_bool, &refuse_mppe_stateful,
       "disallow MPPE stateful mode", OPT_PRIO | 1 },
 
+    /* MPPC compression (RFC 2118), negotiated along with MPPE */
+    { "mppc", o_bool, &refuse_mppc,
+      "allow MPPC compression", OPT_PRIO },
+    { "nomppc", o_bool, &refuse_mppc,
+      "disallow MPPC compression", OPT_PRIO | 1 },
+
 #ifdef __APPLE__
     // for compatibility
     { "mppe-stateless", o_bool, &refuse_mppe_stateful,
@@ -666,6 +673,10 @@ ccp_resetci(f)
 	    return;
 	}
 
+	/* MPPC rides in the same option as MPPE */
+	if (!refuse_mppc)
+	    go->mppe |= MPPE_OPT_MPPC;
+
 	/* sync options */
 	ao->mppe = go->mppe;
 	/* MPPE is not compatible with other compression types */
@@ -992,6 +1003,8 @@ ccp_nakci(f, p, len)
         */
 	if ((try.mppe & MPPE_OPT_STATEFUL) && refuse_mppe_stateful)
 	    try.mppe &= ~MPPE_OPT_STATEFUL;
+	if ((try.mppe & MPPE_OPT_MPPC) && refuse_mppc)
+	    try.mppe &= ~MPPE_OPT_MPPC;
         if ((try.mppe & MPPE_OPT_40) && !(ao->mppe & MPPE_OPT_40))
 	    try.mppe &= ~MPPE_OPT_40;
         if ((try.mppe & MPPE_OPT_128) && !(ao->mppe & MPPE_OPT_128))
@@ -1206,6 +1219,12 @@ ccp_reqci(f, p, lenp, dont_nak)
 		    ho->mppe &= ~MPPE_OPT_UNKNOWN;
 		}
 
+		/* Nak MPPC if we don't want to decompress it. */
+		if ((ho->mppe & MPPE_OPT_MPPC) && refuse_mppc) {
+		    newret = CONFNAK;
+		    ho->mppe &= ~MPPE_OPT_MPPC;
+		}
+
 		/* Check state opt */
 		if (ho->mppe & MPPE_OPT_STATEFUL) {
 		    /*
@@ -1464,6 +1483,10 @@ method_name(opt, opt2)
 	char *p = result;
 	char *q = result + sizeof(result); /* 1 past result */
 
+	if (opt->mppe & MPPE_OPT_MPPC) {
+	    slprintf(p, q - p, "MPPC/");
+	    p += 5;
+	}
 	slprintf(p, q - p, "MPPE ");
 	p += 5;
 	if (opt->mppe & MPPE_OPT_128) {
@@ -141,6 +141,8 @@ static struct chap_server_state {
 #define TIMEOUT_PENDING		0x10
 #define CHALLENGE_VALID		0x20
 #define RESPONSE_VALID      0x40
+#define VERIFY_PENDING		0x80	/* verifier will call chap_verify_done */
+#define VERIFY_DEFAULT		0x100	/* ... for a packet of chap_unknown_hook */
 
 /*
  * Prototypes.
@@ -152,6 +154,12 @@ static void chap_timeout(void *arg);
 static void chap_generate_challenge(struct chap_server_state *ss);
 static void chap_handle_response(struct chap_server_state *ss, int code,
 		unsigned char *pkt, int len);
+static void chap_send_result(struct chap_server_state *ss, int id, int ok,
+		unsigned char *name);
+#ifdef __APPLE__
+static void chap_send_default_result(struct chap_server_state *ss, int id,
+		int ok);
+#endif
 static int chap_verify_response(u_char *name, u_char *ourname, int id,
 		struct chap_digest_type *digest,
 		unsigned char *challenge, unsigned char *response,
@@ -382,6 +390,10 @@ chap_generate_challenge(struct chap_server_state *ss)
 #ifdef __APPLE__
 static char prev_name[MAXNAMELEN+1];
 #endif
+/* response being verified asynchronously */
+static char pending_name[MAXNAMELEN+1];
+static int pending_id;
+
 /*
  * chap_handle_response - check the response to our challenge.
  */
@@ -389,8 +401,8 @@ static void
 chap_handle_response(struct chap_server_state *ss, int id,
 		     unsigned char *pkt, int len)
 {
-	int response_len, ok = 0, mlen;
-	unsigned char *response, *p;
+	int response_len, ok = 0;
+	unsigned char *response;
 	unsigned char *name = NULL;	/* initialized to shut gcc up */
 	int (*verifier)(u_char *, u_char *, int, struct chap_digest_type *,
 		unsigned char *, unsigned char *, unsigned char *, int);
@@ -400,6 +412,9 @@ chap_handle_response(struct chap_server_state *ss, int id,
 		return;
 	if (id != ss->challenge[PPP_HDRLEN+1] || len < 2)
 		return;
+	/* a retransmission of the response we are verifying */
+	if (ss->flags & VERIFY_PENDING)
+		return;
     if (ss->flags & CHALLENGE_VALID) {
 		response = pkt;
 		GETCHAR(response_len, pkt);
@@ -428,6 +443,13 @@ chap_handle_response(struct chap_server_state *ss, int id,
 		ok = (*verifier)(name, (u_char*)ss->name, id, ss->digest,
 				 ss->challenge + PPP_HDRLEN + CHAP_HDRLEN,
 				 response, ss->message, sizeof(ss->message));
+		if (ok == CHAP_VERIFY_PENDING) {
+			/* the result will come through chap_verify_done */
+			ss->flags |= VERIFY_PENDING;
+			strlcpy(pending_name, (char*)name, sizeof(pending_name));
+			pending_id = id;
+			return;
+		}
 		if (!ok || !auth_number()) {
 			ss->flags |= AUTH_FAILED;
 			//warning("Peer %q failed CHAP authentication", name);
@@ -435,6 +457,47 @@ chap_handle_response(struct chap_server_state *ss, int id,
 	} else if ((ss->flags & AUTH_DONE) == 0)
         return;
 
+	chap_send_result(ss, id, ok, name);
+}
+
+/*
+ * chap_verify_done - the verifier has completed asynchronously.
+ * ok has the same meaning as the return value of chap_verify_hook.
+ * The result is ignored if the link went down in the meantime.
+ */
+void
+chap_verify_done(int unit, int ok)
+{
+	struct chap_server_state *ss = &server;
+
+	if ((ss->flags & VERIFY_PENDING) == 0)
+		return;
+#ifdef __APPLE__
+	if (ss->flags & VERIFY_DEFAULT) {
+		ss->flags &= ~(VERIFY_PENDING | VERIFY_DEFAULT);
+		if (!ok)
+			ss->flags |= AUTH_FAILED;
+		chap_send_default_result(ss, pending_id, ok);
+		return;
+	}
+#endif
+	ss->flags &= ~VERIFY_PENDING;
+	if (!ok || !auth_number())
+		ss->flags |= AUTH_FAILED;
+	chap_send_result(ss, pending_id, ok, (unsigned char*)pending_name);
+}
+
+/*
+ * chap_send_result - send the success or failure of the peer's
+ * authentication, and update our state accordingly.
+ */
+static void
+chap_send_result(struct chap_server_state *ss, int id, int ok,
+		 unsigned char *name)
+{
+	int mlen, len;
+	unsigned char *p;
+
 	/* send the response */
 	p = outpacket_buf;
 	MAKEHEADER(p, PPP_CHAP);
@@ -487,8 +550,7 @@ static void
 chap_handle_default(struct chap_server_state *ss, int code, int id,
 		     unsigned char *pkt, int len)
 {
-	int ok = 0, mlen;
-	unsigned char *p;
+	int ok = 0;
 	//unsigned char *name = NULL;	/* initialized to shut gcc up */
 
 	if (!chap_unknown_hook)
@@ -497,6 +559,10 @@ chap_handle_default(struct chap_server_state *ss, int code, int id,
 	if ((ss->flags & LOWERUP) == 0)
 		return;
 
+	/* a retransmission of the packet we are verifying */
+	if (ss->flags & VERIFY_PENDING)
+		return;
+
     ss->message[0] = 0;
 
 	if ((ss->flags & AUTH_DONE) == 0) {
@@ -504,12 +570,31 @@ chap_handle_default(struct chap_server_state *ss, int code, int id,
 		ok = (*chap_unknown_hook)(prev_name, ss->name, code, id, ss->digest,
 			 ss->challenge + PPP_HDRLEN + CHAP_HDRLEN,
 			 pkt, len, ss->message, sizeof(ss->message));
+		if (ok == CHAP_VERIFY_PENDING) {
+			/* the result will come through chap_verify_done */
+			ss->flags |= VERIFY_PENDING | VERIFY_DEFAULT;
+			pending_id = id;
+			return;
+		}
 		if (!ok) {
 			ss->flags |= AUTH_FAILED;
 			//warning("Peer %q failed CHAP authentication", prev_name);
 		}
 	}
 
+	chap_send_default_result(ss, id, ok);
+}
+
+/*
+ * chap_send_default_result - send the result of a packet handled
+ * by chap_unknown_hook, and update our state accordingly.
+ */
+static void
+chap_send_default_result(struct chap_server_state *ss, int id, int ok)
+{
+	int mlen, len;
+	unsigned char *p;
+
 	if (ok == -2)
 		return;
 		
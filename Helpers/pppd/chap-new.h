@@ -156,6 +156,14 @@ extern int (*chap_verify_hook)(u_char *name, u_char *ourname, int id,
 			unsigned char *challenge, unsigned char *response,
 			unsigned char *message, int message_space);
 
+/*
+ * A chap_verify_hook or chap_unknown_hook may return CHAP_VERIFY_PENDING
+ * when it cannot decide right away; it must then report the result later
+ * with chap_verify_done.
+ */
+#define CHAP_VERIFY_PENDING	(-3)
+extern void chap_verify_done(int unit, int ok);
+
 #ifdef __APPLE__
 /* Hook for a plugin to validate unknown CHAP packets */
 extern int (*chap_unknown_hook)(char *name, char *ourname, int code, int id,
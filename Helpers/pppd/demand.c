@@ -92,16 +92,52 @@ int escape_flag;
 int flush_flag;
 int fcs;
 
+/*
+ * Packets queued while the link comes up, kept in one list per network
+ * protocol, so that each protocol replays only its own packets.
+ * Packets are stored in fixed size slots, allocated by chunks and
+ * recycled through a free list. The chunks are freed once the queue
+ * is empty again.
+ * The queue is bounded in memory (demand_maxbytes, each packet is
+ * charged a full slot) and in age (demand_maxage): the oldest packets
+ * are dropped first.
+ */
 struct packet {
     int length;
     struct packet *next;
+    struct timeval time;		/* when it was queued */
     unsigned char data[1];
 };
 
-struct packet *pend_q;
-struct packet *pend_qtail;
+#define PEND_MAXPROTO	8		/* max nb of protocols queued */
+#define PEND_CHUNK	16		/* slots allocated at a time */
+
+struct pend_chunk {
+    struct pend_chunk *next;
+};
+#define PEND_CHUNK_HDR	((sizeof(struct pend_chunk) + 7) & ~7)
+
+struct pend_list {
+    int proto;				/* PPP protocol, 0 if unused */
+    struct packet *head, *tail;
+};
+
+static struct pend_list pend_q[PEND_MAXPROTO];
+static struct packet *pend_free;	/* recycled slots */
+static struct pend_chunk *pend_chunks;	/* chunks the slots come from */
+static int pend_slotsize;		/* size of a slot */
+static int pend_bytes;			/* slot bytes currently queued */
+static int pend_packets;		/* packets currently queued */
+static int pend_drop_full;		/* packets dropped, queue full */
+static int pend_drop_age;		/* packets dropped, too old */
+static int pend_maxwait;		/* max queueing time (ms) of a replayed packet */
 
 static int active_packet __P((unsigned char *, int));
+static void pend_gettime __P((struct timeval *));
+static void pend_release __P((struct pend_list *));
+static void pend_expire __P((struct timeval *));
+static void pend_report __P((void));
+static void pend_freechunks __P((void));
 
 /*
  * demand_conf - configure the interface for doing dial-on-demand.
@@ -120,7 +156,8 @@ demand_conf()
     if (frame == NULL)
 	novm("demand frame");
     framelen = 0;
-    pend_q = NULL;
+    BZERO(pend_q, sizeof(pend_q));
+    pend_slotsize = (sizeof(struct packet) + framemax + 7) & ~7;
     escape_flag = 0;
     flush_flag = 0;
     fcs = PPP_INITFCS;
@@ -176,11 +213,18 @@ demand_discard()
     get_loop_output();
 
     /* discard all saved packets */
-    for (pkt = pend_q; pkt != NULL; pkt = nextpkt) {
-	nextpkt = pkt->next;
-	free(pkt);
+    for (i = 0; i < PEND_MAXPROTO; i++) {
+	for (pkt = pend_q[i].head; pkt != NULL; pkt = nextpkt) {
+	    nextpkt = pkt->next;
+	    pkt->next = pend_free;
+	    pend_free = pkt;
+	}
+	pend_q[i].head = pend_q[i].tail = NULL;
+	pend_q[i].proto = 0;
     }
-    pend_q = NULL;
+    pend_bytes = pend_packets = 0;
+    pend_freechunks();
+    pend_report();
     framelen = 0;
     flush_flag = 0;
     escape_flag = 0;
@@ -302,6 +346,9 @@ loop_frame(frame, len)
     int len;
 {
     struct packet *pkt;
+    struct pend_list *list, *oldest;
+    struct timeval now;
+    int i, proto;
 
     dbglog("Dial on demand: %P", frame, len);
     if (len < PPP_HDRLEN)
@@ -311,17 +358,78 @@ loop_frame(frame, len)
     if (!active_packet(frame, len))
 	return 0;
 
-    pkt = (struct packet *) malloc(sizeof(struct packet) + len);
-    if (pkt != NULL) {
-	pkt->length = len;
-	pkt->next = NULL;
-	memcpy(pkt->data, frame, len);
-	if (pend_q == NULL)
-	    pend_q = pkt;
-	else
-	    pend_qtail->next = pkt;
-	pend_qtail = pkt;
+    if (len + sizeof(struct packet) > pend_slotsize
+	|| pend_slotsize > demand_maxbytes) {
+	pend_drop_full++;
+	return 1;
+    }
+
+    pend_gettime(&now);
+    pend_expire(&now);
+
+    /* make room, dropping the oldest packets of any protocol */
+    while (pend_bytes + pend_slotsize > demand_maxbytes) {
+	oldest = NULL;
+	for (i = 0; i < PEND_MAXPROTO; i++) {
+	    list = &pend_q[i];
+	    if (list->head && (oldest == NULL
+			       || timercmp(&list->head->time, &oldest->head->time, <)))
+		oldest = list;
+	}
+	if (oldest == NULL)
+	    break;
+	pend_release(oldest);
+	pend_drop_full++;
+    }
+
+    /* find the list of this protocol, or a free one */
+    proto = PPP_PROTOCOL(frame);
+    list = NULL;
+    for (i = 0; i < PEND_MAXPROTO; i++) {
+	if (pend_q[i].proto == proto) {
+	    list = &pend_q[i];
+	    break;
+	}
+	if (list == NULL && pend_q[i].head == NULL)
+	    list = &pend_q[i];
     }
+    if (list == NULL) {
+	pend_drop_full++;
+	return 1;
+    }
+    list->proto = proto;
+
+    if (pend_free == NULL) {
+	struct pend_chunk *chunk;
+
+	chunk = malloc(PEND_CHUNK_HDR + PEND_CHUNK * pend_slotsize);
+	if (chunk == NULL) {
+	    pend_drop_full++;
+	    return 1;
+	}
+	chunk->next = pend_chunks;
+	pend_chunks = chunk;
+	for (i = 0; i < PEND_CHUNK; i++) {
+	    pkt = (struct packet *)
+		((u_char *) chunk + PEND_CHUNK_HDR + i * pend_slotsize);
+	    pkt->next = pend_free;
+	    pend_free = pkt;
+	}
+    }
+    pkt = pend_free;
+    pend_free = pkt->next;
+
+    pkt->length = len;
+    pkt->next = NULL;
+    pkt->time = now;
+    memcpy(pkt->data, frame, len);
+    if (list->head == NULL)
+	list->head = pkt;
+    else
+	list->tail->next = pkt;
+    list->tail = pkt;
+    pend_bytes += pend_slotsize;
+    pend_packets++;
     return 1;
 }
 
@@ -333,27 +441,116 @@ void
 demand_rexmit(proto)
     int proto;
 {
-    struct packet *pkt, *prev, *nextpkt;
-
-    prev = NULL;
-    pkt = pend_q;
-    pend_q = NULL;
-    for (; pkt != NULL; pkt = nextpkt) {
-	nextpkt = pkt->next;
-	if (PPP_PROTOCOL(pkt->data) == proto) {
+    struct pend_list *list;
+    struct packet *pkt;
+    struct timeval now;
+    int i, wait;
+
+    pend_gettime(&now);
+    pend_expire(&now);
+
+    for (i = 0; i < PEND_MAXPROTO; i++)
+	if (pend_q[i].proto == proto)
+	    break;
+    if (i < PEND_MAXPROTO) {
+	list = &pend_q[i];
+	while ((pkt = list->head) != NULL) {
+	    wait = (now.tv_sec - pkt->time.tv_sec) * 1000
+		+ (now.tv_usec - pkt->time.tv_usec) / 1000;
+	    if (wait > pend_maxwait)
+		pend_maxwait = wait;
 	    output(0, pkt->data, pkt->length);
-	    free(pkt);
-	} else {
-	    if (prev == NULL)
-		pend_q = pkt;
-	    else
-		prev->next = pkt;
-	    prev = pkt;
+	    pend_release(list);
+	}
+	list->proto = 0;
+    }
+    if (pend_packets == 0)
+	pend_freechunks();
+    pend_report();
+}
+
+/*
+ * pend_gettime - read the clock used to age queued packets.
+ */
+static void
+pend_gettime(tv)
+    struct timeval *tv;
+{
+#ifdef __APPLE__
+    if (getabsolutetime(tv) == 0)
+	return;
+#endif
+    gettimeofday(tv, NULL);
+}
+
+/*
+ * pend_release - remove the first packet of a list and recycle its slot.
+ */
+static void
+pend_release(list)
+    struct pend_list *list;
+{
+    struct packet *pkt = list->head;
+
+    list->head = pkt->next;
+    if (list->head == NULL)
+	list->tail = NULL;
+    pend_bytes -= pend_slotsize;
+    pend_packets--;
+    pkt->next = pend_free;
+    pend_free = pkt;
+}
+
+/*
+ * pend_expire - drop the packets queued for longer than demand_maxage.
+ */
+static void
+pend_expire(now)
+    struct timeval *now;
+{
+    struct pend_list *list;
+    int i;
+
+    if (demand_maxage <= 0)
+	return;
+    for (i = 0; i < PEND_MAXPROTO; i++) {
+	list = &pend_q[i];
+	/* lists are in arrival order, the oldest is first */
+	while (list->head
+	       && now->tv_sec - list->head->time.tv_sec > demand_maxage) {
+	    pend_release(list);
+	    pend_drop_age++;
 	}
     }
-    pend_qtail = prev;
-    if (prev != NULL)
-	prev->next = NULL;
+}
+
+/*
+ * pend_freechunks - give the slots back to the system, the queue is empty.
+ */
+static void
+pend_freechunks()
+{
+    struct pend_chunk *chunk;
+
+    while ((chunk = pend_chunks) != NULL) {
+	pend_chunks = chunk->next;
+	free(chunk);
+    }
+    pend_free = NULL;
+}
+
+/*
+ * pend_report - log and reset the queue statistics.
+ */
+static void
+pend_report()
+{
+    if (pend_drop_full || pend_drop_age)
+	notice("Dial on demand: dropped %d packets (queue full), %d packets (too old)",
+	       pend_drop_full, pend_drop_age);
+    if (pend_maxwait)
+	dbglog("Dial on demand: packets replayed after up to %d ms", pend_maxwait);
+    pend_drop_full = pend_drop_age = pend_maxwait = 0;
 }
 
 /*
@@ -365,6 +365,7 @@ EapLowerDown(unit)
 
     cstate->clientstate = EAPCS_INITIAL;
     cstate->serverstate = EAPSS_INITIAL;
+    cstate->server_ext_pending = 0;
 
     if (cstate->client_ext) {
         cstate->client_ext->dispose(cstate->client_ext_ctx);
@@ -706,6 +707,9 @@ EapReceiveResponse(cstate, inpacket, packet_len,  inp, id, len)
     if (id != cstate->req_id)
 	return;			/* doesn't match ID of last challenge */
 
+    if (cstate->server_ext_pending)
+	return;			/* retransmission of the response being verified */
+
     if (len < 1) {
 	EAPDEBUG(("EapReceiveResponse: rcvd short packet."));
 	return;
@@ -1112,6 +1116,24 @@ EAPServerProcess(eap_state *cstate, u_int16_t notification, u_char *inpacket, in
     return 0;
 }
 
+/*
+ * eap_verify_done - the server extension has filled its output
+ * asynchronously, after returning EAP_ACTION_VERIFY_PENDING.
+ * The output is ignored if the link went down in the meantime.
+ */
+void
+eap_verify_done(unit)
+    int unit;
+{
+    eap_state *cstate = &eap[unit];
+
+    if (!cstate->server_ext_pending)
+	return;
+    cstate->server_ext_pending = 0;
+
+    EAPServerAction(cstate);
+}
+
 /*
  * EAPServerGetAttributes - get server specific attributes.
  */
@@ -1239,6 +1261,11 @@ EAPServerAction(cstate)
             }
             break;
             
+        case EAP_ACTION_VERIFY_PENDING:
+            /* the result will come through eap_verify_done */
+            cstate->server_ext_pending = 1;
+            break;
+
         case EAP_ACTION_INVOKE_UI:            
         case EAP_ACTION_ACCESS_GRANTED:
         case EAP_ACTION_ACCESS_DENIED:
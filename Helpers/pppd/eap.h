@@ -109,6 +109,7 @@ typedef struct eap_state {
     void *server_ext_ctx;	/* server eap extension context */
     EAP_Input *server_ext_input;	/* server eap extension input structure */
     EAP_Output *server_ext_output;	/* server eap extension output structure */
+    int server_ext_pending;	/* server eap extension will call eap_verify_done */
 
 } eap_state;
 
@@ -148,6 +149,7 @@ void EapAuthPeer __P((int, char *));
 void EapGenChallenge __P((eap_state *));
 void EapLostSuccess __P((int));
 void EapLostFailure __P((int));
+void eap_verify_done __P((int));
 
 int EapGetClientSecret(void *cookie, u_char *our_name, u_char *peer_name, u_char *secret, int *secretlen);
 int EapGetServerSecret(void *cookie, u_char *our_name, u_char *peer_name, u_char *secret, int *secretlen);
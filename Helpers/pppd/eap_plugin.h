@@ -140,6 +140,7 @@ typedef struct EAP_Input {
 #define EAP_ACTION_SEND_WITH_TIMEOUT	5
 #define EAP_ACTION_SEND_AND_DONE	6
 #define EAP_ACTION_CANCEL		7
+#define EAP_ACTION_VERIFY_PENDING	8	/* server will fill the output later, and call eap_verify_done */
 
 
 typedef struct EAP_Output {
@@ -72,6 +72,7 @@
 
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <sys/types.h>
 
 #include "pppd.h"
@@ -89,6 +90,8 @@ static void fsm_rtermreq __P((fsm *, int, u_char *, int));
 static void fsm_rtermack __P((fsm *));
 static void fsm_rcoderej __P((fsm *, u_char *, int));
 static void fsm_sconfreq __P((fsm *, int));
+static void fsm_settimer __P((fsm *, int));
+static void fsm_rtt_sample __P((fsm *));
 
 #define PROTO_NAME(f)	((f)->callbacks->proto_name)
 
@@ -105,6 +108,10 @@ fsm_init(f)
     fsm *f;
 {
     f->state = INITIAL;
+    f->rto = 0;
+    f->srtt = f->rttvar = 0;
+    f->rtt_valid = 0;
+    f->timeout_set = 0;
     f->flags = 0;
     f->id = 0;				/* XXX Start with random id? */
     f->timeouttime = DEFTIMEOUT;
@@ -118,6 +125,20 @@ fsm_init(f)
 }
 
 
+/*
+ * fsm_setstate - Change the state of the fsm, tracing the transition.
+ */
+void
+fsm_setstate(f, state)
+    fsm *f;
+    int state;
+{
+    if (f->state != state)
+	trace_event(TRACE_FSM, PROTO_NAME(f), f->state, state);
+    f->state = state;
+}
+
+
 /*
  * fsm_lowerup - The lower layer is up.
  */
@@ -125,18 +146,21 @@ void
 fsm_lowerup(f)
     fsm *f;
 {
+    /* a new link, forget what we measured on the previous one */
+    f->srtt = f->rttvar = 0;
+
     switch( f->state ){
     case INITIAL:
-	f->state = CLOSED;
+	fsm_setstate(f, CLOSED);
 	break;
 
     case STARTING:
 	if( f->flags & OPT_SILENT )
-	    f->state = STOPPED;
+	    fsm_setstate(f, STOPPED);
 	else {
 	    /* Send an initial configure-request */
 	    fsm_sconfreq(f, 0);
-	    f->state = REQSENT;
+	    fsm_setstate(f, REQSENT);
 	}
 	break;
 
@@ -157,17 +181,17 @@ fsm_lowerdown(f)
 {
     switch( f->state ){
     case CLOSED:
-	f->state = INITIAL;
+	fsm_setstate(f, INITIAL);
 	break;
 
     case STOPPED:
-	f->state = STARTING;
+	fsm_setstate(f, STARTING);
 	if( f->callbacks->starting )
 	    (*f->callbacks->starting)(f);
 	break;
 
     case CLOSING:
-	f->state = INITIAL;
+	fsm_setstate(f, INITIAL);
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
 	break;
 
@@ -175,14 +199,14 @@ fsm_lowerdown(f)
     case REQSENT:
     case ACKRCVD:
     case ACKSENT:
-	f->state = STARTING;
+	fsm_setstate(f, STARTING);
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
 	break;
 
     case OPENED:
 	if( f->callbacks->down )
 	    (*f->callbacks->down)(f);
-	f->state = STARTING;
+	fsm_setstate(f, STARTING);
 	break;
 
     default:
@@ -200,23 +224,23 @@ fsm_open(f)
 {
     switch( f->state ){
     case INITIAL:
-	f->state = STARTING;
+	fsm_setstate(f, STARTING);
 	if( f->callbacks->starting )
 	    (*f->callbacks->starting)(f);
 	break;
 
     case CLOSED:
 	if( f->flags & OPT_SILENT )
-	    f->state = STOPPED;
+	    fsm_setstate(f, STOPPED);
 	else {
 	    /* Send an initial configure-request */
 	    fsm_sconfreq(f, 0);
-	    f->state = REQSENT;
+	    fsm_setstate(f, REQSENT);
 	}
 	break;
 
     case CLOSING:
-	f->state = STOPPING;
+	fsm_setstate(f, STOPPING);
 	/* fall through */
     case STOPPED:
     case OPENED:
@@ -244,13 +268,13 @@ fsm_close(f, reason)
     f->term_reason_len = (reason == NULL? 0: strlen(reason));
     switch( f->state ){
     case STARTING:
-	f->state = INITIAL;
+	fsm_setstate(f, INITIAL);
 	break;
     case STOPPED:
-	f->state = CLOSED;
+	fsm_setstate(f, CLOSED);
 	break;
     case STOPPING:
-	f->state = CLOSING;
+	fsm_setstate(f, CLOSING);
 	break;
 
     case REQSENT:
@@ -269,7 +293,7 @@ fsm_close(f, reason)
 	TIMEOUT(fsm_timeout, f, f->timeouttime);
 	--f->retransmits;
 
-	f->state = CLOSING;
+	fsm_setstate(f, CLOSING);
 	break;
     }
 }
@@ -291,7 +315,7 @@ fsm_timeout(arg)
 	    /*
 	     * We've waited for an ack long enough.  Peer probably heard us.
 	     */
-	    f->state = (f->state == CLOSING)? CLOSED: STOPPED;
+	    fsm_setstate(f, (f->state == CLOSING)? CLOSED: STOPPED);
 	    if( f->callbacks->finished )
 		(*f->callbacks->finished)(f);
 	} else {
@@ -308,7 +332,7 @@ fsm_timeout(arg)
     case ACKSENT:
 	if (f->retransmits <= 0) {
 	    warning("%s: timeout sending Config-Requests\n", PROTO_NAME(f));
-	    f->state = STOPPED;
+	    fsm_setstate(f, STOPPED);
 	    if( (f->flags & OPT_PASSIVE) == 0 && f->callbacks->finished )
 		(*f->callbacks->finished)(f);
 
@@ -318,7 +342,7 @@ fsm_timeout(arg)
 		(*f->callbacks->retransmit)(f);
 	    fsm_sconfreq(f, 1);		/* Re-send Configure-Request */
 	    if( f->state == ACKRCVD )
-		f->state = REQSENT;
+		fsm_setstate(f, REQSENT);
 	}
 	break;
 
@@ -491,13 +515,13 @@ fsm_rconfreq(f, id, inp, len)
 	if( f->callbacks->down )
 	    (*f->callbacks->down)(f);	/* Inform upper layers */
 	fsm_sconfreq(f, 0);		/* Send initial Configure-Request */
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
 
     case STOPPED:
 	/* Negotiation started by our peer */
 	fsm_sconfreq(f, 0);		/* Send initial Configure-Request */
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
     }
 
@@ -519,11 +543,11 @@ fsm_rconfreq(f, id, inp, len)
     if (code == CONFACK) {
 	if (f->state == ACKRCVD) {
 	    UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
-	    f->state = OPENED;
+	    fsm_setstate(f, OPENED);
 	    if (f->callbacks->up)
 		(*f->callbacks->up)(f);	/* Inform upper layers */
 	} else
-	    f->state = ACKSENT;
+	    fsm_setstate(f, ACKSENT);
 	f->nakloops = 0;
 #ifdef __APPLE__	
 	f->recvreqid = id;
@@ -532,7 +556,7 @@ fsm_rconfreq(f, id, inp, len)
     } else {
 	/* we sent CONFACK or CONFREJ */
 	if (f->state != ACKRCVD)
-	    f->state = REQSENT;
+	    fsm_setstate(f, REQSENT);
 	if( code == CONFNAK )
 	    ++f->nakloops;
     }
@@ -558,6 +582,7 @@ fsm_rconfack(f, id, inp, len)
 	return;
     }
     f->seen_ack = 1;
+    fsm_rtt_sample(f);
 
     switch (f->state) {
     case CLOSED:
@@ -566,7 +591,7 @@ fsm_rconfack(f, id, inp, len)
 	break;
 
     case REQSENT:
-	f->state = ACKRCVD;
+	fsm_setstate(f, ACKRCVD);
 	f->retransmits = f->maxconfreqtransmits;
 	break;
 
@@ -574,12 +599,12 @@ fsm_rconfack(f, id, inp, len)
 	/* Huh? an extra valid Ack? oh well... */
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
 	fsm_sconfreq(f, 0);
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
 
     case ACKSENT:
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
-	f->state = OPENED;
+	fsm_setstate(f, OPENED);
 	f->retransmits = f->maxconfreqtransmits;
 	if (f->callbacks->up)
 	    (*f->callbacks->up)(f);	/* Inform upper layers */
@@ -590,7 +615,7 @@ fsm_rconfack(f, id, inp, len)
 	if (f->callbacks->down)
 	    (*f->callbacks->down)(f);	/* Inform upper layers */
 	fsm_sconfreq(f, 0);		/* Send initial Configure-Request */
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
     }
 }
@@ -618,6 +643,7 @@ fsm_rconfnakrej(f, code, id, inp, len)
 	return;
     }
     f->seen_ack = 1;
+    fsm_rtt_sample(f);
 
     switch (f->state) {
     case CLOSED:
@@ -630,12 +656,12 @@ fsm_rconfnakrej(f, code, id, inp, len)
 	/* They didn't agree to what we wanted - try another request */
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
 	if (ret < 0)
-	    f->state = STOPPED;		/* kludge for stopping CCP */
+	    fsm_setstate(f, STOPPED);		/* kludge for stopping CCP */
 	else {
 #ifdef __APPLE__
             if (f->reqloops >= f->maxreqloops) {
                 warning("%s: Maximum Config-Requests exceeded\n", PROTO_NAME(f));
-                f->state = STOPPED;
+                fsm_setstate(f, STOPPED);
                 if( (f->flags & OPT_PASSIVE) == 0 && f->callbacks->finished )
                     (*f->callbacks->finished)(f);
             }
@@ -649,7 +675,7 @@ fsm_rconfnakrej(f, code, id, inp, len)
 	/* Got a Nak/reject when we had already had an Ack?? oh well... */
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
 	fsm_sconfreq(f, 0);
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
 
     case OPENED:
@@ -657,7 +683,7 @@ fsm_rconfnakrej(f, code, id, inp, len)
 	if (f->callbacks->down)
 	    (*f->callbacks->down)(f);	/* Inform upper layers */
 	fsm_sconfreq(f, 0);		/* Send initial Configure-Request */
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
     }
 }
@@ -676,7 +702,7 @@ fsm_rtermreq(f, id, p, len)
     switch (f->state) {
     case ACKRCVD:
     case ACKSENT:
-	f->state = REQSENT;		/* Start over but keep trying */
+	fsm_setstate(f, REQSENT);		/* Start over but keep trying */
 	break;
 
     case OPENED:
@@ -685,7 +711,7 @@ fsm_rtermreq(f, id, p, len)
 	} else
 	    info("%s terminated by peer", PROTO_NAME(f));
 	f->retransmits = 0;
-	f->state = STOPPING;
+	fsm_setstate(f, STOPPING);
 	if (f->callbacks->down)
 	    (*f->callbacks->down)(f);	/* Inform upper layers */
 	TIMEOUT(fsm_timeout, f, f->timeouttime);
@@ -706,26 +732,26 @@ fsm_rtermack(f)
     switch (f->state) {
     case CLOSING:
 	UNTIMEOUT(fsm_timeout, f);
-	f->state = CLOSED;
+	fsm_setstate(f, CLOSED);
 	if( f->callbacks->finished )
 	    (*f->callbacks->finished)(f);
 	break;
     case STOPPING:
 	UNTIMEOUT(fsm_timeout, f);
-	f->state = STOPPED;
+	fsm_setstate(f, STOPPED);
 	if( f->callbacks->finished )
 	    (*f->callbacks->finished)(f);
 	break;
 
     case ACKRCVD:
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
 
     case OPENED:
 	if (f->callbacks->down)
 	    (*f->callbacks->down)(f);	/* Inform upper layers */
 	fsm_sconfreq(f, 0);
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 	break;
     }
 }
@@ -751,7 +777,7 @@ fsm_rcoderej(f, inp, len)
     warning("%s: Rcvd Code-Reject for code %d, id %d", PROTO_NAME(f), code, id);
 
     if( f->state == ACKRCVD )
-	f->state = REQSENT;
+	fsm_setstate(f, REQSENT);
 }
 
 
@@ -769,7 +795,7 @@ fsm_protreject(f)
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
 	/* fall through */
     case CLOSED:
-	f->state = CLOSED;
+	fsm_setstate(f, CLOSED);
 	if( f->callbacks->finished )
 	    (*f->callbacks->finished)(f);
 	break;
@@ -781,7 +807,7 @@ fsm_protreject(f)
 	UNTIMEOUT(fsm_timeout, f);	/* Cancel timeout */
 	/* fall through */
     case STOPPED:
-	f->state = STOPPED;
+	fsm_setstate(f, STOPPED);
 	if( f->callbacks->finished )
 	    (*f->callbacks->finished)(f);
 	break;
@@ -797,7 +823,7 @@ fsm_protreject(f)
 	TIMEOUT(fsm_timeout, f, f->timeouttime);
 	--f->retransmits;
 
-	f->state = STOPPING;
+	fsm_setstate(f, STOPPING);
 	break;
 
     default:
@@ -855,9 +881,99 @@ fsm_sconfreq(f, retransmit)
     /* send the request to our peer */
     fsm_sdata(f, CONFREQ, f->reqid, outp, cilen);
 
+    /*
+     * Time the first transmission of a request only: a reply to a
+     * retransmitted request is ambiguous (Karn's algorithm).
+     */
+    if (!retransmit) {
+#ifdef __APPLE__
+	f->rtt_valid = (getabsolutetime(&f->reqtime) == 0);
+#else
+	f->rtt_valid = (gettimeofday(&f->reqtime, NULL) == 0);
+#endif
+    } else
+	f->rtt_valid = 0;
+
     /* start the retransmit timer */
     --f->retransmits;
-    TIMEOUT(fsm_timeout, f, f->timeouttime);
+    fsm_settimer(f, retransmit);
+}
+
+
+/*
+ * fsm_settimer - Start the Configure-Request restart timer.
+ *
+ * The timer is derived from this fsm's RTT estimate, or is timeouttime
+ * until we have one, or if the user set the restart time.
+ * Retransmissions double it, up to the larger of timeouttime and the
+ * estimate, so that a lossy link still gives up after about
+ * maxconfreqtransmits * timeouttime.
+ * Terminate-Requests always use timeouttime, a slow peer must be
+ * given the time to ack them.
+ */
+static void
+fsm_settimer(f, backoff)
+    fsm *f;
+    int backoff;
+{
+    int base, limit;
+
+    if (f->srtt && !f->timeout_set) {
+	base = f->srtt + 4 * f->rttvar;
+	if (base < FSM_MINRTO)
+	    base = FSM_MINRTO;
+	if (base > FSM_MAXRTO)
+	    base = FSM_MAXRTO;
+    } else
+	base = f->timeouttime * 1000;
+
+    if (backoff && f->rto) {
+	limit = MAX(base, f->timeouttime * 1000);
+	f->rto = MIN(f->rto * 2, limit);
+    } else
+	f->rto = base;
+
+    timeout(fsm_timeout, f, f->rto / 1000, (f->rto % 1000) * 1000);
+}
+
+
+/*
+ * fsm_rtt_sample - A valid reply to our request has been received,
+ * update the RTT estimate.
+ */
+static void
+fsm_rtt_sample(f)
+    fsm *f;
+{
+    struct timeval now;
+    int rtt;
+
+    if (!f->rtt_valid)
+	return;
+    f->rtt_valid = 0;
+
+#ifdef __APPLE__
+    if (getabsolutetime(&now) < 0)
+#else
+    if (gettimeofday(&now, NULL) < 0)
+#endif
+	return;
+    rtt = (now.tv_sec - f->reqtime.tv_sec) * 1000
+	+ (now.tv_usec - f->reqtime.tv_usec) / 1000;
+    if (rtt < 0)
+	return;
+    if (rtt == 0)
+	rtt = 1;
+
+    if (f->srtt == 0) {
+	f->srtt = rtt;
+	f->rttvar = rtt / 2;
+    } else {
+	f->rttvar = (3 * f->rttvar + abs(f->srtt - rtt)) / 4;
+	f->srtt = (7 * f->srtt + rtt) / 8;
+    }
+    FSMDEBUG(("%s: rtt %d ms, srtt %d ms, rttvar %d ms", PROTO_NAME(f),
+	      rtt, f->srtt, f->rttvar));
 }
 
 
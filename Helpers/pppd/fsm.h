@@ -96,7 +96,13 @@ typedef struct fsm {
     u_char id;			/* Current id */
     u_char reqid;		/* Current request id */
     u_char seen_ack;		/* Have received valid Ack/Nak/Rej to Req */
-    int timeouttime;		/* Timeout time in milliseconds */
+    int timeouttime;		/* Timeout time in seconds */
+    bool timeout_set;		/* timeouttime set by the user */
+    int rto;			/* Current restart timer in milliseconds */
+    int srtt;			/* Smoothed RTT in ms, 0 if no sample yet */
+    int rttvar;			/* RTT variation in ms */
+    struct timeval reqtime;	/* When the current request was first sent */
+    u_char rtt_valid;		/* reqtime can be used for an RTT sample */
     int maxconfreqtransmits;	/* Maximum Configure-Request transmissions */
     int retransmits;		/* Number of retransmissions left */
     int maxtermtransmits;	/* Maximum Terminate-Request transmissions */
@@ -174,6 +180,8 @@ typedef struct fsm_callbacks {
  * Timeouts.
  */
 #define DEFTIMEOUT	3	/* Timeout time in seconds */
+#define FSM_MINRTO	200	/* Min adaptive restart timer (ms) */
+#define FSM_MAXRTO	30000	/* Max adaptive restart timer (ms) */
 #define DEFMAXTERMREQS	2	/* Maximum Terminate-Request transmissions */
 #define DEFMAXCONFREQS	10	/* Maximum Configure-Request transmissions */
 #define DEFMAXNAKLOOPS	5	/* Maximum number of nak loops */
@@ -185,6 +193,7 @@ typedef struct fsm_callbacks {
  * Prototypes
  */
 void fsm_init __P((fsm *));
+void fsm_setstate __P((fsm *, int));
 void fsm_lowerup __P((fsm *));
 void fsm_lowerdown __P((fsm *));
 void fsm_open __P((fsm *));
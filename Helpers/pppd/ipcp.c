@@ -232,7 +232,8 @@ static option_t ipcp_option_list[] = {
       "Nameserver for SMB over TCP/IP for peer" },
 
     { "ipcp-restart", o_int, &ipcp_fsm[0].timeouttime,
-      "Set timeout for IPCP", OPT_PRIO },
+      "Set timeout for IPCP", OPT_PRIO,
+      &ipcp_fsm[0].timeout_set },
     { "ipcp-max-terminate", o_int, &ipcp_fsm[0].maxtermtransmits,
       "Set max #xmits for term-reqs", OPT_PRIO },
     { "ipcp-max-configure", o_int, &ipcp_fsm[0].maxconfreqtransmits,
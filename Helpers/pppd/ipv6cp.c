@@ -273,7 +273,8 @@ static option_t ipv6cp_option_list[] = {
 #endif /* defined(SOL2) */
 
     { "ipv6cp-restart", o_int, &ipv6cp_fsm[0].timeouttime,
-      "Set timeout for IPv6CP", OPT_PRIO },
+      "Set timeout for IPv6CP", OPT_PRIO,
+      &ipv6cp_fsm[0].timeout_set },
     { "ipv6cp-max-terminate", o_int, &ipv6cp_fsm[0].maxtermtransmits,
       "Set max #xmits for term-reqs", OPT_PRIO },
     { "ipv6cp-max-configure", o_int, &ipv6cp_fsm[0].maxconfreqtransmits,
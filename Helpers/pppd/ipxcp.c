@@ -177,7 +177,8 @@ static option_t ipxcp_option_list[] = {
        &ipxcp_wantoptions[0].name },
 
     { "ipxcp-restart", o_int, &ipxcp_fsm[0].timeouttime,
-      "Set timeout for IPXCP", OPT_PRIO },
+      "Set timeout for IPXCP", OPT_PRIO,
+      &ipxcp_fsm[0].timeout_set },
     { "ipxcp-max-terminate", o_int, &ipxcp_fsm[0].maxtermtransmits,
       "Set max #xmits for IPXCP term-reqs", OPT_PRIO },
     { "ipxcp-max-configure", o_int, &ipxcp_fsm[0].maxconfreqtransmits,
@@ -180,7 +180,8 @@ static option_t lcp_option_list[] = {
     { "lcp-echo-interval", o_int, &lcp_echo_interval,
       "Set time in seconds between LCP echo requests", OPT_PRIO },
     { "lcp-restart", o_int, &lcp_fsm[0].timeouttime,
-      "Set time in seconds between LCP retransmissions", OPT_PRIO },
+      "Set time in seconds between LCP retransmissions", OPT_PRIO,
+      &lcp_fsm[0].timeout_set },
     { "lcp-max-terminate", o_int, &lcp_fsm[0].maxtermtransmits,
       "Set maximum number of LCP terminate-request transmissions", OPT_PRIO },
     { "lcp-max-configure", o_int, &lcp_fsm[0].maxconfreqtransmits,
@@ -467,7 +468,7 @@ lcp_close(unit, reason)
 	 * lcp_close() in passive/silent mode when a connection hasn't
 	 * been established.
 	 */
-	f->state = CLOSED;
+	fsm_setstate(f, CLOSED);
 	lcp_finished(f);
 
     } else {
@@ -270,6 +270,7 @@ static void cleanup_db __P((void));
 
 static void handle_events __P((void));
 static void print_link_stats __P((void));
+static void trace_ipup __P((void *, uintptr_t));
 
 extern	char	*ttyname __P((int));
 extern	char	*getlogin __P((void));
@@ -363,6 +364,7 @@ main(argc, argv)
     mainthread_id = pthread_self();
 #endif
     link_stats_valid = 0;
+    add_notifier(&ip_up_notifier, trace_ipup, 0);
     new_phase(PHASE_INITIALIZE);
 
 	
@@ -675,6 +677,7 @@ main(argc, argv)
         if (kill_link)
 			break;
 	devfd = the_channel->connect(&t);
+        trace_event(TRACE_HOOK, "connect", 0, devfd < 0 ? devfd : 0);
 
         if (redialalternate) 
             redialingalternate = !redialingalternate;
@@ -1068,6 +1071,9 @@ handle_events()
     }
 #endif
     waiting = 0;
+#ifdef __APPLE__
+    dispatch_ready_fds();
+#endif
     calltimeout();
 #ifdef __APPLE__
     if (got_sigtstp) {
@@ -1230,6 +1236,7 @@ detach()
 	return;
     if (pipe(pipefd) == -1)
 	pipefd[0] = pipefd[1] = -1;
+    log_flush();
     if ((pid = fork()) < 0) {
 	error("Couldn't detach (fork failed: %m)");
 	die(1);			/* or just return? */
@@ -1260,6 +1267,7 @@ detach()
     complete_read(pipefd[0], numbuf, 1);
     close(pipefd[0]);
 
+    log_async_reinit();
 #ifdef __APPLE__
     sys_reinit();
 #endif    
@@ -1588,12 +1596,187 @@ void
 new_phase(p)
     int p;
 {
+    /* a new connection attempt starts a new trace */
+    if (p == PHASE_SERIALCONN && phase != PHASE_WAITONBUSY)
+	trace_reset();
+    trace_event(TRACE_PHASE, NULL, phase, p);
     phase = p;
     if (new_phase_hook)
 	(*new_phase_hook)(p);
     notify(phasechange, p);
 }
 
+/*
+ * Negotiation latency tracing.
+ * Phase changes, fsm state transitions and auth/channel results are
+ * stamped with monotonic time, and the time spent in each phase is
+ * accumulated, so that we can tell where connection setup time goes.
+ */
+#define TRACE_MAX	256
+#define TRACE_NPHASES	(PHASE_WAITING + 1)
+
+struct trace_ev {
+    struct timeval t;		/* when it happened */
+    short kind;			/* TRACE_xxx */
+    const char *name;		/* protocol or hook name */
+    int from, to;		/* states or result */
+};
+
+static struct trace_ev trace_evs[TRACE_MAX];
+static int trace_count;		/* nb of events recorded */
+static int trace_lost;		/* nb of events that didn't fit */
+static struct timeval trace_start;	/* start of the connection attempt */
+static struct timeval trace_phase_start;	/* start of the current phase */
+static int trace_phase_ms[TRACE_NPHASES];	/* time spent in each phase */
+
+static const char *trace_phase_names[TRACE_NPHASES] = {
+    "dead", "initialize", "serialconn", "dormant", "establish",
+    "authenticate", "callback", "network", "running", "terminate",
+    "disconnect", "holdoff", "onhold", "waitonbusy", "waiting"
+};
+
+static const char *trace_fsm_names[] = {
+    "initial", "starting", "closed", "stopped", "closing",
+    "stopping", "reqsent", "ackrcvd", "acksent", "opened"
+};
+
+/*
+ * trace_gettime - read the monotonic clock.
+ */
+static int
+trace_gettime(tv)
+    struct timeval *tv;
+{
+#ifdef __APPLE__
+    return getabsolutetime(tv);
+#else
+    return gettimeofday(tv, NULL);
+#endif
+}
+
+/*
+ * trace_ms - milliseconds elapsed from a to b.
+ */
+static int
+trace_ms(a, b)
+    struct timeval *a, *b;
+{
+    return (b->tv_sec - a->tv_sec) * 1000 + (b->tv_usec - a->tv_usec) / 1000;
+}
+
+/*
+ * trace_reset - forget the events of the previous connection attempt.
+ */
+void
+trace_reset()
+{
+    trace_count = trace_lost = 0;
+    BZERO(trace_phase_ms, sizeof(trace_phase_ms));
+    if (trace_gettime(&trace_start) < 0)
+	trace_start.tv_sec = trace_start.tv_usec = 0;
+    trace_phase_start = trace_start;
+}
+
+/*
+ * trace_event - record a negotiation event.
+ */
+void
+trace_event(kind, name, from, to)
+    int kind;
+    const char *name;
+    int from, to;
+{
+    struct timeval now;
+    struct trace_ev *ev;
+
+    /* the clock isn't available before sys_init */
+    if (trace_gettime(&now) < 0 || trace_start.tv_sec == 0)
+	return;
+
+    if (kind == TRACE_PHASE) {
+	if (from >= 0 && from < TRACE_NPHASES)
+	    trace_phase_ms[from] += trace_ms(&trace_phase_start, &now);
+	trace_phase_start = now;
+    }
+
+    if (trace_count == TRACE_MAX) {
+	trace_lost++;
+	return;
+    }
+    ev = &trace_evs[trace_count++];
+    ev->t = now;
+    ev->kind = kind;
+    ev->name = name;
+    ev->from = from;
+    ev->to = to;
+}
+
+/*
+ * trace_report - log the negotiation trace.
+ * The per-phase summary is logged, and published if publish is set,
+ * the individual events are only logged in debug mode.
+ */
+void
+trace_report(when, publish)
+    const char *when;
+    int publish;
+{
+    struct timeval now;
+    struct trace_ev *ev;
+    int i, ms[TRACE_NPHASES], total;
+
+    if (trace_start.tv_sec == 0 || trace_gettime(&now) < 0)
+	return;
+
+    for (i = 0; i < trace_count && debug; i++) {
+	ev = &trace_evs[i];
+	total = trace_ms(&trace_start, &ev->t);
+	switch (ev->kind) {
+	case TRACE_PHASE:
+	    dbglog("trace: +%d.%03d phase %s -> %s", total / 1000, total % 1000,
+		   (ev->from >= 0 && ev->from < TRACE_NPHASES) ? trace_phase_names[ev->from] : "?",
+		   (ev->to >= 0 && ev->to < TRACE_NPHASES) ? trace_phase_names[ev->to] : "?");
+	    break;
+	case TRACE_FSM:
+	    dbglog("trace: +%d.%03d %s %s -> %s", total / 1000, total % 1000, ev->name,
+		   (ev->from >= 0 && ev->from <= OPENED) ? trace_fsm_names[ev->from] : "?",
+		   (ev->to >= 0 && ev->to <= OPENED) ? trace_fsm_names[ev->to] : "?");
+	    break;
+	case TRACE_HOOK:
+	    dbglog("trace: +%d.%03d %s 0x%x = %d", total / 1000, total % 1000, ev->name, ev->from, ev->to);
+	    break;
+	}
+    }
+    if (trace_lost)
+	dbglog("trace: %d events not recorded", trace_lost);
+
+    /* include the time spent so far in the current phase */
+    BCOPY(trace_phase_ms, ms, sizeof(ms));
+    if (phase >= 0 && phase < TRACE_NPHASES)
+	ms[phase] += trace_ms(&trace_phase_start, &now);
+    total = trace_ms(&trace_start, &now);
+
+    info("Timing at %s (ms): connect=%d establish=%d authenticate=%d network=%d total=%d",
+	 when, ms[PHASE_SERIALCONN], ms[PHASE_ESTABLISH],
+	 ms[PHASE_AUTHENTICATE], ms[PHASE_NETWORK], total);
+#ifdef __APPLE__
+    if (publish)
+	sys_publish_timing(ms[PHASE_SERIALCONN], ms[PHASE_ESTABLISH],
+			   ms[PHASE_AUTHENTICATE], ms[PHASE_NETWORK], total);
+#endif
+}
+
+/*
+ * trace_ipup - IPCP has come up, report how long it took.
+ */
+static void
+trace_ipup(arg, val)
+    void *arg;
+    uintptr_t val;
+{
+    trace_report("ip-up", 1);
+}
+
 /*
  * die - clean up state and exit with the specified status.
  */
@@ -1605,6 +1788,8 @@ die(status)
 	print_link_stats();
 #endif
     cleanup();
+    /* the exit values are only logged, the PPP entry is about to go away */
+    trace_report("exit", 0);
     notify(exitnotify, status);
     sys_log(LOG_INFO, "Exit.");
     exit(status);
@@ -1677,16 +1862,129 @@ update_link_stats(u)
 }
 
 
+/*
+ * Pending timeouts are kept in a binary min-heap, ordered by expiry time.
+ * Callouts are also hashed on (func, arg), so untimeout doesn't scan them all.
+ * Callout structures are recycled through a free list instead of being
+ * allocated and freed for each timeout.
+ */
 struct	callout {
     struct timeval	c_time;		/* time at which to call routine */
     void		*c_arg;		/* argument to routine */
     void		(*c_func) __P((void *)); /* routine */
-    struct		callout *c_next;
+    u_int32_t		c_seq;		/* insertion order, for equal times */
+    int			c_index;	/* position in the heap */
+    struct		callout *c_next; /* next in hash bucket or free list */
 };
 
-static struct callout *callout = NULL;	/* Callout list */
+#define CALLOUT_HASH_SIZE	64	/* power of 2 */
+#define CALLOUT_HASH(func, arg)	\
+    ((((uintptr_t)(func) >> 2) ^ ((uintptr_t)(arg) >> 3)) & (CALLOUT_HASH_SIZE - 1))
+#define CALLOUT_CHUNK		32	/* callouts allocated at once */
+
+static struct callout **callout_heap = NULL;	/* heap of pending callouts */
+static int callout_count = 0;			/* nb of pending callouts */
+static int callout_size = 0;			/* size of the heap array */
+static struct callout *callout_hash[CALLOUT_HASH_SIZE];
+static struct callout *callout_free = NULL;	/* recycled callouts */
+static u_int32_t callout_seq = 0;
 static struct timeval timenow;		/* Current time */
 
+/*
+ * callout_before - tell if callout a must fire before callout b.
+ */
+static int
+callout_before(a, b)
+    struct callout *a, *b;
+{
+    if (a->c_time.tv_sec != b->c_time.tv_sec)
+	return a->c_time.tv_sec < b->c_time.tv_sec;
+    if (a->c_time.tv_usec != b->c_time.tv_usec)
+	return a->c_time.tv_usec < b->c_time.tv_usec;
+    return (int32_t)(a->c_seq - b->c_seq) < 0;
+}
+
+/*
+ * callout_set - put a callout at a given position in the heap.
+ */
+static void
+callout_set(index, p)
+    int index;
+    struct callout *p;
+{
+    callout_heap[index] = p;
+    p->c_index = index;
+}
+
+/*
+ * callout_up - move a callout towards the top of the heap.
+ */
+static void
+callout_up(index)
+    int index;
+{
+    struct callout *p = callout_heap[index];
+    int parent;
+
+    while (index > 0) {
+	parent = (index - 1) / 2;
+	if (!callout_before(p, callout_heap[parent]))
+	    break;
+	callout_set(index, callout_heap[parent]);
+	index = parent;
+    }
+    callout_set(index, p);
+}
+
+/*
+ * callout_down - move a callout towards the bottom of the heap.
+ */
+static void
+callout_down(index)
+    int index;
+{
+    struct callout *p = callout_heap[index];
+    int child;
+
+    while ((child = 2 * index + 1) < callout_count) {
+	if (child + 1 < callout_count
+	    && callout_before(callout_heap[child + 1], callout_heap[child]))
+	    child++;
+	if (!callout_before(callout_heap[child], p))
+	    break;
+	callout_set(index, callout_heap[child]);
+	index = child;
+    }
+    callout_set(index, p);
+}
+
+/*
+ * callout_remove - take a callout out of the heap and of the hash,
+ * and put it back on the free list.
+ */
+static void
+callout_remove(p)
+    struct callout *p;
+{
+    struct callout **pp;
+    int index = p->c_index;
+
+    for (pp = &callout_hash[CALLOUT_HASH(p->c_func, p->c_arg)]; *pp != p; pp = &(*pp)->c_next)
+	;
+    *pp = p->c_next;
+
+    if (--callout_count != index) {
+	callout_set(index, callout_heap[callout_count]);
+	if (index > 0 && callout_before(callout_heap[index], callout_heap[(index - 1) / 2]))
+	    callout_up(index);
+	else
+	    callout_down(index);
+    }
+
+    p->c_next = callout_free;
+    callout_free = p;
+}
+
 /*
  * timeout - Schedule a timeout.
  */
@@ -1696,18 +1994,38 @@ timeout(func, arg, secs, usecs)
     void *arg;
     int secs, usecs;
 {
-    struct callout *newp, *p, **pp;
+    struct callout *newp;
+    int i;
 
     MAINDEBUG(("Timeout %p:%p in %d.%03d seconds.", func, arg,
 	       secs, usecs/1000));
 
     /*
-     * Allocate timeout.
+     * Get a timeout from the free list, and make room for it in the heap.
      */
-    if ((newp = (struct callout *) malloc(sizeof(struct callout))) == NULL)
-	fatal("Out of memory in timeout()!");
+    if (callout_free == NULL) {
+	if ((newp = (struct callout *) malloc(CALLOUT_CHUNK * sizeof(struct callout))) == NULL)
+	    fatal("Out of memory in timeout()!");
+	for (i = 0; i < CALLOUT_CHUNK; i++) {
+	    newp[i].c_next = callout_free;
+	    callout_free = &newp[i];
+	}
+    }
+    if (callout_count == callout_size) {
+	struct callout **heap;
+	heap = (struct callout **) realloc(callout_heap,
+		(callout_size + CALLOUT_CHUNK) * sizeof(struct callout *));
+	if (heap == NULL)
+	    fatal("Out of memory in timeout()!");
+	callout_heap = heap;
+	callout_size += CALLOUT_CHUNK;
+    }
+    newp = callout_free;
+    callout_free = newp->c_next;
+
     newp->c_arg = arg;
     newp->c_func = func;
+    newp->c_seq = callout_seq++;
 #ifdef __APPLE__
     // timeout get screwed up if you change the current time of the machine...
     // use absolute time instead, as we are just interested in deltas, not actual time.
@@ -1723,15 +2041,13 @@ timeout(func, arg, secs, usecs)
     }
 
     /*
-     * Find correct place and link it in.
+     * Link it in the hash, and in the heap.
      */
-    for (pp = &callout; (p = *pp); pp = &p->c_next)
-	if (newp->c_time.tv_sec < p->c_time.tv_sec
-	    || (newp->c_time.tv_sec == p->c_time.tv_sec
-		&& newp->c_time.tv_usec < p->c_time.tv_usec))
-	    break;
-    newp->c_next = p;
-    *pp = newp;
+    i = CALLOUT_HASH(func, arg);
+    newp->c_next = callout_hash[i];
+    callout_hash[i] = newp;
+    callout_set(callout_count++, newp);
+    callout_up(newp->c_index);
 }
 
 
@@ -1743,19 +2059,19 @@ untimeout(func, arg)
     void (*func) __P((void *));
     void *arg;
 {
-    struct callout **copp, *freep;
+    struct callout *p, *first = NULL;
 
     MAINDEBUG(("Untimeout %p:%p.", func, arg));
 
     /*
-     * Find first matching timeout and remove it from the list.
+     * Find first matching timeout and remove it.
      */
-    for (copp = &callout; (freep = *copp); copp = &freep->c_next)
-	if (freep->c_func == func && freep->c_arg == arg) {
-	    *copp = freep->c_next;
-	    free((char *) freep);
-	    break;
-	}
+    for (p = callout_hash[CALLOUT_HASH(func, arg)]; p; p = p->c_next)
+	if (p->c_func == func && p->c_arg == arg
+	    && (first == NULL || callout_before(p, first)))
+	    first = p;
+    if (first)
+	callout_remove(first);
 }
 
 
@@ -1766,25 +2082,29 @@ static void
 calltimeout()
 {
     struct callout *p;
+    void (*func) __P((void *));
+    void *arg;
 
-    while (callout != NULL) {
-	p = callout;
-
+    /* read the time once, timeouts set by the routines we call will read it again */
 #ifdef __APPLE__
-        if (getabsolutetime(&timenow) < 0)
+    if (getabsolutetime(&timenow) < 0)
 #else
-	if (gettimeofday(&timenow, NULL) < 0)
+    if (gettimeofday(&timenow, NULL) < 0)
 #endif
-	    fatal("Failed to get time of day: %m");
+	fatal("Failed to get time of day: %m");
+
+    while (callout_count > 0) {
+	p = callout_heap[0];
+
 	if (!(p->c_time.tv_sec < timenow.tv_sec
 	      || (p->c_time.tv_sec == timenow.tv_sec
 		  && p->c_time.tv_usec <= timenow.tv_usec)))
 	    break;		/* no, it's not time yet */
 
-	callout = p->c_next;
-	(*p->c_func)(p->c_arg);
-
-	free((char *) p);
+	func = p->c_func;
+	arg = p->c_arg;
+	callout_remove(p);
+	(*func)(arg);
     }
 }
 
@@ -1796,16 +2116,19 @@ static struct timeval *
 timeleft(tvp)
     struct timeval *tvp;
 {
-    if (callout == NULL)
+    struct callout *p;
+
+    if (callout_count == 0)
 	return NULL;
 
+    p = callout_heap[0];
 #ifdef __APPLE__
     getabsolutetime(&timenow);
 #else
     gettimeofday(&timenow, NULL);
 #endif
-    tvp->tv_sec = callout->c_time.tv_sec - timenow.tv_sec;
-    tvp->tv_usec = callout->c_time.tv_usec - timenow.tv_usec;
+    tvp->tv_sec = p->c_time.tv_sec - timenow.tv_sec;
+    tvp->tv_usec = p->c_time.tv_usec - timenow.tv_usec;
     if (tvp->tv_usec < 0) {
 	tvp->tv_usec += 1000000;
 	tvp->tv_sec -= 1;
@@ -2056,6 +2379,7 @@ bad_signal(sig)
     if (crashed)
 	_exit(127);
     crashed = 1;
+    log_async_stop();		/* we may have interrupted log_write */
     error("Fatal signal %d", sig);
     if (conn_running)
 	kill_my_pg(SIGTERM);
@@ -134,6 +134,8 @@ char	passwd[MAXSECRETLEN] = { 0 };	/* Password for PAP */
 bool	persist = 0;		/* Reopen link after it goes down */
 char	our_name[MAXNAMELEN] = { 0 };	/* Our name for authentication purposes */
 bool	demand = 0;		/* do dial-on-demand */
+int	demand_maxbytes = 256 * 1024;	/* max bytes queued while dialing */
+int	demand_maxage = 30;	/* max seconds a queued packet is kept */
 char	*ipparam = NULL;	/* Extra parameter for ip up/down scripts */
 int	idle_time_limit = 0;	/* Disconnect if idle for this many seconds */
 bool   	noidlerecv = 0;         /* Disconnect if idle only for outgoing traffic */
@@ -145,6 +147,7 @@ bool	log_default = 1;	/* log_to_fd is default (stdout) */
 int	maxfail = 10;		/* max # of unsuccessful connection attempts */
 char	linkname[MAXPATHLEN] = { 0 };	/* logical name for link */
 bool	tune_kernel = FALSE;		/* may alter kernel settings */
+bool	qos_propagate = FALSE;		/* copy inner DSCP to the link/tunnel header */
 int	connect_delay = 1000;	/* wait this many ms after connect script */
 int	req_unit = -1;		/* requested interface unit */
 bool	multilink = 0;		/* Enable multilink operation */
@@ -235,6 +238,14 @@ struct option_list {
 
 static struct option_list *extra_options = NULL;
 
+/*
+ * Hash index of the non-wild options, by name.
+ * Built on the first lookup, and again when the set of option lists changes.
+ */
+static option_t **option_hash = NULL;
+static int option_hash_size = 0;		/* power of 2, 0 if not built */
+static struct channel *option_hash_channel = NULL; /* the_channel when built */
+
 /*
  * Valid arguments.
  */
@@ -292,6 +303,10 @@ option_t general_options[] = {
 
     { "demand", o_bool, &demand,
       "Dial on demand", OPT_INITONLY | 1, &persist },
+    { "demand-max-bytes", o_int, &demand_maxbytes,
+      "Max memory (bytes) queued while bringing the link up on demand", OPT_PRIO },
+    { "demand-max-age", o_int, &demand_maxage,
+      "Max seconds a packet is queued while bringing the link up on demand", OPT_PRIO },
 
     { "--version", o_special_noarg, (void *)showversion,
       "Show version number" },
@@ -326,6 +341,11 @@ option_t general_options[] = {
     { "noktune", o_bool, &tune_kernel,
       "Don't alter kernel settings", OPT_PRIOSUB },
 
+    { "qos-propagate", o_bool, &qos_propagate,
+      "Copy the DSCP of IP packets to the link header", OPT_PRIO | 1 },
+    { "noqos-propagate", o_bool, &qos_propagate,
+      "Don't copy the DSCP of IP packets to the link header", OPT_PRIOSUB },
+
     { "connect-delay", o_int, &connect_delay,
       "Maximum time (in ms) to wait after connect script finishes",
       OPT_PRIO },
@@ -686,9 +706,94 @@ match_option(name, opt, dowild)
 }
 
 /*
- * find_option - scan the option lists for the various protocols
- * looking for an entry with the given name.
- * This could be optimized by using a hash table.
+ * option_hash_name - hash an option name.
+ */
+static u_int32_t
+option_hash_name(name)
+    const char *name;
+{
+	u_int32_t h = 2166136261U;
+
+	while (*name)
+		h = (h ^ (u_char) *name++) * 16777619U;
+	return h;
+}
+
+/*
+ * option_hash_insert - add an option to the hash index, unless an
+ * option with the same name is already there: lists are inserted in
+ * lookup order, and the first match wins.
+ */
+static void
+option_hash_insert(opt)
+    option_t *opt;
+{
+	u_int32_t i, mask = option_hash_size - 1;
+
+	if (opt->type == o_wild)
+		return;
+	for (i = option_hash_name(opt->name) & mask; option_hash[i]; i = (i + 1) & mask)
+		if (strcmp(option_hash[i]->name, opt->name) == 0)
+			return;
+	option_hash[i] = opt;
+}
+
+/*
+ * option_hash_build - (re)build the hash index of all the option lists.
+ */
+static void
+option_hash_build()
+{
+	option_t *opt;
+	struct option_list *list;
+	int i, n;
+
+	/* count the options, to size the table at most half full */
+	n = 0;
+	for (opt = general_options; opt->name != NULL; ++opt)
+		n++;
+	for (opt = auth_options; opt->name != NULL; ++opt)
+		n++;
+	for (list = extra_options; list != NULL; list = list->next)
+		for (opt = list->options; opt->name != NULL; ++opt)
+			n++;
+	for (opt = the_channel->options; opt->name != NULL; ++opt)
+		n++;
+	for (i = 0; protocols[i] != NULL; ++i)
+		if ((opt = protocols[i]->options) != NULL)
+			for (; opt->name != NULL; ++opt)
+				n++;
+
+	for (option_hash_size = 64; option_hash_size < 2 * n; option_hash_size <<= 1)
+		;
+	if (option_hash)
+		free(option_hash);
+	option_hash = (option_t **) calloc(option_hash_size, sizeof(option_t *));
+	if (option_hash == NULL)
+		novm("option hash");
+
+	for (opt = general_options; opt->name != NULL; ++opt)
+		option_hash_insert(opt);
+	for (opt = auth_options; opt->name != NULL; ++opt)
+		option_hash_insert(opt);
+	for (list = extra_options; list != NULL; list = list->next)
+		for (opt = list->options; opt->name != NULL; ++opt)
+			option_hash_insert(opt);
+	for (opt = the_channel->options; opt->name != NULL; ++opt)
+		option_hash_insert(opt);
+	for (i = 0; protocols[i] != NULL; ++i)
+		if ((opt = protocols[i]->options) != NULL)
+			for (; opt->name != NULL; ++opt)
+				option_hash_insert(opt);
+
+	option_hash_channel = the_channel;
+}
+
+/*
+ * find_option - look for an entry with the given name in the option
+ * lists for the various protocols.
+ * Plain names are looked up in the hash index, wild options are only
+ * scanned when no plain option matches.
  */
 static option_t *
 find_option(name)
@@ -696,28 +801,35 @@ find_option(name)
 {
 	option_t *opt;
 	struct option_list *list;
-	int i, dowild;
+	u_int32_t h, mask;
+	int i;
 
-	for (dowild = 0; dowild <= 1; ++dowild) {
-		for (opt = general_options; opt->name != NULL; ++opt)
-			if (match_option(name, opt, dowild))
-				return opt;
-		for (opt = auth_options; opt->name != NULL; ++opt)
-			if (match_option(name, opt, dowild))
+	if (option_hash_size == 0 || option_hash_channel != the_channel)
+		option_hash_build();
+
+	mask = option_hash_size - 1;
+	for (h = option_hash_name(name) & mask; (opt = option_hash[h]) != NULL; h = (h + 1) & mask)
+		if (strcmp(name, opt->name) == 0)
+			return opt;
+
+	for (opt = general_options; opt->name != NULL; ++opt)
+		if (match_option(name, opt, 1))
+			return opt;
+	for (opt = auth_options; opt->name != NULL; ++opt)
+		if (match_option(name, opt, 1))
+			return opt;
+	for (list = extra_options; list != NULL; list = list->next)
+		for (opt = list->options; opt->name != NULL; ++opt)
+			if (match_option(name, opt, 1))
 				return opt;
-		for (list = extra_options; list != NULL; list = list->next)
-			for (opt = list->options; opt->name != NULL; ++opt)
-				if (match_option(name, opt, dowild))
+	for (opt = the_channel->options; opt->name != NULL; ++opt)
+		if (match_option(name, opt, 1))
+			return opt;
+	for (i = 0; protocols[i] != NULL; ++i)
+		if ((opt = protocols[i]->options) != NULL)
+			for (; opt->name != NULL; ++opt)
+				if (match_option(name, opt, 1))
 					return opt;
-		for (opt = the_channel->options; opt->name != NULL; ++opt)
-			if (match_option(name, opt, dowild))
-				return opt;
-		for (i = 0; protocols[i] != NULL; ++i)
-			if ((opt = protocols[i]->options) != NULL)
-				for (; opt->name != NULL; ++opt)
-					if (match_option(name, opt, dowild))
-						return opt;
-	}
 	return NULL;
 }
 
@@ -996,6 +1108,9 @@ add_options(opt)
     list->options = opt;
     list->next = extra_options;
     extra_options = list;
+
+    /* the hash index will be rebuilt on the next lookup */
+    option_hash_size = 0;
 }
 
 /*
@@ -1004,8 +1119,10 @@ add_options(opt)
 void
 check_options()
 {
-	if (logfile_fd >= 0 && logfile_fd != log_to_fd)
+	if (logfile_fd >= 0 && logfile_fd != log_to_fd) {
+		log_flush();
 		close(logfile_fd);
+	}
 }
 
 /*
@@ -1750,8 +1867,10 @@ setlogfile(argv)
 #endif
     }
     strlcpy(logfile_name, *argv, sizeof(logfile_name));
-    if (logfile_fd >= 0)
+    if (logfile_fd >= 0) {
+	log_flush();
 	close(logfile_fd);
+    }
     logfile_fd = fd;
     log_to_fd = fd;
     log_default = 0;
@@ -452,6 +452,8 @@ extern char	our_name[MAXNAMELEN];/* Our name for authentication purposes */
 extern char	remote_name[MAXNAMELEN]; /* Peer's name for authentication */
 extern bool	explicit_remote;/* remote_name specified with remotename opt */
 extern bool	demand;		/* Do dial-on-demand */
+extern int	demand_maxbytes;/* Max bytes queued while dialing */
+extern int	demand_maxage;	/* Max seconds a packet stays queued */
 extern char	*ipparam;	/* Extra parameter for ip up/down scripts */
 extern bool	cryptpap;	/* Others' PAP passwords are encrypted */
 extern int	idle_time_limit;/* Shut down link if idle for this long */
@@ -477,6 +479,7 @@ extern bool	sync_serial;	/* Device is synchronous serial device */
 extern int	maxfail;	/* Max # of unsuccessful connection attempts */
 extern char	linkname[MAXPATHLEN]; /* logical name for link */
 extern bool	tune_kernel;	/* May alter kernel settings as necessary */
+extern bool	qos_propagate;	/* Copy inner DSCP to the link/tunnel header */
 extern int	connect_delay;	/* Time to delay after connect script */
 extern int	max_data_rate;	/* max bytes/sec through charshunt */
 extern int	req_unit;	/* interface unit number to use */
@@ -557,6 +560,13 @@ extern int  option_priority;	/* priority of current options */
 #define PHASE_WAITING		14
 #endif
 
+/*
+ * Kinds of negotiation trace events.
+ */
+#define TRACE_PHASE		0	/* phase change: from, to */
+#define TRACE_FSM		1	/* fsm state transition: from, to */
+#define TRACE_HOOK		2	/* auth or channel hook: result in to */
+
 /*
  * The following struct gives the addresses of procedures to call
  * for a particular protocol.
@@ -683,6 +693,10 @@ void update_link_stats __P((int)); /* Get stats at link termination */
 void script_setenv __P((char *, char *, int));	/* set script env var */
 void script_unsetenv __P((char *));		/* unset script env var */
 void new_phase __P((int));	/* signal start of new phase */
+void trace_reset __P((void));	/* start a new negotiation trace */
+void trace_event __P((int, const char *, int, int));
+				/* record a timestamped negotiation event */
+void trace_report __P((const char *, int)); /* log the negotiation trace */
 void add_notifier __P((struct notifier **, notify_func, void *));
 void add_notifier_last __P((struct notifier **, notify_func, void *));
 void remove_notifier __P((struct notifier **, notify_func, void *));
@@ -705,6 +719,9 @@ int vslprintf __P((char *, int, char *, va_list));	/* vsprintf++ */
 size_t strlcpy __P((char *, const char *, size_t));	/* safe strcpy */
 size_t strlcat __P((char *, const char *, size_t));	/* safe strncpy */
 #endif
+void log_flush __P((void));	/* wait for queued log lines to be written */
+void log_async_reinit __P((void)); /* restart the log writer after fork */
+void log_async_stop __P((void));	/* log synchronously, signal safe */
 void dbglog __P((char *, ...));	/* log a debug message */
 void info __P((char *, ...));	/* log an informational message */
 void notice __P((char *, ...));	/* log a notice-level message */
@@ -823,6 +840,8 @@ void auth_check_options __P((void));
 void auth_reset __P((int));	/* check what secrets we have */
 int  check_passwd __P((int, u_char *, int, u_char *, int, char **));
 				/* Check peer-supplied username/password */
+int  check_passwd_done __P((int, int));
+				/* pap_auth_hook has completed asynchronously */
 int  get_secret __P((int, u_char *, u_char *, u_char *, int *, int));
 				/* get "secret" for chap */
 int  get_srp_secret __P((int unit, char *client, char *server, char *secret,
@@ -885,8 +904,12 @@ int sys_check_controller(void);
 int sys_setup_security_session(void);
 int sys_loadplugin(char *arg);
 void sys_publish_remoteaddress(char *addr);
+void sys_publish_timing(int connect, int establish, int authenticate, int network, int total);
 int getabsolutetime(struct timeval *timenow);
-bool is_ready_fd(int fd);	/* check if fd is ready (out of select) */
+bool is_ready_fd(int fd);	/* check if fd is ready (out of wait_input) */
+void add_fd_handler(int fd, void (*handler)(int, void *), void *arg);
+				/* Add fd with a readiness callback */
+void dispatch_ready_fds(void);	/* Call the callbacks of the ready fds */
 void set_up_tty_local __P((int, int)); /* Set up port's 'local' parameters only. */
 void ppp_hold __P((int unit));	/* stop ppp traffic on this link */
 void ppp_cont __P((int unit));	/* resume ppp traffic on this link */
@@ -1024,6 +1047,12 @@ extern int (*pap_check_hook) __P((void));
 extern int (*pap_auth_hook) __P((char *user, char *passwd, char **msgp,
 				 struct wordlist **paddrs,
 				 struct wordlist **popts));
+/*
+ * A pap_auth_hook may return PAP_VERIFY_PENDING when it cannot decide
+ * right away; it must then report the result later with pap_verify_done.
+ */
+#define PAP_VERIFY_PENDING	(-3)
+extern void pap_verify_done __P((int unit, int ok, char *msg));
 extern void (*pap_logout_hook) __P((void));
 extern int (*pap_passwd_hook) __P((char *user, char *passwd));
 extern int (*allowed_address_hook) __P((u_int32_t addr));
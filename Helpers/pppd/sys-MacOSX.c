@@ -67,6 +67,9 @@
 #include <sys/wait.h>
 #include <sys/un.h>
 #include <sys/ucred.h>
+#include <sys/event.h>
+#include <sys/mman.h>
+#include <poll.h>
 #import "acsp.h"
 #ifdef PPP_FILTER
 #include <net/bpf.h>
@@ -207,9 +210,19 @@ static struct winsize 	wsinfo;			/* Initial window size info */
 
 static int 		ip_sockfd;		/* socket for doing interface ioctls */
 
-static fd_set 		in_fds;			/* set of fds that wait_input waits for */
-static fd_set 		ready_fds;		/* set of fds currently ready (out of select) */
-static int 		max_in_fd;		/* highest fd set in in_fds */
+/* event loop: fds that wait_input waits for are registered with a kqueue */
+#define EV_BATCH	64			/* max events collected per wait_input */
+struct fd_entry {
+    u_int8_t		registered;		/* fd is registered with the kqueue */
+    u_int8_t		ready;			/* fd was returned by the last wait_input */
+    void		(*handler)(int, void *);	/* optional readiness callback */
+    void		*arg;			/* callback argument */
+};
+static int 		ev_kq = -1;		/* kqueue wait_input waits on */
+static struct fd_entry	*ev_fds;		/* fd table, indexed by fd */
+static int 		ev_nfds;		/* size of ev_fds */
+static int 		ev_ready[EV_BATCH];	/* fds currently ready (out of kevent) */
+static int 		ev_nready;		/* nb of entries in ev_ready */
 
 static int 		if_is_up;		/* the interface is currently up */
 static int		ipv4_plumbed = 0; 	/* is ipv4 plumbed on the interface ? */
@@ -234,6 +247,8 @@ bool	 		noload = 0;		/* don't load the kernel extension */
 bool                    looplocal = 0;  /* Don't loop local traffic destined to the local address some applications rely on this default behavior */
 bool            addifroute = 0;  /* install route for the netmask of the interface */
 bool            noipv6override = 0;  /* don't override IPv6 traffic if IPv4 is primary */
+char			*pcapfile = NULL;	/* record packets to this pcapng file */
+bool			pcapcontrolonly = 0;	/* record only control protocol packets */
 
 static struct in_addr		ifroute_address;
 static struct in_addr		ifroute_mask;
@@ -264,6 +279,10 @@ option_t sys_options[] = {
       "Don't loop local traffic destined to the local address", 0},
     { "noipv6override", o_bool, &noipv6override,
       "Don't override other IPv6 interfaces if ppp is default for IPv4", 1},
+    { "pcapfile", o_string, &pcapfile,
+      "Record packets sent/received to a pcapng file", OPT_PRIO | OPT_PRIV},
+    { "pcap-control-only", o_bool, &pcapcontrolonly,
+      "Record only control protocol packets in the pcapng file", 1},
     { NULL }
 };
 
@@ -866,10 +885,6 @@ void sys_init()
         timeScaleMicroSeconds = ((double) timebaseInfo.numer / (double) timebaseInfo.denom) / 1000;
         timeScaleSeconds = timeScaleMicroSeconds / 1000000;
     }
-
-    FD_ZERO(&in_fds);
-    FD_ZERO(&ready_fds);
-    max_in_fd = 0;
 }
 
 /* ----------------------------------------------------------------------------- 
@@ -1339,6 +1354,12 @@ int generic_establish_ppp (int fd, UInt8 *delegate)
         looped = 0;
     }
 
+    // let the link copy the DSCP of ip packets to its tunnel or ethernet header
+    if (qos_propagate)
+        set_flags(ppp_sockfd, get_flags(ppp_sockfd) | SC_QOS_PROPAGATE);
+    else
+        set_flags(ppp_sockfd, get_flags(ppp_sockfd) & ~SC_QOS_PROPAGATE);
+
     if (!multilink) {
         add_fd(ppp_sockfd);
         if (ioctl(s, PPPIOCCONNECT, &ifunit) < 0) {
@@ -1597,6 +1618,175 @@ int open_ppp_loopback()
     return ppp_sockfd;
 }
 
+/* -----------------------------------------------------------------------------
+pcapng recorder
+packets are appended as Enhanced Packet Blocks with nanosecond timestamps
+and LINKTYPE_PPP_WITH_DIR framing, through a window of the file mapped in
+memory: recording a packet is a memcpy, the kernel writes the pages back.
+the file is preallocated by windows and trimmed to its real size on close
+----------------------------------------------------------------------------- */
+#define PCAPNG_SHB		0x0A0D0D0A	/* section header block */
+#define PCAPNG_IDB		0x00000001	/* interface description block */
+#define PCAPNG_EPB		0x00000006	/* enhanced packet block */
+#define PCAPNG_BOM		0x1A2B3C4D	/* byte order magic */
+#define LINKTYPE_PPP_WITH_DIR	204
+#define PCAP_WINDOW		(1024 * 1024)	/* size of the mapped window */
+
+static int 		pcap_fd = -1;
+static u_char		*pcap_map;		/* mapped window */
+static off_t		pcap_map_off;		/* file offset of the window */
+static size_t		pcap_map_pos;		/* write position in the window */
+static int		pcap_failed;		/* don't retry after an error */
+
+/* -----------------------------------------------------------------------------
+make room for len bytes in the mapped window, sliding it if needed
+----------------------------------------------------------------------------- */
+static u_char *pcap_reserve(size_t len)
+{
+    size_t 	pagesize = getpagesize(), keep;
+    off_t	off;
+
+    if (pcap_map && pcap_map_pos + len <= PCAP_WINDOW)
+        return pcap_map + pcap_map_pos;
+
+    // slide the window to the page holding the write position
+    off = pcap_map_off + (pcap_map_pos & ~(pagesize - 1));
+    keep = pcap_map_pos & (pagesize - 1);
+    if (pcap_map)
+        munmap(pcap_map, PCAP_WINDOW);
+    pcap_map = NULL;
+    if (keep + len > PCAP_WINDOW
+        || ftruncate(pcap_fd, off + PCAP_WINDOW) < 0)
+        return NULL;
+    pcap_map = mmap(NULL, PCAP_WINDOW, PROT_READ | PROT_WRITE, MAP_SHARED, pcap_fd, off);
+    if (pcap_map == MAP_FAILED) {
+        pcap_map = NULL;
+        return NULL;
+    }
+    pcap_map_off = off;
+    pcap_map_pos = keep;
+    return pcap_map + pcap_map_pos;
+}
+
+/* -----------------------------------------------------------------------------
+close the capture, trimming the preallocated space
+----------------------------------------------------------------------------- */
+static void pcap_close(void)
+{
+    if (pcap_fd < 0)
+        return;
+    if (pcap_map)
+        munmap(pcap_map, PCAP_WINDOW);
+    ftruncate(pcap_fd, pcap_map_off + pcap_map_pos);
+    close(pcap_fd);
+    pcap_fd = -1;
+    pcap_map = NULL;
+}
+
+/* -----------------------------------------------------------------------------
+we are exiting, close the capture
+----------------------------------------------------------------------------- */
+static void pcap_exitnotify(void *arg, uintptr_t exitcode)
+{
+    pcap_close();
+}
+
+/* -----------------------------------------------------------------------------
+create the capture file, and write the section and interface headers
+----------------------------------------------------------------------------- */
+static int pcap_open(void)
+{
+    u_int32_t	*hdr;
+
+    pcap_fd = open(pcapfile, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (pcap_fd < 0) {
+        error("Can't create pcap file %s: %m", pcapfile);
+        return -1;
+    }
+    fcntl(pcap_fd, F_SETFD, FD_CLOEXEC);
+    pcap_map_off = 0;
+    pcap_map_pos = 0;
+
+    if ((hdr = (u_int32_t *)pcap_reserve(28 + 32)) == NULL) {
+        error("Can't map pcap file %s: %m", pcapfile);
+        close(pcap_fd);
+        pcap_fd = -1;
+        return -1;
+    }
+
+    // section header block, version 1.0, unknown section length
+    hdr[0] = PCAPNG_SHB;
+    hdr[1] = 28;
+    hdr[2] = PCAPNG_BOM;
+    ((u_int16_t *)hdr)[6] = 1;
+    ((u_int16_t *)hdr)[7] = 0;
+    hdr[4] = 0xFFFFFFFF;
+    hdr[5] = 0xFFFFFFFF;
+    hdr[6] = 28;
+
+    // interface description block, no snaplen, with if_tsresol = 10^-9
+    hdr[7] = PCAPNG_IDB;
+    hdr[8] = 32;
+    ((u_int16_t *)hdr)[18] = LINKTYPE_PPP_WITH_DIR;
+    ((u_int16_t *)hdr)[19] = 0;
+    hdr[10] = 0;
+    ((u_int16_t *)hdr)[22] = 9;		// option if_tsresol
+    ((u_int16_t *)hdr)[23] = 1;		// length
+    hdr[12] = 0;
+    ((u_char *)hdr)[48] = 9;		// nanoseconds, padded
+    hdr[13] = 0;			// opt_endofopt
+    hdr[14] = 32;
+    pcap_map_pos += 28 + 32;
+
+    add_notifier(&exitnotify, pcap_exitnotify, 0);
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+record a packet, starting with the FF03 header. dir is 1 if sent, 0 if received
+----------------------------------------------------------------------------- */
+static void pcap_record(int dir, u_char *p, int len)
+{
+    struct timespec	ts;
+    u_int64_t		ns;
+    u_int32_t		*blk, caplen, blen;
+
+    if (pcap_failed || len < PPP_HDRLEN)
+        return;
+    // control protocols have the high bit set (0xC021, 0x8021, ...)
+    if (pcapcontrolonly && !(p[2] & 0x80))
+        return;
+    if (pcap_fd < 0 && pcap_open() < 0) {
+        pcap_failed = 1;
+        return;
+    }
+
+    caplen = len + 1;				// direction byte
+    blen = 28 + ((caplen + 3) & ~3) + 4;
+    if ((blk = (u_int32_t *)pcap_reserve(blen)) == NULL) {
+        error("Can't extend pcap file %s: %m", pcapfile);
+        pcap_failed = 1;
+        pcap_close();
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ns = (u_int64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    blk[0] = PCAPNG_EPB;
+    blk[1] = blen;
+    blk[2] = 0;					// interface id
+    blk[3] = (u_int32_t)(ns >> 32);
+    blk[4] = (u_int32_t)ns;
+    blk[5] = caplen;
+    blk[6] = caplen;
+    ((u_char *)blk)[28] = dir;
+    memcpy((u_char *)blk + 29, p, len);
+    bzero((u_char *)blk + 28 + caplen, blen - 4 - 28 - caplen);
+    blk[blen / 4 - 1] = blen;
+    pcap_map_pos += blen;
+}
+
 /* -----------------------------------------------------------------------------
 Output PPP packet
 ----------------------------------------------------------------------------- */
@@ -1604,6 +1794,8 @@ void output(int unit, u_char *p, int len)
 {
 
     dump_packet("sent", p, len);
+    if (pcapfile)
+        pcap_record(1, p, len);
     
     // don't write FF03
     len -= 2;
@@ -1619,22 +1811,132 @@ void output(int unit, u_char *p, int len)
     }
 }
 
+/* -----------------------------------------------------------------------------
+register fd with the kqueue for read events
+----------------------------------------------------------------------------- */
+static int ev_register(int fd)
+{
+    struct kevent ev;
+
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+    return kevent(ev_kq, &ev, 1, NULL, 0, NULL);
+}
+
+/* -----------------------------------------------------------------------------
+create the kqueue and register all the fds currently in the table.
+kqueues are not inherited across fork, so this is also used by sys_reinit
+----------------------------------------------------------------------------- */
+static void ev_open()
+{
+    int fd;
+
+    if (ev_kq >= 0)
+        close(ev_kq);
+    ev_kq = kqueue();
+    if (ev_kq < 0)
+        fatal("kqueue: %m");
+    fcntl(ev_kq, F_SETFD, FD_CLOEXEC);
+
+    ev_nready = 0;
+    for (fd = 0; fd < ev_nfds; fd++) {
+        ev_fds[fd].ready = 0;
+        if (ev_fds[fd].registered && ev_register(fd) < 0)
+            error("kevent: can't register fd %d: %m", fd);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+return the table entry for fd, growing the table if needed
+----------------------------------------------------------------------------- */
+static struct fd_entry *ev_entry(int fd)
+{
+    struct fd_entry *fds;
+    int n;
+
+    if (fd >= ev_nfds) {
+        n = ev_nfds ? ev_nfds : 64;
+        while (n <= fd)
+            n *= 2;
+        fds = realloc(ev_fds, n * sizeof(*fds));
+        if (fds == NULL)
+            novm("fd table");
+        bzero(&fds[ev_nfds], (n - ev_nfds) * sizeof(*fds));
+        ev_fds = fds;
+        ev_nfds = n;
+    }
+    return &ev_fds[fd];
+}
+
+/* -----------------------------------------------------------------------------
+forget the result of the previous wait_input
+----------------------------------------------------------------------------- */
+static void ev_clear_ready()
+{
+    int i;
+
+    for (i = 0; i < ev_nready; i++)
+        if (ev_ready[i] < ev_nfds)
+            ev_fds[ev_ready[i]].ready = 0;
+    ev_nready = 0;
+}
+
 /* -----------------------------------------------------------------------------
 wait until there is data available, for the length of time specified by *timo
 (indefinite if timo is NULL)
 ----------------------------------------------------------------------------- */
 void wait_input(struct timeval *timo)
 {
-    int n;
+    struct kevent events[EV_BATCH];
+    struct timespec ts, *tsp = NULL;
+    int i, n, fd;
+
+    ev_clear_ready();
+    if (ev_kq < 0)
+        ev_open();
+
+    if (timo) {
+        ts.tv_sec = timo->tv_sec;
+        ts.tv_nsec = timo->tv_usec * 1000;
+        tsp = &ts;
+    }
+
+    n = kevent(ev_kq, NULL, 0, events, EV_BATCH, tsp);
+    if (n < 0 && errno != EINTR)
+	fatal("kevent: %m");
+
+    for (i = 0; i < n; i++) {
+        fd = events[i].ident;
+        if (events[i].flags & EV_ERROR)
+            continue;
+        if (fd >= ev_nfds || !ev_fds[fd].registered)
+            continue;
+        /* fill in the list before flagging the entry, we may be interrupted */
+        ev_ready[ev_nready] = fd;
+        ev_nready++;
+        ev_fds[fd].ready = 1;
+    }
+}
 
-    ready_fds = in_fds;
-    n = select(max_in_fd + 1, &ready_fds, NULL, NULL, timo);
-   if (n < 0 && errno != EINTR)
-	fatal("select: %m");
+/* -----------------------------------------------------------------------------
+call the handlers of the fds returned by the last wait_input
+must be called outside of the wait_input/siglongjmp window
+----------------------------------------------------------------------------- */
+void dispatch_ready_fds()
+{
+    struct fd_entry *entry;
+    int i, fd;
 
-   if (n < 0) {
-        FD_ZERO(&ready_fds);
-   }
+    for (i = 0; i < ev_nready; i++) {
+        fd = ev_ready[i];
+        if (fd >= ev_nfds)
+            continue;
+        entry = &ev_fds[fd];
+        /* a previous handler may have removed this fd */
+        if (entry->ready && entry->registered && entry->handler)
+            (*entry->handler)(fd, entry->arg);
+    }
+    /* don't dispatch again if the next wait_input is skipped by a signal */
+    ev_clear_ready();
 }
 
 /* -----------------------------------------------------------------------------
@@ -1643,18 +1945,15 @@ return 0 if timeout expires, < 0 if error, otherwise > 0
 ----------------------------------------------------------------------------- */
 int wait_input_fd(int fd, int delay)
 {
-    fd_set 		ready;
+    struct pollfd 	pfd;
     int 		n;
-    struct timeval 	t;
 
-    t.tv_sec = delay / 1000;
-    t.tv_usec = delay % 1000;
-
-    FD_ZERO(&ready);
-    FD_SET(fd, &ready);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
 
     do {
-        n = select(fd + 1, &ready, NULL, &ready, &t);
+        n = poll(&pfd, 1, delay);
     } while (n < 0 && errno == EINTR);
     
     if (n > 0)
@@ -1670,9 +1969,32 @@ add an fd to the set that wait_input waits for
 ----------------------------------------------------------------------------- */
 void add_fd(int fd)
 {
-    FD_SET(fd, &in_fds);
-    if (fd > max_in_fd)
-	max_in_fd = fd;
+    add_fd_handler(fd, NULL, NULL);
+}
+
+/* -----------------------------------------------------------------------------
+add an fd to the set that wait_input waits for,
+handler will be called by dispatch_ready_fds when the fd is readable
+----------------------------------------------------------------------------- */
+void add_fd_handler(int fd, void (*handler)(int, void *), void *arg)
+{
+    struct fd_entry *entry;
+
+    if (fd < 0)
+        return;
+    if (ev_kq < 0)
+        ev_open();
+
+    entry = ev_entry(fd);
+    entry->handler = handler;
+    entry->arg = arg;
+    if (entry->registered)
+        return;
+    if (ev_register(fd) < 0) {
+        error("kevent: can't register fd %d: %m", fd);
+        return;
+    }
+    entry->registered = 1;
 }
 
 /* -----------------------------------------------------------------------------
@@ -1680,15 +2002,26 @@ remove an fd from the set that wait_input waits for
 ----------------------------------------------------------------------------- */
 void remove_fd(int fd)
 {
-    FD_CLR(fd, &in_fds);
+    struct fd_entry *entry;
+    struct kevent ev;
+
+    if (fd < 0 || fd >= ev_nfds)
+        return;
+    entry = &ev_fds[fd];
+    if (entry->registered && ev_kq >= 0) {
+        /* fails harmlessly if fd was already closed */
+        EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, 0);
+        kevent(ev_kq, &ev, 1, NULL, 0, NULL);
+    }
+    bzero(entry, sizeof(*entry));
 }
 
 /* -----------------------------------------------------------------------------
-return 1 is fd is set (i.e. select returned with this file descriptor set)
+return 1 is fd is set (i.e. kevent returned with this file descriptor ready)
 ----------------------------------------------------------------------------- */
 bool is_ready_fd(int fd)
 {
-    return (FD_ISSET(fd, &ready_fds) != 0);
+    return (fd >= 0 && fd < ev_nfds && ev_fds[fd].ready);
 }
 
 /* -----------------------------------------------------------------------------
@@ -1717,6 +2050,8 @@ int read_packet(u_char *buf)
                 error("read from socket bundle: %m");
         }
     }
+    if (len > 0 && pcapfile)
+        pcap_record(0, buf - 2, len + 2);
     return (len <= 0 ? len : len + 2);
 }
 
@@ -3772,6 +4107,19 @@ void sys_publish_remoteaddress(char *addr)
         publish_dictstrentry(kSCEntNetPPP, kSCPropNetPPPCommRemoteAddress, addr, kCFStringEncodingUTF8);
 }
 
+/* -----------------------------------------------------------------------------
+publish the negotiation timing, in milliseconds, so that vpnd and the
+controller can collect it
+----------------------------------------------------------------------------- */
+void sys_publish_timing(int connect, int establish, int authenticate, int network, int total)
+{
+    publish_dictnumentry(kSCEntNetPPP, CFSTR("TimingConnect"), connect);
+    publish_dictnumentry(kSCEntNetPPP, CFSTR("TimingEstablish"), establish);
+    publish_dictnumentry(kSCEntNetPPP, CFSTR("TimingAuthenticate"), authenticate);
+    publish_dictnumentry(kSCEntNetPPP, CFSTR("TimingNetwork"), network);
+    publish_dictnumentry(kSCEntNetPPP, CFSTR("TimingTotal"), total);
+}
+
 /* -----------------------------------------------------------------------------
 our pid has changed, reinit things
 ----------------------------------------------------------------------------- */
@@ -3783,6 +4131,12 @@ void sys_reinit()
         fatal("SCDynamicStoreCreate failed: %s", SCErrorString(SCError()));
     
     publish_dictnumentry(kSCEntNetPPP, CFSTR("pid"), getpid());
+
+    /* the kqueue was not inherited from our parent */
+    if (ev_kq >= 0) {
+        ev_kq = -1;
+        ev_open();
+    }
 }
 
 /* ----------------------------------------------------------------------------- 
@@ -141,6 +141,7 @@ upap_state upap[NUM_PPP];		/* UPAP state; one for each unit */
 static void upap_timeout __P((void *));
 static void upap_reqtimeout __P((void *));
 static void upap_rauthreq __P((upap_state *, u_char *, int, int));
+static void upap_sresult __P((upap_state *, int, int, char *, u_char *, int));
 static void upap_rauthack __P((upap_state *, u_char *, int, int));
 static void upap_rauthnak __P((upap_state *, u_char *, int, int));
 static void upap_sauthreq __P((upap_state *));
@@ -328,7 +329,8 @@ upap_protrej(unit)
 	error("PAP authentication failed due to protocol-reject");
 	auth_withpeer_fail(unit, PPP_PAP);
     }
-    if (u->us_serverstate == UPAPSS_LISTEN) {
+    if (u->us_serverstate == UPAPSS_LISTEN ||
+	u->us_serverstate == UPAPSS_VERIFY) {
 	error("PAP authentication of peer failed (protocol-reject)");
 	auth_peer_fail(unit, PPP_PAP);
     }
@@ -406,14 +408,18 @@ upap_rauthreq(u, inp, id, len)
 {
     u_char ruserlen, rpasswdlen;
     u_char *ruser, *rpasswd;
-    char rhostname[256];
     int retcode;
     char *msg;
-    int msglen;
 
     if (u->us_serverstate < UPAPSS_LISTEN)
 	return;
 
+    /*
+     * A retransmission of the authenticate-request we are verifying.
+     */
+    if (u->us_serverstate == UPAPSS_VERIFY)
+	return;
+
     /*
      * If we receive a duplicate authenticate-request, we are
      * supposed to return the same status as for the first request.
@@ -456,6 +462,58 @@ upap_rauthreq(u, inp, id, len)
 			   rpasswdlen, &msg);
     BZERO(rpasswd, rpasswdlen);
 
+    if (retcode == PAP_VERIFY_PENDING) {
+	/* the result will come through pap_verify_done */
+	u->us_serverstate = UPAPSS_VERIFY;
+	u->us_verifyid = id;
+	BCOPY(ruser, u->us_verifyuser, ruserlen);
+	u->us_verifyuserlen = ruserlen;
+	if (u->us_reqtimeout > 0)
+	    UNTIMEOUT(upap_reqtimeout, u);
+	return;
+    }
+
+    upap_sresult(u, retcode, id, msg, ruser, ruserlen);
+}
+
+
+/*
+ * pap_verify_done - the pap_auth_hook has completed asynchronously.
+ * ok has the same meaning as the return value of pap_auth_hook.
+ * The result is ignored if the link went down in the meantime.
+ */
+void
+pap_verify_done(unit, ok, msg)
+    int unit;
+    int ok;
+    char *msg;
+{
+    upap_state *u = &upap[unit];
+
+    if (u->us_serverstate != UPAPSS_VERIFY)
+	return;
+
+    upap_sresult(u, check_passwd_done(unit, ok), u->us_verifyid,
+		 msg ? msg : "", u->us_verifyuser, u->us_verifyuserlen);
+}
+
+
+/*
+ * upap_sresult - Send the result of the peer's authentication,
+ * and update our state accordingly.
+ */
+static void
+upap_sresult(u, retcode, id, msg, ruser, ruserlen)
+    upap_state *u;
+    int retcode;
+    int id;
+    char *msg;
+    u_char *ruser;
+    int ruserlen;
+{
+    char rhostname[256];
+    int msglen;
+
     /*
      * Check remote number authorization.  A plugin may have filled in
      * the remote number or added an allowed number, and rather than
@@ -94,6 +94,9 @@ typedef struct upap_state {
     int us_transmits;		/* Number of auth-reqs sent */
     int us_maxtransmits;	/* Maximum number of auth-reqs to send */
     int us_reqtimeout;		/* Time to wait for auth-req from peer */
+    u_char us_verifyid;		/* Id of the auth-req being verified */
+    u_char us_verifyuser[256];	/* User of the auth-req being verified */
+    int us_verifyuserlen;	/* User length */
 } upap_state;
 
 
@@ -116,6 +119,7 @@ typedef struct upap_state {
 #define UPAPSS_LISTEN	3	/* Listening for an Authenticate */
 #define UPAPSS_OPEN	4	/* We've sent an Ack */
 #define UPAPSS_BADAUTH	5	/* We've sent a Nak */
+#define UPAPSS_VERIFY	6	/* Waiting for pap_verify_done */
 
 
 /*
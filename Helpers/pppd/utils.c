@@ -76,7 +76,9 @@
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #ifdef SVR4
 #include <sys/mkdev.h>
 #endif
@@ -103,6 +105,7 @@ extern char *strerror();
 
 static void logit __P((int, char *, va_list));
 static void log_write __P((int, char *));
+static int log_async_put __P((int, char *, int, char *, int));
 static void vslp_printer __P((void *, char *, ...));
 static void format_packet __P((u_char *, int, void (*) (void *, char *, ...),
 			       void *));
@@ -742,9 +745,10 @@ log_write(level, buf)
 {
 #ifdef __APPLE__
     time_t t;
-    int ns;
+    int ns = 0;
     char s[64];
 #endif
+    int queued;
 
     sys_log(level, "%s", buf);
     if (log_to_fd >= 0 && (level != LOG_DEBUG || debug)) {
@@ -753,18 +757,334 @@ log_write(level, buf)
 #ifdef __APPLE__
 	time(&t);
 	ns = strftime(s, sizeof(s), "%c : ", localtime(&t));
-        if (write(log_to_fd, s, ns) != ns)
-            log_to_fd = -1;
 #endif
-
 	if (n > 0 && buf[n-1] == '\n')
 	    --n;
-	if (write(log_to_fd, buf, n) != n
-	    || write(log_to_fd, "\n", 1) != 1)
+
+#ifdef __APPLE__
+	queued = log_async_put(log_to_fd, s, ns, buf, n);
+#else
+	queued = log_async_put(log_to_fd, NULL, 0, buf, n);
+#endif
+	if (queued) {
+	    if (queued < 0)
+		log_to_fd = -1;		/* the writer thread couldn't write it */
+	    return;
+	}
+#ifdef __APPLE__
+        if (write(log_to_fd, s, ns) != ns)
+            log_to_fd = -1;
+#endif
+	if (log_to_fd >= 0 && (write(log_to_fd, buf, n) != n
+	    || write(log_to_fd, "\n", 1) != 1))
 	    log_to_fd = -1;
     }
 }
 
+/*
+ * Asynchronous log file writer.
+ * log_write only copies the formatted line in a ring of fixed size
+ * slots, a background thread writes the pending lines in batches.
+ * The lines must be formatted by the caller, as their arguments
+ * (packets, strings) don't outlive the call.
+ * When the ring is full, lines are dropped and counted, and the
+ * count is written with the next batch.
+ * A failed write is reported back to log_write, which stops logging
+ * to that fd as the synchronous path does.
+ * Lines logged from a signal handler must not take log_mtx, the
+ * handler calls log_async_stop first and they are written synchronously.
+ * log_async_stop and the writer synchronize through log_writer_writing
+ * and log_written only, without the lock.
+ */
+#define LOG_RING_SLOTS	128			/* must be a power of 2 */
+#define LOG_SLOT_LEN	1024			/* max line length, with prefix */
+#define LOG_BATCH	32			/* max lines per writev */
+
+struct log_slot {
+    int fd;				/* where the line goes */
+    int len;				/* length of line, including '\n' */
+    char line[LOG_SLOT_LEN];
+};
+
+static struct log_slot *log_ring;		/* NULL if no writer thread */
+static u_int32_t log_head;		/* next slot to fill */
+static u_int32_t log_tail;		/* next slot to write */
+static u_int32_t log_drops;		/* lines dropped, not reported yet */
+static int log_failed_fd = -1;		/* fd the writer failed to write to */
+static volatile sig_atomic_t log_async_disabled; /* write synchronously */
+static int log_writer_busy;		/* writer thread is writing a batch */
+static volatile sig_atomic_t log_writer_writing; /* writer thread is in writev */
+static volatile u_int32_t log_written;	/* next slot to write, as seen by log_async_stop */
+static pthread_mutex_t log_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;	/* work to do */
+static pthread_cond_t log_done_cond = PTHREAD_COND_INITIALIZER;	/* ring drained */
+
+/*
+ * log_writer - the background thread, writing pending lines.
+ */
+static void *
+log_writer(arg)
+    void *arg;
+{
+    struct iovec iov[LOG_BATCH + 1];
+    char dropmsg[64];
+    u_int32_t head, tail, drops;
+    int i, n, fd, len;
+
+    pthread_mutex_lock(&log_mtx);
+    for (;;) {
+	/* drops are reported along with the next line */
+	while (log_tail == log_head)
+	    pthread_cond_wait(&log_cond, &log_mtx);
+
+	/* slots between tail and head belong to us until we move tail */
+	head = log_head;
+	tail = log_tail;
+	drops = log_drops;
+	log_drops = 0;
+	log_writer_busy = 1;
+	pthread_mutex_unlock(&log_mtx);
+
+	while (tail != head) {
+	    /* batch consecutive lines going to the same fd */
+	    fd = log_ring[tail & (LOG_RING_SLOTS - 1)].fd;
+	    n = 0;
+	    len = 0;
+	    if (drops) {
+		iov[n].iov_base = dropmsg;
+		iov[n].iov_len = snprintf(dropmsg, sizeof(dropmsg),
+					  "%u log messages dropped\n", drops);
+		len += iov[n].iov_len;
+		n++;
+		drops = 0;
+	    }
+	    for (i = 0; i < LOG_BATCH && tail != head; i++, tail++) {
+		struct log_slot *slot = &log_ring[tail & (LOG_RING_SLOTS - 1)];
+		if (slot->fd != fd)
+		    break;
+		iov[n].iov_base = slot->line;
+		iov[n].iov_len = slot->len;
+		len += slot->len;
+		n++;
+	    }
+	    /* pairs with log_async_stop, one of us sees the other's store */
+	    log_writer_writing = 1;
+	    __sync_synchronize();
+	    if (log_async_disabled) {
+		log_writer_writing = 0;
+		return NULL;		/* log_async_stop writes the rest */
+	    }
+	    n = writev(fd, iov, n);
+	    log_written = tail;
+	    __sync_synchronize();
+	    log_writer_writing = 0;
+	    pthread_mutex_lock(&log_mtx);
+	    if (n != len)
+		log_failed_fd = fd;
+	    log_tail = tail;
+	    pthread_mutex_unlock(&log_mtx);
+	}
+
+	pthread_mutex_lock(&log_mtx);
+	log_writer_busy = 0;
+	if (log_tail == log_head)
+	    pthread_cond_broadcast(&log_done_cond);
+    }
+    return NULL;
+}
+
+/*
+ * log_atfork_prepare, log_atfork_parent, log_atfork_child - keep the
+ * ring consistent across fork. The writer thread doesn't exist in the
+ * child, which writes synchronously (its lines would otherwise be lost
+ * when it execs), unless it calls log_async_reinit.
+ */
+static void
+log_atfork_prepare()
+{
+    pthread_mutex_lock(&log_mtx);
+}
+
+static void
+log_atfork_parent()
+{
+    pthread_mutex_unlock(&log_mtx);
+}
+
+static void
+log_atfork_child()
+{
+    /* pending lines are the parent's to write */
+    log_tail = log_head;
+    log_written = log_head;
+    log_drops = 0;
+    log_failed_fd = -1;
+    log_writer_busy = 0;
+    log_async_disabled = 1;
+    pthread_mutex_unlock(&log_mtx);
+    pthread_cond_init(&log_cond, NULL);
+    pthread_cond_init(&log_done_cond, NULL);
+}
+
+/*
+ * log_async_start - start the writer thread.
+ */
+static int
+log_async_start()
+{
+    static int atfork_installed = 0;
+    pthread_attr_t attr;
+    pthread_t tid;
+    sigset_t all, old;
+    int err;
+
+    if (log_ring == NULL) {
+	log_ring = malloc(LOG_RING_SLOTS * sizeof(struct log_slot));
+	if (log_ring == NULL)
+	    return 0;
+    }
+    if (!atfork_installed) {
+	if (pthread_atfork(log_atfork_prepare, log_atfork_parent, log_atfork_child))
+	    goto fail;
+	atexit(log_flush);
+	atfork_installed = 1;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    /* the thread inherits our mask, signals must go to the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    err = pthread_create(&tid, &attr, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    pthread_attr_destroy(&attr);
+    if (err)
+	goto fail;
+    return 1;
+
+fail:
+    free(log_ring);
+    log_ring = NULL;
+    log_async_disabled = 1;
+    return 0;
+}
+
+/*
+ * log_async_put - queue a line for the writer thread.
+ * Returns 0 if the line must be written synchronously by the caller,
+ * -1 if the writer thread failed to write to fd.
+ */
+static int
+log_async_put(fd, prefix, plen, buf, n)
+    int fd;
+    char *prefix;
+    int plen;
+    char *buf;
+    int n;
+{
+    struct log_slot *slot;
+
+    if (log_async_disabled)
+	return 0;
+    if (log_ring == NULL && !log_async_start())
+	return 0;
+
+    if (plen + n + 1 > LOG_SLOT_LEN) {
+	/* too long for a slot, keep the order and write it ourselves */
+	log_flush();
+	return 0;
+    }
+
+    pthread_mutex_lock(&log_mtx);
+    if (fd == log_failed_fd) {
+	log_failed_fd = -1;
+	pthread_mutex_unlock(&log_mtx);
+	return -1;
+    }
+    if (log_head - log_tail == LOG_RING_SLOTS) {
+	log_drops++;
+    } else {
+	slot = &log_ring[log_head & (LOG_RING_SLOTS - 1)];
+	slot->fd = fd;
+	if (plen)
+	    memcpy(slot->line, prefix, plen);
+	memcpy(slot->line + plen, buf, n);
+	slot->line[plen + n] = '\n';
+	slot->len = plen + n + 1;
+	log_head++;
+    }
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_mtx);
+    return 1;
+}
+
+/*
+ * log_flush - wait until all the queued lines have been written.
+ * Must be called before closing or replacing the log fd.
+ */
+void
+log_flush()
+{
+    if (log_ring == NULL || log_async_disabled)
+	return;
+    pthread_mutex_lock(&log_mtx);
+    while (log_tail != log_head || log_writer_busy)
+	pthread_cond_wait(&log_done_cond, &log_mtx);
+    /* report it now, the fd may be closed and its number reused */
+    if (log_failed_fd >= 0 && log_failed_fd == log_to_fd)
+	log_to_fd = -1;
+    log_failed_fd = -1;
+    pthread_mutex_unlock(&log_mtx);
+}
+
+/*
+ * log_async_stop - write synchronously from now on.
+ * Safe to call from a signal handler: the interrupted code may hold
+ * log_mtx, so neither this nor the following log lines take it.
+ * Waits for the writer thread to finish the writev it is in, then writes
+ * the lines still queued, so that they don't interleave with ours.
+ */
+void
+log_async_stop()
+{
+    struct timespec ts;
+    struct log_slot *slot;
+    u_int32_t i;
+
+    if (log_async_disabled)
+	return;
+    log_async_disabled = 1;
+    if (log_ring == NULL)
+	return;
+
+    __sync_synchronize();
+    ts.tv_sec = 0;
+    ts.tv_nsec = 1000000;
+    while (log_writer_writing)
+	nanosleep(&ts, NULL);
+
+    /* the writer won't start another writev, the queued lines are ours */
+    __sync_synchronize();
+    for (i = log_written; i != log_head; i++) {
+	slot = &log_ring[i & (LOG_RING_SLOTS - 1)];
+	write(slot->fd, slot->line, slot->len);
+    }
+    log_written = log_head;
+}
+
+/*
+ * log_async_reinit - we are a forked child that carries on as pppd,
+ * use a writer thread of our own.
+ */
+void
+log_async_reinit()
+{
+    if (log_ring == NULL)
+	return;
+    log_async_disabled = 0;
+    if (!log_async_start())
+	log_async_disabled = 1;
+}
+
 /*
  * fatal - log an error message and die horribly.
  */
@@ -183,6 +183,7 @@
 #define kRASPropPPPoEDeviceName           	CFSTR("DeviceName")					/*									CFString */
 #define kRASPropPPPoEServiceName           	CFSTR("ServiceName")				/*									CFString */
 #define kRASPropPPPoEAccessConcentratorName CFSTR("AccessConcentratorName")		/*									CFString */
+#define kRASPropPPPoEMaxPayload           	CFSTR("MaxPayload")					/*									CFNumber */
 
 
 /*
@@ -272,6 +272,7 @@ static int spawn(struct vpn_params *params)
         else
             continue;   // skip it
     
+        vpnlog_flush();
         switch (pidChild = fork ()) {
             case 0:		// in child
                 execve(PATH_VPND, args, NULL);		// launch it
@@ -355,6 +356,7 @@ static void redirect_std_file(void)
 static void detach(void)
 {
     errno = 0;
+    vpnlog_flush();
     switch (fork()) {
         case 0:		// in child
             break;
@@ -447,6 +449,7 @@ static void create_log_file(char *inLogPath)
 	}
     else {
         fcntl(fileno(logfile), F_SETFD, 1);
+        setvbuf(logfile, NULL, _IOFBF, 64 * 1024);
 
         // Add the file header only when first created.
         //if (!ftell(logfile))
@@ -504,8 +507,10 @@ void vpnlog(int nSyslogPriority, char *format_str, ...)
         va_start(args, format_str);
         fputs(theTime, logfile);
         vfprintf(logfile, format_str, args); 
-        fflush(logfile);
         va_end(args);
+        // debug and info lines are written in batches by vpnlog_flush
+        if (LOG_PRI(nSyslogPriority) <= LOG_WARNING)
+            fflush(logfile);
     }
     
     va_start(args, format_str);
@@ -524,6 +529,16 @@ void vpnlog(int nSyslogPriority, char *format_str, ...)
 
 }
 
+// ----------------------------------------------------------------------------
+//	vpnlog_flush
+//	write the buffered log lines, called before blocking and before fork
+// ----------------------------------------------------------------------------
+void vpnlog_flush(void)
+{
+    if (logfile)
+        fflush(logfile);
+}
+
 //-----------------------------------------------------------------------------
 //	dump_params
 //-----------------------------------------------------------------------------
@@ -94,6 +94,7 @@ u_long load_kext(char *kext, int byBundleID)
 {
     int pid;
 
+    vpnlog_flush();
     if ((pid = fork()) < 0)
         return 1;
 
@@ -48,6 +48,7 @@ int find_address(const struct sockaddr_in *address, char *interface); /* check i
 #define	PLUGINS_DIR 	"/System/Library/Extensions/"
 
 void vpnlog(int nSyslogPriority, char *format_str, ...);
+void vpnlog_flush(void);
 int update_prefs(void);
 void toggle_debug(void);
 void set_terminate(void);
@@ -42,6 +42,7 @@
 #include <sys/kern_event.h>
 #include <arpa/inet.h>
 #include <sys/un.h>
+#include <spawn.h>
 
 #include <net/if_var.h>
 
@@ -121,7 +122,7 @@ extern int got_sig_hup(void);
 extern int got_sig_usr1(void);
 extern int got_terminate(void);
 
-static pid_t fork_child(int fdSocket);
+static pid_t spawn_child(int fdSocket, struct vpn_params *params, char *addr_str);
 static int reap_children(void);
 static int terminate_children(void);
 static int getabsolutetime(struct timeval *timenow);
@@ -423,6 +424,7 @@ int call_ipconfig(char *command, char *interface, struct in_addr *address, int t
 	char str[32], str1[32];
 	
 
+    vpnlog_flush();
     if ((pid = fork()) < 0)
         return 1;
 
@@ -786,6 +788,7 @@ void accept_connections(struct vpn_params* params)
 		}
      
 		fds = fds_save;
+		vpnlog_flush();
         i = select(fdmax, &fds, NULL, NULL, hastimeout ? &timeout : 0);
 		
 		// --------------- file descriptor selected --------------
@@ -895,37 +898,20 @@ void accept_connections(struct vpn_params* params)
                 }
                 if (child_sockfd == 0)
                     continue;
-                // Turn this connection over to a child.
-                while ((pid_child = fork_child(child_sockfd)) < 0) {
-                    if (errno != EINTR) {
-                        vpnlog(LOG_ERR, "Error during fork = %s\n", strerror(errno));
-                        goto fail;
-                    } else if (got_terminate())
-                        goto fail;
-                }
-                if (pid_child && address_slot) {			// parent
-                    vpnlog(LOG_NOTICE, "Incoming call... Address given to client = %s\n", address_slot->ip_address);
-                    TAILQ_REMOVE(&free_address_list, address_slot, next);
-                    address_slot->pid = pid_child;
-                    TAILQ_INSERT_TAIL(&child_list, address_slot, next);
-					lb_cur_connections++;
-                } else if (address_slot) {	
-                    // child
-                    snprintf(addr_str, sizeof(addr_str), ":%s", address_slot->ip_address);
-                    params->exec_args[params->next_arg_index] = addr_str;	// setup ip address in arg list
-                    params->exec_args[params->next_arg_index + 1] = 0;		// make sure arg list end with zero
-                    execve(PATH_PPPD, params->exec_args, NULL);			// launch it
-                    
-                    /* not reached except if there is an error */
-                    vpnlog(LOG_ERR, "execve failed during exec of /usr/sbin/pppd\nARGUMENTS\n");
-                    for (i = 1; i < MAXARG && i < params->next_arg_index; i++) {
-                        if (params->exec_args[i])
-                            vpnlog(LOG_DEBUG, "%d :  %s\n", i, params->exec_args[i]);
-                    }
-                    vpnlog(LOG_DEBUG, "\n");
-				
-                    exit(1);
+                if (address_slot == 0) {
+                    // server is full, there is no address to hand out
+                    close(child_sockfd);
+                    continue;
                 }
+                // Turn this connection over to a child.
+                snprintf(addr_str, sizeof(addr_str), ":%s", address_slot->ip_address);
+                if ((pid_child = spawn_child(child_sockfd, params, addr_str)) < 0)
+                    continue;		// the address slot stays free
+                vpnlog(LOG_NOTICE, "Incoming call... Address given to client = %s\n", address_slot->ip_address);
+                TAILQ_REMOVE(&free_address_list, address_slot, next);
+                address_slot->pid = pid_child;
+                TAILQ_INSERT_TAIL(&child_list, address_slot, next);
+                lb_cur_connections++;
             }
         }
 		
@@ -1027,35 +1013,64 @@ fail:
 
 
 //-----------------------------------------------------------------------------
-//	fork_child
+//	spawn_child
+//
+//	launch pppd for the connection on fdSocket, without duplicating vpnd.
+//	the socket becomes the child's stdin, stdout and stderr go to /dev/null
+//	and every other descriptor is closed by the kernel at exec time.
 //-----------------------------------------------------------------------------
-static pid_t fork_child(int fdSocket)
+static pid_t spawn_child(int fdSocket, struct vpn_params *params, char *addr_str)
 {
-    register pid_t	pidChild = 0 ;
-    int 		i;
-    
-    errno = 0 ;
-
-    switch (pidChild = fork ()) {
-        case 0:		// in child
-            break ;
-        case -1:	// error
-            syslog(LOG_ERR, "fork() failed: %m") ;
-            /* FALLTHRU */
-        default:	// parent
-            close (fdSocket) ;
-            return pidChild ;
+    posix_spawnattr_t		attr;
+    posix_spawn_file_actions_t	actions;
+    char			*envp[1] = { 0 };
+    pid_t			pidChild = -1;
+    int 			i, err;
+
+    if ((err = posix_spawnattr_init(&attr))) {
+        close(fdSocket);
+        errno = err;
+        return -1;
+    }
+    if ((err = posix_spawn_file_actions_init(&actions))) {
+        posix_spawnattr_destroy(&attr);
+        close(fdSocket);
+        errno = err;
+        return -1;
+    }
+
+    params->exec_args[params->next_arg_index] = addr_str;	// setup ip address in arg list
+    params->exec_args[params->next_arg_index + 1] = 0;		// make sure arg list end with zero
+
+    err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+    if (!err)
+        err = posix_spawn_file_actions_adddup2(&actions, fdSocket, STDIN_FILENO);
+    if (!err)
+        err = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_RDWR, 0);
+    if (!err)
+        err = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_RDWR, 0);
+    if (!err)
+        err = posix_spawn(&pidChild, PATH_PPPD, &actions, &attr, params->exec_args, envp);
+
+    if (err) {
+        vpnlog(LOG_ERR, "posix_spawn failed during exec of %s - err = %s\nARGUMENTS\n", PATH_PPPD, strerror(err));
+        for (i = 1; i < MAXARG && i < params->next_arg_index + 1; i++) {
+            if (params->exec_args[i])
+                vpnlog(LOG_DEBUG, "%d :  %s\n", i, params->exec_args[i]);
+        }
+        vpnlog(LOG_DEBUG, "\n");
     }
 
-    for (i = getdtablesize() - 1; i >= 0; i--) 
-        if (i != fdSocket) 
-            close(i);
-    dup2 (fdSocket, STDIN_FILENO) ;
-    open("/dev/null", O_RDWR, 0);
-    open("/dev/null", O_RDWR, 0);
-    close (fdSocket) ;
+    params->exec_args[params->next_arg_index] = 0;		// addr_str is on the caller's stack
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fdSocket);
 
-    return pidChild ;
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return pidChild;
 }
 
 